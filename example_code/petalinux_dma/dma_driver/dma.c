@@ -1,7 +1,7 @@
-/*   
+/*
     Simple DMA driver for PetaLinux
-                    
-    From "Getting Started with the Xilinx Zynq FPGA and Vivado" 
+
+    From "Getting Started with the Xilinx Zynq FPGA and Vivado"
     by Peter Milder (peter.milder@stonybrook.edu)
 
     Copyright (C) 2018 Peter Milder
@@ -22,250 +22,3870 @@
 
 // Assumptions:
 //    1. The DMA module's base address is 0x40400000. If this does not match, change the
-//       DMA_BASE macro in dma.h
+//       DMA_BASE macro in dma.h (or pass the right address to the dma_ctx_* functions)
 //    2. Your system uses an AXI DMA module loopback
 //    3. The DMA is configured to have a 14 bit length register. If this does not match, change
 //       the macro MAX_DMA_LEN_BITS in dma.h
-//    4. The DMA is configured to run in "simple mode" (not scatter/gather)
+//    4. The DMA is configured to run in "simple mode" (not scatter/gather), unless you use
+//       the dma_sg_* functions, which need the scatter-gather engine enabled
 //    5. You are using the memalloc kernel module and you have inserted it with modprobe memalloc
 
 
 #include <stdio.h>
 #include <fcntl.h>  // file operations
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
 #include "dma.h"
 
-// Initialize the DMA
-int dma_init(int size) {
-    
-    // Check size (bytes) 
-    int res = check_size(size);
-    if (res)
-        return res;
-    
-    
-    ///////////////////////////////////////////////////
-    // mmap the DMA control interface
-    mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
-    if (mem_fd == -1) {
-        printf("ERROR: failed to open /dev/mem\n");
-        dma_cleanup();
+// One pair of Tx/Rx buffers in a buffer ring
+struct dma_slot {
+    void *txbase, *rxbase;
+    unsigned int tx_phy_addr, rx_phy_addr;
+    int tx_buffer_id, rx_buffer_id;
+    int len;                 // bytes submitted for this slot's transfer
+};
+
+// Application memory registered for DMA
+struct dma_region {
+    int in_use;
+    void *addr;              // the application's memory (or our mapping of the dma-buf)
+    int size;
+    int mapped;              // addr is our mmap of a dma-buf; munmap it when unregistering
+    int id;                  // memalloc ID of the imported memory, or -1 if it is bounced
+    unsigned int phy_addr;
+    void *bounce;            // buffer the data is copied through, if it could not be imported
+    int bounce_id;
+    unsigned int bounce_phy_addr;
+};
+
+// Queue of asynchronous transfers on one channel. The first one is the one the DMA is moving.
+struct async_queue {
+    struct dma_xfer *head, *tail;
+    int cntl_reg, status_reg;
+};
+
+struct dma_xfer {
+    struct dma_ctx *ctx;
+    int fd;                  // eventfd, readable once the transfer is done
+    int status;              // 0 while pending, 1 when done, -1 on error
+    int freed;               // the application has freed the handle before it finished
+    unsigned int phy_addr;
+    int offset;              // offset into the context's Tx or Rx buffer
+    int size;
+    struct dma_xfer *next;
+};
+
+// Everything the driver knows about one DMA engine
+struct dma_ctx {
+    unsigned int base_addr;  // physical address of the DMA's control/status regs
+    int opened;              // the registers are mapped
+    int allocated;           // the context was malloc-ed by dma_ctx_*init()
+
+    // Devices
+    int mem_fd;              // file descriptor for /dev/mem
+    volatile int *cfg_base;  // Pointer to base address of DMA control/status regs
+
+    // Buffers
+    void *txbase;            // Pointer to tx buffer base address
+    void *rxbase;            // Pointer to rx buffer base address
+    int owns_buffers;        // the buffers were reserved by this context (not a stripe)
+    int tx_buffer_id;
+    int rx_buffer_id;
+    unsigned int tx_phy_addr;
+    unsigned int rx_phy_addr;
+    int buffer_size;         // size of the tx and rx buffers, in bytes
+    int tx_mode, rx_mode;    // DMA_BUF_COHERENT, DMA_BUF_CACHED or DMA_BUF_WC
+    int width;               // stream width, in bytes
+    int dre;                 // the Data Realignment Engine is enabled (unaligned transfers)
+    int rx_sync_offset;      // part of a cached RxBuffer to sync for the CPU after the
+    int rx_sync_size;        // transfer into it (0 bytes: nothing to sync)
+    struct dma_init_stats init_stats;  // how long initializing took
+
+    // Scatter-gather mode
+    volatile struct dma_sg_desc *tx_ring;   // Tx descriptor ring
+    volatile struct dma_sg_desc *rx_ring;   // Rx descriptor ring
+    int tx_ring_id, rx_ring_id;
+    unsigned int tx_ring_phy_addr, rx_ring_phy_addr;
+    int ring_len;            // number of descriptors in each ring
+    int tx_ring_used, rx_ring_used;  // descriptors in the last chain built
+
+    // Buffer ring. The counters only ever increase; the slot they refer to is the
+    // counter modulo ring_slots.
+    struct dma_slot slots[DMA_RING_MAX_SLOTS];
+    unsigned int ring_slots; // number of slots in the ring
+    unsigned int ring_head;  // producer: next slot the application fills
+    unsigned int ring_engine;// next slot the DMA moves
+    unsigned int ring_tail;  // consumer: next slot the application drains
+    int ring_busy;           // the DMA is moving slot ring_engine right now
+
+    // Waiting by polling: the last transfer started, and a straight-line fit of how long
+    // transfers take (time = setup + bytes/bandwidth), updated after every wait
+    double xfer_start_us;    // when the last transfer was started
+    int xfer_bytes;          // its size
+    int xfer_pending;        // nobody has seen it finish yet
+    double fit_n, fit_x, fit_y, fit_xx, fit_xy;  // decaying sums of 1, bytes, us, bytes^2, bytes*us
+    struct dma_wait_stats wait_stats;
+
+    // Interrupt mode
+    int use_irq;             // wait for interrupts instead of polling
+    int mm2s_uio_fd;         // UIO devices that deliver the MM2S and S2MM interrupts
+    int s2mm_uio_fd;
+
+    // Registered application memory
+    struct dma_region regions[DMA_MAX_REGIONS];
+    int rx_region;           // region the last dma_region_rx() went to, or -1
+    int rx_region_offset, rx_region_size;
+
+    // Asynchronous transfers
+    struct async_queue mm2s_queue, s2mm_queue;
+    pthread_t async_thread;
+    pthread_mutex_t async_lock;
+    int async_running;
+    int async_kick_fd;       // eventfd to wake up the completion thread
+
+    // Service thread (note 12 in dma.h)
+    struct dma_service *service;
+
+    // Continuous capture (note 15 in dma.h)
+    struct dma_capture *capture;
+};
+
+// A service thread, and the requests submitted to it
+struct dma_service {
+    struct dma_ctx *ctx;
+    struct dma_request *head;// submitted requests, newest first; pushed without locks
+    int running;             // accepting requests
+    int sleeping;            // the thread is (about to be) asleep on kick_fd
+    int kick_fd;             // eventfd to wake it up
+    pthread_t thread;
+    long long requests, batches, wakeups;
+};
+
+// A continuous capture: S2MM filling a ring of slots, kept going by the capture thread.
+// head is written only by the capture thread, and tail only by the consumer.
+struct dma_capture {
+    struct dma_ctx *ctx;
+    int nslots, slot_size, mode;
+    int window;              // filled slots that are safe to read; older ones may be overwritten
+    void *base;              // the slots, one after another in one buffer
+    int buffer_id;
+    unsigned int phy_addr;
+    volatile struct dma_sg_desc *ring;   // one descriptor per slot, in a closed chain
+    int ring_id;
+    unsigned int ring_phy_addr;
+    int *len;                // bytes received into each slot, the last time it was filled
+    char *stalled;           // whether the DMA had stopped for want of slots just before each
+
+    unsigned long long head; // slots the thread has counted as filled
+    unsigned long long seen; // slots the thread has started to count (head, or head+1)
+    unsigned long long tail; // next slot the consumer takes
+    int wake_word;           // changes whenever there is news for the consumer; it sleeps on it
+    int waiting;             // the consumer is (about to be) asleep on wake_word
+    int failed;              // the DMA stopped with an error
+    int running;
+    int kick_fd;             // eventfd to wake the thread up from an interrupt wait
+    pthread_t thread;
+    long long bytes, lost, stalls;
+};
+
+// A slab of a buffer pool: DMA_POOL_SLAB_SIZE bytes, split into blocks of one size class
+struct pool_slab {
+    int cls;                 // size class, or -1 while the slab is free
+    int in_use;              // blocks handed out
+    int carved;              // blocks handed out at least once since the slab got its class;
+                             // the ones after these have never been used
+    int top;                 // released blocks on the slab's stack
+    int prev, next;          // neighbours on its class's list of slabs with free blocks, or on
+                             // the list of free slabs (-1: none)
+};
+
+// A pool of DMA buffers, carved out of a few large memalloc buffers ("regions")
+struct dma_pool {
+    int mode;                // DMA_BUF_COHERENT, DMA_BUF_CACHED or DMA_BUF_WC
+    int nregions;
+    int region_size;         // a multiple of DMA_POOL_SLAB_SIZE
+    int slabs_per_region;
+    void **base;             // each region's mapping, physical address and memalloc ID
+    unsigned int *phy_addr;
+    int *id;
+
+    struct pool_slab *slabs;
+    unsigned short *stacks;  // each slab's stack of released block numbers
+    unsigned long long *used;  // each slab's bitmap of blocks in use
+    int free_slabs;          // first free slab, or -1
+    int partial[DMA_POOL_CLASSES];  // first slab of each class with a free block, or -1
+    pthread_mutex_t lock;
+
+    long long acquires, releases, failures;
+    int blocks_in_use[DMA_POOL_CLASSES];
+    long long bytes_in_use, bytes_high_water;
+};
+
+// Several engines sharing one pair of buffers, each moving one slice of every transfer
+struct dma_stripe {
+    int n;                   // number of engines
+    int sg;                  // the engines use scatter-gather mode
+    struct dma_ctx ctx[DMA_STRIPE_MAX_ENGINES];
+    void *txbase, *rxbase;
+    int tx_buffer_id, rx_buffer_id;
+    unsigned int tx_phy_addr, rx_phy_addr;
+    int buffer_size;
+};
+
+// The transfers queued on one MCDMA channel, one way: a cycle of DMA_MC_QUEUE_LEN
+// descriptors. The driver queues at head and hands back at tail; the MCDMA works its way
+// from one to the other.
+struct dma_mc_queue {
+    volatile struct dma_mc_desc *ring;
+    unsigned int ring_phy_addr;
+    unsigned int head, tail;         // transfers queued, and handed back
+    int offset[DMA_MC_QUEUE_LEN];    // where each transfer is in the channel's buffer
+};
+
+// An MCDMA: nchannels channels each way, each with a buffer and a queue
+struct dma_mc {
+    struct dma_ctx ctx;              // the registers (the rest of the context goes unused)
+    int nchannels;
+    int buffer_size;                 // per channel
+    void *txbase, *rxbase;           // the channels' buffers, one after another
+    int tx_buffer_id, rx_buffer_id;
+    unsigned int tx_phy_addr, rx_phy_addr;
+    volatile struct dma_mc_desc *rings;   // every queue's descriptors
+    int rings_id;
+    unsigned int rings_phy_addr;
+    struct dma_mc_queue queue[2][DMA_MC_MAX_CHANNELS];   // [DMA_MC_TX or DMA_MC_RX][channel]
+    int next;                        // queue dma_mc_poll() looks at first: channel*2 + dir
+};
+
+// Macros to ease setting and reading DMA control/status regs and polling
+#ifdef DMA_MODEL
+#define set_dma_reg(ctx,offset,value) dma_model_write((ctx)->cfg_base, offset, value)
+#else
+#define set_dma_reg(ctx,offset,value) (ctx)->cfg_base[(offset)/4] = (value)
+#endif
+#define get_dma_reg(ctx,offset)       (ctx)->cfg_base[(offset)/4]
+#define s2mm_busy(ctx) ((get_dma_reg(ctx, S2MM_STATUS_REG) & DMA_IDLE) == 0)
+#define mm2s_busy(ctx) ((get_dma_reg(ctx, MM2S_STATUS_REG) & DMA_IDLE) == 0)
+
+// Called in every iteration of a polling loop. The model's thread may have to share the
+// CPU with the loop, so give it a chance to run.
+#ifdef DMA_MODEL
+#define poll_pause() sched_yield()
+#else
+#define poll_pause()
+#endif
+
+// Record a trace event (see dma_trace.h) for the DMA at base address "dma". Without
+// -DDMA_TRACE this is nothing at all.
+#ifdef DMA_TRACE
+#define trace(dma,event,bytes) do { if (dma_trace_enabled) dma_trace_record(event, dma, bytes); } while (0)
+#else
+#define trace(dma,event,bytes) do { } while (0)
+#endif
+
+// Value for the control register when starting a channel
+#define dma_cntl_start(ctx) ((ctx)->use_irq ? (DMA_START | DMA_IOC_IRQ_EN | DMA_ERR_IRQ_EN) : DMA_START)
+
+// Internal functions
+static int check_len(int size, int unit, int max); /* Checks a size against the stream's granularity */
+static int check_size(struct dma_ctx *ctx, int size); /* Checks transfer size is legal */
+static int check_buffer_size(int size, int sg); /* Checks a buffer size, before there is a context to check against */
+static int check_sg_size(struct dma_ctx *ctx, int size); /* Checks scatter-gather transfer size is legal */
+static int check_addr(struct dma_ctx *ctx, unsigned int phy_addr); /* Checks a transfer's address is aligned */
+static int ctx_unit(struct dma_ctx *ctx); /* Transfer granularity of a context, in bytes */
+static int check_fit(struct dma_ctx *ctx, int offset, int size); /* Checks a transfer fits in the buffers */
+static int ctx_open(struct dma_ctx *ctx, unsigned int base_addr); /* Maps the DMA registers and opens /dev/memalloc */
+static int memalloc_open();      /* Opens /dev/memalloc, or counts one more user of it */
+static void memalloc_close();    /* Closes /dev/memalloc after its last user */
+static void ctx_release(struct dma_ctx *ctx); /* Releases everything a context holds */
+static int reserve_rings(struct dma_ctx *ctx, int size); /* Reserves scatter-gather descriptor rings */
+static int reserve_buffer(int size, int mode, int *id, unsigned int *phy_addr, void **base); /* Reserves and mmaps a buffer */
+static void release_buffer(int id, void *base, int size); /* Unmaps and releases a buffer */
+static int export_buffer(int id);  /* Exports a buffer as a dma-buf */
+static int import_buffer(void *addr, int dmabuf_fd, int size, int *id, unsigned int *phy_addr); /* Imports memory in place */
+static int sync_buffer(int id, int dir, int offset, int size); /* Syncs the caches for a cached or imported buffer */
+static int buffer_sync(struct dma_ctx *ctx, int is_tx, int dir, int offset, int size); /* Syncs part of a cached Tx/Rx buffer */
+static int finish_rx(struct dma_ctx *ctx); /* Makes the last receive visible to the CPU */
+static int sg_setup(struct dma_ctx *ctx, volatile struct dma_sg_desc *ring, unsigned int ring_phy_addr,
+                    int first, unsigned int buf_phy_addr, int size, int is_tx); /* Builds a descriptor chain */
+static int ctx_rx_at(struct dma_ctx *ctx, int offset, int size); /* dma_ctx_rx at an offset */
+static int ctx_tx_at(struct dma_ctx *ctx, int offset, int size); /* dma_ctx_tx at an offset */
+static int rx_start(struct dma_ctx *ctx, int offset, int size); /* ctx_rx_at without the checks */
+static int tx_start(struct dma_ctx *ctx, int offset, int size); /* ctx_tx_at without the checks */
+static int ctx_sg_rx_at(struct dma_ctx *ctx, int offset, int size); /* dma_ctx_sg_rx at an offset */
+static int ctx_sg_tx_at(struct dma_ctx *ctx, int offset, int size); /* dma_ctx_sg_tx at an offset */
+static void ring_advance(struct dma_ctx *ctx); /* Moves the buffer ring along as the DMA finishes */
+static int report_timeout(struct dma_ctx *ctx); /* Prints the DMA status after a timeout */
+static double now_seconds(); /* Seconds on the monotonic clock */
+static void wait_begin(struct dma_ctx *ctx, int size); /* Notes the start of a transfer, for wait_done() */
+static int wait_done(struct dma_ctx *ctx, int (*done)(struct dma_ctx *)); /* Sleeps, then polls, until done */
+static void xfer_idle(struct dma_ctx *ctx); /* Notes that the last transfer has been seen to finish */
+static int irq_wait(struct dma_ctx *ctx, int fd, int status_reg); /* Waits for and acknowledges one interrupt */
+static int irq_sync(struct dma_ctx *ctx); /* Waits with interrupts until both channels are idle */
+static int uio_read(int fd);     /* Reads the interrupt count from a UIO device */
+static int uio_enable(int fd);   /* Re-enables a UIO device's interrupt */
+static void async_stop(struct dma_ctx *ctx); /* Stops the asynchronous completion thread */
+
+// The context behind the single-DMA functions (dma_init(), dma_rx(), ...)
+static struct dma_ctx default_ctx;
+
+// /dev/memalloc is opened once, and shared by every context in the process
+static int memalloc_dev_fd = -1;  // file descriptor for /dev/memalloc
+static int memalloc_users;        // number of contexts and pools using it
+static pthread_mutex_t memalloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Put a context in its "nothing open" state
+static void ctx_clear(struct dma_ctx *ctx, unsigned int base_addr) {
+    int allocated = ctx->allocated;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->allocated = allocated;
+    ctx->base_addr = base_addr;
+    ctx->mem_fd = -1;
+    ctx->mm2s_uio_fd = ctx->s2mm_uio_fd = -1;
+    ctx->async_kick_fd = -1;
+    ctx->rx_region = -1;
+    ctx->width = DMA_DATA_WIDTH;
+    ctx->dre = DMA_DRE;
+    ctx->mm2s_queue.cntl_reg = MM2S_CNTL_REG;
+    ctx->mm2s_queue.status_reg = MM2S_STATUS_REG;
+    ctx->s2mm_queue.cntl_reg = S2MM_CNTL_REG;
+    ctx->s2mm_queue.status_reg = S2MM_STATUS_REG;
+    pthread_mutex_init(&ctx->async_lock, NULL);
+}
+
+// Open the DMA registers and memalloc, then reserve tx and rx buffers of the given size,
+// with the given kinds of memory (DMA_BUF_COHERENT, DMA_BUF_CACHED or DMA_BUF_WC)
+static int ctx_setup(struct dma_ctx *ctx, unsigned int base_addr, int size, int tx_mode, int rx_mode) {
+    if (tx_mode < DMA_BUF_COHERENT || tx_mode > DMA_BUF_WC ||
+        rx_mode < DMA_BUF_COHERENT || rx_mode > DMA_BUF_CACHED) {
+        // The CPU reads the RxBuffer, and write-combining memory is slow to read
+        printf("ERROR: Illegal buffer modes (tx %d, rx %d). Write-combining is only for the TxBuffer.\n",
+               tx_mode, rx_mode);
         return -1;
     }
-    
-    dma_cfg_base = (unsigned int*)mmap(NULL, DMA_MMAP_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, DMA_BASE);
-    if (dma_cfg_base == NULL) {
-        printf("ERROR: Failed to mmap DMA control registers\n");
-        dma_cleanup();
+
+    trace(base_addr, DMA_TRACE_INIT_BEGIN, size);
+    double t0 = now_seconds();
+    if (ctx_open(ctx, base_addr))
+        return -1;
+    double t1 = now_seconds();
+
+    if (reserve_buffer(size, tx_mode, &ctx->tx_buffer_id, &ctx->tx_phy_addr, &ctx->txbase)) {
+        printf("ERROR: memalloc (tx) reserve failed\n");
+        ctx_release(ctx);
         return -1;
     }
-    
-    // Open the /dev/memalloc file
-    memalloc_dev_fd = open("/dev/memalloc", O_RDWR);
-    if (memalloc_dev_fd == -1) {
-        printf("ERROR: failed to open /dev/memalloc. Try running 'modprobe memalloc'\n");
-        dma_cleanup();
+
+    if (reserve_buffer(size, rx_mode, &ctx->rx_buffer_id, &ctx->rx_phy_addr, &ctx->rxbase)) {
+        printf("ERROR: memalloc (rx) reserve failed\n");
+        ctx_release(ctx);
         return -1;
     }
 
-    // Reserve the tx buffer. 
-    struct ioctl_arg_t ioctl_arg;
-    ioctl_arg.buffer_size = size;
-    int status = ioctl(memalloc_dev_fd, MEMALLOC_RESERVE_CMD, &ioctl_arg);
-    if (status) 
-        return status;      
+    ctx->owns_buffers = 1;
+    ctx->buffer_size = size;
+    ctx->tx_mode = tx_mode;
+    ctx->rx_mode = rx_mode;
 
-    // Record its ID and physical address
-    tx_buffer_id = ioctl_arg.buffer_id;
-    tx_phy_addr = ioctl_arg.phys_addr;
-    
-    if (tx_buffer_id < 0 || status < 0) {
-        printf("ERROR: memalloc (tx) reserve failed (id %d, status %d)\n", tx_buffer_id, status);
-        return(-1);
-    }
+    double t2 = now_seconds();
+    ctx->init_stats.open_us = (t1 - t0) * 1e6;
+    ctx->init_stats.buffers_us = (t2 - t1) * 1e6;
+    ctx->init_stats.total_us = (t2 - t0) * 1e6;
+    ctx->init_stats.buffers = 2;
+    return 0;
+}
 
-    status = ioctl(memalloc_dev_fd, MEMALLOC_GET_PHYSICAL_CMD, &ioctl_arg);
-    if (status)
-        return status;    
-    tx_phy_addr = ioctl_arg.phys_addr;
+static int ctx_init(struct dma_ctx *ctx, unsigned int base_addr, int size, int tx_mode, int rx_mode) {
+
+    // Check size (bytes)
+    int res = check_buffer_size(size, 0);
+    if (res)
+        return res;
 
-    // Activate the buffer we just created
-    status = ioctl(memalloc_dev_fd, MEMALLOC_ACTIVATE_BUFFER_CMD, &ioctl_arg);
-    if (status)
-        return status;
+    res = ctx_setup(ctx, base_addr, size, tx_mode, rx_mode);
+    if (res == 0)
+        trace(base_addr, DMA_TRACE_INIT_END, size);
+    return res;
+}
 
-    // mmap it and record its virtual address
-    txbase = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memalloc_dev_fd, 0);
-    if (txbase == NULL) {
-        printf("ERROR: mmap tx buffer failed");
-        return(-1);
-    }
-     
-    // Do the same thing the rx buffer: reserve it, record its physical address and id, and mmap it.
-    status = ioctl(memalloc_dev_fd, MEMALLOC_RESERVE_CMD, &ioctl_arg);
-    if (status)
-        return status;
+// The same as ctx_init(), except that the size can be larger, and we also reserve one
+// descriptor ring for each channel.
+static int ctx_sg_init(struct dma_ctx *ctx, unsigned int base_addr, int size, int tx_mode, int rx_mode) {
 
-    rx_buffer_id = ioctl_arg.buffer_id;    
+    int res = check_buffer_size(size, 1);
+    if (res)
+        return res;
 
-    status = ioctl(memalloc_dev_fd, MEMALLOC_GET_PHYSICAL_CMD, &ioctl_arg);
-    if (status)
-        return status;    
-    rx_phy_addr = ioctl_arg.phys_addr;
+    res = ctx_setup(ctx, base_addr, size, tx_mode, rx_mode);
+    if (res)
+        return res;
 
+    double t0 = now_seconds();
+    if (reserve_rings(ctx, size)) {
+        ctx_release(ctx);
+        return -1;
+    }
+    double us = (now_seconds() - t0) * 1e6;
+    ctx->init_stats.buffers_us += us;
+    ctx->init_stats.total_us += us;
+    ctx->init_stats.buffers += 2;
+    trace(base_addr, DMA_TRACE_INIT_END, size);
+    return 0;
+}
 
-    status = ioctl(memalloc_dev_fd, MEMALLOC_ACTIVATE_BUFFER_CMD, &ioctl_arg);
-    if (status)
-        return status;
+// Reserve descriptor rings with enough descriptors to cover "size" bytes
+static int reserve_rings(struct dma_ctx *ctx, int size) {
+    ctx->ring_len = (size + DMA_SG_MAX_CHUNK - 1) / DMA_SG_MAX_CHUNK;
 
-    if (rx_buffer_id < 0 || status < 0) {
-        printf("ERROR: memalloc (rx) reserve failed (id %d, status %d)\n", rx_buffer_id, status);
-        return(-1);
+    void *ring;
+    if (reserve_buffer(ctx->ring_len*DMA_SG_DESC_SIZE, DMA_BUF_COHERENT, &ctx->tx_ring_id, &ctx->tx_ring_phy_addr, &ring)) {
+        printf("ERROR: memalloc (tx descriptors) reserve failed\n");
+        return -1;
     }
+    ctx->tx_ring = ring;
 
-    rxbase = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memalloc_dev_fd, 0);
-    if (rxbase == NULL) {
-        printf("ERROR: mmap rx buffer failed");
-        return(-1);
+    if (reserve_buffer(ctx->ring_len*DMA_SG_DESC_SIZE, DMA_BUF_COHERENT, &ctx->rx_ring_id, &ctx->rx_ring_phy_addr, &ring)) {
+        printf("ERROR: memalloc (rx descriptors) reserve failed\n");
+        return -1;
     }
-            
+    ctx->rx_ring = ring;
     return 0;
 }
 
+// Allocate a context and initialize it with one of the functions above
+static struct dma_ctx *ctx_alloc(unsigned int base_addr) {
+    struct dma_ctx *ctx = calloc(1, sizeof(struct dma_ctx));
+    if (ctx == NULL) {
+        printf("ERROR: failed to allocate DMA context\n");
+        return NULL;
+    }
+    ctx->allocated = 1;
+    ctx_clear(ctx, base_addr);
+    return ctx;
+}
+
+struct dma_ctx *dma_ctx_init_mode(unsigned int base_addr, int size, int tx_mode, int rx_mode) {
+    struct dma_ctx *ctx = ctx_alloc(base_addr);
+    if (ctx && ctx_init(ctx, base_addr, size, tx_mode, rx_mode)) {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+struct dma_ctx *dma_ctx_sg_init_mode(unsigned int base_addr, int size, int tx_mode, int rx_mode) {
+    struct dma_ctx *ctx = ctx_alloc(base_addr);
+    if (ctx && ctx_sg_init(ctx, base_addr, size, tx_mode, rx_mode)) {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+struct dma_ctx *dma_ctx_init(unsigned int base_addr, int size) {
+    return dma_ctx_init_mode(base_addr, size, DMA_BUF_COHERENT, DMA_BUF_COHERENT);
+}
+
+struct dma_ctx *dma_ctx_sg_init(unsigned int base_addr, int size) {
+    return dma_ctx_sg_init_mode(base_addr, size, DMA_BUF_COHERENT, DMA_BUF_COHERENT);
+}
+
 // Return a pointer to the TxBuffer. User code an call this function, cast the pointer to
 // the desired datatype, and interact with the buffer.
-void* getTxBuffer() {
-    return txbase;
+void* dma_ctx_tx_buffer(struct dma_ctx *ctx) {
+    return ctx->txbase;
 }
 
 // Return a pointer to the RxBuffer. User code can call this function, cast the pointer to
 // the desired datatype, and interact with the buffer.
-void* getRxBuffer() {
-    return rxbase;
+void* dma_ctx_rx_buffer(struct dma_ctx *ctx) {
+    return ctx->rxbase;
 }
 
 // Reset the DMA
-void dma_reset() {
-    set_dma_reg(MM2S_CNTL_REG, DMA_RESET);
-    set_dma_reg(S2MM_CNTL_REG, DMA_RESET);   
+void dma_ctx_reset(struct dma_ctx *ctx) {
+    set_dma_reg(ctx, MM2S_CNTL_REG, DMA_RESET);
+    set_dma_reg(ctx, S2MM_CNTL_REG, DMA_RESET);
 }
 
-// Set up a DMA "receive" on the S2MM channel
-int dma_rx(int size) {
+// Start the S2MM channel receiving "size" bytes at physical address phy_addr
+static void start_rx(struct dma_ctx *ctx, unsigned int phy_addr, int size) {
+    // Halt the DMA if necessary
+    set_dma_reg(ctx, S2MM_CNTL_REG, 0);
+
+    // Write the destination address
+    set_dma_reg(ctx, S2MM_DEST_ADDR_REG, phy_addr);
+
+    // Set the start bit (and the interrupt enables, if we are using them)
+    set_dma_reg(ctx, S2MM_CNTL_REG, dma_cntl_start(ctx));
+
+    // Set the Rx length
+    set_dma_reg(ctx, S2MM_LEN_REG, size);
+}
+
+// Start the MM2S channel sending "size" bytes from physical address phy_addr
+static void start_tx(struct dma_ctx *ctx, unsigned int phy_addr, int size) {
+    // Halt the DMA if necessary
+    set_dma_reg(ctx, MM2S_CNTL_REG, 0);
+
+    // Write the source address
+    set_dma_reg(ctx, MM2S_SRC_ADDR_REG, phy_addr);
+
+    // Set the start bit (and the interrupt enables, if we are using them)
+    set_dma_reg(ctx, MM2S_CNTL_REG, dma_cntl_start(ctx));
+
+    // Set the Tx length
+    set_dma_reg(ctx, MM2S_LEN_REG, size);
+}
+
+// Set up a DMA "receive" on the S2MM channel, "offset" bytes into the RxBuffer
+static int ctx_rx_at(struct dma_ctx *ctx, int offset, int size) {
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, size);
+
     // Check size is legal
-    int res = check_size(size);
+    int res = check_size(ctx, size);
     if (res)
         return res;
 
-    // Halt the DMA if necessary
-    set_dma_reg(S2MM_CNTL_REG, 0);
+    if (check_fit(ctx, offset, size))
+        return -1;
 
-    // Write the destination address
-    set_dma_reg(S2MM_DEST_ADDR_REG, rx_phy_addr); 
+    return rx_start(ctx, offset, size);
+}
 
-    // Set the start bit
-    set_dma_reg(S2MM_CNTL_REG, DMA_START);
+// ctx_rx_at() once the transfer has been checked
+static int rx_start(struct dma_ctx *ctx, int offset, int size) {
+    if (buffer_sync(ctx, 0, MEMALLOC_SYNC_FOR_DEVICE, offset, size))
+        return -1;
 
-    // Set the Rx length
-    set_dma_reg(S2MM_LEN_REG, size);
-    
+    start_rx(ctx, ctx->rx_phy_addr + offset, size);
+    wait_begin(ctx, size);
+    ctx->rx_sync_offset = offset;
+    ctx->rx_sync_size = size;
     return 0;
 }
 
-// Set up a DMA "transmit" on the MM2S channel
-int dma_tx(int size) {
+// Set up a DMA "transmit" on the MM2S channel, "offset" bytes into the TxBuffer
+static int ctx_tx_at(struct dma_ctx *ctx, int offset, int size) {
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, size);
 
     // Check size is legal
-    int res = check_size(size);
+    int res = check_size(ctx, size);
     if (res)
         return res;
 
-    // Halt the DMA if necessary
-    set_dma_reg(MM2S_CNTL_REG, 0);
+    if (check_fit(ctx, offset, size))
+        return -1;
 
-    // Write the destination address
-    set_dma_reg(MM2S_SRC_ADDR_REG, tx_phy_addr); 
+    return tx_start(ctx, offset, size);
+}
 
-    // Set the start bit
-    set_dma_reg(MM2S_CNTL_REG, DMA_START);
+// ctx_tx_at() once the transfer has been checked
+static int tx_start(struct dma_ctx *ctx, int offset, int size) {
+    if (buffer_sync(ctx, 1, MEMALLOC_SYNC_FOR_DEVICE, offset, size))
+        return -1;
 
-    // Set the Rx length
-    set_dma_reg(MM2S_LEN_REG, size);
-    
+    start_tx(ctx, ctx->tx_phy_addr + offset, size);
+    wait_begin(ctx, size);
     return 0;
 }
 
-// Block until the MM2S and S2MM channels are both idle
-int dma_sync() {
-    int its=0;
-
-    // while loop to check for completion (done when status reg & 0x2 != 0)
-    while (s2mm_busy() || mm2s_busy()) {
-        its++;
-        if (its == 1000000) {
-            printf("ERROR: Timeout waiting for DMA.");
-            printf("mm2s status: %x\n", get_dma_reg(MM2S_STATUS_REG));
-            printf("s2mm status: %x\n", get_dma_reg(S2MM_STATUS_REG));
-            return -1;
-        }
+int dma_ctx_rx(struct dma_ctx *ctx, int size) {
+    return ctx_rx_at(ctx, 0, size);
+}
+
+int dma_ctx_tx(struct dma_ctx *ctx, int size) {
+    return ctx_tx_at(ctx, 0, size);
+}
+
+// The caller has checked the size and offset already (dma.hpp does, at compile time)
+int dma_ctx_start_rx(struct dma_ctx *ctx, int offset, int size) {
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, size);
+    return rx_start(ctx, offset, size);
+}
+
+int dma_ctx_start_tx(struct dma_ctx *ctx, int offset, int size) {
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, size);
+    return tx_start(ctx, offset, size);
+}
+
+// Transfers into and out of memory the context does not own, such as pool blocks. It is
+// the caller's to sync, so dma_ctx_sync() has nothing to sync afterwards.
+int dma_ctx_rx_phys(struct dma_ctx *ctx, unsigned int phy_addr, int size) {
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, size);
+    if (check_size(ctx, size) || check_addr(ctx, phy_addr))
+        return -1;
+
+    start_rx(ctx, phy_addr, size);
+    wait_begin(ctx, size);
+    ctx->rx_sync_size = 0;
+    return 0;
+}
+
+int dma_ctx_tx_phys(struct dma_ctx *ctx, unsigned int phy_addr, int size) {
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, size);
+    if (check_size(ctx, size) || check_addr(ctx, phy_addr))
+        return -1;
+
+    start_tx(ctx, phy_addr, size);
+    wait_begin(ctx, size);
+    return 0;
+}
+
+// Match the driver's checks to the DMA's stream: "width" bytes per beat, and unaligned
+// transfers allowed if the DRE is enabled
+int dma_ctx_set_stream(struct dma_ctx *ctx, int width, int dre) {
+    if (width < 4 || width > 128 || (width & (width-1)) != 0) {
+        printf("ERROR: DMA stream width %d bytes is not a power of 2 from 4 to 128\n", width);
+        return -1;
+    }
+    if (dre && width > 8) {
+        printf("ERROR: The AXI DMA only offers the Data Realignment Engine on streams of up to 64 bits\n");
+        return -1;
     }
+
+    ctx->width = width;
+    ctx->dre = (dre != 0);
     return 0;
 }
 
+// Returns 1 if either channel is still moving data, without waiting
+int dma_ctx_busy(struct dma_ctx *ctx) {
+    if (s2mm_busy(ctx) || mm2s_busy(ctx))
+        return 1;
+    xfer_idle(ctx);
+    return 0;
+}
 
-// A cleanup function. If files are open; close them. If regions are mmap-ed, munmap them.
-void dma_cleanup() {
-    // release Tx buffer
-    // release Rx buffer
+// Note that a transfer of "size" bytes has just been started. If the other channel was
+// started too, with a different size, the transfer counts as the larger of the two.
+static void wait_begin(struct dma_ctx *ctx, int size) {
+    if (!ctx->xfer_pending || size > ctx->xfer_bytes)
+        ctx->xfer_bytes = size;
+    ctx->xfer_pending = 1;
+    ctx->xfer_start_us = now_seconds() * 1e6;
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_END, size);
+}
 
-    struct ioctl_arg_t ioctl_arg;
-    ioctl_arg.buffer_id = tx_buffer_id;
-    int status = ioctl(memalloc_dev_fd, MEMALLOC_RELEASE_CMD, &ioctl_arg);
-    if (status < 0) {
-        printf("ERROR: failed to release buffer %d. Status: %d\n", tx_buffer_id, status);
+// Note that the driver has seen the last transfer finish
+static void xfer_idle(struct dma_ctx *ctx) {
+    if (ctx->xfer_pending)
+        trace(ctx->base_addr, DMA_TRACE_HW_IDLE, ctx->xfer_bytes);
+    ctx->xfer_pending = 0;
+}
+
+// Predict how long a transfer of "bytes" bytes takes, in microseconds, from the fit.
+// Until there are samples of two different sizes, assume DMA_WAIT_DEFAULT_MBPS and no setup.
+static double wait_predict(struct dma_ctx *ctx, int bytes) {
+    if (ctx->fit_n < 0.5)
+        return bytes / (double)DMA_WAIT_DEFAULT_MBPS;   // bytes / (MB/s) = us
+
+    double mx = ctx->fit_x / ctx->fit_n, my = ctx->fit_y / ctx->fit_n;
+    double var = ctx->fit_xx / ctx->fit_n - mx*mx;
+    double slope = 0, setup = 0;
+    if (var > 0.01*mx*mx) {
+        slope = (ctx->fit_xy / ctx->fit_n - mx*my) / var;
+        setup = my - slope*mx;
     }
+    if (slope <= 0 || setup < 0) {
+        // Not enough spread in the sizes (or noise): scale the average time by size
+        slope = (mx > 0) ? my / mx : 1.0 / DMA_WAIT_DEFAULT_MBPS;
+        setup = 0;
+    }
+    ctx->wait_stats.mb_per_s = 1.0 / slope;
+    ctx->wait_stats.setup_us = setup;
+    return setup + slope*bytes;
+}
 
-    ioctl_arg.buffer_id = rx_buffer_id;
-    status = ioctl(memalloc_dev_fd, MEMALLOC_RELEASE_CMD, &ioctl_arg);
-    if (status < 0) {
-        printf("ERROR: failed to release buffer %d. Status: %d\n", rx_buffer_id, status);
+// Add a measured transfer time to the fit. Older samples fade out, so the fit follows
+// changes in the system (other bus masters, clock changes, ...).
+static void wait_learn(struct dma_ctx *ctx, int bytes, double us) {
+    const double d = DMA_WAIT_DECAY;
+    ctx->fit_n  = ctx->fit_n*d + 1;
+    ctx->fit_x  = ctx->fit_x*d + bytes;
+    ctx->fit_y  = ctx->fit_y*d + us;
+    ctx->fit_xx = ctx->fit_xx*d + (double)bytes*bytes;
+    ctx->fit_xy = ctx->fit_xy*d + (double)bytes*us;
+}
+
+static void sleep_us(double us) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(us / 1e6);
+    ts.tv_nsec = (long)((us - ts.tv_sec*1e6) * 1000);
+    nanosleep(&ts, NULL);
+}
+
+// Wait for the last transfer started (see wait_begin()) until done(ctx) returns 1. Rather
+// than spinning the whole time, sleep through most of the time the transfer is predicted
+// to take, then poll for the rest. If it runs late, back off: poll less and less often.
+// The deadline grows with the size of the transfer.
+// Returns: 0 when done; -1 on timeout
+static int wait_done(struct dma_ctx *ctx, int (*done)(struct dma_ctx *)) {
+    struct dma_wait_stats *st = &ctx->wait_stats;
+    double start = ctx->xfer_start_us;
+    int bytes = ctx->xfer_bytes;
+
+    // (done() may start the next transfer, in a ring; then it has already called xfer_idle())
+    st->polls++;
+    if (done(ctx)) {
+        if (ctx->xfer_start_us == start)
+            xfer_idle(ctx);   // it may have been done for a while; nothing to learn
+        return 0;
     }
-    
 
-    if (memalloc_dev_fd > -1) 
-        close(memalloc_dev_fd);
+    double predicted = wait_predict(ctx, bytes);
+    double deadline = start + DMA_WAIT_TIMEOUT_MS*1000.0 + bytes / (double)DMA_WAIT_MIN_MBPS;
+    double t = now_seconds() * 1e6;
+    st->waits++;
+
+    // Sleep, leaving time for the sleep itself to overrun
+    double nap = predicted*DMA_WAIT_SLEEP_FRACTION - (t - start) - DMA_WAIT_SLEEP_MARGIN_US;
+    if (nap >= DMA_WAIT_MIN_SLEEP_US) {
+        sleep_us(nap);
+        st->sleep_us += nap;
+    }
 
-    if (dma_cfg_base)
-        munmap((void*)dma_cfg_base, DMA_MMAP_LEN);
+    double backoff = 1;
+    while (1) {
+        st->polls++;
+        if (done(ctx))
+            break;
+        t = now_seconds() * 1e6;
+        if (t > deadline)
+            return report_timeout(ctx);
+        if (t - start < predicted + DMA_WAIT_SPIN_US) {
+            poll_pause();
+        } else {
+            sleep_us(backoff);
+            st->sleep_us += backoff;
+            if (backoff < DMA_WAIT_MAX_BACKOFF_US)
+                backoff *= 2;
+        }
+    }
 
-    if (mem_fd > -1) 
-        close(mem_fd);
+    // Done: as far as we know, within one poll of now
+    if (ctx->xfer_start_us == start)
+        xfer_idle(ctx);
+    double actual = now_seconds() * 1e6 - start;
+    st->error_us += (actual > predicted) ? actual - predicted : predicted - actual;
+    wait_learn(ctx, bytes, actual);
+    return 0;
+}
 
+static int simple_done(struct dma_ctx *ctx) {
+    return !s2mm_busy(ctx) && !mm2s_busy(ctx);
 }
 
-static int check_size(int size) {
-    // The DMA's buffer length register is MAX_DMA_LEN_BITS bits, so the size 
-    //    must be strictly < 2^MAX_DMA_LEN_BITS
-    // All accesses must be at least word width (4 bytes), and must be 4-byte aligned.
-    //    So, size must be a multiple of 4.
+// Block until the MM2S and S2MM channels are both idle
+int dma_ctx_sync(struct dma_ctx *ctx) {
+    int res;
+    trace(ctx->base_addr, DMA_TRACE_SYNC_BEGIN, 0);
 
-    if (size < 4) {
-        printf("ERROR: Requested DMA transfer size (%d bytes) is not legal\n", size);
+    if (ctx->use_irq)
+        res = irq_sync(ctx);
+    else
+        res = wait_done(ctx, simple_done);   // done when status reg & 0x2 != 0
+    if (res == 0)
+        res = finish_rx(ctx);
+
+    trace(ctx->base_addr, DMA_TRACE_SYNC_END, 0);
+    return res;
+}
+
+void dma_ctx_init_stats(struct dma_ctx *ctx, struct dma_init_stats *stats) {
+    *stats = ctx->init_stats;
+}
+
+void dma_ctx_wait_stats(struct dma_ctx *ctx, struct dma_wait_stats *stats) {
+    wait_predict(ctx, 0);   // brings mb_per_s and setup_us up to date
+    *stats = ctx->wait_stats;
+    if (stats->waits > 0)
+        stats->error_us /= stats->waits;
+}
+
+
+// Build a chain of descriptors in the given ring, starting at descriptor "first" and
+// covering "size" bytes starting at buf_phy_addr. Each descriptor moves at most
+// DMA_SG_MAX_CHUNK bytes. The last descriptor in the ring points back to the start.
+// Returns: the number of descriptors used
+static int sg_setup(struct dma_ctx *ctx, volatile struct dma_sg_desc *ring, unsigned int ring_phy_addr,
+                    int first, unsigned int buf_phy_addr, int size, int is_tx) {
+    int n = (size + DMA_SG_MAX_CHUNK - 1) / DMA_SG_MAX_CHUNK;
+
+    for (int i=0; i<n; i++) {
+        int len = (i == n-1) ? size - i*DMA_SG_MAX_CHUNK : DMA_SG_MAX_CHUNK;
+        unsigned int control = len;
+        volatile struct dma_sg_desc *d = &ring[first + i];
+
+        // On the Tx side, mark the start and end of the packet so the stream gets TLAST
+        if (is_tx && i == 0)
+            control |= DMA_SG_TXSOF;
+        if (is_tx && i == n-1)
+            control |= DMA_SG_TXEOF;
+
+        d->next_desc = ring_phy_addr + ((first+i+1) % ctx->ring_len)*DMA_SG_DESC_SIZE;
+        d->next_desc_msb = 0;
+        d->buffer_addr = buf_phy_addr + i*DMA_SG_MAX_CHUNK;
+        d->buffer_addr_msb = 0;
+        d->control = control;
+        d->status = 0;
+    }
+    return n;
+}
+
+// Set up a scatter-gather "receive" on the S2MM channel, "offset" bytes into the RxBuffer
+static int ctx_sg_rx_at(struct dma_ctx *ctx, int offset, int size) {
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, size);
+    int res = check_sg_size(ctx, size);
+    if (res)
+        return res;
+
+    if (check_fit(ctx, offset, size))
+        return -1;
+
+    if (buffer_sync(ctx, 0, MEMALLOC_SYNC_FOR_DEVICE, offset, size))
+        return -1;
+    ctx->rx_sync_offset = offset;
+    ctx->rx_sync_size = size;
+
+    ctx->rx_ring_used = sg_setup(ctx, ctx->rx_ring, ctx->rx_ring_phy_addr, 0, ctx->rx_phy_addr + offset, size, 0);
+
+    // Halt the DMA if necessary; CURDESC can only be written while halted
+    set_dma_reg(ctx, S2MM_CNTL_REG, 0);
+
+    // Point the DMA at the first descriptor
+    set_dma_reg(ctx, S2MM_CURDESC_REG, ctx->rx_ring_phy_addr);
+
+    // Set the start bit (and the interrupt enables, if we are using them)
+    set_dma_reg(ctx, S2MM_CNTL_REG, dma_cntl_start(ctx));
+
+    // Writing the tail descriptor starts the whole chain
+    set_dma_reg(ctx, S2MM_TAILDESC_REG, ctx->rx_ring_phy_addr + (ctx->rx_ring_used-1)*DMA_SG_DESC_SIZE);
+    wait_begin(ctx, size);
+
+    return 0;
+}
+
+// Set up a scatter-gather "transmit" on the MM2S channel, "offset" bytes into the TxBuffer
+static int ctx_sg_tx_at(struct dma_ctx *ctx, int offset, int size) {
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, size);
+    int res = check_sg_size(ctx, size);
+    if (res)
+        return res;
+
+    if (check_fit(ctx, offset, size))
         return -1;
+
+    if (buffer_sync(ctx, 1, MEMALLOC_SYNC_FOR_DEVICE, offset, size))
+        return -1;
+
+    ctx->tx_ring_used = sg_setup(ctx, ctx->tx_ring, ctx->tx_ring_phy_addr, 0, ctx->tx_phy_addr + offset, size, 1);
+
+    set_dma_reg(ctx, MM2S_CNTL_REG, 0);
+    set_dma_reg(ctx, MM2S_CURDESC_REG, ctx->tx_ring_phy_addr);
+    set_dma_reg(ctx, MM2S_CNTL_REG, dma_cntl_start(ctx));
+    set_dma_reg(ctx, MM2S_TAILDESC_REG, ctx->tx_ring_phy_addr + (ctx->tx_ring_used-1)*DMA_SG_DESC_SIZE);
+    wait_begin(ctx, size);
+
+    return 0;
+}
+
+int dma_ctx_sg_rx(struct dma_ctx *ctx, int size) {
+    return ctx_sg_rx_at(ctx, 0, size);
+}
+
+int dma_ctx_sg_tx(struct dma_ctx *ctx, int size) {
+    return ctx_sg_tx_at(ctx, 0, size);
+}
+
+static int sg_done(struct dma_ctx *ctx) {
+    return (ctx->tx_ring[ctx->tx_ring_used-1].status & DMA_SG_CMPLT) &&
+           (ctx->rx_ring[ctx->rx_ring_used-1].status & DMA_SG_CMPLT);
+}
+
+// Block until the last descriptor in both the Tx and Rx chains is complete. The DMA
+// writes the status words back to memory, so this never reads the MMIO registers
+// unless something goes wrong.
+static int sg_sync(struct dma_ctx *ctx) {
+    volatile unsigned int *tx_status = &ctx->tx_ring[ctx->tx_ring_used-1].status;
+    volatile unsigned int *rx_status = &ctx->rx_ring[ctx->rx_ring_used-1].status;
+
+    // With interrupts, the DMA interrupts as each descriptor completes
+    while (ctx->use_irq && !(*rx_status & DMA_SG_CMPLT)) {
+        if (irq_wait(ctx, ctx->s2mm_uio_fd, S2MM_STATUS_REG))
+            return report_timeout(ctx);
+    }
+    while (ctx->use_irq && !(*tx_status & DMA_SG_CMPLT)) {
+        if (irq_wait(ctx, ctx->mm2s_uio_fd, MM2S_STATUS_REG))
+            return report_timeout(ctx);
     }
 
-    if ((size & 0x3) != 0) {
-        printf("ERROR: Requested DMA transfer size (%d bytes) is not a multiple of 4\n", size);
+    if (wait_done(ctx, sg_done))
         return -1;
+
+    // A descriptor is marked complete even if it finished with an error
+    for (int i=0; i<ctx->tx_ring_used; i++) {
+        if (ctx->tx_ring[i].status & DMA_SG_ERR_MASK) {
+            printf("ERROR: Tx descriptor %d status: %x\n", i, ctx->tx_ring[i].status);
+            return -1;
+        }
+    }
+    for (int i=0; i<ctx->rx_ring_used; i++) {
+        if (ctx->rx_ring[i].status & DMA_SG_ERR_MASK) {
+            printf("ERROR: Rx descriptor %d status: %x\n", i, ctx->rx_ring[i].status);
+            return -1;
+        }
     }
-        
-    
-    if (size >= (1<<MAX_DMA_LEN_BITS)) {
-        printf("ERROR: Requested DMA transfer size (%d bytes) is larger than maximum size %d\n", size, ((1<<MAX_DMA_LEN_BITS)-1));
+    return finish_rx(ctx);
+}
+
+int dma_ctx_sg_sync(struct dma_ctx *ctx) {
+    trace(ctx->base_addr, DMA_TRACE_SYNC_BEGIN, 0);
+    int res = sg_sync(ctx);
+    trace(ctx->base_addr, DMA_TRACE_SYNC_END, 0);
+    return res;
+}
+
+
+// Replace the descriptor rings with longer ones, of "len" descriptors each
+static int grow_rings(struct dma_ctx *ctx, int len) {
+    int tx_id, rx_id;
+    unsigned int tx_phy, rx_phy;
+    void *tx_ring, *rx_ring;
+
+    if (reserve_buffer(len*DMA_SG_DESC_SIZE, DMA_BUF_COHERENT, &tx_id, &tx_phy, &tx_ring))
         return -1;
+    if (reserve_buffer(len*DMA_SG_DESC_SIZE, DMA_BUF_COHERENT, &rx_id, &rx_phy, &rx_ring)) {
+        release_buffer(tx_id, tx_ring, len*DMA_SG_DESC_SIZE);
+        return -1;
+    }
+
+    release_buffer(ctx->tx_ring_id, (void*)ctx->tx_ring, ctx->ring_len*DMA_SG_DESC_SIZE);
+    release_buffer(ctx->rx_ring_id, (void*)ctx->rx_ring, ctx->ring_len*DMA_SG_DESC_SIZE);
+    ctx->tx_ring = tx_ring;
+    ctx->tx_ring_id = tx_id;
+    ctx->tx_ring_phy_addr = tx_phy;
+    ctx->rx_ring = rx_ring;
+    ctx->rx_ring_id = rx_id;
+    ctx->rx_ring_phy_addr = rx_phy;
+    ctx->ring_len = len;
+    return 0;
+}
+
+// Check every transfer of a batch, and find the parts of the buffers they use.
+// Returns: the number of descriptors the batch needs on each channel; -1 on error
+static int batch_check(struct dma_ctx *ctx, const struct dma_batch_entry *e, int n,
+                       int *tx_lo, int *tx_hi, int *rx_lo, int *rx_hi) {
+    int sg = (ctx->tx_ring != NULL);
+    int desc = 0;
+
+    *tx_lo = *rx_lo = ctx->buffer_size;
+    *tx_hi = *rx_hi = 0;
+    for (int i=0; i<n; i++) {
+        if ((sg ? check_sg_size(ctx, e[i].len) : check_size(ctx, e[i].len)) ||
+            check_fit(ctx, e[i].tx_offset, e[i].len) || check_fit(ctx, e[i].rx_offset, e[i].len)) {
+            printf("ERROR: Bad DMA batch entry %d\n", i);
+            return -1;
+        }
+        if (e[i].tx_offset < *tx_lo)
+            *tx_lo = e[i].tx_offset;
+        if (e[i].tx_offset + e[i].len > *tx_hi)
+            *tx_hi = e[i].tx_offset + e[i].len;
+        if (e[i].rx_offset < *rx_lo)
+            *rx_lo = e[i].rx_offset;
+        if (e[i].rx_offset + e[i].len > *rx_hi)
+            *rx_hi = e[i].rx_offset + e[i].len;
+        desc += (e[i].len + DMA_SG_MAX_CHUNK - 1) / DMA_SG_MAX_CHUNK;
+    }
+    return desc;
+}
+
+// Simple mode: the channels are started once, as usual. After that each transfer only
+// needs its length written (which starts it), plus its address if that changed; the
+// channels are not halted in between.
+static int batch_simple(struct dma_ctx *ctx, const struct dma_batch_entry *e, int n, int *writes) {
+    unsigned int tx_addr = 0, rx_addr = 0;
+
+    for (int i=0; i<n; i++) {
+        unsigned int tx = ctx->tx_phy_addr + e[i].tx_offset;
+        unsigned int rx = ctx->rx_phy_addr + e[i].rx_offset;
+
+        trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, e[i].len);
+        if (i == 0) {
+            start_rx(ctx, rx, e[i].len);
+            start_tx(ctx, tx, e[i].len);
+            *writes += 8;
+        } else {
+            if (rx != rx_addr) {
+                set_dma_reg(ctx, S2MM_DEST_ADDR_REG, rx);
+                (*writes)++;
+            }
+            set_dma_reg(ctx, S2MM_LEN_REG, e[i].len);
+            if (tx != tx_addr) {
+                set_dma_reg(ctx, MM2S_SRC_ADDR_REG, tx);
+                (*writes)++;
+            }
+            set_dma_reg(ctx, MM2S_LEN_REG, e[i].len);
+            *writes += 2;
+        }
+        tx_addr = tx;
+        rx_addr = rx;
+        wait_begin(ctx, e[i].len);
+
+        // The channels are only free for the next transfer once this one is done
+        if (ctx->use_irq ? irq_sync(ctx) : wait_done(ctx, simple_done))
+            return -1;
+        if ((get_dma_reg(ctx, MM2S_STATUS_REG) | get_dma_reg(ctx, S2MM_STATUS_REG)) & DMA_ERR_MASK)
+            return report_timeout(ctx);
     }
+    return 0;
+}
+
+// Scatter-gather mode: as many transfers as fit in the rings go in one chain per
+// channel, each transfer its own packet, and the chain is started with one TAILDESC
+// write. The rings are grown to hold the whole batch, up to DMA_BATCH_MAX_DESC.
+static int batch_sg(struct dma_ctx *ctx, const struct dma_batch_entry *e, int n, int desc, int *writes) {
+    if (desc > ctx->ring_len && ctx->ring_len < DMA_BATCH_MAX_DESC)
+        grow_rings(ctx, desc < DMA_BATCH_MAX_DESC ? desc : DMA_BATCH_MAX_DESC);  // if not, use smaller chains
 
+    int i = 0;
+    while (i < n) {
+        int tx_used = 0, rx_used = 0, first = i;
+        trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, 0);
+        while (i < n && tx_used + (e[i].len + DMA_SG_MAX_CHUNK - 1) / DMA_SG_MAX_CHUNK <= ctx->ring_len) {
+            tx_used += sg_setup(ctx, ctx->tx_ring, ctx->tx_ring_phy_addr, tx_used,
+                                ctx->tx_phy_addr + e[i].tx_offset, e[i].len, 1);
+            rx_used += sg_setup(ctx, ctx->rx_ring, ctx->rx_ring_phy_addr, rx_used,
+                                ctx->rx_phy_addr + e[i].rx_offset, e[i].len, 0);
+            i++;
+        }
+        if (i == first) {
+            printf("ERROR: DMA batch entry %d needs more descriptors than there are\n", i);
+            return -1;
+        }
+        ctx->tx_ring_used = tx_used;
+        ctx->rx_ring_used = rx_used;
+
+        set_dma_reg(ctx, S2MM_CNTL_REG, 0);
+        set_dma_reg(ctx, S2MM_CURDESC_REG, ctx->rx_ring_phy_addr);
+        set_dma_reg(ctx, S2MM_CNTL_REG, dma_cntl_start(ctx));
+        set_dma_reg(ctx, S2MM_TAILDESC_REG, ctx->rx_ring_phy_addr + (rx_used-1)*DMA_SG_DESC_SIZE);
+        set_dma_reg(ctx, MM2S_CNTL_REG, 0);
+        set_dma_reg(ctx, MM2S_CURDESC_REG, ctx->tx_ring_phy_addr);
+        set_dma_reg(ctx, MM2S_CNTL_REG, dma_cntl_start(ctx));
+        set_dma_reg(ctx, MM2S_TAILDESC_REG, ctx->tx_ring_phy_addr + (tx_used-1)*DMA_SG_DESC_SIZE);
+        *writes += 8;
+
+        int bytes = 0;
+        for (int k=first; k<i; k++)
+            bytes += e[k].len;
+        wait_begin(ctx, bytes);
+
+        // sg_sync() waits for the last descriptors and checks them all
+        int rx_sync_size = ctx->rx_sync_size;
+        ctx->rx_sync_size = 0;
+        int res = sg_sync(ctx);
+        ctx->rx_sync_size = rx_sync_size;
+        if (res)
+            return -1;
+    }
     return 0;
 }
+
+// Run a batch of transfers, one after another, checking them all first
+int dma_ctx_batch(struct dma_ctx *ctx, const struct dma_batch_entry *e, int n, struct dma_batch_stats *stats) {
+    int tx_lo, tx_hi, rx_lo, rx_hi, writes = 0;
+
+    if (ctx->txbase == NULL) {
+        printf("ERROR: DMA batches need the buffers from dma_init() or dma_sg_init()\n");
+        return -1;
+    }
+    if (n <= 0)
+        return 0;
+    int desc = batch_check(ctx, e, n, &tx_lo, &tx_hi, &rx_lo, &rx_hi);
+    if (desc < 0)
+        return -1;
+
+    double start = now_seconds();
+
+    // One cache sync for each buffer, for the whole batch
+    if (buffer_sync(ctx, 1, MEMALLOC_SYNC_FOR_DEVICE, tx_lo, tx_hi - tx_lo) ||
+        buffer_sync(ctx, 0, MEMALLOC_SYNC_FOR_DEVICE, rx_lo, rx_hi - rx_lo))
+        return -1;
+    ctx->rx_sync_offset = rx_lo;
+    ctx->rx_sync_size = rx_hi - rx_lo;
+
+    int res = ctx->tx_ring ? batch_sg(ctx, e, n, desc, &writes) : batch_simple(ctx, e, n, &writes);
+    if (res == 0)
+        res = finish_rx(ctx);
+    ctx->rx_sync_size = 0;
+
+    if (stats) {
+        stats->transfers = n;
+        stats->bytes = 0;
+        for (int i=0; i<n; i++)
+            stats->bytes += e[i].len;
+        stats->seconds = now_seconds() - start;
+        stats->us_per_transfer = stats->seconds * 1e6 / n;
+        stats->reg_writes = writes;
+    }
+    return res;
+}
+
+
+// Initialize a context with a ring of "nslots" pairs of Tx and Rx buffers, each of the given size
+static int ctx_ring_init(struct dma_ctx *ctx, unsigned int base_addr, int nslots, int size) {
+    int res = check_buffer_size(size, 0);
+    if (res)
+        return res;
+
+    if (nslots < 2 || nslots > DMA_RING_MAX_SLOTS) {
+        printf("ERROR: Requested ring of %d slots; must be between 2 and %d\n", nslots, DMA_RING_MAX_SLOTS);
+        return -1;
+    }
+
+    trace(base_addr, DMA_TRACE_INIT_BEGIN, size);
+    double t0 = now_seconds();
+    if (ctx_open(ctx, base_addr))
+        return -1;
+    double t1 = now_seconds();
+
+    for (int i=0; i<nslots; i++) {
+        struct dma_slot *s = &ctx->slots[i];
+        if (reserve_buffer(size, DMA_BUF_COHERENT, &s->tx_buffer_id, &s->tx_phy_addr, &s->txbase) ||
+            reserve_buffer(size, DMA_BUF_COHERENT, &s->rx_buffer_id, &s->rx_phy_addr, &s->rxbase)) {
+            printf("ERROR: memalloc reserve failed for ring slot %d\n", i);
+            ctx->buffer_size = size;
+            ctx_release(ctx);
+            return -1;
+        }
+    }
+
+    ctx->ring_slots = nslots;
+    ctx->buffer_size = size;
+    ctx->ring_head = ctx->ring_engine = ctx->ring_tail = 0;
+    ctx->ring_busy = 0;
+
+    double t2 = now_seconds();
+    ctx->init_stats.open_us = (t1 - t0) * 1e6;
+    ctx->init_stats.buffers_us = (t2 - t1) * 1e6;
+    ctx->init_stats.total_us = (t2 - t0) * 1e6;
+    ctx->init_stats.buffers = 2*nslots;
+    trace(base_addr, DMA_TRACE_INIT_END, nslots*size);
+    return 0;
+}
+
+struct dma_ctx *dma_ctx_ring_init(unsigned int base_addr, int nslots, int size) {
+    struct dma_ctx *ctx = ctx_alloc(base_addr);
+    if (ctx && ctx_ring_init(ctx, base_addr, nslots, size)) {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void* dma_ctx_ring_tx_buffer(struct dma_ctx *ctx, int slot) {
+    return ctx->slots[slot].txbase;
+}
+
+void* dma_ctx_ring_rx_buffer(struct dma_ctx *ctx, int slot) {
+    return ctx->slots[slot].rxbase;
+}
+
+// If the DMA finished the slot it was moving, mark it done; then, if the DMA is free,
+// start the next slot the application has submitted. This is called from every ring
+// function, so the DMA is kept busy without interrupts or a separate thread.
+static void ring_advance(struct dma_ctx *ctx) {
+    if (ctx->ring_busy) {
+        if (s2mm_busy(ctx) || mm2s_busy(ctx))
+            return;
+        ctx->ring_busy = 0;
+        ctx->ring_engine++;
+        xfer_idle(ctx);
+    }
+
+    if (ctx->ring_engine != ctx->ring_head) {
+        struct dma_slot *s = &ctx->slots[ctx->ring_engine % ctx->ring_slots];
+        trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, s->len);
+        start_rx(ctx, s->rx_phy_addr, s->len);
+        start_tx(ctx, s->tx_phy_addr, s->len);
+        wait_begin(ctx, s->len);
+        ctx->ring_busy = 1;
+    }
+}
+
+// Return the slot the application should fill next, or -1 if every slot is in use
+int dma_ctx_ring_produce(struct dma_ctx *ctx) {
+    ring_advance(ctx);
+    if (ctx->ring_head - ctx->ring_tail == ctx->ring_slots)
+        return -1;
+    return ctx->ring_head % ctx->ring_slots;
+}
+
+// Hand the slot returned by dma_ring_produce() to the DMA, to move "size" bytes
+int dma_ctx_ring_submit(struct dma_ctx *ctx, int size) {
+    int res = check_size(ctx, size);
+    if (res)
+        return res;
+
+    if (size > ctx->buffer_size) {
+        printf("ERROR: Requested DMA transfer size (%d bytes) is larger than the buffer (%d bytes)\n", size, ctx->buffer_size);
+        return -1;
+    }
+
+    if (ctx->ring_head - ctx->ring_tail == ctx->ring_slots) {
+        printf("ERROR: Submitted to a full DMA ring\n");
+        return -1;
+    }
+
+    ctx->slots[ctx->ring_head % ctx->ring_slots].len = size;
+    ctx->ring_head++;
+    ring_advance(ctx);
+    return 0;
+}
+
+// Return the slot the application should drain next if its transfer is done, or -1 if not
+int dma_ctx_ring_consume(struct dma_ctx *ctx) {
+    ring_advance(ctx);
+    if (ctx->ring_tail == ctx->ring_engine)
+        return -1;
+    return ctx->ring_tail % ctx->ring_slots;
+}
+
+static int ring_done(struct dma_ctx *ctx) {
+    return dma_ctx_ring_consume(ctx) >= 0;
+}
+
+// Like dma_ring_consume(), but block until the transfer is done
+int dma_ctx_ring_wait(struct dma_ctx *ctx) {
+    if (ctx->ring_tail == ctx->ring_head) {
+        printf("ERROR: Waiting on an empty DMA ring\n");
+        return -1;
+    }
+
+    trace(ctx->base_addr, DMA_TRACE_SYNC_BEGIN, 0);
+    int slot;
+    while ((slot = dma_ctx_ring_consume(ctx)) < 0) {
+        if (ctx->use_irq ? irq_sync(ctx) : wait_done(ctx, ring_done)) {
+            slot = -1;
+            break;
+        }
+    }
+    trace(ctx->base_addr, DMA_TRACE_SYNC_END, 0);
+    return slot;
+}
+
+// The application is done with the slot from dma_ring_consume(); it can be filled again
+void dma_ctx_ring_release(struct dma_ctx *ctx) {
+    if (ctx->ring_tail != ctx->ring_engine)
+        ctx->ring_tail++;
+    ring_advance(ctx);
+}
+
+int dma_ctx_ring_producer_index(struct dma_ctx *ctx) {
+    return ctx->ring_head % ctx->ring_slots;
+}
+
+int dma_ctx_ring_consumer_index(struct dma_ctx *ctx) {
+    return ctx->ring_tail % ctx->ring_slots;
+}
+
+// Number of slots submitted but not yet drained (including the one the DMA is moving)
+int dma_ctx_ring_pending(struct dma_ctx *ctx) {
+    return ctx->ring_head - ctx->ring_tail;
+}
+
+// Returns 1 if the DMA is moving a slot right now
+int dma_ctx_ring_in_flight(struct dma_ctx *ctx) {
+    ring_advance(ctx);
+    return ctx->ring_busy;
+}
+
+
+// Seconds on the monotonic clock, for measuring throughput
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Read up to n bytes, retrying short reads, until n bytes or end of file.
+// Returns: the number of bytes read, or -1 on error
+static int read_full(int fd, void *buf, int n) {
+    int done = 0;
+    while (done < n) {
+        ssize_t r = read(fd, (char*)buf + done, n - done);
+        if (r < 0) {
+            printf("ERROR: read from input failed\n");
+            return -1;
+        }
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+// Write all n bytes, retrying short writes. Returns: 0 on success; -1 on error
+static int write_full(int fd, const void *buf, int n) {
+    int done = 0;
+    while (done < n) {
+        ssize_t w = write(fd, (const char*)buf + done, n - done);
+        if (w <= 0) {
+            printf("ERROR: write to output failed\n");
+            return -1;
+        }
+        done += w;
+    }
+    return 0;
+}
+
+// Stream from in_fd (or, if in_fd is -1, from the in_len bytes at in_mem) through the
+// DMA into out_fd, using the context's buffer ring. Reading into one slot and writing
+// out another both happen while the DMA moves a third.
+//
+// The chunk size starts at DMA_STREAM_MIN_CHUNK and doubles after each window of
+// DMA_STREAM_WINDOW chunks, as long as that makes the measured throughput better. If
+// the throughput later drops off a lot, it starts searching again.
+static int stream_run(struct dma_ctx *ctx, int in_fd, const char *in_mem, long long in_len,
+                      int out_fd, struct dma_stream_stats *stats) {
+    if (ctx->ring_slots == 0) {
+        printf("ERROR: Streaming needs a buffer ring; initialize the DMA with dma_ring_init()\n");
+        return -1;
+    }
+
+    int bytes[DMA_RING_MAX_SLOTS];        // real (unpadded) bytes in each slot
+    int unit = ctx_unit(ctx);               // chunks are padded to a multiple of this
+    int max_chunk = ctx->buffer_size & ~(unit-1);
+    int chunk = (DMA_STREAM_MIN_CHUNK < max_chunk) ? DMA_STREAM_MIN_CHUNK : max_chunk;
+    int best_chunk = chunk;
+    double best_rate = 0;
+    int searching = 1;
+
+    long long in_pos = 0, total = 0;
+    int chunks = 0, eof = 0;
+    int window_chunks = 0;
+    long long window_bytes = 0;
+    double start = now_seconds();
+    double window_start = start;
+
+    while (!eof || dma_ctx_ring_pending(ctx) > 0) {
+        // Fill and submit as many slots as we can
+        int slot;
+        while (!eof && (slot = dma_ctx_ring_produce(ctx)) >= 0) {
+            char *tx = dma_ctx_ring_tx_buffer(ctx, slot);
+            int n;
+            if (in_fd >= 0) {
+                n = read_full(in_fd, tx, chunk);
+                if (n < 0)
+                    return -1;
+            } else {
+                n = (in_len - in_pos < chunk) ? (int)(in_len - in_pos) : chunk;
+                memcpy(tx, in_mem + in_pos, n);
+                in_pos += n;
+            }
+            if (n < chunk)
+                eof = 1;
+            if (n == 0)
+                break;
+
+            // Without the DRE the DMA moves whole stream beats; pad the end of the data
+            // with zeros
+            int padded = (n + unit-1) & ~(unit-1);
+            memset(tx + n, 0, padded - n);
+            bytes[slot] = n;
+            if (dma_ctx_ring_submit(ctx, padded))
+                return -1;
+        }
+
+        if (dma_ctx_ring_pending(ctx) == 0)
+            continue;
+
+        // Drain the oldest slot
+        slot = dma_ctx_ring_wait(ctx);
+        if (slot < 0)
+            return -1;
+        if (write_full(out_fd, dma_ctx_ring_rx_buffer(ctx, slot), bytes[slot]))
+            return -1;
+        total += bytes[slot];
+        window_bytes += bytes[slot];
+        chunks++;
+        dma_ctx_ring_release(ctx);
+
+        // Adjust the chunk size once per window
+        if (++window_chunks == DMA_STREAM_WINDOW) {
+            double t = now_seconds();
+            double rate = window_bytes / (t - window_start);
+            if (searching) {
+                if (rate > best_rate * 1.05) {
+                    best_rate = rate;
+                    best_chunk = chunk;
+                    if (chunk < max_chunk)
+                        chunk = (2*chunk < max_chunk) ? 2*chunk : max_chunk;
+                    else
+                        searching = 0;
+                } else {
+                    chunk = best_chunk;
+                    searching = 0;
+                }
+            } else if (rate < best_rate * 0.75) {
+                best_rate = rate;
+                searching = 1;
+            }
+            window_chunks = 0;
+            window_bytes = 0;
+            window_start = t;
+        }
+    }
+
+    if (stats) {
+        stats->bytes = total;
+        stats->seconds = now_seconds() - start;
+        stats->mb_per_s = (stats->seconds > 0) ? total / stats->seconds / 1e6 : 0;
+        stats->chunks = chunks;
+        stats->chunk_size = best_chunk;
+    }
+    return 0;
+}
+
+int dma_ctx_stream(struct dma_ctx *ctx, int in_fd, int out_fd, struct dma_stream_stats *stats) {
+    return stream_run(ctx, in_fd, NULL, 0, out_fd, stats);
+}
+
+int dma_ctx_stream_mem(struct dma_ctx *ctx, const void *in, long long len, int out_fd,
+                       struct dma_stream_stats *stats) {
+    return stream_run(ctx, -1, in, len, out_fd, stats);
+}
+
+
+// Register application memory (addr != NULL) or a dma-buf (fd >= 0) for DMA. If memalloc
+// can import it in place, the DMA uses it directly; otherwise it gets a bounce buffer.
+// Returns: the region number, or -1 on error
+static int region_register(struct dma_ctx *ctx, void *addr, int fd, int size) {
+    if (size <= 0) {
+        printf("ERROR: Requested DMA region size (%d bytes) is not legal\n", size);
+        return -1;
+    }
+
+    int n;
+    for (n=0; n<DMA_MAX_REGIONS; n++)
+        if (!ctx->regions[n].in_use)
+            break;
+    if (n == DMA_MAX_REGIONS) {
+        printf("ERROR: No free DMA region (at most %d can be registered)\n", DMA_MAX_REGIONS);
+        return -1;
+    }
+
+    struct dma_region *r = &ctx->regions[n];
+    memset(r, 0, sizeof(*r));
+    r->size = size;
+    r->id = -1;
+
+    // The DMA can only use memory in place if it starts on a stream-width boundary (or
+    // anywhere, with the DRE)
+    int imported = 0;
+    if (((unsigned long)addr & (ctx_unit(ctx)-1)) == 0)
+        imported = (import_buffer(addr, fd, size, &r->id, &r->phy_addr) == 0);
+    if (!imported)
+        r->id = -1;
+
+    // A dma-buf needs mapping for the CPU to use it (and for the bounce buffer to copy it)
+    if (fd >= 0) {
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            addr = NULL;
+            if (!imported) {
+                printf("ERROR: dma-buf %d cannot be imported or mapped\n", fd);
+                return -1;
+            }
+        }
+        r->mapped = (addr != NULL);
+    }
+    r->addr = addr;
+
+    if (!imported && reserve_buffer(size, DMA_BUF_COHERENT, &r->bounce_id, &r->bounce_phy_addr, &r->bounce)) {
+        printf("ERROR: memalloc (bounce buffer) reserve failed\n");
+        if (r->mapped)
+            munmap(addr, size);
+        return -1;
+    }
+
+    r->in_use = 1;
+    return n;
+}
+
+int dma_ctx_register(struct dma_ctx *ctx, void *addr, int size) {
+    return region_register(ctx, addr, -1, size);
+}
+
+int dma_ctx_register_dmabuf(struct dma_ctx *ctx, int fd, int size) {
+    return region_register(ctx, NULL, fd, size);
+}
+
+// Check that a region is registered and the transfer fits inside it.
+// Returns: the region, or NULL on error
+static struct dma_region *region_check(struct dma_ctx *ctx, int region, int offset, int size) {
+    if (region < 0 || region >= DMA_MAX_REGIONS || !ctx->regions[region].in_use) {
+        printf("ERROR: DMA region %d is not registered\n", region);
+        return NULL;
+    }
+    struct dma_region *r = &ctx->regions[region];
+
+    if (check_size(ctx, size))
+        return NULL;
+    if (offset < 0 || (offset & (ctx_unit(ctx)-1)) != 0 || offset + size > r->size) {
+        printf("ERROR: DMA transfer of %d bytes at offset %d does not fit in region %d (%d bytes)\n",
+               size, offset, region, r->size);
+        return NULL;
+    }
+    return r;
+}
+
+void* dma_ctx_region_buffer(struct dma_ctx *ctx, int region) {
+    return ctx->regions[region].addr;
+}
+
+int dma_ctx_region_zero_copy(struct dma_ctx *ctx, int region) {
+    return ctx->regions[region].id >= 0;
+}
+
+// Send "size" bytes from "offset" bytes into a region
+int dma_ctx_region_tx(struct dma_ctx *ctx, int region, int offset, int size) {
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, size);
+    struct dma_region *r = region_check(ctx, region, offset, size);
+    if (r == NULL)
+        return -1;
+
+    if (r->id >= 0) {
+        // Write the CPU's cached data back to memory, so the DMA reads it (only the
+        // bytes sent, not the whole region)
+        if (sync_buffer(r->id, MEMALLOC_SYNC_FOR_DEVICE, offset, size))
+            return -1;
+        start_tx(ctx, r->phy_addr + offset, size);
+    } else {
+        memcpy((char*)r->bounce + offset, (char*)r->addr + offset, size);
+        start_tx(ctx, r->bounce_phy_addr + offset, size);
+    }
+    wait_begin(ctx, size);
+    return 0;
+}
+
+// Receive "size" bytes into a region, "offset" bytes in. The data is visible to the CPU
+// once dma_sync() returns.
+int dma_ctx_region_rx(struct dma_ctx *ctx, int region, int offset, int size) {
+    trace(ctx->base_addr, DMA_TRACE_SUBMIT_BEGIN, size);
+    struct dma_region *r = region_check(ctx, region, offset, size);
+    if (r == NULL)
+        return -1;
+
+    if (r->id >= 0) {
+        // Clean the caches first, so nothing cached is written over the DMA's data later
+        if (sync_buffer(r->id, MEMALLOC_SYNC_FOR_DEVICE, offset, size))
+            return -1;
+        start_rx(ctx, r->phy_addr + offset, size);
+    } else {
+        start_rx(ctx, r->bounce_phy_addr + offset, size);
+    }
+    wait_begin(ctx, size);
+
+    ctx->rx_region = region;
+    ctx->rx_region_offset = offset;
+    ctx->rx_region_size = size;
+    return 0;
+}
+
+// After a receive, make the data visible to the CPU. For a cached RxBuffer, or a region,
+// drop the stale cache lines; for a region that could not be imported, copy the data out
+// of the bounce buffer.
+static int finish_rx(struct dma_ctx *ctx) {
+    if (ctx->rx_sync_size > 0) {
+        int size = ctx->rx_sync_size;
+        ctx->rx_sync_size = 0;
+        if (buffer_sync(ctx, 0, MEMALLOC_SYNC_FOR_CPU, ctx->rx_sync_offset, size))
+            return -1;
+    }
+
+    if (ctx->rx_region < 0)
+        return 0;
+
+    struct dma_region *r = &ctx->regions[ctx->rx_region];
+    ctx->rx_region = -1;
+    if (r->id >= 0)
+        return sync_buffer(r->id, MEMALLOC_SYNC_FOR_CPU, ctx->rx_region_offset, ctx->rx_region_size);
+
+    memcpy((char*)r->addr + ctx->rx_region_offset, (char*)r->bounce + ctx->rx_region_offset,
+           ctx->rx_region_size);
+    return 0;
+}
+
+void dma_ctx_unregister(struct dma_ctx *ctx, int region) {
+    if (region < 0 || region >= DMA_MAX_REGIONS || !ctx->regions[region].in_use)
+        return;
+
+    struct dma_region *r = &ctx->regions[region];
+    if (r->id >= 0)
+        release_buffer(r->id, NULL, r->size);
+    if (r->bounce)
+        release_buffer(r->bounce_id, r->bounce, r->size);
+    if (r->mapped)
+        munmap(r->addr, r->size);
+    if (ctx->rx_region == region)
+        ctx->rx_region = -1;
+    r->in_use = 0;
+}
+
+// Export the TxBuffer or RxBuffer as a dma-buf (note 17 in dma.h)
+int dma_ctx_export_tx_buffer(struct dma_ctx *ctx) {
+    if (!ctx->owns_buffers) {
+        printf("ERROR: This context has no Tx buffer of its own to export\n");
+        return -1;
+    }
+    return export_buffer(ctx->tx_buffer_id);
+}
+
+int dma_ctx_export_rx_buffer(struct dma_ctx *ctx) {
+    if (!ctx->owns_buffers) {
+        printf("ERROR: This context has no Rx buffer of its own to export\n");
+        return -1;
+    }
+    return export_buffer(ctx->rx_buffer_id);
+}
+
+
+// Open the UIO devices for the DMA's interrupts, and from now on wait for interrupts
+// instead of polling
+int dma_ctx_irq_init(struct dma_ctx *ctx, const char *mm2s_uio, const char *s2mm_uio) {
+#ifdef DMA_MODEL
+    // The model provides its own (eventfd-based) UIO devices
+    ctx->mm2s_uio_fd = dma_model_uio_open(ctx->cfg_base, MM2S_CNTL_REG);
+    ctx->s2mm_uio_fd = dma_model_uio_open(ctx->cfg_base, S2MM_CNTL_REG);
+#else
+    ctx->mm2s_uio_fd = open(mm2s_uio, O_RDWR);
+    ctx->s2mm_uio_fd = open(s2mm_uio, O_RDWR);
+#endif
+    if (ctx->mm2s_uio_fd == -1 || ctx->s2mm_uio_fd == -1) {
+        printf("ERROR: failed to open %s and %s; polling the DMA instead\n", mm2s_uio, s2mm_uio);
+#ifndef DMA_MODEL
+        if (ctx->mm2s_uio_fd > -1)
+            close(ctx->mm2s_uio_fd);
+        if (ctx->s2mm_uio_fd > -1)
+            close(ctx->s2mm_uio_fd);
+#endif
+        ctx->mm2s_uio_fd = ctx->s2mm_uio_fd = -1;
+        return -1;
+    }
+
+    // Clear anything left over, then enable the interrupts in UIO
+    set_dma_reg(ctx, MM2S_STATUS_REG, DMA_IRQ_MASK);
+    set_dma_reg(ctx, S2MM_STATUS_REG, DMA_IRQ_MASK);
+    ctx->use_irq = 1;
+    return 0;
+}
+
+// Read the interrupt count from a UIO device. (The model's fake devices are eventfds,
+// which need 8-byte reads and writes; real UIO devices use 4 bytes.)
+static int uio_read(int fd) {
+#ifdef DMA_MODEL
+    uint64_t count;
+#else
+    uint32_t count;
+#endif
+    return (read(fd, &count, sizeof(count)) == sizeof(count)) ? 0 : -1;
+}
+
+// Re-enable the interrupt of a UIO device. The kernel disables it each time it fires.
+static int uio_enable(int fd) {
+#ifdef DMA_MODEL
+    return dma_model_uio_enable(fd);
+#else
+    uint32_t one = 1;
+    return (write(fd, &one, sizeof(one)) == sizeof(one)) ? 0 : -1;
+#endif
+}
+
+// Sleep until one interrupt arrives from a UIO device, then acknowledge it in the DMA
+// status register (the interrupt bits are write-1-to-clear), and re-enable it. The
+// DMA must be acknowledged first, or the interrupt fires again straight away.
+// Returns: 0 on success; -1 on timeout or error
+static int irq_wait(struct dma_ctx *ctx, int fd, int status_reg) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, DMA_IRQ_TIMEOUT_MS) <= 0)
+        return -1;
+    if (uio_read(fd))
+        return -1;
+
+    set_dma_reg(ctx, status_reg, DMA_IRQ_MASK);
+    if (uio_enable(fd))
+        return -1;
+
+    if (get_dma_reg(ctx, status_reg) & DMA_ERR_MASK) {
+        printf("ERROR: DMA error interrupt. ");
+        return -1;
+    }
+    return 0;
+}
+
+// Wait with interrupts until both channels are idle. An interrupt may be left over from
+// a transfer that finished before anyone waited for it, so keep waiting until the
+// channel really is idle.
+static int irq_sync(struct dma_ctx *ctx) {
+    while (s2mm_busy(ctx)) {
+        if (irq_wait(ctx, ctx->s2mm_uio_fd, S2MM_STATUS_REG))
+            return report_timeout(ctx);
+    }
+    while (mm2s_busy(ctx)) {
+        if (irq_wait(ctx, ctx->mm2s_uio_fd, MM2S_STATUS_REG))
+            return report_timeout(ctx);
+    }
+    xfer_idle(ctx);
+    return 0;
+}
+
+static int report_timeout(struct dma_ctx *ctx) {
+    printf("ERROR: Timeout waiting for DMA.");
+    printf("mm2s status: %x\n", get_dma_reg(ctx, MM2S_STATUS_REG));
+    printf("s2mm status: %x\n", get_dma_reg(ctx, S2MM_STATUS_REG));
+    return -1;
+}
+
+
+// Start the DMA on the transfer at the head of a queue
+static void async_start(struct dma_ctx *ctx, struct async_queue *q) {
+    struct dma_xfer *x = q->head;
+    if (q->cntl_reg == MM2S_CNTL_REG)
+        start_tx(ctx, x->phy_addr, x->size);
+    else
+        start_rx(ctx, x->phy_addr, x->size);
+}
+
+// Signal a finished transfer's handle
+static void async_finish(struct dma_xfer *x, int status) {
+    x->status = status;
+    if (x->freed) {
+        close(x->fd);
+        free(x);
+        return;
+    }
+    uint64_t one = 1;
+    if (write(x->fd, &one, sizeof(one)) != sizeof(one))
+        printf("ERROR: failed to signal DMA transfer completion\n");
+}
+
+// If the transfer at the head of a queue is done, signal it and start the next one.
+// Returns: 1 if a transfer finished; 0 if not
+static int async_check(struct dma_ctx *ctx, struct async_queue *q) {
+    struct dma_xfer *x = q->head;
+    if (x == NULL)
+        return 0;
+
+    int status = get_dma_reg(ctx, q->status_reg);
+    if (status & DMA_ERR_MASK) {
+        printf("ERROR: DMA error. status: %x\n", status);
+        // the channel has halted; fail everything queued on it
+        q->head = q->tail = NULL;
+        while (x) {
+            struct dma_xfer *next = x->next;
+            async_finish(x, -1);
+            x = next;
+        }
+        return 1;
+    }
+    if ((status & DMA_IDLE) == 0)
+        return 0;
+
+    q->head = x->next;
+    if (q->head == NULL)
+        q->tail = NULL;
+    else
+        async_start(ctx, q);
+
+    // Received data is not the CPU's to read until a cached RxBuffer is synced
+    status = 1;
+    if (q == &ctx->s2mm_queue && buffer_sync(ctx, 0, MEMALLOC_SYNC_FOR_CPU, x->offset, x->size))
+        status = -1;
+    async_finish(x, status);
+    return 1;
+}
+
+// The completion thread. It sleeps until a channel interrupts (or, without interrupts,
+// checks the channels every DMA_ASYNC_POLL_US microseconds while anything is queued),
+// then signals the finished transfers and starts the next queued ones.
+static void *async_main(void *arg) {
+    struct dma_ctx *ctx = arg;
+
+    pthread_mutex_lock(&ctx->async_lock);
+    while (ctx->async_running) {
+        if (async_check(ctx, &ctx->mm2s_queue) + async_check(ctx, &ctx->s2mm_queue))
+            continue;
+
+        int queued = (ctx->mm2s_queue.head != NULL) || (ctx->s2mm_queue.head != NULL);
+        pthread_mutex_unlock(&ctx->async_lock);
+
+        struct pollfd pfd[3];
+        pfd[0].fd = ctx->async_kick_fd;
+        pfd[1].fd = ctx->mm2s_uio_fd;
+        pfd[2].fd = ctx->s2mm_uio_fd;
+        for (int i=0; i<3; i++) {
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+        }
+
+        if (ctx->use_irq || !queued) {
+            poll(pfd, ctx->use_irq ? 3 : 1, -1);
+        } else {
+            struct timespec ts = { 0, DMA_ASYNC_POLL_US*1000 };
+            nanosleep(&ts, NULL);
+        }
+
+        pthread_mutex_lock(&ctx->async_lock);
+        if (pfd[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(ctx->async_kick_fd, &count, sizeof(count)) != sizeof(count))
+                printf("ERROR: failed to read DMA completion thread wakeup\n");
+        }
+        // Acknowledge the interrupts, then re-enable them in UIO
+        if (pfd[1].revents & POLLIN) {
+            uio_read(ctx->mm2s_uio_fd);
+            set_dma_reg(ctx, MM2S_STATUS_REG, DMA_IRQ_MASK);
+            uio_enable(ctx->mm2s_uio_fd);
+        }
+        if (pfd[2].revents & POLLIN) {
+            uio_read(ctx->s2mm_uio_fd);
+            set_dma_reg(ctx, S2MM_STATUS_REG, DMA_IRQ_MASK);
+            uio_enable(ctx->s2mm_uio_fd);
+        }
+    }
+    pthread_mutex_unlock(&ctx->async_lock);
+    return NULL;
+}
+
+// Start the completion thread, the first time it is needed
+static int async_start_thread(struct dma_ctx *ctx) {
+    if (ctx->async_running)
+        return 0;
+
+    ctx->async_kick_fd = eventfd(0, EFD_CLOEXEC);
+    if (ctx->async_kick_fd == -1) {
+        printf("ERROR: failed to create eventfd\n");
+        return -1;
+    }
+
+    ctx->async_running = 1;
+    if (pthread_create(&ctx->async_thread, NULL, async_main, ctx)) {
+        printf("ERROR: failed to start DMA completion thread\n");
+        ctx->async_running = 0;
+        close(ctx->async_kick_fd);
+        ctx->async_kick_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Stop the completion thread, and fail anything still queued
+static void async_stop(struct dma_ctx *ctx) {
+    if (!ctx->async_running)
+        return;
+
+    pthread_mutex_lock(&ctx->async_lock);
+    ctx->async_running = 0;
+    uint64_t one = 1;
+    if (write(ctx->async_kick_fd, &one, sizeof(one)) != sizeof(one))
+        printf("ERROR: failed to wake DMA completion thread\n");
+    pthread_mutex_unlock(&ctx->async_lock);
+    pthread_join(ctx->async_thread, NULL);
+
+    struct async_queue *queues[2] = { &ctx->mm2s_queue, &ctx->s2mm_queue };
+    for (int i=0; i<2; i++) {
+        struct dma_xfer *x = queues[i]->head;
+        while (x) {
+            struct dma_xfer *next = x->next;
+            async_finish(x, -1);
+            x = next;
+        }
+        queues[i]->head = queues[i]->tail = NULL;
+    }
+
+    close(ctx->async_kick_fd);
+    ctx->async_kick_fd = -1;
+}
+
+// Queue a transfer on a channel, and start it if the channel is free
+static struct dma_xfer *async_submit(struct dma_ctx *ctx, struct async_queue *q, unsigned int phy_addr,
+                                     int offset, int size) {
+    if (check_size(ctx, size) || check_fit(ctx, offset, size))
+        return NULL;
+
+    if (buffer_sync(ctx, q == &ctx->mm2s_queue, MEMALLOC_SYNC_FOR_DEVICE, offset, size))
+        return NULL;
+
+    if (async_start_thread(ctx))
+        return NULL;
+
+    struct dma_xfer *x = calloc(1, sizeof(struct dma_xfer));
+    if (x == NULL)
+        return NULL;
+    x->fd = eventfd(0, EFD_CLOEXEC);
+    if (x->fd == -1) {
+        printf("ERROR: failed to create eventfd\n");
+        free(x);
+        return NULL;
+    }
+    x->ctx = ctx;
+    x->phy_addr = phy_addr + offset;
+    x->offset = offset;
+    x->size = size;
+
+    pthread_mutex_lock(&ctx->async_lock);
+    if (q->tail)
+        q->tail->next = x;
+    else
+        q->head = x;
+    q->tail = x;
+    if (q->head == x)
+        async_start(ctx, q);
+
+    // Wake the completion thread, in case it is sleeping with nothing queued
+    uint64_t one = 1;
+    if (write(ctx->async_kick_fd, &one, sizeof(one)) != sizeof(one))
+        printf("ERROR: failed to wake DMA completion thread\n");
+    pthread_mutex_unlock(&ctx->async_lock);
+    return x;
+}
+
+struct dma_xfer *dma_ctx_tx_async(struct dma_ctx *ctx, int offset, int size) {
+    return async_submit(ctx, &ctx->mm2s_queue, ctx->tx_phy_addr, offset, size);
+}
+
+struct dma_xfer *dma_ctx_rx_async(struct dma_ctx *ctx, int offset, int size) {
+    return async_submit(ctx, &ctx->s2mm_queue, ctx->rx_phy_addr, offset, size);
+}
+
+int dma_xfer_fd(struct dma_xfer *x) {
+    return x->fd;
+}
+
+int dma_xfer_status(struct dma_xfer *x) {
+    pthread_mutex_lock(&x->ctx->async_lock);
+    int status = x->status;
+    pthread_mutex_unlock(&x->ctx->async_lock);
+    return status;
+}
+
+// Wait until one of the transfers is done
+int dma_xfer_wait_any(struct dma_xfer **x, int n, int timeout_ms) {
+    struct pollfd pfd[n];
+    for (int i=0; i<n; i++) {
+        pfd[i].fd = x[i]->fd;
+        pfd[i].events = POLLIN;
+    }
+
+    int res = poll(pfd, n, timeout_ms);
+    if (res == 0) {
+        printf("ERROR: Timeout waiting for DMA.\n");
+        return -1;
+    }
+    if (res < 0)
+        return -1;
+
+    for (int i=0; i<n; i++)
+        if (pfd[i].revents & POLLIN)
+            return i;
+    return -1;
+}
+
+int dma_xfer_wait(struct dma_xfer *x, int timeout_ms) {
+    if (dma_xfer_wait_any(&x, 1, timeout_ms) < 0)
+        return -1;
+    return dma_xfer_status(x) == 1 ? 0 : -1;
+}
+
+// Wait until all of the transfers are done
+int dma_xfer_wait_all(struct dma_xfer **x, int n, int timeout_ms) {
+    int res = 0;
+    for (int i=0; i<n; i++) {
+        if (dma_xfer_wait(x[i], timeout_ms))
+            res = -1;
+    }
+    return res;
+}
+
+void dma_xfer_free(struct dma_xfer *x) {
+    pthread_mutex_t *lock = &x->ctx->async_lock;
+    pthread_mutex_lock(lock);
+    if (x->status == 0) {
+        // still queued; the completion thread frees it when it finishes
+        x->freed = 1;
+    } else {
+        close(x->fd);
+        free(x);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+
+// --------------------------------------------------------------------
+// Service thread (note 12 in dma.h)
+//
+// Producers push requests onto a stack with a compare-and-swap on its head. The service
+// thread takes the whole stack at once, with an atomic exchange, rather than popping one
+// request at a time; so there is no ABA problem, and no lock on either side. It reverses
+// what it took, to run the requests in the order they were submitted.
+//
+// A request's state is also the word its waiters sleep on with futex(), so completing
+// it costs no system call unless someone is actually asleep.
+
+#define REQ_QUEUED  0        // submitted
+#define REQ_WAITING 1        // submitted, and a thread may be asleep in dma_request_wait()
+#define REQ_DONE    2
+#define REQ_FAILED  3
+
+static long futex(int *addr, int op, int val) {
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+// Complete a request. Once its state changes, its waiter may return and free it, so the
+// state is changed last, by an exchange that also says whether anyone needs waking.
+// (Waking an address whose memory has been freed is harmless.)
+static void request_finish(struct dma_request *r, int status) {
+    int state = status ? REQ_FAILED : REQ_DONE;
+    if (r->done) {
+        r->state = state;
+        r->done(r, status);   // the request is the callback's from here on
+        return;
+    }
+    if (__atomic_exchange_n(&r->state, state, __ATOMIC_ACQ_REL) == REQ_WAITING)
+        futex(&r->state, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+// Run up to DMA_SERVICE_MAX_BATCH requests, in order, as one batch. A request that is not
+// a legal transfer fails on its own; a DMA error fails the batch it happened in.
+static void service_run(struct dma_service *s, struct dma_request **r, int n) {
+    struct dma_ctx *ctx = s->ctx;
+    struct dma_batch_entry e[DMA_SERVICE_MAX_BATCH];
+    struct dma_request *ok[DMA_SERVICE_MAX_BATCH];
+    int sg = (ctx->tx_ring != NULL);
+    int m = 0;
+
+    for (int i=0; i<n; i++) {
+        if ((sg ? check_sg_size(ctx, r[i]->len) : check_size(ctx, r[i]->len)) ||
+            check_fit(ctx, r[i]->tx_offset, r[i]->len) || check_fit(ctx, r[i]->rx_offset, r[i]->len)) {
+            printf("ERROR: Bad DMA request (%d bytes, from %d to %d)\n", r[i]->len, r[i]->tx_offset, r[i]->rx_offset);
+            request_finish(r[i], -1);
+            continue;
+        }
+        e[m].tx_offset = r[i]->tx_offset;
+        e[m].rx_offset = r[i]->rx_offset;
+        e[m].len = r[i]->len;
+        ok[m++] = r[i];
+    }
+
+    if (m) {
+        int res = dma_ctx_batch(ctx, e, m, NULL);
+        if (res)
+            dma_ctx_reset(ctx);   // so the next batch starts from a clean DMA
+        for (int i=0; i<m; i++)
+            request_finish(ok[i], res);
+        __atomic_fetch_add(&s->batches, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&s->requests, n, __ATOMIC_RELAXED);
+}
+
+// The service thread. It runs whatever has been submitted, then sleeps until there is more.
+static void *service_main(void *arg) {
+    struct dma_service *s = arg;
+
+    for (;;) {
+        struct dma_request *r = __atomic_exchange_n(&s->head, NULL, __ATOMIC_ACQUIRE);
+        if (r == NULL) {
+            if (!__atomic_load_n(&s->running, __ATOMIC_ACQUIRE))
+                break;
+
+            // Say we are going to sleep, then look once more: either a producer sees the
+            // flag and wakes us, or we see its request here
+            __atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&s->head, __ATOMIC_SEQ_CST) == NULL &&
+                __atomic_load_n(&s->running, __ATOMIC_SEQ_CST)) {
+                uint64_t count;
+                __atomic_fetch_add(&s->wakeups, 1, __ATOMIC_RELAXED);
+                if (read(s->kick_fd, &count, sizeof(count)) != sizeof(count))
+                    printf("ERROR: failed to read DMA service thread wakeup\n");
+            }
+            __atomic_store_n(&s->sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Oldest first
+        struct dma_request *fifo = NULL;
+        while (r) {
+            struct dma_request *next = r->next;
+            r->next = fifo;
+            fifo = r;
+            r = next;
+        }
+
+        // Take each request off the list before it completes: it may be freed after that
+        while (fifo) {
+            struct dma_request *batch[DMA_SERVICE_MAX_BATCH];
+            int n = 0;
+            while (fifo && n < DMA_SERVICE_MAX_BATCH) {
+                batch[n++] = fifo;
+                fifo = fifo->next;
+            }
+            service_run(s, batch, n);
+        }
+    }
+    return NULL;
+}
+
+// Start the service thread for a context
+int dma_ctx_service_start(struct dma_ctx *ctx) {
+    if (ctx->service)
+        return 0;
+    if (ctx->txbase == NULL) {
+        printf("ERROR: The DMA service needs the buffers from dma_init() or dma_sg_init()\n");
+        return -1;
+    }
+
+    struct dma_service *s = calloc(1, sizeof(struct dma_service));
+    if (s == NULL)
+        return -1;
+    s->ctx = ctx;
+    s->kick_fd = eventfd(0, EFD_CLOEXEC);
+    if (s->kick_fd == -1) {
+        printf("ERROR: failed to create eventfd\n");
+        free(s);
+        return -1;
+    }
+
+    s->running = 1;
+    if (pthread_create(&s->thread, NULL, service_main, s)) {
+        printf("ERROR: failed to start DMA service thread\n");
+        close(s->kick_fd);
+        free(s);
+        return -1;
+    }
+    ctx->service = s;
+    return 0;
+}
+
+// Push a request onto the service's stack, and wake the thread if it is asleep
+int dma_ctx_submit(struct dma_ctx *ctx, struct dma_request *req) {
+    struct dma_service *s = ctx->service;
+    if (s == NULL || !__atomic_load_n(&s->running, __ATOMIC_ACQUIRE)) {
+        printf("ERROR: The DMA service is not running\n");
+        return -1;
+    }
+
+    req->state = REQ_QUEUED;
+    req->next = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s->head, &req->next, req, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
+
+    if (__atomic_load_n(&s->sleeping, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(s->kick_fd, &one, sizeof(one)) != sizeof(one))
+            printf("ERROR: failed to wake DMA service thread\n");
+    }
+    return 0;
+}
+
+int dma_request_status(struct dma_request *req) {
+    int state = __atomic_load_n(&req->state, __ATOMIC_ACQUIRE);
+    if (state == REQ_DONE)
+        return 1;
+    return (state == REQ_FAILED) ? -1 : 0;
+}
+
+// Mark the request as waited on, then sleep until its state changes from that
+int dma_request_wait(struct dma_request *req) {
+    int state = __atomic_load_n(&req->state, __ATOMIC_ACQUIRE);
+    while (state == REQ_QUEUED || state == REQ_WAITING) {
+        if (state == REQ_QUEUED &&
+            !__atomic_compare_exchange_n(&req->state, &state, REQ_WAITING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            continue;   // it changed under us; look again
+        futex(&req->state, FUTEX_WAIT_PRIVATE, REQ_WAITING);
+        state = __atomic_load_n(&req->state, __ATOMIC_ACQUIRE);
+    }
+    return (state == REQ_DONE) ? 0 : -1;
+}
+
+void dma_ctx_service_stats(struct dma_ctx *ctx, struct dma_service_stats *stats) {
+    struct dma_service *s = ctx->service;
+    memset(stats, 0, sizeof(*stats));
+    if (s == NULL)
+        return;
+    stats->requests = __atomic_load_n(&s->requests, __ATOMIC_RELAXED);
+    stats->batches = __atomic_load_n(&s->batches, __ATOMIC_RELAXED);
+    stats->wakeups = __atomic_load_n(&s->wakeups, __ATOMIC_RELAXED);
+    stats->mean_batch = stats->batches ? (double)stats->requests / stats->batches : 0;
+}
+
+// Let the thread finish what is queued, then stop it
+void dma_ctx_service_stop(struct dma_ctx *ctx) {
+    struct dma_service *s = ctx->service;
+    if (s == NULL)
+        return;
+
+    __atomic_store_n(&s->running, 0, __ATOMIC_SEQ_CST);
+    uint64_t one = 1;
+    if (write(s->kick_fd, &one, sizeof(one)) != sizeof(one))
+        printf("ERROR: failed to wake DMA service thread\n");
+    pthread_join(s->thread, NULL);
+
+    // Fail anything that was submitted after the thread's last look
+    struct dma_request *r = __atomic_exchange_n(&s->head, NULL, __ATOMIC_ACQUIRE);
+    while (r) {
+        struct dma_request *next = r->next;
+        request_finish(r, -1);
+        r = next;
+    }
+
+    close(s->kick_fd);
+    free(s);
+    ctx->service = NULL;
+}
+
+
+// --------------------------------------------------------------------
+// Continuous capture (note 15 in dma.h)
+//
+// S2MM follows a closed chain of descriptors, one per slot: it fills the slots in order,
+// writes each descriptor's status, and goes straight on to the next, whether or not
+// anyone has read it. The capture thread turns the descriptors' complete bits into a
+// count of slots filled (head), clearing each bit so the slot's next filling shows up
+// too. The complete bits cannot tell one turn round the ring from two, so the DMA must
+// never get a whole turn ahead of the count: the thread keeps the tail descriptor
+// nslots-1 slots past head, moving it on each time it counts. If the thread falls that
+// far behind, the DMA stops at the tail, holding up the stream, until it catches up;
+// the next slot is marked as stalled. (Cyclic mode would never stop, but then a late
+// thread would miscount without knowing.) The consumer
+// compares head with its own count (tail), like the reader of a seqlock: a slot is only
+// good if the DMA cannot have started on it again, both when it is taken and after it
+// has been read. The DMA is filling the slot after head, and the thread may not have
+// seen the one before that yet, so only the newest nslots-2 slots are safe. The thread
+// can fall behind, though, so after the read the slot's own descriptor is checked too:
+// the DMA must not be on it, nor have completed it again.
+
+static long futex_wait_ms(int *addr, int val, int timeout_ms) {
+    struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+// Tell the consumer there is news, waking it if it is asleep
+static void capture_wake(struct dma_capture *c) {
+    __atomic_fetch_add(&c->wake_word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&c->waiting, __ATOMIC_SEQ_CST))
+        futex(&c->wake_word, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+// The capture thread. It counts filled slots and moves the tail on, then sleeps until an
+// interrupt (or, without interrupts, for DMA_CAPTURE_POLL_US microseconds).
+static void *capture_main(void *arg) {
+    struct dma_capture *c = arg;
+    struct dma_ctx *ctx = c->ctx;
+    unsigned long long head = c->head;
+    unsigned long long limit = head + c->nslots - 1;   // slots the DMA may fill before it stops
+    unsigned long long resumed = ~0ULL;                // first slot filled after a stall
+
+    while (__atomic_load_n(&c->running, __ATOMIC_ACQUIRE)) {
+        int filled = 0;
+        while (head < limit) {
+            int slot = head % c->nslots;
+            volatile struct dma_sg_desc *d = &c->ring[slot];
+            unsigned int status = __atomic_load_n(&d->status, __ATOMIC_ACQUIRE);
+            if ((status & DMA_SG_CMPLT) == 0)
+                break;
+            __atomic_store_n(&c->seen, head + 1, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&d->status, 0, __ATOMIC_SEQ_CST);
+            c->len[slot] = status & DMA_SG_LEN_MASK;
+            c->stalled[slot] = (head == resumed);
+            __atomic_fetch_add(&c->bytes, status & DMA_SG_LEN_MASK, __ATOMIC_RELAXED);
+            head++;
+            filled++;
+        }
+        if (filled) {
+            // Having filled up to the tail, the DMA has stopped; the next slot starts
+            // where it picks up again
+            if (head == limit) {
+                resumed = head;
+                __atomic_fetch_add(&c->stalls, 1, __ATOMIC_RELAXED);
+            }
+            // Each slot the DMA may now fill was counted, and its complete bit cleared, on
+            // the last turn. Move the tail before publishing head, so that a consumer never
+            // sees the DMA stopped on a slot it has taken.
+            limit = head + c->nslots - 1;
+            set_dma_reg(ctx, S2MM_TAILDESC_REG, c->ring_phy_addr + ((limit-1) % c->nslots)*DMA_SG_DESC_SIZE);
+            __atomic_store_n(&c->head, head, __ATOMIC_SEQ_CST);
+            capture_wake(c);
+        }
+
+        int status = get_dma_reg(ctx, S2MM_STATUS_REG);
+        if (status & DMA_ERR_MASK) {
+            printf("ERROR: DMA error during capture. s2mm status: %x\n", status);
+            __atomic_store_n(&c->failed, 1, __ATOMIC_SEQ_CST);
+            capture_wake(c);
+            break;
+        }
+
+        if (ctx->use_irq) {
+            struct pollfd pfd[2];
+            pfd[0].fd = c->kick_fd;
+            pfd[1].fd = ctx->s2mm_uio_fd;
+            pfd[0].events = pfd[1].events = POLLIN;
+            pfd[0].revents = pfd[1].revents = 0;
+            poll(pfd, 2, DMA_IRQ_TIMEOUT_MS);
+            if (pfd[1].revents & POLLIN) {
+                uio_read(ctx->s2mm_uio_fd);
+                set_dma_reg(ctx, S2MM_STATUS_REG, DMA_IRQ_MASK);
+                uio_enable(ctx->s2mm_uio_fd);
+            }
+        } else {
+            struct timespec ts = { 0, DMA_CAPTURE_POLL_US*1000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Release whatever a capture has reserved so far
+static void capture_free(struct dma_capture *c) {
+    if (c->kick_fd != -1)
+        close(c->kick_fd);
+    if (c->ring)
+        release_buffer(c->ring_id, (void*)c->ring, c->nslots*DMA_SG_DESC_SIZE);
+    if (c->base)
+        release_buffer(c->buffer_id, c->base, c->nslots*c->slot_size);
+    free(c->len);
+    free(c->stalled);
+    free(c);
+}
+
+// Stop S2MM and wait for it to halt: only then can CURDESC be written, or the memory it
+// writes to be freed. If it does not halt, reset the DMA (both channels) instead.
+static void capture_halt(struct dma_ctx *ctx) {
+    set_dma_reg(ctx, S2MM_CNTL_REG, 0);
+    for (int i=0; i<1000 && !(get_dma_reg(ctx, S2MM_STATUS_REG) & DMA_HALTED); i++)
+        poll_pause();
+    if (!(get_dma_reg(ctx, S2MM_STATUS_REG) & DMA_HALTED)) {
+        printf("ERROR: S2MM did not halt; resetting the DMA\n");
+        dma_ctx_reset(ctx);
+    }
+}
+
+// Set up the slots and their descriptor cycle, start S2MM on it, and start the thread
+int dma_ctx_capture_start(struct dma_ctx *ctx, int nslots, int slot_size, int mode) {
+    if (!ctx->opened) {
+        printf("ERROR: Initialize the DMA before starting a capture\n");
+        return -1;
+    }
+    if (ctx->capture) {
+        printf("ERROR: A DMA capture is already running\n");
+        return -1;
+    }
+    if (nslots < 3) {
+        printf("ERROR: Requested capture into %d slots; needs at least 3\n", nslots);
+        return -1;
+    }
+    if (check_size(ctx, slot_size))   // each slot is one descriptor
+        return -1;
+    if ((long long)nslots * slot_size > INT_MAX) {
+        printf("ERROR: Requested capture of %d slots of %d bytes is too large\n", nslots, slot_size);
+        return -1;
+    }
+
+    struct dma_capture *c = calloc(1, sizeof(struct dma_capture));
+    if (c == NULL) {
+        printf("ERROR: failed to allocate DMA capture\n");
+        return -1;
+    }
+    c->ctx = ctx;
+    c->nslots = nslots;
+    c->slot_size = slot_size;
+    c->mode = mode;
+    c->window = nslots - 2;
+    c->kick_fd = -1;
+    c->len = calloc(nslots, sizeof(int));
+    c->stalled = calloc(nslots, 1);
+    if (c->len == NULL || c->stalled == NULL) {
+        printf("ERROR: failed to allocate DMA capture\n");
+        capture_free(c);
+        return -1;
+    }
+
+    void *ring;
+    if (reserve_buffer(nslots*slot_size, mode, &c->buffer_id, &c->phy_addr, &c->base)) {
+        printf("ERROR: memalloc (capture slots) reserve failed\n");
+        c->base = NULL;
+        capture_free(c);
+        return -1;
+    }
+    if (reserve_buffer(nslots*DMA_SG_DESC_SIZE, DMA_BUF_COHERENT, &c->ring_id, &c->ring_phy_addr, &ring)) {
+        printf("ERROR: memalloc (capture descriptors) reserve failed\n");
+        capture_free(c);
+        return -1;
+    }
+    c->ring = ring;
+    for (int i=0; i<nslots; i++) {
+        volatile struct dma_sg_desc *d = &c->ring[i];
+        d->next_desc = c->ring_phy_addr + ((i+1) % nslots)*DMA_SG_DESC_SIZE;
+        d->next_desc_msb = 0;
+        d->buffer_addr = c->phy_addr + i*slot_size;
+        d->buffer_addr_msb = 0;
+        d->control = slot_size;
+        d->status = 0;
+    }
+    c->kick_fd = eventfd(0, EFD_CLOEXEC);
+    if (c->kick_fd == -1)
+        printf("ERROR: failed to create eventfd\n");
+    if (c->kick_fd == -1 ||
+        (mode == DMA_BUF_CACHED && sync_buffer(c->buffer_id, MEMALLOC_SYNC_FOR_DEVICE, 0, 0))) {
+        capture_free(c);
+        return -1;
+    }
+
+    // The DMA may fill all but one slot before the capture thread first moves the tail
+    capture_halt(ctx);
+    set_dma_reg(ctx, S2MM_CURDESC_REG, c->ring_phy_addr);
+    set_dma_reg(ctx, S2MM_CNTL_REG, dma_cntl_start(ctx));
+    set_dma_reg(ctx, S2MM_TAILDESC_REG, c->ring_phy_addr + (nslots-2)*DMA_SG_DESC_SIZE);
+
+    c->running = 1;
+    if (pthread_create(&c->thread, NULL, capture_main, c)) {
+        printf("ERROR: failed to start DMA capture thread\n");
+        capture_halt(ctx);
+        capture_free(c);
+        return -1;
+    }
+    ctx->capture = c;
+    return 0;
+}
+
+int dma_ctx_capture_next(struct dma_ctx *ctx, struct dma_capture_block *b) {
+    struct dma_capture *c = ctx->capture;
+    if (c == NULL) {
+        printf("ERROR: No DMA capture is running\n");
+        return -1;
+    }
+
+    unsigned long long head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+    if (head == c->tail)
+        return __atomic_load_n(&c->failed, __ATOMIC_ACQUIRE) ? -1 : 0;
+
+    // Skip the slots the DMA may already have started to overwrite
+    b->lost = 0;
+    if (head - c->tail > (unsigned long long)c->window) {
+        b->lost = head - c->window - c->tail;
+        __atomic_store_n(&c->tail, head - c->window, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&c->lost, b->lost, __ATOMIC_RELAXED);
+    }
+
+    int slot = c->tail % c->nslots;
+    b->seq = c->tail;
+    b->len = c->len[slot];
+    b->stalled = c->stalled[slot];
+    b->data = (char*)c->base + (long)slot*c->slot_size;
+    if (c->mode == DMA_BUF_CACHED && sync_buffer(c->buffer_id, MEMALLOC_SYNC_FOR_CPU, slot*c->slot_size, b->len))
+        return -1;
+    return 1;
+}
+
+int dma_ctx_capture_wait(struct dma_ctx *ctx, struct dma_capture_block *b, int timeout_ms) {
+    double deadline = now_seconds() + timeout_ms / 1000.0;
+    for (;;) {
+        int res = dma_ctx_capture_next(ctx, b);
+        if (res)
+            return res;
+
+        int left_ms = -1;
+        if (timeout_ms >= 0) {
+            left_ms = (int)((deadline - now_seconds()) * 1000);
+            if (left_ms <= 0)
+                return 0;
+        }
+
+        // Say we are going to sleep, then look once more: either the thread sees the flag
+        // and wakes us, or we see its news here
+        struct dma_capture *c = ctx->capture;
+        int word = __atomic_load_n(&c->wake_word, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&c->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&c->head, __ATOMIC_SEQ_CST) == c->tail &&
+            !__atomic_load_n(&c->failed, __ATOMIC_SEQ_CST))
+            futex_wait_ms(&c->wake_word, word, left_ms);
+        __atomic_store_n(&c->waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Check that the DMA has not started on the slot again while it was being read. The
+// order matters: the DMA moves CURDESC on only after it completes a descriptor, and the
+// thread counts a completion in seen before it clears it. As the DMA can never get a
+// turn ahead of seen, a slot that was filled again is always caught by one of the three.
+int dma_ctx_capture_release(struct dma_ctx *ctx, struct dma_capture_block *b) {
+    struct dma_capture *c = ctx->capture;
+    if (c == NULL || b->seq != c->tail) {
+        printf("ERROR: DMA capture slots must be released in the order they were taken\n");
+        return -1;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);   // the reads of the data come before these
+    int slot = b->seq % c->nslots;
+    unsigned int curdesc = get_dma_reg(ctx, S2MM_CURDESC_REG);
+    unsigned int status = __atomic_load_n(&c->ring[slot].status, __ATOMIC_SEQ_CST);
+    unsigned long long seen = __atomic_load_n(&c->seen, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&c->tail, b->seq + 1, __ATOMIC_RELAXED);
+    if (curdesc == c->ring_phy_addr + slot*DMA_SG_DESC_SIZE || (status & DMA_SG_CMPLT) ||
+        seen - b->seq > (unsigned long long)c->window) {
+        __atomic_fetch_add(&c->lost, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+unsigned long long dma_ctx_capture_head(struct dma_ctx *ctx) {
+    return ctx->capture ? __atomic_load_n(&ctx->capture->head, __ATOMIC_ACQUIRE) : 0;
+}
+
+void dma_ctx_capture_stats(struct dma_ctx *ctx, struct dma_capture_stats *stats) {
+    struct dma_capture *c = ctx->capture;
+    memset(stats, 0, sizeof(*stats));
+    if (c == NULL)
+        return;
+    stats->slots = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+    stats->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+    stats->lost = __atomic_load_n(&c->lost, __ATOMIC_RELAXED);
+    stats->stalls = __atomic_load_n(&c->stalls, __ATOMIC_RELAXED);
+    stats->pending = (int)(stats->slots - __atomic_load_n(&c->tail, __ATOMIC_RELAXED));
+}
+
+// Stop the thread, then halt S2MM before its buffers go away
+void dma_ctx_capture_stop(struct dma_ctx *ctx) {
+    struct dma_capture *c = ctx->capture;
+    if (c == NULL)
+        return;
+
+    __atomic_store_n(&c->running, 0, __ATOMIC_SEQ_CST);
+    uint64_t one = 1;
+    if (write(c->kick_fd, &one, sizeof(one)) != sizeof(one))
+        printf("ERROR: failed to wake DMA capture thread\n");
+    pthread_join(c->thread, NULL);
+
+    capture_halt(ctx);
+    capture_free(c);
+    ctx->capture = NULL;
+}
+
+
+// --------------------------------------------------------------------
+// Buffer pools (note 13 in dma.h)
+//
+// The regions are split into slabs of DMA_POOL_SLAB_SIZE bytes. A slab is given a size
+// class (blocks of DMA_POOL_MIN_BLOCK << class bytes) when its class runs out of free
+// blocks, and goes back to the free slabs when its last block is released. Each class
+// keeps a list of its slabs that have a free block, and each slab a stack of the blocks
+// released back to it, so acquiring and releasing a block take the same few steps
+// whatever the pool holds. A new slab is not split up front: its blocks are handed out
+// in order the first time round.
+
+#define POOL_STACK_LEN (DMA_POOL_SLAB_SIZE / DMA_POOL_MIN_BLOCK)   // most blocks in a slab
+#define POOL_USED_WORDS ((POOL_STACK_LEN + 63) / 64)                // words in a slab's bitmap
+
+static int pool_block_size(int cls) {
+    return DMA_POOL_MIN_BLOCK << cls;
+}
+
+// The word of slab s's in-use bitmap that holds block n's bit (1ull << (n % 64))
+static unsigned long long *pool_used(struct dma_pool *p, int s, int n) {
+    return &p->used[(size_t)s * POOL_USED_WORDS + n / 64];
+}
+
+// Remove a slab from a list
+static void slab_unlink(struct dma_pool *p, int *head, int s) {
+    struct pool_slab *sl = &p->slabs[s];
+    if (sl->prev >= 0)
+        p->slabs[sl->prev].next = sl->next;
+    else
+        *head = sl->next;
+    if (sl->next >= 0)
+        p->slabs[sl->next].prev = sl->prev;
+    sl->prev = sl->next = -1;
+}
+
+// Put a slab at the front of a list
+static void slab_push(struct dma_pool *p, int *head, int s) {
+    struct pool_slab *sl = &p->slabs[s];
+    sl->prev = -1;
+    sl->next = *head;
+    if (*head >= 0)
+        p->slabs[*head].prev = s;
+    *head = s;
+}
+
+// Find the region, slab and block of a pointer into the pool.
+// Returns: the slab number, or -1 if the pointer is not the start of a block in use
+static int pool_find(struct dma_pool *p, void *block, int *region, int *offset) {
+    char *b = block;
+    for (int r=0; r<p->nregions; r++) {
+        char *base = p->base[r];
+        if (b < base || b >= base + p->region_size)
+            continue;
+        int off = b - base;
+        int s = r * p->slabs_per_region + off / DMA_POOL_SLAB_SIZE;
+        int cls = p->slabs[s].cls;
+        if (cls < 0 || (off % DMA_POOL_SLAB_SIZE) % pool_block_size(cls) != 0)
+            break;
+        int n = (off % DMA_POOL_SLAB_SIZE) / pool_block_size(cls);
+        if (!(*pool_used(p, s, n) & (1ull << (n % 64)))) {
+            printf("ERROR: DMA pool block %p is not in use (released twice?)\n", block);
+            return -1;
+        }
+        *region = r;
+        *offset = off;
+        return s;
+    }
+    printf("ERROR: %p is not a block from this DMA pool\n", block);
+    return -1;
+}
+
+// Reserve the regions, and put all their slabs on the free list
+struct dma_pool *dma_pool_create(int nregions, int region_size, int mode) {
+    if (nregions < 1 || region_size < 1) {
+        printf("ERROR: A DMA pool needs at least one region\n");
+        return NULL;
+    }
+    if (mode != DMA_BUF_COHERENT && mode != DMA_BUF_CACHED && mode != DMA_BUF_WC) {
+        printf("ERROR: Unknown DMA buffer mode %d\n", mode);
+        return NULL;
+    }
+    if ((long long)nregions * ((region_size + DMA_POOL_SLAB_SIZE - 1) / DMA_POOL_SLAB_SIZE) *
+        DMA_POOL_SLAB_SIZE > INT_MAX) {
+        printf("ERROR: Requested DMA pool of %d regions of %d bytes is too large\n", nregions, region_size);
+        return NULL;
+    }
+    region_size = (region_size + DMA_POOL_SLAB_SIZE - 1) / DMA_POOL_SLAB_SIZE * DMA_POOL_SLAB_SIZE;
+
+    struct dma_pool *p = calloc(1, sizeof(struct dma_pool));
+    if (p == NULL)
+        return NULL;
+    p->mode = mode;
+    p->region_size = region_size;
+    p->slabs_per_region = region_size / DMA_POOL_SLAB_SIZE;
+    pthread_mutex_init(&p->lock, NULL);
+
+    int nslabs = nregions * p->slabs_per_region;
+    p->slabs = malloc(nslabs * sizeof(struct pool_slab));
+    p->stacks = malloc((size_t)nslabs * POOL_STACK_LEN * sizeof(unsigned short));
+    p->base = calloc(nregions, sizeof(void*));
+    p->phy_addr = calloc(nregions, sizeof(unsigned int));
+    p->used = calloc((size_t)nslabs * POOL_USED_WORDS, sizeof(unsigned long long));
+    p->id = calloc(nregions, sizeof(int));
+    if (p->slabs == NULL || p->stacks == NULL || p->used == NULL || p->base == NULL ||
+        p->phy_addr == NULL || p->id == NULL || memalloc_open()) {
+        free(p->slabs);
+        free(p->stacks);
+        free(p->used);
+        free(p->base);
+        free(p->phy_addr);
+        free(p->id);
+        free(p);
+        return NULL;
+    }
+
+    for (int r=0; r<nregions; r++) {
+        if (reserve_buffer(region_size, mode, &p->id[r], &p->phy_addr[r], &p->base[r])) {
+            printf("ERROR: failed to reserve DMA pool region %d (%d bytes)\n", r, region_size);
+            dma_pool_destroy(p);
+            return NULL;
+        }
+        p->nregions = r+1;
+    }
+
+    p->free_slabs = -1;
+    for (int c=0; c<DMA_POOL_CLASSES; c++)
+        p->partial[c] = -1;
+    for (int s=nslabs-1; s>=0; s--) {
+        p->slabs[s] = (struct pool_slab){ .cls = -1 };
+        slab_push(p, &p->free_slabs, s);
+    }
+    return p;
+}
+
+// Take a block from the first slab of its class with one free, giving the class a free
+// slab if it has none
+void *dma_pool_acquire(struct dma_pool *p, int size, unsigned int *phy_addr) {
+    if (size < 1 || size > DMA_POOL_SLAB_SIZE) {
+        printf("ERROR: DMA pool blocks are 1 to %d bytes, not %d\n", DMA_POOL_SLAB_SIZE, size);
+        return NULL;
+    }
+    int cls = (size <= DMA_POOL_MIN_BLOCK) ? 0 : 32 - __builtin_clz(size - 1) - __builtin_ctz(DMA_POOL_MIN_BLOCK);
+    int bsize = pool_block_size(cls);
+    int nblocks = DMA_POOL_SLAB_SIZE / bsize;
+
+    pthread_mutex_lock(&p->lock);
+    int s = p->partial[cls];
+    if (s < 0) {
+        s = p->free_slabs;
+        if (s < 0) {
+            p->failures++;
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        slab_unlink(p, &p->free_slabs, s);
+        p->slabs[s] = (struct pool_slab){ .cls = cls, .prev = -1, .next = -1 };
+        slab_push(p, &p->partial[cls], s);
+    }
+
+    struct pool_slab *sl = &p->slabs[s];
+    int block = sl->top ? p->stacks[(size_t)s * POOL_STACK_LEN + --sl->top] : sl->carved++;
+    *pool_used(p, s, block) |= 1ull << (block % 64);
+    if (++sl->in_use == nblocks)
+        slab_unlink(p, &p->partial[cls], s);   // full
+
+    p->acquires++;
+    p->blocks_in_use[cls]++;
+    p->bytes_in_use += bsize;
+    if (p->bytes_in_use > p->bytes_high_water)
+        p->bytes_high_water = p->bytes_in_use;
+    pthread_mutex_unlock(&p->lock);
+
+    int r = s / p->slabs_per_region;
+    int offset = (s % p->slabs_per_region) * DMA_POOL_SLAB_SIZE + block * bsize;
+    if (phy_addr)
+        *phy_addr = p->phy_addr[r] + offset;
+    return (char*)p->base[r] + offset;
+}
+
+// Push the block on its slab's stack. The slab goes back on its class's list if it was
+// full, or back to the free slabs if this was its last block in use.
+void dma_pool_release(struct dma_pool *p, void *block) {
+    int r, offset;
+    if (block == NULL)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    int s = pool_find(p, block, &r, &offset);
+    if (s < 0) {
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    struct pool_slab *sl = &p->slabs[s];
+    int cls = sl->cls;
+    int bsize = pool_block_size(cls);
+    int nblocks = DMA_POOL_SLAB_SIZE / bsize;
+    int n = (offset % DMA_POOL_SLAB_SIZE) / bsize;
+    *pool_used(p, s, n) &= ~(1ull << (n % 64));
+
+    if (sl->in_use == nblocks)
+        slab_push(p, &p->partial[cls], s);
+    if (--sl->in_use == 0) {
+        slab_unlink(p, &p->partial[cls], s);
+        sl->cls = -1;
+        slab_push(p, &p->free_slabs, s);
+    } else {
+        p->stacks[(size_t)s * POOL_STACK_LEN + sl->top++] = n;
+    }
+
+    p->releases++;
+    p->blocks_in_use[cls]--;
+    p->bytes_in_use -= bsize;
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Sync part of a block (from its start) for the CPU or the DMA. Only cached pools
+// need it; for write-combining ones, it just makes sure the writes have gone out.
+int dma_pool_sync(struct dma_pool *p, void *block, int size, int dir) {
+    if (p->mode == DMA_BUF_WC && dir == MEMALLOC_SYNC_FOR_DEVICE)
+        __sync_synchronize();
+    if (p->mode != DMA_BUF_CACHED)
+        return 0;
+
+    int r, offset;
+    pthread_mutex_lock(&p->lock);
+    int s = pool_find(p, block, &r, &offset);
+    pthread_mutex_unlock(&p->lock);
+    if (s < 0)
+        return -1;
+    return sync_buffer(p->id[r], dir, offset, size);
+}
+
+void dma_pool_stats(struct dma_pool *p, struct dma_pool_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&p->lock);
+    int nslabs = p->nregions * p->slabs_per_region;
+    for (int s=0; s<nslabs; s++) {
+        if (p->slabs[s].cls < 0)
+            stats->free_slabs++;
+        else
+            stats->slabs[p->slabs[s].cls]++;
+    }
+    for (int c=0; c<DMA_POOL_CLASSES; c++) {
+        stats->block_size[c] = pool_block_size(c);
+        stats->blocks_in_use[c] = p->blocks_in_use[c];
+    }
+    stats->total_slabs = nslabs;
+    stats->acquires = p->acquires;
+    stats->releases = p->releases;
+    stats->failures = p->failures;
+    stats->bytes_in_use = p->bytes_in_use;
+    stats->bytes_high_water = p->bytes_high_water;
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Release the regions, and free the pool. Blocks still in use go with it.
+void dma_pool_destroy(struct dma_pool *p) {
+    for (int r=0; r<p->nregions; r++)
+        release_buffer(p->id[r], p->base[r], p->region_size);
+    memalloc_close();
+    free(p->slabs);
+    free(p->stacks);
+    free(p->used);
+    free(p->base);
+    free(p->phy_addr);
+    free(p->id);
+    free(p);
+}
+
+
+// --------------------------------------------------------------------
+// Sets of buffers, reserved in one go
+
+int dma_buffers_reserve(struct dma_buffer *b, int n, double *us) {
+    double t0 = now_seconds();
+    if (memalloc_open())
+        return -1;
+
+    for (int i=0; i<n; i++) {
+        if (b[i].size < 1 || b[i].mode < DMA_BUF_COHERENT || b[i].mode > DMA_BUF_WC ||
+            reserve_buffer(b[i].size, b[i].mode, &b[i].id, &b[i].phy_addr, &b[i].addr)) {
+            printf("ERROR: failed to reserve DMA buffer %d of %d (%d bytes, mode %d)\n", i, n, b[i].size, b[i].mode);
+            while (i-- > 0) {
+                release_buffer(b[i].id, b[i].addr, b[i].size);
+                b[i].addr = NULL;
+            }
+            memalloc_close();
+            return -1;
+        }
+    }
+
+    if (us)
+        *us = (now_seconds() - t0) * 1e6;
+    return 0;
+}
+
+int dma_buffer_sync(struct dma_buffer *b, int offset, int size, int dir) {
+    if (b->mode == DMA_BUF_WC && dir == MEMALLOC_SYNC_FOR_DEVICE)
+        __sync_synchronize();
+    if (b->mode != DMA_BUF_CACHED)
+        return 0;
+    return sync_buffer(b->id, dir, offset, size);
+}
+
+void dma_buffers_release(struct dma_buffer *b, int n) {
+    for (int i=0; i<n; i++) {
+        if (b[i].addr)
+            release_buffer(b[i].id, b[i].addr, b[i].size);
+        b[i].addr = NULL;
+    }
+    memalloc_close();
+}
+
+
+// Initialize a stripe: one context per engine, all sharing one pair of buffers of the
+// given size. Each transfer is split into one slice per engine.
+struct dma_stripe *dma_stripe_init(const unsigned int *base_addrs, int n, int size, int sg) {
+    if (n < 1 || n > DMA_STRIPE_MAX_ENGINES) {
+        printf("ERROR: Requested stripe over %d engines; must be between 1 and %d\n", n, DMA_STRIPE_MAX_ENGINES);
+        return NULL;
+    }
+    if (check_buffer_size(size, 1))
+        return NULL;
+
+    struct dma_stripe *s = calloc(1, sizeof(struct dma_stripe));
+    if (s == NULL) {
+        printf("ERROR: failed to allocate DMA stripe\n");
+        return NULL;
+    }
+    s->sg = sg;
+
+    for (int i=0; i<n; i++) {
+        ctx_clear(&s->ctx[i], base_addrs[i]);
+        if (ctx_open(&s->ctx[i], base_addrs[i])) {
+            dma_stripe_cleanup(s);
+            return NULL;
+        }
+        s->n = i+1;
+    }
+
+    if (reserve_buffer(size, DMA_BUF_COHERENT, &s->tx_buffer_id, &s->tx_phy_addr, &s->txbase) ||
+        reserve_buffer(size, DMA_BUF_COHERENT, &s->rx_buffer_id, &s->rx_phy_addr, &s->rxbase)) {
+        printf("ERROR: memalloc reserve failed for DMA stripe\n");
+        s->buffer_size = size;
+        dma_stripe_cleanup(s);
+        return NULL;
+    }
+    s->buffer_size = size;
+
+    // Every engine sees the whole buffer, but only moves its own slice of it
+    for (int i=0; i<n; i++) {
+        struct dma_ctx *ctx = &s->ctx[i];
+        ctx->txbase = s->txbase;
+        ctx->rxbase = s->rxbase;
+        ctx->tx_phy_addr = s->tx_phy_addr;
+        ctx->rx_phy_addr = s->rx_phy_addr;
+        ctx->buffer_size = size;
+        if (sg && reserve_rings(ctx, size)) {
+            dma_stripe_cleanup(s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+void* dma_stripe_tx_buffer(struct dma_stripe *s) {
+    return s->txbase;
+}
+
+void* dma_stripe_rx_buffer(struct dma_stripe *s) {
+    return s->rxbase;
+}
+
+struct dma_ctx *dma_stripe_ctx(struct dma_stripe *s, int i) {
+    return &s->ctx[i];
+}
+
+void dma_stripe_reset(struct dma_stripe *s) {
+    for (int i=0; i<s->n; i++)
+        dma_ctx_reset(&s->ctx[i]);
+}
+
+// Split "size" bytes into one slice per engine, and start each engine on its slice.
+// Every slice is a multiple of the widest engine's stream width (so each starts aligned,
+// whether or not it has a DRE); the last engine takes what is left over.
+static int stripe_start(struct dma_stripe *s, int size, int is_tx) {
+    int width = 0;
+    for (int i=0; i<s->n; i++)
+        if (s->ctx[i].width > width)
+            width = s->ctx[i].width;
+
+    if (check_sg_size(&s->ctx[s->n-1], size))
+        return -1;
+    if (size < width*s->n) {
+        printf("ERROR: Requested DMA transfer size (%d bytes) is too small to split over %d engines\n", size, s->n);
+        return -1;
+    }
+
+    int slice = (size / s->n) & ~(width-1);
+    for (int i=0; i<s->n; i++) {
+        int offset = i*slice;
+        int len = (i == s->n-1) ? size - offset : slice;
+        int res;
+        if (s->sg)
+            res = is_tx ? ctx_sg_tx_at(&s->ctx[i], offset, len) : ctx_sg_rx_at(&s->ctx[i], offset, len);
+        else
+            res = is_tx ? ctx_tx_at(&s->ctx[i], offset, len) : ctx_rx_at(&s->ctx[i], offset, len);
+        if (res)
+            return res;
+    }
+    return 0;
+}
+
+int dma_stripe_rx(struct dma_stripe *s, int size) {
+    return stripe_start(s, size, 0);
+}
+
+int dma_stripe_tx(struct dma_stripe *s, int size) {
+    return stripe_start(s, size, 1);
+}
+
+// Wait for every engine. They all run at the same time, so this takes as long as the slowest.
+int dma_stripe_sync(struct dma_stripe *s) {
+    int res = 0;
+    for (int i=0; i<s->n; i++) {
+        if (s->sg ? dma_ctx_sg_sync(&s->ctx[i]) : dma_ctx_sync(&s->ctx[i]))
+            res = -1;
+    }
+    return res;
+}
+
+void dma_stripe_cleanup(struct dma_stripe *s) {
+    if (s->txbase)
+        release_buffer(s->tx_buffer_id, s->txbase, s->buffer_size);
+    if (s->rxbase)
+        release_buffer(s->rx_buffer_id, s->rxbase, s->buffer_size);
+    for (int i=0; i<s->n; i++)
+        ctx_release(&s->ctx[i]);
+    free(s);
+}
+
+
+// Multichannel DMA (note 16 in dma.h)
+//
+// Each channel has a queue of descriptors each way, in a cycle, and the MCDMA works
+// through each queue up to its tail descriptor. Queueing a transfer fills in the next
+// descriptor and moves the tail on to it; a channel that had reached its old tail
+// carries on from there. Finished transfers are handed back in order from each queue,
+// and their descriptors reused.
+
+// Offset of a register of channel ch, on the MM2S or the S2MM side
+#define mc_ch_reg(dir,ch,off) (((dir) == DMA_MC_RX ? DMA_MC_S2MM : 0) + DMA_MC_CH_REG(ch) + (off))
+
+// Reset the MCDMA, empty every queue, and start every channel, waiting for its first tail
+static void mc_start(struct dma_mc *mc) {
+    struct dma_ctx *ctx = &mc->ctx;
+    set_dma_reg(ctx, DMA_MC_CCR_REG, DMA_RESET);
+    set_dma_reg(ctx, DMA_MC_S2MM + DMA_MC_CCR_REG, DMA_RESET);
+    for (int i=0; i<1000 && (get_dma_reg(ctx, DMA_MC_CCR_REG) & DMA_RESET); i++)
+        poll_pause();   // the reset bit clears itself when the reset is done
+
+    for (int dir=DMA_MC_TX; dir<=DMA_MC_RX; dir++) {
+        for (int ch=0; ch<mc->nchannels; ch++) {
+            struct dma_mc_queue *q = &mc->queue[dir][ch];
+            for (int i=0; i<DMA_MC_QUEUE_LEN; i++) {
+                volatile struct dma_mc_desc *d = &q->ring[i];
+                memset((void*)d, 0, sizeof(*d));
+                d->next_desc = q->ring_phy_addr + ((i+1) % DMA_MC_QUEUE_LEN)*DMA_SG_DESC_SIZE;
+            }
+            q->head = q->tail = 0;
+        }
+    }
+    mc->next = 0;
+
+    // As PG288 says: enable the channels, point them at their descriptors, let them
+    // fetch, then start the MCDMA. Nothing moves until a tail descriptor is written.
+    for (int dir=DMA_MC_TX; dir<=DMA_MC_RX; dir++) {
+        int side = (dir == DMA_MC_RX) ? DMA_MC_S2MM : 0;
+        set_dma_reg(ctx, side + DMA_MC_CHEN_REG, (1 << mc->nchannels) - 1);
+        for (int ch=0; ch<mc->nchannels; ch++) {
+            set_dma_reg(ctx, mc_ch_reg(dir, ch, DMA_MC_CH_CURDESC), mc->queue[dir][ch].ring_phy_addr);
+            set_dma_reg(ctx, mc_ch_reg(dir, ch, DMA_MC_CH_CR), DMA_START);
+        }
+        set_dma_reg(ctx, side + DMA_MC_CCR_REG, DMA_START);
+    }
+}
+
+struct dma_mc *dma_mc_init(unsigned int base_addr, int nchannels, int size) {
+    if (nchannels < 1 || nchannels > DMA_MC_MAX_CHANNELS) {
+        printf("ERROR: Requested MCDMA with %d channels; must be between 1 and %d\n", nchannels, DMA_MC_MAX_CHANNELS);
+        return NULL;
+    }
+    if (check_buffer_size(size, 1))
+        return NULL;
+    if (size > INT_MAX / nchannels) {
+        printf("ERROR: Requested MCDMA buffers of %d channels by %d bytes are too large\n", nchannels, size);
+        return NULL;
+    }
+
+    struct dma_mc *mc = calloc(1, sizeof(struct dma_mc));
+    if (mc == NULL) {
+        printf("ERROR: failed to allocate MCDMA\n");
+        return NULL;
+    }
+    mc->nchannels = nchannels;
+    mc->buffer_size = size;
+
+    ctx_clear(&mc->ctx, base_addr);
+    if (ctx_open(&mc->ctx, base_addr)) {
+        free(mc);
+        return NULL;
+    }
+#ifdef DMA_MODEL
+    if (dma_model_mcdma(mc->ctx.cfg_base, nchannels)) {
+        dma_mc_cleanup(mc);
+        return NULL;
+    }
+#endif
+
+    int rings_len = 2*nchannels*DMA_MC_QUEUE_LEN*DMA_SG_DESC_SIZE;
+    void *rings = NULL;
+    if (reserve_buffer(nchannels*size, DMA_BUF_COHERENT, &mc->tx_buffer_id, &mc->tx_phy_addr, &mc->txbase) ||
+        reserve_buffer(nchannels*size, DMA_BUF_COHERENT, &mc->rx_buffer_id, &mc->rx_phy_addr, &mc->rxbase) ||
+        reserve_buffer(rings_len, DMA_BUF_COHERENT, &mc->rings_id, &mc->rings_phy_addr, &rings)) {
+        printf("ERROR: memalloc reserve failed for MCDMA\n");
+        dma_mc_cleanup(mc);
+        return NULL;
+    }
+    mc->rings = rings;
+
+    for (int dir=DMA_MC_TX; dir<=DMA_MC_RX; dir++) {
+        for (int ch=0; ch<nchannels; ch++) {
+            int first = (dir*nchannels + ch)*DMA_MC_QUEUE_LEN;
+            mc->queue[dir][ch].ring = &mc->rings[first];
+            mc->queue[dir][ch].ring_phy_addr = mc->rings_phy_addr + first*DMA_SG_DESC_SIZE;
+        }
+    }
+    mc_start(mc);
+    return mc;
+}
+
+void* dma_mc_tx_buffer(struct dma_mc *mc, int ch) {
+    return (char*)mc->txbase + (long)ch*mc->buffer_size;
+}
+
+void* dma_mc_rx_buffer(struct dma_mc *mc, int ch) {
+    return (char*)mc->rxbase + (long)ch*mc->buffer_size;
+}
+
+// Check a channel number
+static int mc_check_channel(struct dma_mc *mc, int ch) {
+    if (ch < 0 || ch >= mc->nchannels) {
+        printf("ERROR: MCDMA channel %d does not exist; there are %d\n", ch, mc->nchannels);
+        return -1;
+    }
+    return 0;
+}
+
+// Queue a transfer on one channel, and move the channel's tail descriptor on to it
+static int mc_queue(struct dma_mc *mc, int ch, int dir, int offset, int size, int tdest) {
+    if (mc_check_channel(mc, ch) || check_size(&mc->ctx, size))
+        return -1;
+    if (offset < 0 || offset > mc->buffer_size - size) {
+        printf("ERROR: Requested DMA transfer (%d bytes at offset %d) does not fit in the %d-byte buffers\n",
+               size, offset, mc->buffer_size);
+        return -1;
+    }
+    if (offset & (ctx_unit(&mc->ctx)-1)) {
+        printf("ERROR: Requested DMA transfer offset (%d) is not a multiple of %d\n", offset, ctx_unit(&mc->ctx));
+        return -1;
+    }
+
+    struct dma_mc_queue *q = &mc->queue[dir][ch];
+    if (q->head - q->tail == DMA_MC_QUEUE_LEN) {
+        printf("ERROR: MCDMA channel %d already has %d transfers queued\n", ch, DMA_MC_QUEUE_LEN);
+        return -1;
+    }
+
+    int i = q->head % DMA_MC_QUEUE_LEN;
+    volatile struct dma_mc_desc *d = &q->ring[i];
+    if (dir == DMA_MC_TX) {
+        d->buffer_addr = mc->tx_phy_addr + ch*mc->buffer_size + offset;
+        d->control = size | DMA_MC_SOP | DMA_MC_EOP;
+        d->mm2s_sideband = (tdest & DMA_MC_TDEST_MASK) << DMA_MC_TDEST_SHIFT;
+        d->mm2s_status = 0;
+    } else {
+        d->buffer_addr = mc->rx_phy_addr + ch*mc->buffer_size + offset;
+        d->control = size;
+        d->s2mm_status = 0;
+        d->s2mm_sideband = 0;
+    }
+    q->offset[i] = offset;
+    q->head++;
+
+    __sync_synchronize();   // the descriptor is in memory before the MCDMA can fetch it
+    set_dma_reg(&mc->ctx, mc_ch_reg(dir, ch, DMA_MC_CH_TAILDESC), q->ring_phy_addr + i*DMA_SG_DESC_SIZE);
+    return 0;
+}
+
+int dma_mc_tx(struct dma_mc *mc, int ch, int offset, int size, int tdest) {
+    if (tdest < 0 || tdest > DMA_MC_TDEST_MASK) {
+        printf("ERROR: TDEST %d does not fit in the MCDMA's sideband word\n", tdest);
+        return -1;
+    }
+    return mc_queue(mc, ch, DMA_MC_TX, offset, size, tdest);
+}
+
+int dma_mc_rx(struct dma_mc *mc, int ch, int offset, int size) {
+    return mc_queue(mc, ch, DMA_MC_RX, offset, size, 0);
+}
+
+int dma_mc_pending(struct dma_mc *mc, int ch, int dir) {
+    if (mc_check_channel(mc, ch))
+        return -1;
+    if (dir != DMA_MC_TX && dir != DMA_MC_RX) {
+        printf("ERROR: MCDMA direction must be DMA_MC_TX or DMA_MC_RX\n");
+        return -1;
+    }
+    return mc->queue[dir][ch].head - mc->queue[dir][ch].tail;
+}
+
+// Hand back the oldest transfer of one queue, if the MCDMA has finished it.
+// Returns: 1 if it had; 0 if not
+static int mc_reap(struct dma_mc *mc, int ch, int dir, struct dma_mc_completion *c) {
+    struct dma_mc_queue *q = &mc->queue[dir][ch];
+    if (q->head == q->tail)
+        return 0;
+
+    int i = q->tail % DMA_MC_QUEUE_LEN;
+    volatile struct dma_mc_desc *d = &q->ring[i];
+    volatile unsigned int *status_word = (dir == DMA_MC_TX) ? &d->mm2s_status : &d->s2mm_status;
+    unsigned int status = __atomic_load_n(status_word, __ATOMIC_ACQUIRE);
+    if ((status & DMA_SG_CMPLT) == 0)
+        return 0;
+
+    c->channel = ch;
+    c->dir = dir;
+    c->offset = q->offset[i];
+    c->len = status & DMA_SG_LEN_MASK;
+    c->tdest = (((dir == DMA_MC_TX) ? d->mm2s_sideband : d->s2mm_sideband) >> DMA_MC_TDEST_SHIFT) & DMA_MC_TDEST_MASK;
+    c->status = 0;
+    if (status & DMA_SG_ERR_MASK) {
+        printf("ERROR: MCDMA %s channel %d reported an error. Descriptor status: %x\n",
+               dir == DMA_MC_TX ? "MM2S" : "S2MM", ch, status);
+        c->status = -1;
+    }
+    *status_word = 0;
+    q->tail++;
+    return 1;
+}
+
+// Take one finished transfer from each queue in turn (channel by channel, Tx then Rx),
+// until a whole turn finds none. The next call starts where this one left off.
+int dma_mc_poll(struct dma_mc *mc, struct dma_mc_completion *c, int max) {
+    if (max < 1) {
+        printf("ERROR: dma_mc_poll() needs room for at least one transfer\n");
+        return -1;
+    }
+
+    int n = 0, empty = 0, nqueues = 2*mc->nchannels;
+    while (n < max && empty < nqueues) {
+        int ch = mc->next / 2, dir = mc->next % 2;
+        mc->next = (mc->next + 1) % nqueues;
+        if (mc_reap(mc, ch, dir, &c[n])) {
+            n++;
+            empty = 0;
+        } else {
+            empty++;
+        }
+    }
+    return n;
+}
+
+// Between polls in the waiting functions: poll flat out for DMA_WAIT_SPIN_US, then sleep
+// longer and longer, up to DMA_WAIT_MAX_BACKOFF_US
+static void mc_pause(double waited_us, int *backoff_us) {
+    if (waited_us < DMA_WAIT_SPIN_US) {
+        poll_pause();
+        return;
+    }
+    struct timespec ts = { 0, *backoff_us * 1000L };
+    nanosleep(&ts, NULL);
+    if (*backoff_us < DMA_WAIT_MAX_BACKOFF_US)
+        *backoff_us *= 2;
+}
+
+int dma_mc_wait(struct dma_mc *mc, struct dma_mc_completion *c, int max, int timeout_ms) {
+    double t0 = now_seconds();
+    int backoff_us = 1;
+    for (;;) {
+        int n = dma_mc_poll(mc, c, max);
+        if (n)
+            return n;
+
+        double waited_us = (now_seconds() - t0) * 1e6;
+        if (timeout_ms >= 0 && waited_us >= timeout_ms * 1000.0)
+            return 0;
+        mc_pause(waited_us, &backoff_us);
+    }
+}
+
+int dma_mc_channel_wait(struct dma_mc *mc, int ch, int dir, struct dma_mc_completion *c, int timeout_ms) {
+    int pending = dma_mc_pending(mc, ch, dir);
+    if (pending <= 0) {
+        if (pending == 0)
+            printf("ERROR: Nothing is queued on MCDMA channel %d\n", ch);
+        return -1;
+    }
+
+    double t0 = now_seconds();
+    int backoff_us = 1;
+    while (!mc_reap(mc, ch, dir, c)) {
+        double waited_us = (now_seconds() - t0) * 1e6;
+        if (timeout_ms >= 0 && waited_us >= timeout_ms * 1000.0)
+            return 0;
+        mc_pause(waited_us, &backoff_us);
+    }
+    return 1;
+}
+
+void dma_mc_reset(struct dma_mc *mc) {
+    mc_start(mc);
+}
+
+void dma_mc_cleanup(struct dma_mc *mc) {
+    if (mc->ctx.cfg_base) {
+        set_dma_reg(&mc->ctx, DMA_MC_CCR_REG, DMA_RESET);
+        set_dma_reg(&mc->ctx, DMA_MC_S2MM + DMA_MC_CCR_REG, DMA_RESET);
+    }
+    if (mc->txbase)
+        release_buffer(mc->tx_buffer_id, mc->txbase, mc->nchannels*mc->buffer_size);
+    if (mc->rxbase)
+        release_buffer(mc->rx_buffer_id, mc->rxbase, mc->nchannels*mc->buffer_size);
+    if (mc->rings)
+        release_buffer(mc->rings_id, (void*)mc->rings, 2*mc->nchannels*DMA_MC_QUEUE_LEN*DMA_SG_DESC_SIZE);
+    ctx_release(&mc->ctx);
+    free(mc);
+}
+
+
+// Release everything a context holds. If files are open; close them. If regions are
+// mmap-ed, munmap them.
+static void ctx_release(struct dma_ctx *ctx) {
+    if (!ctx->opened)
+        return;
+
+    dma_ctx_capture_stop(ctx);
+    dma_ctx_service_stop(ctx);
+    async_stop(ctx);
+
+    for (int i=0; i<DMA_MAX_REGIONS; i++)
+        dma_ctx_unregister(ctx, i);
+
+    // release Tx and Rx buffers and descriptor rings
+    if (ctx->tx_ring)
+        release_buffer(ctx->tx_ring_id, (void*)ctx->tx_ring, ctx->ring_len*DMA_SG_DESC_SIZE);
+    if (ctx->rx_ring)
+        release_buffer(ctx->rx_ring_id, (void*)ctx->rx_ring, ctx->ring_len*DMA_SG_DESC_SIZE);
+    if (ctx->owns_buffers && ctx->txbase)
+        release_buffer(ctx->tx_buffer_id, ctx->txbase, ctx->buffer_size);
+    if (ctx->owns_buffers && ctx->rxbase)
+        release_buffer(ctx->rx_buffer_id, ctx->rxbase, ctx->buffer_size);
+    for (int i=0; i<DMA_RING_MAX_SLOTS; i++) {
+        if (ctx->slots[i].txbase)
+            release_buffer(ctx->slots[i].tx_buffer_id, ctx->slots[i].txbase, ctx->buffer_size);
+        if (ctx->slots[i].rxbase)
+            release_buffer(ctx->slots[i].rx_buffer_id, ctx->slots[i].rxbase, ctx->buffer_size);
+    }
+
+#ifdef DMA_MODEL
+    if (ctx->cfg_base)
+        dma_model_close(ctx->cfg_base);   // this also closes the model's UIO devices
+#else
+    if (ctx->mm2s_uio_fd > -1)
+        close(ctx->mm2s_uio_fd);
+
+    if (ctx->s2mm_uio_fd > -1)
+        close(ctx->s2mm_uio_fd);
+
+    if (ctx->cfg_base)
+        munmap((void*)ctx->cfg_base, DMA_MMAP_LEN);
+
+    if (ctx->mem_fd > -1)
+        close(ctx->mem_fd);
+#endif
+
+    memalloc_close();
+    ctx_clear(ctx, ctx->base_addr);
+}
+
+// A cleanup function. Releases everything, and frees the context if dma_ctx_*init() allocated it.
+void dma_ctx_cleanup(struct dma_ctx *ctx) {
+    ctx_release(ctx);
+    if (ctx->allocated)
+        free(ctx);
+}
+
+// Open and mmap the DMA control interface, and open the /dev/memalloc file
+static int ctx_open(struct dma_ctx *ctx, unsigned int base_addr) {
+    ctx_clear(ctx, base_addr);
+
+#ifdef DMA_MODEL
+    ctx->cfg_base = dma_model_open(base_addr);
+    if (ctx->cfg_base == NULL) {
+        printf("ERROR: failed to start DMA model\n");
+        return -1;
+    }
+#else
+    ///////////////////////////////////////////////////
+    // mmap the DMA control interface
+    ctx->mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (ctx->mem_fd == -1) {
+        printf("ERROR: failed to open /dev/mem\n");
+        return -1;
+    }
+
+    void *regs = mmap(NULL, DMA_MMAP_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->mem_fd, base_addr);
+    if (regs == MAP_FAILED) {
+        printf("ERROR: Failed to mmap DMA control registers\n");
+        close(ctx->mem_fd);
+        ctx->mem_fd = -1;
+        return -1;
+    }
+    ctx->cfg_base = regs;
+#endif
+
+    if (memalloc_open()) {
+#ifdef DMA_MODEL
+        dma_model_close(ctx->cfg_base);
+#else
+        munmap((void*)ctx->cfg_base, DMA_MMAP_LEN);
+        close(ctx->mem_fd);
+#endif
+        ctx_clear(ctx, base_addr);
+        return -1;
+    }
+
+    ctx->opened = 1;
+    return 0;
+}
+
+// Open the /dev/memalloc file, unless a context or pool already has
+static int memalloc_open() {
+    pthread_mutex_lock(&memalloc_lock);
+#ifndef DMA_MODEL
+    if (memalloc_dev_fd == -1) {
+        memalloc_dev_fd = open("/dev/memalloc", O_RDWR);
+        if (memalloc_dev_fd == -1) {
+            printf("ERROR: failed to open /dev/memalloc. Try running 'modprobe memalloc'\n");
+            pthread_mutex_unlock(&memalloc_lock);
+            return -1;
+        }
+    }
+#endif
+    memalloc_users++;
+    pthread_mutex_unlock(&memalloc_lock);
+    return 0;
+}
+
+// Close /dev/memalloc when the last context or pool is done with it
+static void memalloc_close() {
+    pthread_mutex_lock(&memalloc_lock);
+    if (--memalloc_users == 0 && memalloc_dev_fd > -1) {
+        close(memalloc_dev_fd);
+        memalloc_dev_fd = -1;
+    }
+    pthread_mutex_unlock(&memalloc_lock);
+}
+
+// Reserve a buffer from memalloc, of the given kind (DMA_BUF_COHERENT, DMA_BUF_CACHED or
+// DMA_BUF_WC), record its ID and physical address, and mmap it. One RESERVE ioctl does
+// what used to take RESERVE, GET_PHYSICAL and ACTIVATE, and the mmap picks the buffer by
+// its physical address, so threads can reserve buffers at the same time. Each buffer gets
+// memory of its own (no MEMALLOC_SUBALLOC), so it starts on a page and can be exported. The
+// mapping is populated and locked up front, so the program's first touch of each page does
+// not fault.
+// Returns: 0 on success; -1 on error
+static int reserve_buffer(int size, int mode, int *id, unsigned int *phy_addr, void **base) {
+#ifdef DMA_MODEL
+    (void)mode;   // the model's memory is always coherent with the CPU
+    if (dma_model_reserve(size, id, phy_addr, base))
+        return -1;
+#else
+    struct ioctl_arg_t ioctl_arg;
+    memset(&ioctl_arg, 0, sizeof(ioctl_arg));
+    ioctl_arg.buffer_size = size;
+    ioctl_arg.flags = mode;
+    int status = ioctl(memalloc_dev_fd, MEMALLOC_RESERVE_CMD, &ioctl_arg);
+    if (status || ioctl_arg.buffer_id < 0) {
+        printf("ERROR: memalloc reserve failed (id %d, status %d)\n", ioctl_arg.buffer_id, status);
+        return -1;
+    }
+    *id = ioctl_arg.buffer_id;
+    *phy_addr = ioctl_arg.phys_addr;
+
+    *base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, memalloc_dev_fd, (off_t)*phy_addr);
+    if (*base == MAP_FAILED) {
+        printf("ERROR: mmap buffer %d failed\n", *id);
+        *base = NULL;
+        release_buffer(*id, NULL, size);
+        return -1;
+    }
+#endif
+    mlock(*base, size);   // best effort: it needs RLIMIT_MEMLOCK (or root)
+    return 0;
+}
+
+// Import memory the application already has (addr), or a dma-buf (dmabuf_fd >= 0),
+// into memalloc, so the DMA can use it in place. This only works if it is physically
+// contiguous. Returns: 0 on success; -1 if it cannot be imported
+static int import_buffer(void *addr, int dmabuf_fd, int size, int *id, unsigned int *phy_addr) {
+#ifdef DMA_MODEL
+    if (dmabuf_fd >= 0)
+        return dma_model_import_dmabuf(dmabuf_fd, size, id, phy_addr);
+    return dma_model_import_user(addr, size, id, phy_addr);
+#else
+    struct ioctl_arg_t ioctl_arg;
+    memset(&ioctl_arg, 0, sizeof(ioctl_arg));
+    ioctl_arg.buffer_size = size;
+    ioctl_arg.user_addr = (unsigned long)addr;
+    ioctl_arg.dmabuf_fd = dmabuf_fd;
+
+    int cmd = (dmabuf_fd >= 0) ? MEMALLOC_IMPORT_DMABUF_CMD : MEMALLOC_IMPORT_USER_CMD;
+    if (ioctl(memalloc_dev_fd, cmd, &ioctl_arg))
+        return -1;
+    *id = ioctl_arg.buffer_id;
+    *phy_addr = ioctl_arg.phys_addr;
+    return 0;
+#endif
+}
+
+// Make "size" bytes at "offset" in a cached or imported buffer (or all of it, if size is
+// 0) visible to the DMA (MEMALLOC_SYNC_FOR_DEVICE) or to the CPU (MEMALLOC_SYNC_FOR_CPU).
+// Returns: 0 on success; -1 on error
+static int sync_buffer(int id, int dir, int offset, int size) {
+#ifdef DMA_MODEL
+    return 0;   // the model shares the CPU's view of memory
+#else
+    struct ioctl_arg_t ioctl_arg;
+    memset(&ioctl_arg, 0, sizeof(ioctl_arg));
+    ioctl_arg.buffer_id = id;
+    ioctl_arg.sync_dir = dir;
+    ioctl_arg.sync_offset = offset;
+    ioctl_arg.buffer_size = size;
+    if (ioctl(memalloc_dev_fd, MEMALLOC_SYNC_CMD, &ioctl_arg)) {
+        printf("ERROR: failed to sync buffer %d\n", id);
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+// Export a buffer as a dma-buf (see note 17 in dma.h)
+// Returns: the dma-buf's file descriptor, or -1 on error
+static int export_buffer(int id) {
+#ifdef DMA_MODEL
+    return dma_model_export_dmabuf(id);
+#else
+    struct ioctl_arg_t ioctl_arg;
+    memset(&ioctl_arg, 0, sizeof(ioctl_arg));
+    ioctl_arg.buffer_id = id;
+    if (ioctl(memalloc_dev_fd, MEMALLOC_EXPORT_DMABUF_CMD, &ioctl_arg)) {
+        printf("ERROR: failed to export buffer %d\n", id);
+        return -1;
+    }
+    return ioctl_arg.dmabuf_fd;
+#endif
+}
+
+// Sync part of a context's TxBuffer (is_tx) or RxBuffer, if it is cached. A write-combining
+// TxBuffer only needs the CPU's pending writes pushed out before the DMA starts.
+static int buffer_sync(struct dma_ctx *ctx, int is_tx, int dir, int offset, int size) {
+    int mode = is_tx ? ctx->tx_mode : ctx->rx_mode;
+    if (mode == DMA_BUF_WC)
+        __sync_synchronize();
+    if (mode != DMA_BUF_CACHED)
+        return 0;
+    return sync_buffer(is_tx ? ctx->tx_buffer_id : ctx->rx_buffer_id, dir, offset, size);
+}
+
+// Unmap a buffer (if it was mapped) and release it back to memalloc
+static void release_buffer(int id, void *base, int size) {
+#ifdef DMA_MODEL
+    dma_model_release(id);
+#else
+    if (base)
+        munmap(base, size);
+
+    struct ioctl_arg_t ioctl_arg;
+    ioctl_arg.buffer_id = id;
+    int status = ioctl(memalloc_dev_fd, MEMALLOC_RELEASE_CMD, &ioctl_arg);
+    if (status < 0) {
+        printf("ERROR: failed to release buffer %d. Status: %d\n", id, status);
+    }
+#endif
+}
+
+// Without the Data Realignment Engine the DMA moves whole beats of its stream, so a size
+// must be a multiple of the stream width ("unit" bytes); with it, any size will do (unit 1)
+static int check_len(int size, int unit, int max) {
+    if (size < unit) {
+        printf("ERROR: Requested DMA transfer size (%d bytes) is not legal\n", size);
+        return -1;
+    }
+
+    if ((size & (unit-1)) != 0) {
+        printf("ERROR: Requested DMA transfer size (%d bytes) is not a multiple of %d\n", size, unit);
+        return -1;
+    }
+
+    if (size > max) {
+        printf("ERROR: Requested DMA transfer size (%d bytes) is larger than maximum size %d\n", size, max);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The granularity of transfers on a context: its stream width, or 1 byte with the DRE
+static int ctx_unit(struct dma_ctx *ctx) {
+    return ctx->dre ? 1 : ctx->width;
+}
+
+static int check_size(struct dma_ctx *ctx, int size) {
+    // The DMA's buffer length register is MAX_DMA_LEN_BITS bits, so the size
+    //    must be strictly < 2^MAX_DMA_LEN_BITS
+    return check_len(size, ctx_unit(ctx), (1<<MAX_DMA_LEN_BITS)-1);
+}
+
+static int check_sg_size(struct dma_ctx *ctx, int size) {
+    // In scatter-gather mode the transfer is split across descriptors, so there is
+    //    no upper limit other than the buffer size.
+    return check_len(size, ctx_unit(ctx), INT_MAX);
+}
+
+static int check_buffer_size(int size, int sg) {
+    // Before a context is set up, its stream is as configured by DMA_DATA_WIDTH and DMA_DRE
+    return check_len(size, DMA_DRE ? 1 : DMA_DATA_WIDTH, sg ? INT_MAX : (1<<MAX_DMA_LEN_BITS)-1);
+}
+
+static int check_addr(struct dma_ctx *ctx, unsigned int phy_addr) {
+    // Without the DRE, the DMA can only start on a stream-width boundary
+    if ((phy_addr & (ctx_unit(ctx)-1)) != 0) {
+        printf("ERROR: DMA transfer address 0x%x is not aligned to the %d-byte stream\n", phy_addr, ctx->width);
+        return -1;
+    }
+    return 0;
+}
+
+static int check_fit(struct dma_ctx *ctx, int offset, int size) {
+    // The transfer must start on a stream-width boundary (unless the DRE is enabled), and
+    // stay inside the buffer
+    if (offset < 0 || offset + size > ctx->buffer_size) {
+        printf("ERROR: DMA transfer of %d bytes at offset %d does not fit in the buffer (%d bytes)\n",
+               size, offset, ctx->buffer_size);
+        return -1;
+    }
+    if ((offset & (ctx_unit(ctx)-1)) != 0) {
+        printf("ERROR: DMA transfer at offset %d is not aligned to the %d-byte stream\n", offset, ctx->width);
+        return -1;
+    }
+    return 0;
+}
+
+
+// --------------------------------------------------------------------
+// The single-DMA functions. These all use one context, for the DMA at DMA_BASE.
+
+int dma_init(int size) {
+    return ctx_init(&default_ctx, DMA_BASE, size, DMA_BUF_COHERENT, DMA_BUF_COHERENT);
+}
+
+int dma_sg_init(int size) {
+    return ctx_sg_init(&default_ctx, DMA_BASE, size, DMA_BUF_COHERENT, DMA_BUF_COHERENT);
+}
+
+int dma_init_mode(int size, int tx_mode, int rx_mode) {
+    return ctx_init(&default_ctx, DMA_BASE, size, tx_mode, rx_mode);
+}
+
+int dma_sg_init_mode(int size, int tx_mode, int rx_mode) {
+    return ctx_sg_init(&default_ctx, DMA_BASE, size, tx_mode, rx_mode);
+}
+
+int dma_ring_init(int nslots, int size) {
+    return ctx_ring_init(&default_ctx, DMA_BASE, nslots, size);
+}
+
+void* getTxBuffer() {
+    return dma_ctx_tx_buffer(&default_ctx);
+}
+
+void* getRxBuffer() {
+    return dma_ctx_rx_buffer(&default_ctx);
+}
+
+void dma_reset() {
+    dma_ctx_reset(&default_ctx);
+}
+
+int dma_rx(int size) {
+    return dma_ctx_rx(&default_ctx, size);
+}
+
+int dma_tx(int size) {
+    return dma_ctx_tx(&default_ctx, size);
+}
+
+int dma_sync() {
+    return dma_ctx_sync(&default_ctx);
+}
+
+int dma_busy() {
+    return dma_ctx_busy(&default_ctx);
+}
+
+int dma_set_stream(int width, int dre) {
+    return dma_ctx_set_stream(&default_ctx, width, dre);
+}
+
+int dma_capture_start(int nslots, int slot_size, int mode) {
+    return dma_ctx_capture_start(&default_ctx, nslots, slot_size, mode);
+}
+
+int dma_capture_next(struct dma_capture_block *b) {
+    return dma_ctx_capture_next(&default_ctx, b);
+}
+
+int dma_capture_wait(struct dma_capture_block *b, int timeout_ms) {
+    return dma_ctx_capture_wait(&default_ctx, b, timeout_ms);
+}
+
+int dma_capture_release(struct dma_capture_block *b) {
+    return dma_ctx_capture_release(&default_ctx, b);
+}
+
+unsigned long long dma_capture_head() {
+    return dma_ctx_capture_head(&default_ctx);
+}
+
+void dma_capture_stats(struct dma_capture_stats *stats) {
+    dma_ctx_capture_stats(&default_ctx, stats);
+}
+
+void dma_capture_stop() {
+    dma_ctx_capture_stop(&default_ctx);
+}
+
+int dma_batch(const struct dma_batch_entry *e, int n, struct dma_batch_stats *stats) {
+    return dma_ctx_batch(&default_ctx, e, n, stats);
+}
+
+int dma_service_start() {
+    return dma_ctx_service_start(&default_ctx);
+}
+
+int dma_submit(struct dma_request *req) {
+    return dma_ctx_submit(&default_ctx, req);
+}
+
+void dma_service_stats(struct dma_service_stats *stats) {
+    dma_ctx_service_stats(&default_ctx, stats);
+}
+
+void dma_service_stop() {
+    dma_ctx_service_stop(&default_ctx);
+}
+
+int dma_rx_phys(unsigned int phy_addr, int size) {
+    return dma_ctx_rx_phys(&default_ctx, phy_addr, size);
+}
+
+int dma_tx_phys(unsigned int phy_addr, int size) {
+    return dma_ctx_tx_phys(&default_ctx, phy_addr, size);
+}
+
+void dma_init_stats(struct dma_init_stats *stats) {
+    dma_ctx_init_stats(&default_ctx, stats);
+}
+
+void dma_wait_stats(struct dma_wait_stats *stats) {
+    dma_ctx_wait_stats(&default_ctx, stats);
+}
+
+int dma_sg_rx(int size) {
+    return dma_ctx_sg_rx(&default_ctx, size);
+}
+
+int dma_sg_tx(int size) {
+    return dma_ctx_sg_tx(&default_ctx, size);
+}
+
+int dma_sg_sync() {
+    return dma_ctx_sg_sync(&default_ctx);
+}
+
+int dma_irq_init(const char *mm2s_uio, const char *s2mm_uio) {
+    return dma_ctx_irq_init(&default_ctx, mm2s_uio, s2mm_uio);
+}
+
+struct dma_xfer *dma_tx_async(int offset, int size) {
+    return dma_ctx_tx_async(&default_ctx, offset, size);
+}
+
+struct dma_xfer *dma_rx_async(int offset, int size) {
+    return dma_ctx_rx_async(&default_ctx, offset, size);
+}
+
+void* dma_ring_tx_buffer(int slot) {
+    return dma_ctx_ring_tx_buffer(&default_ctx, slot);
+}
+
+void* dma_ring_rx_buffer(int slot) {
+    return dma_ctx_ring_rx_buffer(&default_ctx, slot);
+}
+
+int dma_ring_produce() {
+    return dma_ctx_ring_produce(&default_ctx);
+}
+
+int dma_ring_submit(int size) {
+    return dma_ctx_ring_submit(&default_ctx, size);
+}
+
+int dma_ring_consume() {
+    return dma_ctx_ring_consume(&default_ctx);
+}
+
+int dma_ring_wait() {
+    return dma_ctx_ring_wait(&default_ctx);
+}
+
+void dma_ring_release() {
+    dma_ctx_ring_release(&default_ctx);
+}
+
+int dma_ring_producer_index() {
+    return dma_ctx_ring_producer_index(&default_ctx);
+}
+
+int dma_ring_consumer_index() {
+    return dma_ctx_ring_consumer_index(&default_ctx);
+}
+
+int dma_ring_pending() {
+    return dma_ctx_ring_pending(&default_ctx);
+}
+
+int dma_ring_in_flight() {
+    return dma_ctx_ring_in_flight(&default_ctx);
+}
+
+int dma_register(void *addr, int size) {
+    return dma_ctx_register(&default_ctx, addr, size);
+}
+
+int dma_register_dmabuf(int fd, int size) {
+    return dma_ctx_register_dmabuf(&default_ctx, fd, size);
+}
+
+void* dma_region_buffer(int region) {
+    return dma_ctx_region_buffer(&default_ctx, region);
+}
+
+int dma_region_zero_copy(int region) {
+    return dma_ctx_region_zero_copy(&default_ctx, region);
+}
+
+int dma_region_tx(int region, int offset, int size) {
+    return dma_ctx_region_tx(&default_ctx, region, offset, size);
+}
+
+int dma_region_rx(int region, int offset, int size) {
+    return dma_ctx_region_rx(&default_ctx, region, offset, size);
+}
+
+void dma_unregister(int region) {
+    dma_ctx_unregister(&default_ctx, region);
+}
+
+int dma_export_tx_buffer() {
+    return dma_ctx_export_tx_buffer(&default_ctx);
+}
+
+int dma_export_rx_buffer() {
+    return dma_ctx_export_rx_buffer(&default_ctx);
+}
+
+int dma_stream(int in_fd, int out_fd, struct dma_stream_stats *stats) {
+    return dma_ctx_stream(&default_ctx, in_fd, out_fd, stats);
+}
+
+int dma_stream_mem(const void *in, long long len, int out_fd, struct dma_stream_stats *stats) {
+    return dma_ctx_stream_mem(&default_ctx, in, len, out_fd, stats);
+}
+
+void dma_cleanup() {
+    ctx_release(&default_ctx);
+}
@@ -24,7 +24,7 @@
 //    1. Set up the system as explained in the PetaLinux chapter of the tutorial
 //    2. Insert the memalloc kernel module by running "modprobe memalloc"
 //    3. Your program needs to include this dma.h, the accompanying dma.c file, and
-//       memalloc.h from the memalloc/ directory.
+//       memalloc.h from the memalloc/ directory, and link with -lpthread.
 //    4. Basic program flow:
 //          - call dma_init(size) to initialize the DMA, where size is the desired buffer
 //            size in bytes
@@ -35,6 +35,148 @@
 //          - call dma_tx(size) to set up the DMA to send data
 //          - call dma_sync() to wait for DMA to finish
 //       See dmatest.c for an example.
+//    5. If your DMA is configured with the scatter-gather engine enabled, use
+//       dma_sg_init(), dma_sg_rx(), dma_sg_tx() and dma_sg_sync() instead of the
+//       dma_init(), dma_rx(), dma_tx() and dma_sync() calls above. In this mode a
+//       single transfer can be much larger than the 2^MAX_DMA_LEN_BITS limit: the
+//       driver splits it into a chain of descriptors, and starts the whole chain
+//       with one write to the TAILDESC register.
+//    6. To keep the CPU and the DMA busy at the same time, use a ring of buffers:
+//          - call dma_ring_init(n, size) to reserve n pairs of Tx/Rx buffers ("slots")
+//          - call dma_ring_produce() to get the slot to fill next, fill its Tx buffer
+//            (dma_ring_tx_buffer(slot)), and hand it to the DMA with dma_ring_submit(size)
+//          - call dma_ring_consume() (or the blocking dma_ring_wait()) to get the next
+//            finished slot, read its Rx buffer (dma_ring_rx_buffer(slot)), and give it
+//            back with dma_ring_release()
+//       Submitted slots are moved by the DMA one after another, so while it moves slot k
+//       you can fill slot k+1 and drain slot k-1.
+//       For data that is larger than any buffer (e.g. a file), dma_stream(in_fd, out_fd,
+//       &stats) does all of this for you after dma_ring_init(): it reads the input in
+//       chunks, sends each through the DMA, writes what comes back to the output, and
+//       reports the throughput it achieved. The chunk size adapts to the throughput,
+//       up to the ring's buffer size.
+//    7. By default dma_sync() (and the other waiting functions) poll the DMA status
+//       registers. To sleep until the DMA raises an interrupt instead, connect the
+//       DMA's mm2s_introut and s2mm_introut to the Zynq, give each its own
+//       "generic-uio" node in the device tree, and call dma_irq_init() with the two
+//       /dev/uioN devices after dma_init().
+//    8. For event-driven programs, dma_tx_async() and dma_rx_async() start a transfer
+//       and return a handle right away. dma_xfer_fd(handle) is a file descriptor that
+//       becomes readable when that transfer is done, so it can be added to your
+//       poll/epoll set along with sockets and timers. Transfers on the same channel are
+//       queued and run in order; Tx and Rx complete separately. A background thread
+//       tracks completion (sleeping on interrupts if you called dma_irq_init()).
+//       Don't mix these with dma_rx()/dma_tx()/dma_sync().
+//    9. To avoid copying data into and out of the Tx and Rx buffers, register your own
+//       memory with dma_register(ptr, size) (or a dma-buf from another driver with
+//       dma_register_dmabuf(fd, size)), and use dma_region_tx()/dma_region_rx() with
+//       the region number it returns, followed by dma_sync(). If memalloc can import
+//       the memory (it must be physically contiguous) the DMA uses it in place;
+//       otherwise the driver copies through a bounce buffer, so it still works, just
+//       without the savings. dma_region_zero_copy() tells you which one you got.
+//   10. If your design has more than one AXI DMA, use a context per DMA: each
+//       dma_ctx_*() function is the same as the dma_*() function above, with the
+//       context as its first argument. For example:
+//          struct dma_ctx *d = dma_ctx_init(0x40410000, size);
+//          dma_ctx_rx(d, size); dma_ctx_tx(d, size); dma_ctx_sync(d);
+//          dma_ctx_cleanup(d);
+//       (The dma_*() functions use a context of their own, for the DMA at DMA_BASE.)
+//       To spread one large transfer over several DMAs, use dma_stripe_init() with
+//       their base addresses: every DMA moves its own slice of the same buffers, and
+//       dma_stripe_sync() waits for all of them. Each DMA needs its own loopback (or
+//       accelerator) between its MM2S and S2MM streams.
+//   11. The Tx and Rx buffers are uncached by default, so the CPU is slow to work with
+//       them. If your program reads or writes them a lot, initialize with
+//       dma_init_mode(size, tx_mode, rx_mode) (or dma_sg_init_mode()) instead:
+//          - DMA_BUF_CACHED buffers are cached. The driver flushes the part of the
+//            buffer being sent before each transfer, and invalidates the part received
+//            after it (in dma_sync(), or when an asynchronous receive finishes).
+//          - DMA_BUF_WC (Tx only) is uncached, but the CPU's writes are combined into
+//            bursts. Good for a buffer the CPU fills and never reads.
+//       The model (below) ignores the mode.
+//   12. If several threads share one DMA, start a service thread with dma_service_start()
+//       and have each thread hand it requests with dma_submit(&req), instead of taking
+//       turns with a mutex around dma_rx()/dma_tx()/dma_sync(). Submitting never blocks
+//       or takes a lock: requests go on a lock-free queue, and the service thread (the
+//       only thread that touches the DMA) runs whatever has queued up as one dma_batch().
+//       Each request then completes on its own: either call dma_request_wait(&req) on it
+//       like a future, or give it a callback, which runs on the service thread.
+//       Don't call the other dma_*() functions while the service is running.
+//   13. memalloc has no limit on how many buffers a process reserves, other than the
+//       memory (CMA) there is to give, but reserving one takes several system calls,
+//       and a ring has at most DMA_RING_MAX_SLOTS slots. For many buffers, or buffers wanted at request time, make
+//       a pool once with dma_pool_create(nregions, region_size, mode): it reserves a
+//       few large regions, and dma_pool_acquire(pool, size, &phy_addr) hands out
+//       cache-line aligned blocks of them, rounded up to a power of 2, without any
+//       system call; dma_pool_release() gives them back. Move data in and out of a
+//       block with dma_tx_phys()/dma_rx_phys() and its physical address, followed by
+//       dma_sync(). For a cached pool (DMA_BUF_CACHED), call dma_pool_sync() on a block
+//       before sending it and after receiving into it. dma_pool_stats() shows how full
+//       the pool is, to help you size it.
+//   14. The driver assumes a 32-bit stream (DMA_DATA_WIDTH) without the Data Realignment
+//       Engine (DMA_DRE): every transfer must then be a multiple of 4 bytes, starting on
+//       a 4-byte boundary. For a DMA configured with a wider stream, change the macros,
+//       or call dma_set_stream(width, dre) after dma_init() (dma_ctx_set_stream() for a
+//       context): transfers are then checked against that width instead, and with the
+//       DRE ("Allow Unaligned Transfers" in Vivado) they can be any number of bytes, at
+//       any address. Wider streams move more per clock, but only if the buffers are
+//       aligned for them; pool blocks are aligned to their size, and at least 64 bytes.
+//   15. To receive a stream that never stops (a sensor, say) without losing data between
+//       dma_rx() calls, start a capture with dma_capture_start(nslots, slot_size, mode)
+//       after dma_init(). It needs the scatter-gather engine: S2MM is set up once to
+//       fill nslots slots of one buffer round and round, and the driver's capture thread
+//       counts the slots as they fill (dma_capture_head()). One consumer thread takes
+//       them in order with dma_capture_next() (or the blocking dma_capture_wait()),
+//       reads the data, and gives each back with dma_capture_release(); neither takes a
+//       lock. The DMA does not wait for the consumer: if it falls behind by more than
+//       nslots-2 slots, the oldest are lost, and dma_capture_next() says how many.
+//       dma_capture_release() fails if a slot was overwritten while it was being read.
+//       The hardware keeps no count of its turns round the ring, so the DMA does wait
+//       for the capture thread: if the thread has not counted the last nslots-1 slots,
+//       the DMA stops and holds up the stream until it has, and the next slot is marked
+//       as stalled (data a source could not hold back is then lost). Make slots big
+//       enough that each takes much longer to fill than DMA_CAPTURE_POLL_US (or use
+//       interrupts), and the ring long enough to ride out scheduling delays.
+//       Don't use dma_rx() while a capture is running.
+//   16. An AXI Multichannel DMA (MCDMA) carries several streams over one AXI-Stream,
+//       told apart by TDEST. Open one with dma_mc_init(base, nchannels, size): each
+//       channel gets its own Tx and Rx buffer and its own queue of transfers each way.
+//       dma_mc_tx(mc, ch, offset, size, tdest) queues a packet on MM2S channel ch,
+//       sent with the given TDEST; dma_mc_rx(mc, ch, offset, size) gives S2MM channel
+//       ch a buffer, which the MCDMA fills with the next packet that arrives with TDEST
+//       ch. So the hardware sorts the streams, not the CPU. The MCDMA serves its MM2S
+//       channels in turn, packet by packet; dma_mc_poll() and dma_mc_wait() hand back
+//       finished transfers from every channel, also in turn, so one busy channel
+//       cannot starve the others. dma_mc_channel_wait() waits for one channel only.
+//       The MCDMA is always in scatter-gather mode; the driver polls its descriptors
+//       rather than taking its per-channel interrupts.
+//   17. To hand received data to another process, or to another driver (a V4L2 or DRM
+//       device, say), without copying it, export the buffer as a dma-buf:
+//       dma_export_rx_buffer() (or dma_export_tx_buffer()) returns a dma-buf fd. Pass
+//       it over a Unix socket (SCM_RIGHTS) or to the other driver's import ioctl; the
+//       other side mmaps it or attaches to it, and the memory stays valid until
+//       dma_cleanup() and every holder of the fd has closed it. For a cached buffer
+//       (DMA_BUF_CACHED), a process that mmaps the fd brackets its reads and writes
+//       with the DMA_BUF_IOCTL_SYNC ioctl (see linux/dma-buf.h).
+//
+// Testing without a board:
+//    Compile with -DDMA_MODEL and add dma_model.c (and -lpthread) to your build.
+//    The driver will then talk to a software model of the AXI DMA (in loopback)
+//    instead of /dev/mem and /dev/memalloc. Each base address gets its own model
+//    DMA, so contexts and stripes can be tested too. The model can also imitate the
+//    DMA's timing (bandwidth, setup latency and jitter) and an accelerator in place of
+//    the loopback; see dma_model.h. For example:
+//       gcc -DDMA_MODEL -I../memalloc dmatest.c dma.c dma_model.c -lpthread
+//
+// Tracing:
+//    Compile with -DDMA_TRACE and add dma_trace.c to your build, then run the program
+//    with DMA_TRACE_FILE=trace.json to get a timeline of every transfer (setup, the
+//    DMA moving data, dma_sync(), and the program's own work in between) that Chrome
+//    or Perfetto can show. See dma_trace.h.
+//
+// C++:
+//    dma.hpp wraps the context functions in RAII classes, with the DMA's base address,
+//    length register width and data width as template parameters. See dma.hpp.
 
 
 // If you want to extend the functionality of this driver, it should be fairly
@@ -44,15 +186,62 @@
 //       buffer; modify that data, then use the same buffer to Tx)
 
 
+#ifndef DMA_H
+#define DMA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // To use this, copy in memalloc.h from the memalloc/ module
 #include "memalloc.h"
 
+#ifdef DMA_MODEL
+#include "dma_model.h"
+#endif
+
+#ifdef DMA_TRACE
+#include "dma_trace.h"
+#endif
+
 // ------------- Configuration macros ---------------------------------
 #define DMA_BASE 0x40400000    // must match your address mapping in Vivado
 #define MAX_DMA_LEN_BITS 14    // must match the DMA configuration in Vivado
+#define DMA_DATA_WIDTH 4       // stream data width in bytes (4, 8, ... 128); must match Vivado
+#define DMA_DRE 0              // 1 if "Allow Unaligned Transfers" (the DRE) is enabled in Vivado
 #define DMA_MMAP_LEN 4096
+#define DMA_RING_MAX_SLOTS 64  // size of this driver's slot table; each slot uses two memalloc buffers
+#define DMA_IRQ_TIMEOUT_MS 1000  // how long to wait for an interrupt before giving up
+#define DMA_ASYNC_POLL_US  10    // how often to check for completion of asynchronous
+                                 // transfers, when not using interrupts
+#define DMA_STRIPE_MAX_ENGINES 4 // most DMAs one stripe can spread a transfer over
+#define DMA_STREAM_MIN_CHUNK 1024 // smallest (and first) chunk size dma_stream() tries
+#define DMA_STREAM_WINDOW    8    // chunks per throughput measurement in dma_stream()
+#define DMA_MAX_REGIONS      8    // application buffers that can be registered at once
+#define DMA_WAIT_DEFAULT_MBPS   400  // bandwidth assumed for waits until there are measurements
+#define DMA_WAIT_MIN_MBPS       10   // slowest bandwidth before a wait times out, on top of...
+#define DMA_WAIT_TIMEOUT_MS     1000 // ...this fixed allowance
+#define DMA_WAIT_SLEEP_FRACTION 0.75 // sleep through this much of the predicted time, then poll
+#define DMA_WAIT_SLEEP_MARGIN_US 60  // how late a sleep may wake up (the default timer slack is 50us)
+#define DMA_WAIT_MIN_SLEEP_US   20   // don't bother sleeping for less than this
+#define DMA_WAIT_SPIN_US        50   // poll flat out until this long after the predicted time...
+#define DMA_WAIT_MAX_BACKOFF_US 1000 // ...then sleep between polls, doubling up to this
+#define DMA_WAIT_DECAY          0.95 // weight of older transfers in the prediction, per transfer
+#define DMA_BATCH_MAX_DESC      256  // longest descriptor chain dma_batch() builds
+#define DMA_SERVICE_MAX_BATCH   64   // most queued requests the service thread runs as one batch
+#define DMA_POOL_SLAB_SIZE   65536   // pools hand memory to size classes in slabs this big...
+#define DMA_POOL_MIN_BLOCK   64      // ...split into blocks of 64 bytes (a cache line), 128, ...
+#define DMA_POOL_CLASSES     11      // ...up to DMA_POOL_SLAB_SIZE
+#define DMA_CAPTURE_POLL_US  50      // how often the capture thread checks for filled slots,
+                                     // when not using interrupts
+#define DMA_MC_MAX_CHANNELS  16      // channels an AXI MCDMA can have each way
+#define DMA_MC_QUEUE_LEN     16      // transfers each MCDMA channel can have queued each way
 // -------------------------------------------------------------------
 
+#if DMA_DRE && DMA_DATA_WIDTH > 8
+#error "The AXI DMA only offers the Data Realignment Engine on streams of up to 64 bits"
+#endif
+
 // ----- Macros for DMA control and status reg interfaces ---------
 #define MM2S_CNTL_REG       0x00
 #define MM2S_STATUS_REG     0x04
@@ -64,17 +253,102 @@
 #define S2MM_DEST_ADDR_REG  0x48
 #define S2MM_LEN_REG        0x58
 
+// Only used in scatter-gather mode
+#define MM2S_CURDESC_REG    0x08
+#define MM2S_TAILDESC_REG   0x10
+#define S2MM_CURDESC_REG    0x38
+#define S2MM_TAILDESC_REG   0x40
+
 // Macros for DMA control and status signals 
 #define DMA_HALT            0
 #define DMA_START           1
 #define DMA_RESET           4
 #define DMA_IDLE            2
+#define DMA_HALTED          1
+#define DMA_ERR_MASK        0x770   // DMAIntErr, DMASlvErr, DMADecErr, SGIntErr, SGSlvErr, SGDecErr
+
+// Interrupt enables (control reg) and interrupt flags (status reg, write 1 to clear)
+#define DMA_IOC_IRQ_EN      (1<<12)
+#define DMA_ERR_IRQ_EN      (1<<14)
+#define DMA_IOC_IRQ         (1<<12)
+#define DMA_ERR_IRQ         (1<<14)
+#define DMA_IRQ_MASK        (7<<12)   // IOC, delay and error interrupts
+// -------------------------------------------------------------------
 
-// Macros to ease setting and reading DMA control/status regs and polling
-#define set_dma_reg(offset,value) dma_cfg_base[offset/4] = value
-#define get_dma_reg(offset)       dma_cfg_base[offset/4]
-#define s2mm_busy() ((get_dma_reg(S2MM_STATUS_REG) & DMA_IDLE) == 0)
-#define mm2s_busy() ((get_dma_reg(MM2S_STATUS_REG) & DMA_IDLE) == 0)
+// ----- Scatter-gather descriptors ----------------------------------
+// Each descriptor is 13 words, and must be aligned to 16 words (64 bytes).
+// The DMA reads them from (and writes their status back to) memory, so
+// the driver checks for completion by reading the status word instead of
+// polling the MMIO status registers.
+struct dma_sg_desc {
+    unsigned int next_desc;       // physical address of next descriptor
+    unsigned int next_desc_msb;
+    unsigned int buffer_addr;     // physical address of data
+    unsigned int buffer_addr_msb;
+    unsigned int reserved[2];
+    unsigned int control;         // buffer length, plus SOF/EOF flags (MM2S only)
+    unsigned int status;          // bytes transferred, plus completion/error flags
+    unsigned int app[5];
+    unsigned int pad[3];
+};
+
+#define DMA_SG_DESC_SIZE    64
+#define DMA_SG_LEN_MASK     0x03ffffff
+#define DMA_SG_TXEOF        (1u<<26)
+#define DMA_SG_TXSOF        (1u<<27)
+#define DMA_SG_RXEOF        (1u<<26)
+#define DMA_SG_RXSOF        (1u<<27)
+#define DMA_SG_ERR_MASK     (7u<<28)  // DMAIntErr, DMASlvErr, DMADecErr
+#define DMA_SG_CMPLT        (1u<<31)
+
+// AXI MCDMA registers (PG288): the MM2S common registers, then a block of registers per
+// channel; the S2MM side is the same again, DMA_MC_S2MM bytes in.
+#define DMA_MC_S2MM         0x500
+#define DMA_MC_CCR_REG      0x00      // common control: DMA_START, DMA_RESET
+#define DMA_MC_CSR_REG      0x04      // common status: DMA_HALTED, DMA_IDLE
+#define DMA_MC_CHEN_REG     0x08      // channel enable, one bit per channel
+#define DMA_MC_CHSER_REG    0x0C      // channels in service, one bit per channel
+#define DMA_MC_ERR_REG      0x10
+#define DMA_MC_CH_REG(ch)   (0x40 + (ch)*0x40)   // first register of channel ch (from 0)
+#define DMA_MC_CH_CR        0x00      // channel control: DMA_START (fetch descriptors)
+#define DMA_MC_CH_SR        0x04      // channel status: DMA_MC_CH_IDLE, and errors
+#define DMA_MC_CH_CURDESC   0x08
+#define DMA_MC_CH_TAILDESC  0x10
+#define DMA_MC_CH_IDLE      1         // the channel has reached its tail descriptor
+
+// MCDMA descriptors are laid out like the AXI DMA's, except that each carries the stream's
+// sideband signals (TDEST, TID, TUSER) too, and S2MM has its status word where MM2S has
+// its sideband word.
+struct dma_mc_desc {
+    unsigned int next_desc;       // physical address of next descriptor
+    unsigned int next_desc_msb;
+    unsigned int buffer_addr;     // physical address of data
+    unsigned int buffer_addr_msb;
+    unsigned int reserved;
+    unsigned int control;         // buffer length, plus SOP/EOP flags (MM2S only)
+    union {
+        unsigned int mm2s_sideband;   // sideband signals to send with the packet
+        unsigned int s2mm_status;     // bytes received, plus completion/error flags
+    };
+    union {
+        unsigned int mm2s_status;     // bytes sent, plus completion/error flags
+        unsigned int s2mm_sideband;   // sideband signals the packet arrived with
+    };
+    unsigned int app[5];
+    unsigned int pad[3];
+};
+
+#define DMA_MC_SOP          (1u<<31)
+#define DMA_MC_EOP          (1u<<30)
+// The sideband words hold TID in bits 31:24, TDEST in bits 20:16 and TUSER in bits 15:0
+#define DMA_MC_TDEST_SHIFT  16
+#define DMA_MC_TDEST_MASK   0x1f      // TDEST, once shifted down
+// The status words have the same bits as DMA_SG_LEN_MASK, DMA_SG_ERR_MASK and DMA_SG_CMPLT
+
+// Largest amount of data one descriptor can describe. It must fit in
+// MAX_DMA_LEN_BITS bits and be a multiple of the widest stream (128 bytes), so that
+// every descriptor after the first starts on a stream-width boundary too.
+#define DMA_SG_MAX_CHUNK    ((1<<MAX_DMA_LEN_BITS) - 128)
 // -------------------------------------------------------------------
 
 
@@ -117,28 +391,600 @@ int dma_tx(int size);
  */
 int dma_sync();
 
+/* Returns 1 if the DMA is still moving data (Tx or Rx), 0 if both are done. Never blocks. */
+int dma_busy();
+
+/* Tell the driver how the DMA's stream is configured: its width in bytes (a power of 2
+ * from 4 to 128), and whether the Data Realignment Engine is enabled (dre = 1; only on
+ * streams of up to 8 bytes). Call it after dma_init(), which starts from DMA_DATA_WIDTH
+ * and DMA_DRE. Returns: 0 on success; -1 on error
+ */
+int dma_set_stream(int width, int dre);
+
+/* How long the last dma_init() (or dma_sg_init(), dma_ring_init(), ...) took. Each buffer
+ * takes one ioctl and one mmap, and is mapped and locked before dma_init() returns, so
+ * the first transfers do not page fault.
+ */
+struct dma_init_stats {
+    double total_us;
+    double open_us;      // mapping the DMA registers and opening /dev/memalloc
+    double buffers_us;   // reserving, mapping and prefaulting the buffers (and descriptor rings)
+    int buffers;         // memalloc buffers reserved
+};
+void dma_init_stats(struct dma_init_stats *stats);
+
+/* Without interrupts, dma_sync() (and dma_sg_sync(), dma_ring_wait()) sleep through most
+ * of the time a transfer is predicted to take, and poll only near the end. The prediction
+ * is a straight-line fit (setup time plus size over bandwidth) to the transfers waited
+ * for so far. These are the numbers behind it.
+ */
+struct dma_wait_stats {
+    long long waits;     // waits that found the DMA still busy
+    long long polls;     // status checks, in all waits
+    double sleep_us;     // time slept, in all waits
+    double error_us;     // average difference between predicted and actual transfer time
+    double mb_per_s;     // the fitted bandwidth
+    double setup_us;     // the fitted time every transfer takes, regardless of size
+};
+void dma_wait_stats(struct dma_wait_stats *stats);
+
+/* One transfer in a batch: send "len" bytes from tx_offset bytes into the TxBuffer, and
+ * receive "len" bytes at rx_offset bytes into the RxBuffer.
+ */
+struct dma_batch_entry {
+    int tx_offset;
+    int rx_offset;
+    int len;
+};
+
+/* What a batch cost */
+struct dma_batch_stats {
+    int transfers;
+    long long bytes;
+    double seconds;          // for the whole batch, including cache syncs
+    double us_per_transfer;
+    int reg_writes;          // DMA register writes for the whole batch
+};
+
+/* Run n transfers, one after another, and block until they are all done. All of them
+ * are checked before the first one starts. This is much cheaper per transfer than
+ * calling dma_rx(), dma_tx() and dma_sync() for each: in simple mode the DMA is not
+ * halted between transfers, and its address registers are only written when they
+ * change; in scatter-gather mode (after dma_sg_init()) the whole batch goes in one
+ * descriptor chain (or a few, past DMA_BATCH_MAX_DESC descriptors).
+ * stats may be NULL. Returns: 0 on success; -1 on error
+ */
+int dma_batch(const struct dma_batch_entry *e, int n, struct dma_batch_stats *stats);
+
+/* A request for the DMA service thread (see note 12 above): send "len" bytes from
+ * "tx_offset" bytes into the TxBuffer, receiving them "rx_offset" bytes into the
+ * RxBuffer. Fill in the first fields; the rest belong to the driver. The request must
+ * stay in place until it completes.
+ */
+struct dma_request {
+    int tx_offset;
+    int rx_offset;
+    int len;
+    /* Called on the service thread when the request completes (status: 0 on success,
+     * -1 on error), or NULL to wait for it with dma_request_wait() instead. The driver
+     * does not touch the request again after calling this, so it may free it.
+     */
+    void (*done)(struct dma_request *req, int status);
+    void *arg;                  // for done(); the driver does not use it
+
+    int state;                  // (driver) queued, done or failed
+    struct dma_request *next;   // (driver) next on the queue
+};
+
+/* What the service thread has done so far */
+struct dma_service_stats {
+    long long requests;         // requests completed, including failed ones
+    long long batches;          // dma_batch() calls they were run in
+    long long wakeups;          // times the thread slept, waiting for requests
+    double mean_batch;          // requests per batch
+};
+
+/* Start a service thread that owns the DMA. Call it after dma_init() or dma_sg_init().
+ * Returns: 0 on success; -1 on error
+ */
+int dma_service_start();
+
+/* Queue a request for the service thread. Safe to call from any number of threads at
+ * once; it does not block. Returns: 0 on success; -1 if the service is not running
+ */
+int dma_submit(struct dma_request *req);
+
+/* Returns 0 if the request is still queued or running, 1 if it is done, -1 if it failed */
+int dma_request_status(struct dma_request *req);
+
+/* Block until a request (without a done() callback) completes. Any number of threads may
+ * wait on the same request. Returns: 0 on success; -1 on error
+ */
+int dma_request_wait(struct dma_request *req);
+
+/* Get the service thread's counters */
+void dma_service_stats(struct dma_service_stats *stats);
+
+/* Finish the requests already queued, then stop the service thread. Don't call it while
+ * other threads may still be submitting. (dma_cleanup() calls it.)
+ */
+void dma_service_stop();
+
+/* Set up DMA to receive "size" bytes into (or send them from) memory at the given physical
+ * address, such as a pool block (see note 13 above), then call dma_sync() as usual. The
+ * memory is not synced for you. Returns: 0 on success; -1 on error
+ */
+int dma_rx_phys(unsigned int phy_addr, int size);
+int dma_tx_phys(unsigned int phy_addr, int size);
+
+/* A buffer for dma_buffers_reserve() */
+struct dma_buffer {
+    int size;                // in: bytes
+    int mode;                // in: DMA_BUF_COHERENT, DMA_BUF_CACHED or DMA_BUF_WC
+    void *addr;              // out: where the program sees it
+    unsigned int phy_addr;   // out: where the DMA sees it (for dma_tx_phys()/dma_rx_phys())
+    int id;                  // out: memalloc's number for it
+};
+
+/* Reserve, map and prefault n buffers of the given sizes and kinds in one call, e.g. for
+ * a worker process that wants all of its buffers ready when it starts. It does not need
+ * dma_init(). Either all of them are reserved, or none. The time it took is stored in
+ * *us, if us is not NULL. Returns: 0 on success; -1 on error
+ */
+int dma_buffers_reserve(struct dma_buffer *bufs, int n, double *us);
+
+/* Sync part of a buffer from dma_buffers_reserve() for the DMA (MEMALLOC_SYNC_FOR_DEVICE)
+ * or the CPU (MEMALLOC_SYNC_FOR_CPU). Only cached buffers need it.
+ * Returns: 0 on success; -1 on error
+ */
+int dma_buffer_sync(struct dma_buffer *buf, int offset, int size, int dir);
+
+/* Release the n buffers reserved together by dma_buffers_reserve() */
+void dma_buffers_release(struct dma_buffer *bufs, int n);
+
+/* A pool of DMA buffers (see note 13 above) */
+struct dma_pool;
+
+/* How full a pool is */
+struct dma_pool_stats {
+    int block_size[DMA_POOL_CLASSES];     // bytes per block, for each size class
+    int blocks_in_use[DMA_POOL_CLASSES];  // blocks acquired and not yet released
+    int slabs[DMA_POOL_CLASSES];          // slabs the class holds
+    int free_slabs, total_slabs;
+    long long bytes_in_use;               // in blocks (so after rounding up)
+    long long bytes_high_water;           // the most bytes_in_use has been
+    long long acquires, releases;
+    long long failures;                   // acquires that found the pool full
+};
+
+/* Reserve nregions memalloc buffers of region_size bytes each (rounded up to a multiple of
+ * DMA_POOL_SLAB_SIZE), of the given kind (DMA_BUF_COHERENT, DMA_BUF_CACHED or DMA_BUF_WC),
+ * for a pool. It does not need dma_init(). Returns: the pool, or NULL on error
+ */
+struct dma_pool *dma_pool_create(int nregions, int region_size, int mode);
+
+/* Get a block of at least "size" bytes (at most DMA_POOL_SLAB_SIZE), aligned to its
+ * rounded-up size up to a page, and its physical address (if phy_addr is not NULL). Safe
+ * to call from several threads. Returns: a pointer to the block, or NULL if the pool is full
+ */
+void *dma_pool_acquire(struct dma_pool *pool, int size, unsigned int *phy_addr);
+
+/* Give a block back to the pool. A pointer that is not a block in use (one released twice,
+ * say) is refused with an ERROR, and the pool is left as it was */
+void dma_pool_release(struct dma_pool *pool, void *block);
+
+/* Sync the first "size" bytes of a block for the DMA (MEMALLOC_SYNC_FOR_DEVICE, before
+ * sending it) or the CPU (MEMALLOC_SYNC_FOR_CPU, after receiving into it).
+ * Returns: 0 on success; -1 on error
+ */
+int dma_pool_sync(struct dma_pool *pool, void *block, int size, int dir);
+
+/* Get a pool's occupancy and counters */
+void dma_pool_stats(struct dma_pool *pool, struct dma_pool_stats *stats);
+
+/* Release the pool's regions (and with them any blocks still in use), and free it */
+void dma_pool_destroy(struct dma_pool *pool);
+
+/* Start capturing the S2MM stream into nslots slots (at least 3) of slot_size bytes each
+ * (see note 15). mode is DMA_BUF_COHERENT or DMA_BUF_CACHED.
+ * Returns: 0 on success; -1 on error
+ */
+int dma_capture_start(int nslots, int slot_size, int mode);
+
+/* A filled slot, from dma_capture_next() */
+struct dma_capture_block {
+    void *data;
+    int len;                     // bytes received into it
+    unsigned long long seq;      // slots filled before it since the capture started
+    long long lost;              // slots lost (overwritten before they were taken) just before it
+    int stalled;                 // the DMA had stopped for want of slots just before it, so
+                                 // the stream was held up there
+};
+
+/* Take the oldest filled slot, without waiting.
+ * Returns: 1 if there was one; 0 if not; -1 on error (the DMA has stopped)
+ */
+int dma_capture_next(struct dma_capture_block *b);
+
+/* The same, but wait up to timeout_ms milliseconds (-1: forever) for a slot to fill.
+ * Returns: 1 if there was one; 0 on timeout; -1 on error
+ */
+int dma_capture_wait(struct dma_capture_block *b, int timeout_ms);
+
+/* Give a slot back, once its data has been used. Slots must be released in order.
+ * Returns: 0 on success; -1 if the slot was overwritten while it was held, so its data
+ * cannot be trusted
+ */
+int dma_capture_release(struct dma_capture_block *b);
+
+/* The number of slots the capture thread has counted as filled since the capture started
+ * (a count kept by the driver, which lags the DMA by up to a poll). Reading it costs one
+ * load. */
+unsigned long long dma_capture_head();
+
+struct dma_capture_stats {
+    unsigned long long slots;    // slots filled
+    long long bytes;             // bytes received
+    long long lost;              // slots lost to overruns, including ones torn while held
+    long long stalls;            // times the DMA stopped because the capture thread fell behind
+    int pending;                 // filled slots not yet taken
+};
+void dma_capture_stats(struct dma_capture_stats *stats);
+
+/* Stop the DMA and the capture thread, and release the slots */
+void dma_capture_stop();
+
 /* Cleanup and unmap everything */
 void dma_cleanup();        
 
+/* Initialize the DMA in scatter-gather mode, with buffers of the given size (in bytes).
+ * The size only needs to be a multiple of the stream width (see note 14); it is not
+ * limited by MAX_DMA_LEN_BITS.
+ * Returns: 0 on success; -1 on error
+ */
+int dma_sg_init(int size);
+
+/* Kinds of memory for the Tx and Rx buffers (see note 11 above) */
+#define DMA_BUF_COHERENT  MEMALLOC_COHERENT       // uncached (the default)
+#define DMA_BUF_CACHED    MEMALLOC_CACHED         // cached, synced around each transfer
+#define DMA_BUF_WC        MEMALLOC_WRITECOMBINE   // write-combining; TxBuffer only
+
+/* The same as dma_init() and dma_sg_init(), with the given kinds of memory for the Tx
+ * and Rx buffers. Returns: 0 on success; -1 on error
+ */
+int dma_init_mode(int size, int tx_mode, int rx_mode);
+int dma_sg_init_mode(int size, int tx_mode, int rx_mode);
+
+/* Set up DMA to receive "size" bytes of data into start of RxBuffer, using a chain
+ * of descriptors. Returns: 0 on success; -1 on error
+ */
+int dma_sg_rx(int size);
+
+/* Set up DMA to send "size" bytes of data from start of TxBuffer, using a chain
+ * of descriptors. Returns: 0 on success; -1 on error
+ */
+int dma_sg_tx(int size);
+
+/* Blocks until the last descriptor of both the Tx and Rx chains is complete.
+ * Returns: 0 on success, -1 on error
+ */
+int dma_sg_sync();
+
+/* Wait for DMA completion with interrupts, through the given UIO devices for the MM2S and
+ * S2MM interrupts, instead of polling. Call this after initializing the DMA.
+ * Returns: 0 on success; -1 on error (and the driver keeps polling)
+ */
+int dma_irq_init(const char *mm2s_uio, const char *s2mm_uio);
+
+/* Handle for an asynchronous transfer */
+struct dma_xfer;
 
+/* Queue a transfer of "size" bytes from "offset" bytes into the TxBuffer (or into
+ * the RxBuffer, for dma_rx_async()).
+ * Returns: a handle for the transfer, or NULL on error
+ */
+struct dma_xfer *dma_tx_async(int offset, int size);
+struct dma_xfer *dma_rx_async(int offset, int size);
+
+/* Returns a file descriptor that becomes readable when the transfer is done.
+ * Only poll it; don't read it. It is closed by dma_xfer_free().
+ */
+int dma_xfer_fd(struct dma_xfer *x);
+
+/* Returns 0 if the transfer is still pending, 1 if it is done, -1 if it failed */
+int dma_xfer_status(struct dma_xfer *x);
+
+/* Block until the transfer is done, for at most timeout_ms (-1 to wait forever).
+ * Returns: 0 on success, -1 on error or timeout
+ */
+int dma_xfer_wait(struct dma_xfer *x, int timeout_ms);
+
+/* Block until any one of the n transfers is done.
+ * Returns: the index of a finished transfer, or -1 on timeout
+ */
+int dma_xfer_wait_any(struct dma_xfer **x, int n, int timeout_ms);
+
+/* Block until all n transfers are done. Returns: 0 on success, -1 on error or timeout */
+int dma_xfer_wait_all(struct dma_xfer **x, int n, int timeout_ms);
+
+/* Free a transfer handle. (It is safe to free a handle before the transfer is done.) */
+void dma_xfer_free(struct dma_xfer *x);
+
+/* Initialize the DMA with a ring of "nslots" Tx/Rx buffer pairs, each of the given size (in bytes).
+ * Use this instead of dma_init(). Returns: 0 on success; -1 on error
+ */
+int dma_ring_init(int nslots, int size);
+
+/* Return pointers to the Tx and Rx buffers of a ring slot */
+void* dma_ring_tx_buffer(int slot);
+void* dma_ring_rx_buffer(int slot);
+
+/* Returns the slot to fill next (the producer index), or -1 if all slots are in use */
+int dma_ring_produce();
+
+/* Submit the producer slot for a transfer of "size" bytes, and advance the producer index.
+ * The transfer starts as soon as the DMA has finished the previously submitted slots.
+ * Returns: 0 on success; -1 on error
+ */
+int dma_ring_submit(int size);
+
+/* Returns the slot to drain next (the consumer index) if its transfer is done, or -1 if not */
+int dma_ring_consume();
+
+/* Blocks until the consumer slot's transfer is done (or a timeout if DMA is stuck).
+ * Returns: the slot, or -1 on error
+ */
+int dma_ring_wait();
+
+/* Release the consumer slot so it can be filled again, and advance the consumer index */
+void dma_ring_release();
+
+/* Current producer and consumer slot indices, number of submitted slots not yet
+ * released, and whether the DMA is moving a slot right now
+ */
+int dma_ring_producer_index();
+int dma_ring_consumer_index();
+int dma_ring_pending();
+int dma_ring_in_flight();
+
+/* Register "size" bytes of application memory at addr for DMA.
+ * Returns: a region number, or -1 on error
+ */
+int dma_register(void *addr, int size);
+
+/* Register a dma-buf (e.g. from a video or GPU driver) of "size" bytes for DMA.
+ * Returns: a region number, or -1 on error
+ */
+int dma_register_dmabuf(int fd, int size);
+
+/* Returns a pointer the CPU can use to get at a region (for a dma-buf, the driver's
+ * mapping of it; NULL if it could not be mapped)
+ */
+void* dma_region_buffer(int region);
+
+/* Returns 1 if the DMA uses the region's memory in place, 0 if it goes through a bounce buffer */
+int dma_region_zero_copy(int region);
+
+/* Set up DMA to send "size" bytes from "offset" bytes into a region, or to receive
+ * them there. Received data is in the region once dma_sync() returns.
+ * Returns: 0 on success; -1 on error
+ */
+int dma_region_tx(int region, int offset, int size);
+int dma_region_rx(int region, int offset, int size);
+
+/* Unregister a region. (dma_cleanup() unregisters all of them.) */
+void dma_unregister(int region);
 
-// -----------------------------------------
-// Internal functions 
-static int check_size(int size); /* Checks transfer size is legal */
+/* Export the Tx or Rx buffer as a dma-buf, to share it with another process or driver
+ * (note 17). Close the fd when it has been handed on.
+ * Returns: the dma-buf's file descriptor, or -1 on error
+ */
+int dma_export_tx_buffer();
+int dma_export_rx_buffer();
+
+/* Results of dma_stream() */
+struct dma_stream_stats {
+    long long bytes;       // bytes streamed through the DMA
+    double seconds;        // time taken
+    double mb_per_s;       // achieved throughput, in MB/s (10^6 bytes per second)
+    int chunks;            // number of DMA transfers
+    int chunk_size;        // chunk size (bytes) that gave the best throughput
+};
+
+/* Stream everything from in_fd to its end through the DMA, writing what the DMA returns to
+ * out_fd. Every chunk comes back from the DMA with the same length it was sent with (as in
+ * a loopback, or an accelerator that maps each word to one word). Needs dma_ring_init();
+ * chunks are at most the ring's buffer size. stats may be NULL.
+ * Returns: 0 on success; -1 on error
+ */
+int dma_stream(int in_fd, int out_fd, struct dma_stream_stats *stats);
+
+/* The same as dma_stream(), but reading "len" bytes from memory (e.g. an mmap-ed file) */
+int dma_stream_mem(const void *in, long long len, int out_fd, struct dma_stream_stats *stats);
+
+
+// --------------------------------------------------------------------
+// One context per DMA, for designs with more than one. These behave like the
+// functions above of the same name.
+
+/* Everything the driver knows about one DMA */
+struct dma_ctx;
+
+/* Initialize the DMA whose control/status registers are at base_addr, in simple mode,
+ * in scatter-gather mode, or with a ring of buffers.
+ * Returns: a new context, or NULL on error
+ */
+struct dma_ctx *dma_ctx_init(unsigned int base_addr, int size);
+struct dma_ctx *dma_ctx_sg_init(unsigned int base_addr, int size);
+struct dma_ctx *dma_ctx_ring_init(unsigned int base_addr, int nslots, int size);
+struct dma_ctx *dma_ctx_init_mode(unsigned int base_addr, int size, int tx_mode, int rx_mode);
+struct dma_ctx *dma_ctx_sg_init_mode(unsigned int base_addr, int size, int tx_mode, int rx_mode);
+
+void* dma_ctx_tx_buffer(struct dma_ctx *ctx);
+void* dma_ctx_rx_buffer(struct dma_ctx *ctx);
+void dma_ctx_reset(struct dma_ctx *ctx);
+int dma_ctx_rx(struct dma_ctx *ctx, int size);
+int dma_ctx_tx(struct dma_ctx *ctx, int size);
+int dma_ctx_sync(struct dma_ctx *ctx);
+int dma_ctx_busy(struct dma_ctx *ctx);
+
+/* dma_ctx_rx() and dma_ctx_tx() "offset" bytes into the buffer, without checking the size
+ * or offset. Only for callers that have checked them already, like dma.hpp.
+ */
+int dma_ctx_start_rx(struct dma_ctx *ctx, int offset, int size);
+int dma_ctx_start_tx(struct dma_ctx *ctx, int offset, int size);
+int dma_ctx_rx_phys(struct dma_ctx *ctx, unsigned int phy_addr, int size);
+int dma_ctx_tx_phys(struct dma_ctx *ctx, unsigned int phy_addr, int size);
+int dma_ctx_set_stream(struct dma_ctx *ctx, int width, int dre);
+int dma_ctx_capture_start(struct dma_ctx *ctx, int nslots, int slot_size, int mode);
+int dma_ctx_capture_next(struct dma_ctx *ctx, struct dma_capture_block *b);
+int dma_ctx_capture_wait(struct dma_ctx *ctx, struct dma_capture_block *b, int timeout_ms);
+int dma_ctx_capture_release(struct dma_ctx *ctx, struct dma_capture_block *b);
+unsigned long long dma_ctx_capture_head(struct dma_ctx *ctx);
+void dma_ctx_capture_stats(struct dma_ctx *ctx, struct dma_capture_stats *stats);
+void dma_ctx_capture_stop(struct dma_ctx *ctx);
+void dma_ctx_wait_stats(struct dma_ctx *ctx, struct dma_wait_stats *stats);
+void dma_ctx_init_stats(struct dma_ctx *ctx, struct dma_init_stats *stats);
+int dma_ctx_batch(struct dma_ctx *ctx, const struct dma_batch_entry *e, int n, struct dma_batch_stats *stats);
+int dma_ctx_service_start(struct dma_ctx *ctx);
+int dma_ctx_submit(struct dma_ctx *ctx, struct dma_request *req);
+void dma_ctx_service_stats(struct dma_ctx *ctx, struct dma_service_stats *stats);
+void dma_ctx_service_stop(struct dma_ctx *ctx);
+int dma_ctx_sg_rx(struct dma_ctx *ctx, int size);
+int dma_ctx_sg_tx(struct dma_ctx *ctx, int size);
+int dma_ctx_sg_sync(struct dma_ctx *ctx);
+int dma_ctx_irq_init(struct dma_ctx *ctx, const char *mm2s_uio, const char *s2mm_uio);
+struct dma_xfer *dma_ctx_tx_async(struct dma_ctx *ctx, int offset, int size);
+struct dma_xfer *dma_ctx_rx_async(struct dma_ctx *ctx, int offset, int size);
+
+void* dma_ctx_ring_tx_buffer(struct dma_ctx *ctx, int slot);
+void* dma_ctx_ring_rx_buffer(struct dma_ctx *ctx, int slot);
+int dma_ctx_ring_produce(struct dma_ctx *ctx);
+int dma_ctx_ring_submit(struct dma_ctx *ctx, int size);
+int dma_ctx_ring_consume(struct dma_ctx *ctx);
+int dma_ctx_ring_wait(struct dma_ctx *ctx);
+void dma_ctx_ring_release(struct dma_ctx *ctx);
+int dma_ctx_ring_producer_index(struct dma_ctx *ctx);
+int dma_ctx_ring_consumer_index(struct dma_ctx *ctx);
+int dma_ctx_ring_pending(struct dma_ctx *ctx);
+int dma_ctx_ring_in_flight(struct dma_ctx *ctx);
+int dma_ctx_register(struct dma_ctx *ctx, void *addr, int size);
+int dma_ctx_register_dmabuf(struct dma_ctx *ctx, int fd, int size);
+void* dma_ctx_region_buffer(struct dma_ctx *ctx, int region);
+int dma_ctx_region_zero_copy(struct dma_ctx *ctx, int region);
+int dma_ctx_region_tx(struct dma_ctx *ctx, int region, int offset, int size);
+int dma_ctx_region_rx(struct dma_ctx *ctx, int region, int offset, int size);
+void dma_ctx_unregister(struct dma_ctx *ctx, int region);
+int dma_ctx_export_tx_buffer(struct dma_ctx *ctx);
+int dma_ctx_export_rx_buffer(struct dma_ctx *ctx);
+int dma_ctx_stream(struct dma_ctx *ctx, int in_fd, int out_fd, struct dma_stream_stats *stats);
+int dma_ctx_stream_mem(struct dma_ctx *ctx, const void *in, long long len, int out_fd,
+                       struct dma_stream_stats *stats);
+
+/* Release everything the context holds, and free it */
+void dma_ctx_cleanup(struct dma_ctx *ctx);
+
+
+// --------------------------------------------------------------------
+// Striping: several DMAs working on one pair of buffers at the same time
+
+/* A set of DMAs that split every transfer between them */
+struct dma_stripe;
+
+/* Initialize the n DMAs at base_addrs[0..n-1] with shared Tx and Rx buffers of the given
+ * size (in bytes). If sg is set, the DMAs use scatter-gather mode, so the size is not
+ * limited by MAX_DMA_LEN_BITS.
+ * Returns: a new stripe, or NULL on error
+ */
+struct dma_stripe *dma_stripe_init(const unsigned int *base_addrs, int n, int size, int sg);
 
-// Global variables for devices
-static int mem_fd;                 // file descriptor for /dev/mem
-static int memalloc_dev_fd;       // file descriptor for /dev/dmabuffer
-volatile int *dma_cfg_base; // Pointer to base address of DMA control/status regs
+/* Return pointers to the shared Tx and Rx buffers */
+void* dma_stripe_tx_buffer(struct dma_stripe *s);
+void* dma_stripe_rx_buffer(struct dma_stripe *s);
 
-// Global variables for dma
-/* static void *dmabuffer;      // Pointer to base address of dmabuffer */
-static void *txbase;         // Pointer to tx buffer base address (== dmabuffer)
-static void *rxbase;         // Pointer to rx buffer base address (== dmabuffer + DMABUFFER_LEN/2)
+/* Reset every DMA in the stripe */
+void dma_stripe_reset(struct dma_stripe *s);
+
+/* Split a transfer of "size" bytes from the start of the buffers into one slice per DMA
+ * (each a multiple of the widest DMA's stream width; the last DMA takes what is left),
+ * and start every DMA on its slice. Returns: 0 on success; -1 on error
+ */
+int dma_stripe_rx(struct dma_stripe *s, int size);
+int dma_stripe_tx(struct dma_stripe *s, int size);
+
+/* Blocks until every DMA in the stripe is done. Returns: 0 on success, -1 on error */
+int dma_stripe_sync(struct dma_stripe *s);
+
+/* The context of the i-th DMA, e.g. to call dma_ctx_irq_init() on it */
+struct dma_ctx *dma_stripe_ctx(struct dma_stripe *s, int i);
+
+/* Release everything the stripe holds, and free it */
+void dma_stripe_cleanup(struct dma_stripe *s);
+
+
+// --------------------------------------------------------------------
+// Multichannel DMA: an AXI MCDMA, with a queue of transfers per channel (note 16)
+
+/* An MCDMA, its channels' buffers, and their queues */
+struct dma_mc;
+
+/* Which way a transfer went */
+#define DMA_MC_TX 0
+#define DMA_MC_RX 1
+
+/* A finished transfer */
+struct dma_mc_completion {
+    int channel;
+    int dir;               // DMA_MC_TX or DMA_MC_RX
+    int offset;            // where it was in the channel's buffer...
+    int len;               // ...and how many bytes were moved
+    int tdest;             // Rx: the TDEST the packet arrived with
+    int status;            // 0, or -1 if the DMA reported an error on this transfer
+};
+
+/* Initialize the MCDMA at base_addr with nchannels channels each way (as many as it was
+ * configured with in Vivado), and a Tx and an Rx buffer of the given size (in bytes)
+ * for each channel.
+ * Returns: a new MCDMA, or NULL on error
+ */
+struct dma_mc *dma_mc_init(unsigned int base_addr, int nchannels, int size);
+
+/* Return pointers to channel ch's Tx and Rx buffers */
+void* dma_mc_tx_buffer(struct dma_mc *mc, int ch);
+void* dma_mc_rx_buffer(struct dma_mc *mc, int ch);
+
+/* Queue a packet of "size" bytes from "offset" bytes into channel ch's Tx buffer, to be
+ * sent with the given TDEST; or queue "size" bytes from "offset" into its Rx buffer, for
+ * the next packet that arrives with TDEST ch. Each channel's transfers finish in order.
+ * Returns: 0 on success; -1 on error (including a full queue)
+ */
+int dma_mc_tx(struct dma_mc *mc, int ch, int offset, int size, int tdest);
+int dma_mc_rx(struct dma_mc *mc, int ch, int offset, int size);
+
+/* Transfers queued on channel ch in direction dir that have not been handed back yet */
+int dma_mc_pending(struct dma_mc *mc, int ch, int dir);
+
+/* Hand back up to max finished transfers, taking one from each channel in turn (starting
+ * after the channel the last call stopped at) until there are no more or c is full.
+ * dma_mc_wait() blocks until there is at least one, or timeout_ms passes (-1: forever).
+ * Returns: the number of transfers in c; -1 on error
+ */
+int dma_mc_poll(struct dma_mc *mc, struct dma_mc_completion *c, int max);
+int dma_mc_wait(struct dma_mc *mc, struct dma_mc_completion *c, int max, int timeout_ms);
+
+/* Block until the oldest transfer queued on channel ch in direction dir is finished, and
+ * hand it back in c. The other channels keep going meanwhile.
+ * Returns: 1 when it is; 0 on a timeout; -1 on error
+ */
+int dma_mc_channel_wait(struct dma_mc *mc, int ch, int dir, struct dma_mc_completion *c, int timeout_ms);
 
-int tx_buffer_id;
-int rx_buffer_id;
-static unsigned int tx_phy_addr;
-static unsigned int rx_phy_addr;
+/* Reset the MCDMA, dropping everything queued, and start it again */
+void dma_mc_reset(struct dma_mc *mc);
 
+/* Release everything the MCDMA holds, and free it */
+void dma_mc_cleanup(struct dma_mc *mc);
 
+#ifdef __cplusplus
+}
+#endif
+#endif /* DMA_H */
@@ -0,0 +1,305 @@
+/*
+    C++ interface to the simple DMA driver for PetaLinux
+
+    From "Getting Started with the Xilinx Zynq FPGA and Vivado"
+    by Peter Milder (peter.milder@stonybrook.edu)
+
+    Copyright (C) 2018 Peter Milder
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// This header wraps the dma_ctx_*() functions of dma.h for C++ (C++20, for std::span).
+// There is nothing to build: include it, and compile dma.c (as C) into your program
+// as usual.
+//
+//    - dma::engine<Base, LenBits, Width, Dre> is one DMA, in simple mode. Its template
+//      parameters are the hardware configuration from Vivado: the base address of its
+//      registers, the width of its buffer length register, the width of its streams in
+//      bytes, and whether unaligned transfers (the Data Realignment Engine) are allowed.
+//      The Tx and Rx buffers are released when it is destroyed.
+//    - engine.tx<T>() and engine.rx<T>() are std::span<T> views of the buffers.
+//    - engine.start(src, dst) sends src (part of the Tx buffer) and receives dst (part
+//      of the Rx buffer). If both spans have a static extent, the size is checked at
+//      compile time, and dma.c does not check it again. It returns a dma::transfer;
+//      wait() on it, or it waits when it goes out of scope.
+//    - engine.add(memory) registers the program's own memory (see note 9 in dma.h)
+//      and returns a dma::region, which unregisters it when it is destroyed.
+//
+// Errors are thrown as dma::error. The driver prints the details, as usual.
+//
+// For example:
+//    dma::engine<0x40400000, 14> d(4096);        // 4096-byte Tx and Rx buffers
+//    auto tx = d.tx<int>();
+//    auto rx = d.rx<int>();
+//    std::iota(tx.begin(), tx.end(), 0);
+//    d.start(tx.first<16>(), rx.first<16>()).wait();
+
+#ifndef DMA_HPP
+#define DMA_HPP
+
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "dma.h"
+
+namespace dma {
+
+class error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Kinds of memory for the Tx and Rx buffers (see note 11 in dma.h)
+enum class mode {
+    coherent = DMA_BUF_COHERENT,
+    cached = DMA_BUF_CACHED,
+    write_combining = DMA_BUF_WC
+};
+
+// What the DMA can move in one simple-mode transfer: a multiple of the stream width (or,
+// with the DRE, any number of bytes), below 2^LenBits bytes
+template <int LenBits, std::size_t Width, bool Dre = false>
+struct limits {
+    static_assert(LenBits >= 8 && LenBits <= 26, "the AXI DMA's length register is 8 to 26 bits wide");
+    static_assert(Width >= 4 && Width <= 128 && (Width & (Width - 1)) == 0,
+                  "the stream width must be a power of 2 from 4 to 128 bytes");
+    static_assert(!Dre || Width <= 8, "the AXI DMA only offers the DRE on streams of up to 64 bits");
+
+    // Transfers are a multiple of this many bytes, starting on a multiple of it
+    static constexpr std::size_t unit = Dre ? 1 : Width;
+    static constexpr std::size_t max_bytes = ((std::size_t(1) << LenBits) - 1) / unit * unit;
+
+    static constexpr bool legal(std::size_t bytes) {
+        return bytes >= unit && bytes <= max_bytes && bytes % unit == 0;
+    }
+};
+
+// A transfer that has been started. Destroying it waits for it to finish.
+class transfer {
+public:
+    transfer(transfer &&o) noexcept : ctx_(std::exchange(o.ctx_, nullptr)) {}
+    transfer &operator=(transfer &&o) noexcept {
+        if (this != &o) {
+            finish();
+            ctx_ = std::exchange(o.ctx_, nullptr);
+        }
+        return *this;
+    }
+    transfer(const transfer &) = delete;
+    transfer &operator=(const transfer &) = delete;
+    ~transfer() { finish(); }
+
+    // Block until the DMA is done (both channels)
+    void wait() {
+        if (ctx_ && dma_ctx_sync(std::exchange(ctx_, nullptr)))
+            throw error("DMA transfer failed");
+    }
+
+    // True once the DMA is done, without waiting. Call wait() afterwards all the same:
+    // it makes received data visible to the CPU.
+    bool done() const { return ctx_ == nullptr || !dma_ctx_busy(ctx_); }
+
+private:
+    template <unsigned int, int, std::size_t, bool> friend class engine;
+    friend class region;
+    explicit transfer(struct dma_ctx *ctx) : ctx_(ctx) {}
+
+    void finish() noexcept {
+        if (ctx_)
+            dma_ctx_sync(std::exchange(ctx_, nullptr));
+    }
+
+    struct dma_ctx *ctx_;
+};
+
+// The program's own memory, registered with a DMA. Destroying it unregisters it.
+class region {
+public:
+    region(region &&o) noexcept
+        : ctx_(std::exchange(o.ctx_, nullptr)), id_(o.id_), base_(o.base_), size_(o.size_) {}
+    region &operator=(region &&o) noexcept {
+        if (this != &o) {
+            release();
+            ctx_ = std::exchange(o.ctx_, nullptr);
+            id_ = o.id_;
+            base_ = o.base_;
+            size_ = o.size_;
+        }
+        return *this;
+    }
+    region(const region &) = delete;
+    region &operator=(const region &) = delete;
+    ~region() { release(); }
+
+    // True if the DMA uses the memory in place; false if it goes through a bounce buffer
+    bool zero_copy() const { return dma_ctx_region_zero_copy(ctx_, id_); }
+
+    // Send part of the region, or receive into part of it
+    template <class T, std::size_t N>
+    [[nodiscard]] transfer send(std::span<T, N> part) {
+        if (dma_ctx_region_tx(ctx_, id_, offset(part), (int)part.size_bytes()))
+            throw error("DMA region transmit failed");
+        return transfer(ctx_);
+    }
+
+    template <class T, std::size_t N>
+    [[nodiscard]] transfer receive(std::span<T, N> part) {
+        static_assert(!std::is_const_v<T>, "cannot receive into const memory");
+        if (dma_ctx_region_rx(ctx_, id_, offset(part), (int)part.size_bytes()))
+            throw error("DMA region receive failed");
+        return transfer(ctx_);
+    }
+
+private:
+    template <unsigned int, int, std::size_t, bool> friend class engine;
+    region(struct dma_ctx *ctx, int id, const void *base, std::size_t size)
+        : ctx_(ctx), id_(id), base_(static_cast<const std::byte *>(base)), size_(size) {}
+
+    template <class T, std::size_t N>
+    int offset(std::span<T, N> part) const {
+        auto p = reinterpret_cast<const std::byte *>(part.data());
+        if (p < base_ || p + part.size_bytes() > base_ + size_)
+            throw error("span is not inside the DMA region");
+        return (int)(p - base_);
+    }
+
+    void release() noexcept {
+        if (ctx_)
+            dma_ctx_unregister(std::exchange(ctx_, nullptr), id_);
+    }
+
+    struct dma_ctx *ctx_;
+    int id_;
+    const std::byte *base_;
+    std::size_t size_;
+};
+
+// One DMA, in simple mode, with its own Tx and Rx buffers
+template <unsigned int Base = DMA_BASE, int LenBits = MAX_DMA_LEN_BITS, std::size_t Width = DMA_DATA_WIDTH,
+          bool Dre = (DMA_DRE != 0)>
+class engine {
+public:
+    using limits = dma::limits<LenBits, Width, Dre>;
+    static constexpr unsigned int base = Base;
+
+    // Open the DMA, with Tx and Rx buffers of "bytes" bytes each. The buffers are a whole
+    // number of stream beats, even with the DRE.
+    explicit engine(std::size_t bytes, mode tx_mode = mode::coherent, mode rx_mode = mode::coherent)
+        : ctx_(nullptr), size_(bytes) {
+        if (bytes > limits::max_bytes || bytes < Width || bytes % Width != 0)
+            throw error("DMA buffer size " + std::to_string(bytes) + " is not a legal transfer size");
+        ctx_ = dma_ctx_init_mode(Base, (int)bytes, (int)tx_mode, (int)rx_mode);
+        if (ctx_ == nullptr)
+            throw error("DMA initialization failed");
+        if (dma_ctx_set_stream(ctx_, (int)Width, Dre)) {
+            release();
+            throw error("DMA stream configuration failed");
+        }
+        dma_ctx_reset(ctx_);
+    }
+
+    engine(engine &&o) noexcept : ctx_(std::exchange(o.ctx_, nullptr)), size_(o.size_) {}
+    engine &operator=(engine &&o) noexcept {
+        if (this != &o) {
+            release();
+            ctx_ = std::exchange(o.ctx_, nullptr);
+            size_ = o.size_;
+        }
+        return *this;
+    }
+    engine(const engine &) = delete;
+    engine &operator=(const engine &) = delete;
+    ~engine() { release(); }
+
+    // The Tx and Rx buffers, as arrays of T
+    template <class T>
+    std::span<T> tx() { return buffer<T>(dma_ctx_tx_buffer(ctx_)); }
+
+    template <class T>
+    std::span<T> rx() { return buffer<T>(dma_ctx_rx_buffer(ctx_)); }
+
+    // Send src (part of the Tx buffer) and receive the same number of bytes into dst (part
+    // of the Rx buffer). With static extents, the size is checked at compile time.
+    template <class S, std::size_t N, class D, std::size_t M>
+    [[nodiscard]] transfer start(std::span<S, N> src, std::span<D, M> dst) {
+        static_assert(!std::is_const_v<D>, "cannot receive into const memory");
+        if constexpr (N != std::dynamic_extent && M != std::dynamic_extent) {
+            static_assert(N * sizeof(S) == M * sizeof(D), "Tx and Rx sizes differ");
+            static_assert(limits::legal(N * sizeof(S)), "illegal DMA transfer size for this configuration");
+        } else if (src.size_bytes() != dst.size_bytes() || !limits::legal(src.size_bytes())) {
+            throw error("illegal DMA transfer size " + std::to_string(src.size_bytes()));
+        }
+
+        int bytes = (int)src.size_bytes();
+        if (dma_ctx_start_rx(ctx_, offset(dst, dma_ctx_rx_buffer(ctx_)), bytes) ||
+            dma_ctx_start_tx(ctx_, offset(src, dma_ctx_tx_buffer(ctx_)), bytes))
+            throw error("DMA start failed");
+        return transfer(ctx_);
+    }
+
+    // Register the program's own memory with this DMA
+    template <class T, std::size_t N>
+    region add(std::span<T, N> memory) {
+        int id = dma_ctx_register(ctx_, (void *)memory.data(), (int)memory.size_bytes());
+        if (id < 0)
+            throw error("DMA region registration failed");
+        return region(ctx_, id, memory.data(), memory.size_bytes());
+    }
+
+    // Wait for interrupts through UIO, instead of polling (see note 7 in dma.h)
+    void irq(const char *mm2s_uio, const char *s2mm_uio) {
+        if (dma_ctx_irq_init(ctx_, mm2s_uio, s2mm_uio))
+            throw error("DMA interrupt setup failed");
+    }
+
+    void reset() { dma_ctx_reset(ctx_); }
+    bool busy() { return dma_ctx_busy(ctx_); }
+
+    // The C context, for anything this class does not wrap
+    struct dma_ctx *ctx() { return ctx_; }
+
+private:
+    template <class T>
+    std::span<T> buffer(void *p) {
+        static_assert(std::is_trivially_copyable_v<T>, "DMA buffers hold plain data");
+        return std::span<T>(static_cast<T *>(p), size_ / sizeof(T));
+    }
+
+    // Where a span starts in a buffer. It must lie inside, on a stream-width boundary
+    // (anywhere, with the DRE).
+    template <class T, std::size_t N>
+    int offset(std::span<T, N> s, void *buf) const {
+        auto p = reinterpret_cast<const std::byte *>(s.data());
+        auto b = static_cast<const std::byte *>(buf);
+        if (p < b || p + s.size_bytes() > b + size_ || (p - b) % limits::unit != 0)
+            throw error("span is not (aligned) inside the DMA buffer");
+        return (int)(p - b);
+    }
+
+    void release() noexcept {
+        if (ctx_)
+            dma_ctx_cleanup(std::exchange(ctx_, nullptr));
+    }
+
+    struct dma_ctx *ctx_;
+    std::size_t size_;
+};
+
+} // namespace dma
+
+#endif /* DMA_HPP */
@@ -0,0 +1,1058 @@
+/*
+    Software model of the AXI DMA, for testing the PetaLinux DMA driver without a board
+
+    From "Getting Started with the Xilinx Zynq FPGA and Vivado"
+    by Peter Milder (peter.milder@stonybrook.edu)
+
+    Copyright (C) 2018 Peter Milder
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// How the model works:
+//    - Each modelled DMA has its own register window, in shared memory (a memfd), just
+//      like the /dev/mem mapping of the real registers. Buffers are memfds too. The driver reads it directly, and
+//      writes go through dma_model_write(), so the model can react to them.
+//    - Writing the LEN register (simple mode) or the TAILDESC register (scatter-gather
+//      mode) of a running channel starts a transfer. As in hardware, a channel that has
+//      gone idle at its tail descriptor carries on from the next one when TAILDESC is
+//      written again (unless CURDESC was written in between).
+//    - The model thread moves data from memory into a small FIFO (MM2S), and from the
+//      FIFO back into memory (S2MM), a few bytes at a time. The end of each MM2S
+//      transfer (or descriptor with TXEOF set) is treated as TLAST.
+//    - In scatter-gather mode, the model reads descriptors from memory and writes their
+//      status words back, just like the hardware.
+//    - Interrupts are delivered through an eventfd per channel, which behaves like a
+//      UIO device: it is signalled when the channel's interrupt output is asserted and
+//      enabled, and is then disabled until re-enabled. As in hardware, the interrupt
+//      output stays asserted until the driver clears the status bits.
+//    - Several DMAs can be open at once (one per dma_model_open() call). They share the
+//      buffers and the model thread, which steps each of them in turn.
+//    - By default data moves as fast as the model thread can copy it. With
+//      dma_model_configure() (or the DMA_MODEL_* environment variables) each channel
+//      instead waits a setup latency (plus random jitter) after it is started, and then
+//      moves data at a fixed bandwidth. A transform can be applied to the stream
+//      between MM2S and S2MM, to stand in for an accelerator instead of a loopback.
+//    - A source (config.source_mbps) can feed the S2MM stream in place of MM2S, like a
+//      sensor: from the time S2MM is first given a buffer it produces 32-bit counting words at a
+//      fixed rate, and words that find the FIFO full are lost.
+//    - A modelled DMA can be turned into an MCDMA (dma_model_mcdma()). Packets then go
+//      straight from an MM2S channel's buffers to those of the S2MM channel their TDEST
+//      picks, without the FIFO.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include "dma.h"
+
+#define MODEL_STEP       256     // bytes moved per channel per step
+#define MODEL_MAX_EOFS   64      // packet boundaries that can be in the FIFO at once
+
+// Bits in the status register that only the model needs
+#define DMA_DEC_ERR      (1<<6)
+#define DMA_SG_INT_ERR   (1<<8)
+#define DMA_SG_DEC_ERR   (1<<10)
+#define DESC_INT_ERR     (1u<<28)  // DMAIntErr, in a descriptor's status word
+
+// Register offsets relative to the start of each channel's registers
+#define CH_CNTL          0x00
+#define CH_STATUS        0x04
+#define CH_CURDESC       0x08
+#define CH_TAILDESC      0x10
+#define CH_ADDR          0x18
+#define CH_LEN           0x28
+
+struct model_buffer {
+    void *base;
+    unsigned int phy_addr;
+    int size;
+    int external;         // imported application memory; the model did not allocate it
+    int fd;               // memfd behind the buffer (if the model allocated it)
+};
+
+struct model_dma;
+
+struct model_chan {
+    struct model_dma *dma; // the DMA this channel belongs to
+    int base;             // offset of this channel's registers (0x00 or 0x30)
+    int is_mm2s;
+    int active;           // a transfer is in progress
+    int sg;               // the transfer uses descriptors
+    unsigned int addr;    // physical address of the current buffer
+    int len;              // length of the current buffer
+    int done;             // bytes of the current buffer moved so far
+    unsigned int desc;    // physical address of the current descriptor
+    unsigned int tail;    // physical address of the tail descriptor
+    int at_tail;          // it went idle after finishing the tail descriptor (at CURDESC)
+    int sof;              // S2MM: next byte is the start of a packet
+    int uio_fd;           // fake UIO device for this channel's interrupt, or -1
+    int uio_enabled;      // the fake UIO device will pass on the next interrupt
+    long long ready;      // time (ns) the channel can start moving data, after its setup latency
+    long long moved;      // bytes moved since then
+};
+
+// A channel of a modelled MCDMA
+struct model_mc_chan {
+    int active;           // it has descriptors to work through, up to its tail
+    unsigned int desc;    // physical address of the current descriptor
+    volatile struct dma_mc_desc *d;   // the current descriptor, once fetched
+    int done;             // bytes of the current descriptor's buffer moved so far
+};
+
+// One modelled DMA
+struct model_dma {
+    int in_use;
+    unsigned int base_addr;       // the address the driver asked for (only used to tell DMAs apart)
+    volatile int *regs;           // register window, mapped from regs_fd
+    int regs_fd;
+    struct model_chan mm2s, s2mm;
+
+    // The stream between MM2S and S2MM
+    unsigned char fifo[DMA_MODEL_FIFO_LEN];
+    long long fifo_in, fifo_out;          // total bytes written to / read from the FIFO
+    long long eofs[MODEL_MAX_EOFS];       // value of fifo_in at the end of each packet
+    int eof_head, eof_count;
+
+    // The source, if there is one
+    long long source_start;               // when S2MM was started (ns); 0: not started
+    long long source_words;               // words produced since then, kept or lost
+
+    // An MCDMA has these in place of the two channels and the FIFO
+    int mc_channels;                      // 0: this is an AXI DMA
+    struct model_mc_chan mc[2][DMA_MC_MAX_CHANNELS];   // [DMA_MC_TX or DMA_MC_RX][channel]
+    int mc_next;                          // MM2S channel whose turn is next
+    int mc_cur;                           // MM2S channel partway through a packet, or -1
+};
+
+static struct model_dma dmas[DMA_MODEL_MAX_INSTANCES];
+static int open_count;                    // number of DMAs open
+static struct model_buffer *buffers;     // by ID; grows as needed, like memalloc's table
+static int nbuffers;
+static unsigned int next_phy_addr;
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake;
+static int running;
+
+// Timing and stream model
+static struct dma_model_config config;
+static int configured;                     // dma_model_configure() was called
+static unsigned int jitter_seed = 1;
+static long long next_event;               // earliest time (ns) a waiting channel can move data
+
+#define reg(c, off) (c)->dma->regs[((c)->base + (off))/4]
+#define mc_reg(m, dir, off) (m)->regs[(((dir) == DMA_MC_RX ? DMA_MC_S2MM : 0) + (off))/4]
+#define mc_ch_reg(m, dir, ch, off) mc_reg(m, dir, DMA_MC_CH_REG(ch) + (off))
+
+// Translate a model "physical" address range back into a host pointer.
+// Returns NULL if the range is not inside one buffer, like a decode error on the bus.
+static void *phys_to_virt(unsigned int addr, int len) {
+    for (int i=0; i<nbuffers; i++) {
+        struct model_buffer *b = &buffers[i];
+        if (b->base && addr >= b->phy_addr && addr + len <= b->phy_addr + b->size)
+            return (char*)b->base + (addr - b->phy_addr);
+    }
+    return NULL;
+}
+
+static void config_from_env();
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// A channel has been started: it can move data once its setup latency has passed
+static void chan_start(struct model_chan *c) {
+    long long latency = config.setup_us * 1000;
+    if (config.jitter_us > 0)
+        latency += (long long)(config.jitter_us * 1000 * (rand_r(&jitter_seed) / (RAND_MAX + 1.0)));
+    c->ready = now_ns() + latency;
+    c->moved = 0;
+}
+
+// Limit n, the number of bytes a channel wants to move, to what the bandwidth model
+// allows by now. Data moves in whole words, except for the end of a buffer ("rest"
+// bytes). If the channel has to wait, remember when it can carry on.
+static int chan_budget(struct model_chan *c, int n, int rest) {
+    if (config.bandwidth_mbps <= 0 && config.setup_us <= 0 && config.jitter_us <= 0)
+        return n;
+
+    long long t = now_ns();
+    long long allowed = n;
+    if (t < c->ready) {
+        allowed = 0;
+    } else if (config.bandwidth_mbps > 0) {
+        // MB/s is bytes per microsecond, so bandwidth/1000 is bytes per nanosecond
+        allowed = (long long)((t - c->ready) * config.bandwidth_mbps / 1000) - c->moved;
+    }
+
+    if (allowed < n)
+        n = (allowed < 0) ? 0 : (int)allowed;
+    if (n < rest)
+        n &= ~0x3;
+
+    if (n == 0) {
+        long long want = (rest < 4) ? rest : 4;
+        long long when = c->ready;
+        if (config.bandwidth_mbps > 0)
+            when += (long long)((c->moved + want) * 1000 / config.bandwidth_mbps);
+        if (when <= t)
+            when = t + 1;
+        if (next_event == 0 || when < next_event)
+            next_event = when;
+    }
+    return n;
+}
+
+// If the channel's interrupt output is asserted, pass it on through the fake UIO device
+static void raise_irq(struct model_chan *c) {
+    if (c->uio_fd < 0 || !c->uio_enabled || !(reg(c, CH_STATUS) & DMA_IRQ_MASK))
+        return;
+
+    uint64_t one = 1;
+    if (write(c->uio_fd, &one, sizeof(one)) == sizeof(one))
+        c->uio_enabled = 0;
+}
+
+// Stop a channel because of an error
+static void chan_error(struct model_chan *c, int err) {
+    c->active = 0;
+    reg(c, CH_STATUS) = (reg(c, CH_STATUS) & ~DMA_IDLE) | DMA_HALTED | err;
+    if (reg(c, CH_CNTL) & DMA_ERR_IRQ_EN)
+        reg(c, CH_STATUS) |= DMA_ERR_IRQ;
+    raise_irq(c);
+}
+
+// The current transfer on a channel is finished
+static void chan_idle(struct model_chan *c) {
+    c->active = 0;
+    reg(c, CH_STATUS) |= DMA_IDLE;
+    if (reg(c, CH_CNTL) & DMA_IOC_IRQ_EN)
+        reg(c, CH_STATUS) |= DMA_IOC_IRQ;
+    raise_irq(c);
+}
+
+// Fetch the descriptor at c->desc and set up its buffer.
+// Returns: the descriptor, or NULL on error
+static volatile struct dma_sg_desc *load_desc(struct model_chan *c) {
+    volatile struct dma_sg_desc *d = phys_to_virt(c->desc, DMA_SG_DESC_SIZE);
+    if (d == NULL) {
+        chan_error(c, DMA_SG_DEC_ERR);
+        return NULL;
+    }
+
+    // The hardware refuses to process a descriptor that is already complete
+    if (d->status & DMA_SG_CMPLT) {
+        chan_error(c, DMA_SG_INT_ERR);
+        return NULL;
+    }
+
+    reg(c, CH_CURDESC) = c->desc;
+    c->addr = d->buffer_addr;
+    c->len = d->control & DMA_SG_LEN_MASK;
+    c->done = 0;
+    return d;
+}
+
+// Finish the current buffer. In scatter-gather mode write back the descriptor status
+// and move on to the next descriptor, unless this was the tail.
+static void finish_buffer(struct model_chan *c, int eop) {
+    if (!c->sg) {
+        if (!c->is_mm2s)
+            reg(c, CH_LEN) = c->done;   // S2MM reports the number of bytes received
+        chan_idle(c);
+        return;
+    }
+
+    volatile struct dma_sg_desc *d = phys_to_virt(c->desc, DMA_SG_DESC_SIZE);
+    unsigned int status = c->done | DMA_SG_CMPLT;
+    if (!c->is_mm2s) {
+        if (c->sof)
+            status |= DMA_SG_RXSOF;
+        if (eop)
+            status |= DMA_SG_RXEOF;
+        c->sof = eop;
+    }
+    __atomic_store_n(&d->status, status, __ATOMIC_RELEASE);
+
+    // With the default interrupt threshold of 1, every descriptor interrupts
+    if (reg(c, CH_CNTL) & DMA_IOC_IRQ_EN) {
+        reg(c, CH_STATUS) |= DMA_IOC_IRQ;
+        raise_irq(c);
+    }
+
+    if (c->desc == c->tail) {
+        c->at_tail = 1;
+        chan_idle(c);
+        return;
+    }
+    c->desc = d->next_desc;
+    load_desc(c);
+}
+
+// Move some data from memory into the FIFO.
+// Returns: number of bytes moved
+static int step_mm2s(struct model_dma *m) {
+    struct model_chan *c = &m->mm2s;
+    if (!c->active)
+        return 0;
+
+    int rest = c->len - c->done;
+    int n = rest;
+    int space = DMA_MODEL_FIFO_LEN - (int)(m->fifo_in - m->fifo_out);
+    if (n > space)
+        n = space;
+    if (n > MODEL_STEP)
+        n = MODEL_STEP;
+    if (n == 0 && c->len != 0)
+        return 0;
+    if (n > 0 && m->eof_count == MODEL_MAX_EOFS)
+        return 0;
+    if (n > 0 && (n = chan_budget(c, n, rest)) == 0)
+        return 0;
+
+    unsigned char *src = phys_to_virt(c->addr + c->done, n);
+    if (src == NULL) {
+        chan_error(c, DMA_DEC_ERR);
+        return 0;
+    }
+
+    // The transform works on a copy, so the source buffer is left alone
+    unsigned char data[MODEL_STEP];
+    memcpy(data, src, n);
+    if (config.transform && n > 0)
+        config.transform(data, n, config.transform_arg);
+
+    for (int i=0; i<n; i++)
+        m->fifo[(m->fifo_in + i) % DMA_MODEL_FIFO_LEN] = data[i];
+    m->fifo_in += n;
+    c->done += n;
+    c->moved += n;
+
+    if (c->done == c->len) {
+        int eop = !c->sg;
+        if (c->sg) {
+            volatile struct dma_sg_desc *d = phys_to_virt(c->desc, DMA_SG_DESC_SIZE);
+            eop = (d->control & DMA_SG_TXEOF) != 0;
+        }
+        if (eop) {
+            m->eofs[(m->eof_head + m->eof_count) % MODEL_MAX_EOFS] = m->fifo_in;
+            m->eof_count++;
+        }
+        finish_buffer(c, eop);
+    }
+    return n > 0 ? n : 1;
+}
+
+// Move some data from the FIFO into memory.
+// Returns: number of bytes moved
+static int step_s2mm(struct model_dma *m) {
+    struct model_chan *c = &m->s2mm;
+    if (!c->active)
+        return 0;
+
+    int n = c->len - c->done;
+    if (n > m->fifo_in - m->fifo_out)
+        n = m->fifo_in - m->fifo_out;
+    if (m->eof_count && n > m->eofs[m->eof_head] - m->fifo_out)
+        n = m->eofs[m->eof_head] - m->fifo_out;
+    if (n > MODEL_STEP)
+        n = MODEL_STEP;
+    if (n > 0)
+        n = chan_budget(c, n, n);
+
+    int at_eof = m->eof_count && m->fifo_out + n == m->eofs[m->eof_head];
+    if (n == 0 && !at_eof)
+        return 0;
+
+    unsigned char *dst = phys_to_virt(c->addr + c->done, n);
+    if (dst == NULL) {
+        chan_error(c, DMA_DEC_ERR);
+        return 0;
+    }
+    for (int i=0; i<n; i++)
+        dst[i] = m->fifo[(m->fifo_out + i) % DMA_MODEL_FIFO_LEN];
+    m->fifo_out += n;
+    c->done += n;
+    c->moved += n;
+
+    if (at_eof) {
+        m->eof_head = (m->eof_head + 1) % MODEL_MAX_EOFS;
+        m->eof_count--;
+    }
+    if (at_eof || c->done == c->len)
+        finish_buffer(c, at_eof);
+    return n > 0 ? n : 1;
+}
+
+// Produce the source's words that are due by now. Each is the number of words produced
+// before it, so a gap in the numbers shows where words were lost.
+// Returns: number of bytes produced (kept or lost)
+static int step_source(struct model_dma *m) {
+    struct model_chan *c = &m->s2mm;
+    if (config.source_mbps <= 0 || !(reg(c, CH_CNTL) & DMA_START)) {
+        m->source_start = 0;
+        return 0;
+    }
+
+    long long t = now_ns();
+    if (m->source_start == 0) {
+        if (!c->active)
+            return 0;   // not until S2MM has somewhere to put the words
+        m->source_start = t;
+        m->source_words = 0;
+    }
+
+    // MB/s is bytes per microsecond, so source_mbps/1000 is bytes per nanosecond. The words
+    // come a step at a time, so the model thread can sleep in between.
+    long long due = (long long)((t - m->source_start) * config.source_mbps / 1000) / 4 - m->source_words;
+    if (due < MODEL_STEP/4) {
+        long long when = m->source_start + (long long)((m->source_words + MODEL_STEP/4) * 4000 / config.source_mbps);
+        if (next_event == 0 || when < next_event)
+            next_event = when;
+        return 0;
+    }
+    due = MODEL_STEP/4;
+
+    for (int i=0; i<due; i++) {
+        uint32_t word = (uint32_t)m->source_words++;
+        if (DMA_MODEL_FIFO_LEN - (m->fifo_in - m->fifo_out) < 4)
+            continue;   // lost
+        for (int k=0; k<4; k++)
+            m->fifo[(m->fifo_in + k) % DMA_MODEL_FIFO_LEN] = (unsigned char)(word >> (8*k));
+        m->fifo_in += 4;
+    }
+    return due*4;
+}
+
+// Stop an MCDMA channel because of an error
+static void mc_error(struct model_dma *m, int dir, int ch, int err) {
+    m->mc[dir][ch].active = 0;
+    mc_ch_reg(m, dir, ch, DMA_MC_CH_SR) |= err;
+    mc_reg(m, dir, DMA_MC_ERR_REG) |= err;
+}
+
+// Fetch an MCDMA channel's current descriptor, unless it has been already.
+// Returns: the descriptor, or NULL if the channel has none (or it is bad)
+static volatile struct dma_mc_desc *mc_fetch(struct model_dma *m, int dir, int ch) {
+    struct model_mc_chan *c = &m->mc[dir][ch];
+    if (!c->active || !(mc_reg(m, dir, DMA_MC_CHEN_REG) & (1 << ch)))
+        return NULL;
+    if (c->d)
+        return c->d;
+
+    volatile struct dma_mc_desc *d = phys_to_virt(c->desc, DMA_SG_DESC_SIZE);
+    if (d == NULL) {
+        mc_error(m, dir, ch, DMA_SG_DEC_ERR);
+        return NULL;
+    }
+    if (((dir == DMA_MC_TX) ? d->mm2s_status : d->s2mm_status) & DMA_SG_CMPLT) {
+        mc_error(m, dir, ch, DMA_SG_INT_ERR);
+        return NULL;
+    }
+    mc_ch_reg(m, dir, ch, DMA_MC_CH_CURDESC) = c->desc;
+    c->d = d;
+    c->done = 0;
+    return d;
+}
+
+// Finish an MCDMA channel's current descriptor: write back its status (and, for S2MM,
+// the packet's sideband), then move on to the next one, unless this was the tail
+static void mc_finish(struct model_dma *m, int dir, int ch, unsigned int flags, int tdest) {
+    struct model_mc_chan *c = &m->mc[dir][ch];
+    volatile struct dma_mc_desc *d = c->d;
+    unsigned int status = c->done | DMA_SG_CMPLT | flags;
+    if (dir == DMA_MC_TX) {
+        __atomic_store_n(&d->mm2s_status, status, __ATOMIC_RELEASE);
+    } else {
+        d->s2mm_sideband = tdest << DMA_MC_TDEST_SHIFT;
+        __atomic_store_n(&d->s2mm_status, status, __ATOMIC_RELEASE);
+    }
+
+    c->d = NULL;
+    if (c->desc == (unsigned int)mc_ch_reg(m, dir, ch, DMA_MC_CH_TAILDESC)) {
+        c->active = 0;
+        mc_ch_reg(m, dir, ch, DMA_MC_CH_SR) |= DMA_MC_CH_IDLE;
+    }
+    c->desc = d->next_desc;
+}
+
+// Move some of the current packet from its MM2S channel to the S2MM channel its TDEST
+// picks. Between packets, the MM2S channels that have something to send take turns.
+// Returns: number of bytes moved (or 1 if anything else happened)
+static int step_mc(struct model_dma *m) {
+    if (!(mc_reg(m, DMA_MC_TX, DMA_MC_CCR_REG) & DMA_START) ||
+        !(mc_reg(m, DMA_MC_RX, DMA_MC_CCR_REG) & DMA_START))
+        return 0;
+
+    for (int i=0; i<m->mc_channels && m->mc_cur < 0; i++) {
+        int ch = (m->mc_next + i) % m->mc_channels;
+        if (mc_fetch(m, DMA_MC_TX, ch)) {
+            m->mc_cur = ch;
+            m->mc_next = (ch + 1) % m->mc_channels;
+        }
+    }
+    if (m->mc_cur < 0)
+        return 0;
+
+    int ch = m->mc_cur;
+    volatile struct dma_mc_desc *in = mc_fetch(m, DMA_MC_TX, ch);
+    if (in == NULL) {
+        m->mc_cur = -1;   // the rest of the packet is bad
+        return 1;
+    }
+    int tdest = (in->mm2s_sideband >> DMA_MC_TDEST_SHIFT) & DMA_MC_TDEST_MASK;
+    if (tdest >= m->mc_channels) {
+        // Nowhere for the packet to go
+        mc_finish(m, DMA_MC_TX, ch, DESC_INT_ERR, 0);
+        mc_error(m, DMA_MC_TX, ch, DMA_SG_INT_ERR);
+        m->mc_cur = -1;
+        return 1;
+    }
+    volatile struct dma_mc_desc *out = mc_fetch(m, DMA_MC_RX, tdest);
+    if (out == NULL)
+        return 0;   // the S2MM channel has no buffer, so the stream stalls
+
+    struct model_mc_chan *src = &m->mc[DMA_MC_TX][ch];
+    struct model_mc_chan *dst = &m->mc[DMA_MC_RX][tdest];
+    int in_len = in->control & DMA_SG_LEN_MASK;
+    int out_len = out->control & DMA_SG_LEN_MASK;
+    int n = in_len - src->done;
+    if (n > out_len - dst->done)
+        n = out_len - dst->done;
+    if (n > MODEL_STEP)
+        n = MODEL_STEP;
+
+    unsigned char *from = phys_to_virt(in->buffer_addr + src->done, n);
+    unsigned char *to = phys_to_virt(out->buffer_addr + dst->done, n);
+    if (from == NULL || to == NULL) {
+        mc_error(m, from == NULL ? DMA_MC_TX : DMA_MC_RX, from == NULL ? ch : tdest, DMA_DEC_ERR);
+        m->mc_cur = -1;
+        return 1;
+    }
+    memcpy(to, from, n);
+    src->done += n;
+    dst->done += n;
+
+    int eop = src->done == in_len && (in->control & DMA_MC_EOP);
+    if (src->done == in_len)
+        mc_finish(m, DMA_MC_TX, ch, 0, 0);
+    if (eop || dst->done == out_len)
+        mc_finish(m, DMA_MC_RX, tdest, eop ? DMA_SG_RXEOF : 0, tdest);
+    if (eop)
+        m->mc_cur = -1;
+    return n > 0 ? n : 1;
+}
+
+static void *model_thread(void *arg) {
+    // Wake up on time for the timing model, not up to 50us late (the default timer slack)
+    prctl(PR_SET_TIMERSLACK, 1);
+
+    pthread_mutex_lock(&lock);
+    while (running) {
+        int progress = 0;
+        next_event = 0;
+        for (int i=0; i<DMA_MODEL_MAX_INSTANCES; i++) {
+            if (dmas[i].in_use && dmas[i].mc_channels) {
+                progress += step_mc(&dmas[i]);
+            } else if (dmas[i].in_use) {
+                progress += step_mm2s(&dmas[i]);
+                progress += step_source(&dmas[i]);
+                progress += step_s2mm(&dmas[i]);
+            }
+        }
+        if (progress == 0 && next_event) {
+            // a channel is waiting on the timing model; sleep until it can go on
+            struct timespec ts = { next_event / 1000000000LL, next_event % 1000000000LL };
+            pthread_cond_timedwait(&wake, &lock, &ts);
+        } else if (progress == 0) {
+            pthread_cond_wait(&wake, &lock);
+        } else {
+            // let the driver get at the registers between steps
+            pthread_mutex_unlock(&lock);
+            pthread_mutex_lock(&lock);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void reset_chan(struct model_chan *c) {
+    struct model_dma *dma = c->dma;
+    int base = c->base;
+    int is_mm2s = c->is_mm2s;
+    int uio_fd = c->uio_fd;
+    int uio_enabled = c->uio_enabled;
+    memset(c, 0, sizeof(*c));
+    c->dma = dma;
+    c->base = base;
+    c->is_mm2s = is_mm2s;
+    c->uio_fd = uio_fd;
+    c->uio_enabled = uio_enabled;
+    c->sof = 1;
+    for (int off=0; off<0x30; off+=4)
+        reg(c, off) = 0;
+    reg(c, CH_STATUS) = DMA_HALTED;
+}
+
+// Reset resets the whole core, including anything in the stream
+static void reset_all(struct model_dma *m) {
+    reset_chan(&m->mm2s);
+    reset_chan(&m->s2mm);
+    m->fifo_in = m->fifo_out = 0;
+    m->eof_head = m->eof_count = 0;
+    m->source_start = 0;
+}
+
+// Reset an MCDMA: every channel stops, with nothing queued
+static void mc_reset(struct model_dma *m) {
+    memset(m->mc, 0, sizeof(m->mc));
+    m->mc_next = 0;
+    m->mc_cur = -1;
+    for (int off=0; off<DMA_MMAP_LEN; off+=4)
+        m->regs[off/4] = 0;
+    for (int dir=DMA_MC_TX; dir<=DMA_MC_RX; dir++) {
+        mc_reg(m, dir, DMA_MC_CSR_REG) = DMA_HALTED;
+        for (int ch=0; ch<m->mc_channels; ch++)
+            mc_ch_reg(m, dir, ch, DMA_MC_CH_SR) = DMA_MC_CH_IDLE;
+    }
+}
+
+// A write to an MCDMA's registers
+static void mc_write(struct model_dma *m, int offset, int value) {
+    int dir = (offset >= DMA_MC_S2MM) ? DMA_MC_RX : DMA_MC_TX;
+    int off = offset - ((dir == DMA_MC_RX) ? DMA_MC_S2MM : 0);
+
+    if (off == DMA_MC_CCR_REG) {
+        if (value & DMA_RESET) {
+            mc_reset(m);
+            return;
+        }
+        mc_reg(m, dir, DMA_MC_CCR_REG) = value;
+        mc_reg(m, dir, DMA_MC_CSR_REG) = (value & DMA_START) ? DMA_IDLE : DMA_HALTED;
+        return;
+    }
+    if (off < DMA_MC_CH_REG(0) || off >= DMA_MC_CH_REG(m->mc_channels)) {
+        m->regs[offset/4] = value;
+        return;
+    }
+
+    int ch = (off - DMA_MC_CH_REG(0)) / (DMA_MC_CH_REG(1) - DMA_MC_CH_REG(0));
+    struct model_mc_chan *c = &m->mc[dir][ch];
+    switch (off - DMA_MC_CH_REG(ch)) {
+    case DMA_MC_CH_SR:
+        // interrupt bits are write-1-to-clear; the rest is read only
+        mc_ch_reg(m, dir, ch, DMA_MC_CH_SR) &= ~(value & DMA_IRQ_MASK);
+        break;
+    case DMA_MC_CH_CR:
+        mc_ch_reg(m, dir, ch, DMA_MC_CH_CR) = value;
+        if (!(value & DMA_START))
+            c->active = 0;
+        break;
+    case DMA_MC_CH_CURDESC:
+        mc_ch_reg(m, dir, ch, DMA_MC_CH_CURDESC) = value;
+        if (!c->active) {
+            c->desc = value;
+            c->d = NULL;
+        }
+        break;
+    case DMA_MC_CH_TAILDESC:
+        // The channel goes on from where it stopped, up to the new tail
+        mc_ch_reg(m, dir, ch, DMA_MC_CH_TAILDESC) = value;
+        if (mc_ch_reg(m, dir, ch, DMA_MC_CH_CR) & DMA_START) {
+            c->active = 1;
+            mc_ch_reg(m, dir, ch, DMA_MC_CH_SR) &= ~DMA_MC_CH_IDLE;
+        }
+        break;
+    default:
+        m->regs[offset/4] = value;
+        break;
+    }
+}
+
+// Find the DMA that a register window belongs to
+static struct model_dma *find_dma(volatile int *regs) {
+    for (int i=0; i<DMA_MODEL_MAX_INSTANCES; i++)
+        if (dmas[i].in_use && dmas[i].regs == regs)
+            return &dmas[i];
+    return NULL;
+}
+
+void dma_model_write(volatile int *regs, int offset, int value) {
+    pthread_mutex_lock(&lock);
+
+    struct model_dma *m = find_dma(regs);
+    if (m == NULL) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if (m->mc_channels) {
+        mc_write(m, offset, value);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    struct model_chan *c = (offset < S2MM_CNTL_REG) ? &m->mm2s : &m->s2mm;
+    int off = offset - c->base;
+
+    switch (off) {
+    case CH_CNTL:
+        if (value & DMA_RESET) {
+            reset_all(m);
+            break;
+        }
+        reg(c, CH_CNTL) = value;
+        if (value & DMA_START) {
+            reg(c, CH_STATUS) &= ~DMA_HALTED;
+            if (!c->active)
+                reg(c, CH_STATUS) |= DMA_IDLE;
+        } else {
+            c->active = 0;
+            reg(c, CH_STATUS) = (reg(c, CH_STATUS) & ~DMA_IDLE) | DMA_HALTED;
+        }
+        break;
+    case CH_STATUS:
+        // interrupt bits are write-1-to-clear; the rest is read only
+        reg(c, CH_STATUS) &= ~(value & DMA_IRQ_MASK);
+        break;
+    case CH_LEN:
+        reg(c, CH_LEN) = value;
+        if ((reg(c, CH_CNTL) & DMA_START) && !c->active) {
+            c->active = 1;
+            c->sg = 0;
+            c->addr = reg(c, CH_ADDR);
+            c->len = value & DMA_SG_LEN_MASK;
+            c->done = 0;
+            chan_start(c);
+            reg(c, CH_STATUS) &= ~DMA_IDLE;
+        }
+        break;
+    case CH_CURDESC:
+        reg(c, CH_CURDESC) = value;
+        c->at_tail = 0;
+        break;
+    case CH_TAILDESC:
+        reg(c, CH_TAILDESC) = value;
+        if (reg(c, CH_CNTL) & DMA_START) {
+            c->tail = value;
+            if (!c->active) {
+                volatile struct dma_sg_desc *d = phys_to_virt(reg(c, CH_CURDESC), DMA_SG_DESC_SIZE);
+                c->active = 1;
+                c->sg = 1;
+                c->desc = (c->at_tail && d) ? d->next_desc : (unsigned int)reg(c, CH_CURDESC);
+                c->at_tail = 0;
+                chan_start(c);
+                reg(c, CH_STATUS) &= ~DMA_IDLE;
+                load_desc(c);
+            }
+        }
+        break;
+    default:
+        m->regs[offset/4] = value;
+        break;
+    }
+
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+volatile int *dma_model_open(unsigned int base_addr) {
+    pthread_mutex_lock(&lock);
+
+    struct model_dma *m = NULL;
+    for (int i=0; i<DMA_MODEL_MAX_INSTANCES; i++) {
+        if (dmas[i].in_use && dmas[i].base_addr == base_addr) {
+            printf("ERROR: DMA model at %x is already open\n", base_addr);
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        if (!dmas[i].in_use && m == NULL)
+            m = &dmas[i];
+    }
+    if (m == NULL) {
+        printf("ERROR: DMA model can only model %d DMAs at once\n", DMA_MODEL_MAX_INSTANCES);
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+    // The register window is shared memory, like the real registers mapped from /dev/mem
+    int regs_fd = syscall(SYS_memfd_create, "dma_model_regs", 0);
+    void *regs = MAP_FAILED;
+    if (regs_fd >= 0 && ftruncate(regs_fd, DMA_MMAP_LEN) == 0)
+        regs = mmap(NULL, DMA_MMAP_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, regs_fd, 0);
+    if (regs == MAP_FAILED) {
+        printf("ERROR: failed to create DMA model registers\n");
+        if (regs_fd >= 0)
+            close(regs_fd);
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+    memset(m, 0, sizeof(*m));
+    m->base_addr = base_addr;
+    m->regs = regs;
+    m->regs_fd = regs_fd;
+    m->mm2s.dma = m;
+    m->mm2s.base = MM2S_CNTL_REG;
+    m->mm2s.is_mm2s = 1;
+    m->mm2s.uio_fd = -1;
+    m->s2mm.dma = m;
+    m->s2mm.base = S2MM_CNTL_REG;
+    m->s2mm.is_mm2s = 0;
+    m->s2mm.uio_fd = -1;
+    reset_all(m);
+
+    // The first DMA opened starts the model thread
+    if (open_count == 0) {
+        next_phy_addr = DMA_MODEL_PHYS_BASE;
+        if (!configured)
+            config_from_env();
+
+        // The thread sleeps until deadlines on the monotonic clock
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&wake, &attr);
+        pthread_condattr_destroy(&attr);
+
+        running = 1;
+        if (pthread_create(&thread, NULL, model_thread, NULL)) {
+            printf("ERROR: failed to start DMA model thread\n");
+            running = 0;
+            munmap(regs, DMA_MMAP_LEN);
+            close(regs_fd);
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+    }
+    m->in_use = 1;
+    open_count++;
+
+    pthread_mutex_unlock(&lock);
+    return m->regs;
+}
+
+int dma_model_mcdma(volatile int *regs, int nchannels) {
+    if (nchannels < 1 || nchannels > DMA_MC_MAX_CHANNELS) {
+        printf("ERROR: DMA model can only model MCDMAs with 1 to %d channels\n", DMA_MC_MAX_CHANNELS);
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    struct model_dma *m = find_dma(regs);
+    if (m) {
+        m->mc_channels = nchannels;
+        mc_reset(m);
+    }
+    pthread_mutex_unlock(&lock);
+    return m ? 0 : -1;
+}
+
+void dma_model_close(volatile int *regs) {
+    pthread_mutex_lock(&lock);
+    struct model_dma *m = find_dma(regs);
+    if (m == NULL) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    m->in_use = 0;
+    if (m->mm2s.uio_fd >= 0)
+        close(m->mm2s.uio_fd);
+    if (m->s2mm.uio_fd >= 0)
+        close(m->s2mm.uio_fd);
+    m->mm2s.uio_fd = m->s2mm.uio_fd = -1;
+    munmap((void*)m->regs, DMA_MMAP_LEN);
+    close(m->regs_fd);
+    m->regs = NULL;
+
+    // The last DMA closed stops the model thread and frees the buffers
+    int last = (--open_count == 0);
+    if (last) {
+        running = 0;
+        pthread_cond_signal(&wake);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (last) {
+        pthread_join(thread, NULL);
+        pthread_cond_destroy(&wake);
+        for (int i=0; i<nbuffers; i++)
+            dma_model_release(i);
+        free(buffers);
+        buffers = NULL;
+        nbuffers = 0;
+    }
+}
+
+// Give host memory a "physical" address range. Call with the lock held.
+// Returns: 0 on success; -1 on error
+static int add_buffer(void *p, int size, int external, int *id, unsigned int *phy_addr) {
+    int i;
+    for (i=0; i<nbuffers; i++)
+        if (buffers[i].base == NULL)
+            break;
+    if (i == nbuffers) {
+        int n = nbuffers ? 2*nbuffers : 16;
+        struct model_buffer *more = realloc(buffers, n * sizeof(struct model_buffer));
+        if (more == NULL) {
+            printf("ERROR: DMA model has no buffer available\n");
+            return -1;
+        }
+        memset(more + nbuffers, 0, (n - nbuffers) * sizeof(struct model_buffer));
+        buffers = more;
+        nbuffers = n;
+    }
+
+    buffers[i].base = p;
+    buffers[i].phy_addr = next_phy_addr;
+    buffers[i].size = size;
+    buffers[i].external = external;
+    buffers[i].fd = -1;
+    next_phy_addr += (size + 4095) & ~4095;
+
+    *id = i;
+    *phy_addr = buffers[i].phy_addr;
+    return 0;
+}
+
+int dma_model_reserve(int size, int *id, unsigned int *phy_addr, void **base) {
+    // Page-align everything, like memalloc does, and hand out shared memory, like
+    // memalloc's mmap (populated up front, like the driver asks memalloc for)
+    int alloc_size = (size + 4095) & ~4095;
+    int fd = syscall(SYS_memfd_create, "dma_model_buffer", 0);
+    void *p = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, alloc_size) == 0)
+        p = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (p == MAP_FAILED) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    int res = add_buffer(p, alloc_size, 0, id, phy_addr);
+    if (res == 0)
+        buffers[*id].fd = fd;
+    pthread_mutex_unlock(&lock);
+    if (res) {
+        munmap(p, alloc_size);
+        close(fd);
+        return res;
+    }
+    *base = p;
+    return 0;
+}
+
+int dma_model_import_user(void *addr, int size, int *id, unsigned int *phy_addr) {
+    pthread_mutex_lock(&lock);
+    int res = add_buffer(addr, size, 1, id, phy_addr);
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+int dma_model_import_dmabuf(int fd, int size, int *id, unsigned int *phy_addr) {
+    return -1;
+}
+
+int dma_model_export_dmabuf(int id) {
+    pthread_mutex_lock(&lock);
+    int fd = -1;
+    if (id >= 0 && id < nbuffers && buffers[id].base && !buffers[id].external)
+        fd = fcntl(buffers[id].fd, F_DUPFD_CLOEXEC, 0);
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+void dma_model_release(int id) {
+    pthread_mutex_lock(&lock);
+    if (id >= 0 && id < nbuffers) {
+        if (buffers[id].base && !buffers[id].external) {
+            munmap(buffers[id].base, buffers[id].size);
+            close(buffers[id].fd);
+        }
+        buffers[id].base = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Read the timing model from the environment, for programs that don't call
+// dma_model_configure() themselves (e.g. dmabench)
+static void config_from_env() {
+    const char *v;
+    memset(&config, 0, sizeof(config));
+    if ((v = getenv("DMA_MODEL_BANDWIDTH")))
+        config.bandwidth_mbps = atof(v);
+    if ((v = getenv("DMA_MODEL_SETUP_US")))
+        config.setup_us = atof(v);
+    if ((v = getenv("DMA_MODEL_JITTER_US")))
+        config.jitter_us = atof(v);
+    if ((v = getenv("DMA_MODEL_SOURCE_MBPS")))
+        config.source_mbps = atof(v);
+}
+
+void dma_model_configure(const struct dma_model_config *cfg) {
+    pthread_mutex_lock(&lock);
+    if (cfg)
+        config = *cfg;
+    else
+        memset(&config, 0, sizeof(config));
+    configured = 1;
+    pthread_mutex_unlock(&lock);
+}
+
+int dma_model_uio_open(volatile int *regs, int offset) {
+    pthread_mutex_lock(&lock);
+    struct model_dma *m = find_dma(regs);
+    if (m == NULL) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    struct model_chan *c = (offset < S2MM_CNTL_REG) ? &m->mm2s : &m->s2mm;
+
+    if (c->uio_fd < 0)
+        c->uio_fd = eventfd(0, EFD_CLOEXEC);
+    c->uio_enabled = 1;   // UIO enables the interrupt when the device is opened
+    int fd = c->uio_fd;
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+int dma_model_uio_enable(int fd) {
+    pthread_mutex_lock(&lock);
+    struct model_chan *c = NULL;
+    for (int i=0; i<DMA_MODEL_MAX_INSTANCES && c == NULL; i++) {
+        struct model_dma *m = &dmas[i];
+        if (!m->in_use)
+            continue;
+        c = (fd == m->mm2s.uio_fd) ? &m->mm2s : (fd == m->s2mm.uio_fd) ? &m->s2mm : NULL;
+    }
+    if (c) {
+        c->uio_enabled = 1;
+        raise_irq(c);     // the interrupt is level-sensitive
+    }
+    pthread_mutex_unlock(&lock);
+    return c ? 0 : -1;
+}
@@ -0,0 +1,123 @@
+/*   
+    Software model of the AXI DMA, for testing the PetaLinux DMA driver without a board
+                    
+    From "Getting Started with the Xilinx Zynq FPGA and Vivado" 
+    by Peter Milder (peter.milder@stonybrook.edu)
+
+    Copyright (C) 2018 Peter Milder
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// When dma.c is compiled with -DDMA_MODEL, it uses these functions in place of
+// /dev/mem and /dev/memalloc. The model runs in its own thread and implements
+// the register interface of an AXI DMA whose MM2S stream is looped back into
+// its S2MM stream, in both simple and scatter-gather mode.
+//
+// The model can also stand in for the UIO devices that deliver the DMA's interrupts.
+//
+// "Physical" addresses handed out by the model are not real addresses; the model
+// translates them back to the host memory it allocated.
+
+#ifndef DMA_MODEL_H
+#define DMA_MODEL_H
+
+#define DMA_MODEL_PHYS_BASE 0x10000000   // first "physical" address handed out
+#define DMA_MODEL_FIFO_LEN  4096         // bytes of stream data in flight between MM2S and S2MM
+#define DMA_MODEL_MAX_INSTANCES 4        // DMAs that can be modelled at once
+
+/* Timing and stream model, shared by all modelled DMAs */
+struct dma_model_config {
+    double bandwidth_mbps;  // MB/s each channel moves once started (0: as fast as possible)
+    double setup_us;        // time from starting a channel until data starts to move
+    double jitter_us;       // random extra setup time, up to this much
+    /* Applied to the stream between MM2S and S2MM, in place (NULL: loopback). len is a
+     * multiple of 4 bytes, except at the end of a buffer. */
+    void (*transform)(unsigned char *data, int len, void *arg);
+    void *transform_arg;
+    /* Feed the S2MM stream from a source instead of MM2S, like a sensor (0: no source). From
+     * when S2MM is first given a buffer, it produces 32-bit words numbered 0, 1, 2, ... at
+     * this many MB/s, whether or not S2MM keeps up; words that do not fit in the FIFO are
+     * lost. Don't use MM2S while it runs. */
+    double source_mbps;
+};
+
+/* Set the timing and stream model (NULL: the default, untimed loopback). If this is never
+ * called, the timing comes from the DMA_MODEL_BANDWIDTH (MB/s), DMA_MODEL_SETUP_US,
+ * DMA_MODEL_JITTER_US and DMA_MODEL_SOURCE_MBPS environment variables when the first DMA
+ * is opened.
+ */
+void dma_model_configure(const struct dma_model_config *cfg);
+
+/* Start modelling the DMA at base_addr (each address gets its own register window).
+ * Returns a pointer to its register window, or NULL on error
+ */
+volatile int *dma_model_open(unsigned int base_addr);
+
+/* Stop modelling a DMA. Closing the last one stops the model thread and frees all
+ * of its buffers
+ */
+void dma_model_close(volatile int *regs);
+
+/* Make the modelled DMA at regs an AXI MCDMA with nchannels channels each way, in place
+ * of an AXI DMA (see note 16 in dma.h). Its MM2S stream is looped back into its S2MM
+ * stream, and each packet's TDEST picks the S2MM channel that receives it; a packet for
+ * a channel with no buffer queued holds up the whole stream, as in hardware. The MM2S
+ * channels take turns, a packet at a time. The timing model, the transform and the
+ * source only apply to AXI DMAs.
+ * Returns: 0 on success; -1 on error
+ */
+int dma_model_mcdma(volatile int *regs, int nchannels);
+
+/* Write a DMA register. (The driver reads registers directly from the window.) */
+void dma_model_write(volatile int *regs, int offset, int value);
+
+/* Reserve a buffer, like memalloc's reserve/get physical/mmap sequence.
+ * Returns: 0 on success; -1 on error
+ */
+int dma_model_reserve(int size, int *id, unsigned int *phy_addr, void **base);
+
+/* Import application memory, like memalloc's IMPORT_USER: the model can move data to
+ * and from any host memory, so this always works in place.
+ * Returns: 0 on success; -1 on error
+ */
+int dma_model_import_user(void *addr, int size, int *id, unsigned int *phy_addr);
+
+/* Import a dma-buf, like memalloc's IMPORT_DMABUF. The model has no dma-bufs to attach
+ * to, so this always fails, and the driver falls back to a bounce buffer.
+ */
+int dma_model_import_dmabuf(int fd, int size, int *id, unsigned int *phy_addr);
+
+/* Export a buffer as a dma-buf, like memalloc's EXPORT_DMABUF. The model's buffers are
+ * memfds, so this returns a new fd of the buffer's memfd: it can be mmap-ed and passed
+ * to other processes like a dma-buf, and keeps the memory alive until it is closed.
+ * Returns: the fd, or -1 on error
+ */
+int dma_model_export_dmabuf(int id);
+
+/* Release a buffer (imported memory is left alone) */
+void dma_model_release(int id);
+
+/* Open a fake UIO device for the interrupt of the channel whose registers start at
+ * "offset" (MM2S_CNTL_REG or S2MM_CNTL_REG). It is an eventfd: the model writes to it
+ * when the channel raises an interrupt, and then (like UIO) disables the interrupt
+ * until dma_model_uio_enable() is called.
+ * Returns: the file descriptor, or -1 on error
+ */
+int dma_model_uio_open(volatile int *regs, int offset);
+
+/* Re-enable the interrupt of a fake UIO device. Returns: 0 on success; -1 on error */
+int dma_model_uio_enable(int fd);
+
+#endif
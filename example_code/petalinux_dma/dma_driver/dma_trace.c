@@ -0,0 +1,241 @@
+/*
+    Per-transfer tracing for the PetaLinux DMA driver
+
+    From "Getting Started with the Xilinx Zynq FPGA and Vivado"
+    by Peter Milder (peter.milder@stonybrook.edu)
+
+    Copyright (C) 2018 Peter Milder
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// How the trace is kept:
+//    - Each thread that records an event gets a ring of DMA_TRACE_EVENTS events the
+//      first time it does. Only that thread writes to it, so recording needs no locks:
+//      it writes the event, then publishes it by advancing the ring's count.
+//    - The rings are linked into a list (with a compare-and-swap, so threads can add
+//      theirs at the same time), and are never freed, so events from threads that have
+//      exited can still be dumped.
+//    - dma_trace_dump() turns the events into Chrome "complete" events: init, setup,
+//      sync and app spans on the thread that recorded them, and engine spans on a track
+//      of their own for each DMA.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "dma_trace.h"
+
+#define TRACE_MAX_DMAS 8   // DMAs one thread's events are followed for, in the dump
+
+struct trace_record {
+    uint64_t ns;           // CLOCK_MONOTONIC
+    unsigned int dma;
+    int event;
+    int bytes;
+};
+
+struct trace_ring {
+    struct trace_record events[DMA_TRACE_EVENTS];
+    unsigned long count;   // events ever recorded; written only by the owning thread
+    int tid;
+    struct trace_ring *next;
+};
+
+int dma_trace_enabled;
+
+static struct trace_ring *rings;            // every thread's ring
+static __thread struct trace_ring *my_ring; // this thread's ring
+static const char *trace_file;              // dump here at exit (DMA_TRACE_FILE)
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Give this thread a ring, and add it to the list
+static struct trace_ring *ring_create() {
+    struct trace_ring *r = calloc(1, sizeof(struct trace_ring));
+    if (r == NULL)
+        return NULL;
+    r->tid = syscall(SYS_gettid);
+    r->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+    my_ring = r;
+    return r;
+}
+
+void dma_trace_enable(int on) {
+    dma_trace_enabled = on;
+}
+
+void dma_trace_record(int event, unsigned int dma, int bytes) {
+    struct trace_ring *r = my_ring;
+    if (r == NULL && (r = ring_create()) == NULL)
+        return;
+
+    unsigned long n = r->count;
+    struct trace_record *e = &r->events[n & (DMA_TRACE_EVENTS-1)];
+    e->ns = now_ns();
+    e->dma = dma;
+    e->event = event;
+    e->bytes = bytes;
+    __atomic_store_n(&r->count, n+1, __ATOMIC_RELEASE);
+}
+
+
+// Where each span currently open on one DMA began (0: not open)
+struct dma_state {
+    unsigned int dma;
+    uint64_t init, submit, engine, sync, app;
+    int bytes;
+};
+
+static void span(FILE *f, int *first, const char *name, int tid, uint64_t t0, uint64_t t1,
+                 uint64_t origin, unsigned int dma, int bytes) {
+    fprintf(f, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+            "\"args\": {\"dma\": \"0x%x\", \"bytes\": %d}}",
+            *first ? "" : ",", name, (int)getpid(), tid, (t0 - origin) / 1000.0, (t1 - t0) / 1000.0, dma, bytes);
+    *first = 0;
+}
+
+// Find (or start following) a DMA in a thread's table
+static struct dma_state *find_state(struct dma_state *s, int *n, unsigned int dma) {
+    for (int i=0; i<*n; i++)
+        if (s[i].dma == dma)
+            return &s[i];
+    if (*n == TRACE_MAX_DMAS)
+        return NULL;
+    struct dma_state *d = &s[(*n)++];
+    *d = (struct dma_state){ .dma = dma };
+    return d;
+}
+
+int dma_trace_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        printf("ERROR: Could not open %s for the DMA trace\n", path);
+        return -1;
+    }
+
+    // Timestamps are written relative to the earliest event kept
+    uint64_t origin = UINT64_MAX;
+    struct trace_ring *head = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (struct trace_ring *r = head; r; r = r->next) {
+        unsigned long count = __atomic_load_n(&r->count, __ATOMIC_ACQUIRE);
+        unsigned long start = (count > DMA_TRACE_EVENTS) ? count - DMA_TRACE_EVENTS : 0;
+        if (count > start && r->events[start & (DMA_TRACE_EVENTS-1)].ns < origin)
+            origin = r->events[start & (DMA_TRACE_EVENTS-1)].ns;
+    }
+
+    int first = 1;
+    unsigned int named[TRACE_MAX_DMAS * 4];
+    int nnamed = 0;
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+    for (struct trace_ring *r = head; r; r = r->next) {
+        unsigned long count = __atomic_load_n(&r->count, __ATOMIC_ACQUIRE);
+        unsigned long start = (count > DMA_TRACE_EVENTS) ? count - DMA_TRACE_EVENTS : 0;
+        struct dma_state states[TRACE_MAX_DMAS];
+        int nstates = 0;
+
+        fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                "\"args\": {\"name\": \"thread %d\"}}", first ? "" : ",", (int)getpid(), r->tid, r->tid);
+        first = 0;
+
+        for (unsigned long i = start; i < count; i++) {
+            struct trace_record *e = &r->events[i & (DMA_TRACE_EVENTS-1)];
+            struct dma_state *d = find_state(states, &nstates, e->dma);
+            if (d == NULL)
+                continue;
+
+            // Engine spans go on a track named after the DMA (its base address as the tid)
+            int k;
+            for (k=0; k<nnamed && named[k] != e->dma; k++)
+                ;
+            if (k == nnamed && nnamed < TRACE_MAX_DMAS * 4) {
+                named[nnamed++] = e->dma;
+                fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                        "\"args\": {\"name\": \"DMA 0x%x\"}}", (int)getpid(), (int)e->dma, e->dma);
+            }
+
+            switch (e->event) {
+            case DMA_TRACE_INIT_BEGIN:
+                d->init = e->ns;
+                break;
+            case DMA_TRACE_INIT_END:
+                if (d->init)
+                    span(f, &first, "init", r->tid, d->init, e->ns, origin, e->dma, e->bytes);
+                d->init = 0;
+                break;
+            case DMA_TRACE_SUBMIT_BEGIN:
+                if (d->app)
+                    span(f, &first, "app", r->tid, d->app, e->ns, origin, e->dma, 0);
+                d->app = 0;
+                d->submit = e->ns;
+                break;
+            case DMA_TRACE_SUBMIT_END:
+                if (d->submit)
+                    span(f, &first, "setup", r->tid, d->submit, e->ns, origin, e->dma, e->bytes);
+                d->submit = 0;
+                if (!d->engine)     // the other channel may already be running
+                    d->engine = e->ns;
+                if (e->bytes > d->bytes)
+                    d->bytes = e->bytes;
+                break;
+            case DMA_TRACE_HW_IDLE:
+                if (d->engine)
+                    span(f, &first, "engine", (int)e->dma, d->engine, e->ns, origin, e->dma, d->bytes);
+                d->engine = 0;
+                d->bytes = 0;
+                break;
+            case DMA_TRACE_SYNC_BEGIN:
+                d->sync = e->ns;
+                break;
+            case DMA_TRACE_SYNC_END:
+                if (d->sync)
+                    span(f, &first, "sync", r->tid, d->sync, e->ns, origin, e->dma, 0);
+                d->sync = 0;
+                d->app = e->ns;
+                break;
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    int res = ferror(f) ? -1 : 0;
+    if (fclose(f) || res) {
+        printf("ERROR: Could not write the DMA trace to %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void dump_at_exit() {
+    dma_trace_dump(trace_file);
+}
+
+// Switch tracing on at startup if DMA_TRACE_FILE is set
+__attribute__((constructor))
+static void trace_from_env() {
+    trace_file = getenv("DMA_TRACE_FILE");
+    if (trace_file && trace_file[0]) {
+        dma_trace_enabled = 1;
+        atexit(dump_at_exit);
+    }
+}
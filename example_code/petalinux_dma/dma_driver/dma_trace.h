@@ -0,0 +1,73 @@
+/*
+    Per-transfer tracing for the PetaLinux DMA driver
+
+    From "Getting Started with the Xilinx Zynq FPGA and Vivado"
+    by Peter Milder (peter.milder@stonybrook.edu)
+
+    Copyright (C) 2018 Peter Milder
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// When dma.c is compiled with -DDMA_TRACE (and dma_trace.c is added to the build), the
+// driver timestamps the steps of every transfer:
+//    - init:   setting up a DMA (dma_init(), dma_ctx_init(), ...)
+//    - setup:  from a dma_rx()/dma_tx() (or ring submit, or batch) call until the DMA
+//              has been started
+//    - engine: from then until the driver sees the DMA go idle
+//    - sync:   the time spent in dma_sync() (or dma_sg_sync(), dma_ring_wait())
+//    - app:    from the end of one sync to the next setup: the time the program spends
+//              filling and draining buffers
+// Each thread records into a ring of its own, without locks, so tracing costs one
+// clock read and a few stores per event. Only the last DMA_TRACE_EVENTS events of each
+// thread are kept.
+//
+// Tracing starts switched off. Switch it on with dma_trace_enable(1), or by setting
+// the DMA_TRACE_FILE environment variable to a file name: the trace is then written
+// there, as Chrome trace JSON, when the program exits. Open it in chrome://tracing or
+// https://ui.perfetto.dev.
+//
+// Without -DDMA_TRACE, none of this is compiled in.
+
+#ifndef DMA_TRACE_H
+#define DMA_TRACE_H
+
+#define DMA_TRACE_EVENTS 4096   // events kept per thread; must be a power of 2
+
+/* What happened */
+enum dma_trace_event {
+    DMA_TRACE_INIT_BEGIN,
+    DMA_TRACE_INIT_END,
+    DMA_TRACE_SUBMIT_BEGIN,
+    DMA_TRACE_SUBMIT_END,
+    DMA_TRACE_HW_IDLE,
+    DMA_TRACE_SYNC_BEGIN,
+    DMA_TRACE_SYNC_END
+};
+
+/* Nonzero while tracing is on. The driver checks this before recording anything. */
+extern int dma_trace_enabled;
+
+/* Switch tracing on (1) or off (0) */
+void dma_trace_enable(int on);
+
+/* Record an event for the DMA at base address "dma", for a transfer of "bytes" bytes */
+void dma_trace_record(int event, unsigned int dma, int bytes);
+
+/* Write every thread's events to a file as Chrome trace JSON. Call it while no
+ * transfers are running. Returns: 0 on success; -1 on error
+ */
+int dma_trace_dump(const char *path);
+
+#endif
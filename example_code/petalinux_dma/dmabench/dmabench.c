@@ -0,0 +1,496 @@
+/*
+    DMA throughput and latency benchmark, with DMA loopback
+
+    From "Getting Started with the Xilinx Zynq FPGA and Vivado"
+    by Peter Milder (peter.milder@stonybrook.edu)
+
+    Copyright (C) 2018 Peter Milder
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// This program measures how fast the DMA driver (dma.c and .h) moves data. It makes the
+// same assumptions about your system as dmatest.c.
+//
+// For every transfer size from the stream width (DMA_DATA_WIDTH) up to the largest the
+// DMA allows (doubling each time), it runs many transfers, and times three parts of each
+// one separately:
+//    - setup:    the dma_rx() and dma_tx() calls
+//    - transfer: from then until the DMA reports it is done (found by polling dma_busy())
+//    - sync:     the dma_sync() call that follows
+// It reports the throughput, the 50th/99th/99.9th percentile of each part, and how much
+// CPU time went into polling, as JSON (default) or CSV. The JSON also has the time
+// dma_init() took.
+//
+// Usage: dmabench [-n reps] [-M max_bytes] [-f json|csv] [-t clock|axi] [-w poll|sync] [-p producers]
+//    -w sync waits for each transfer in dma_sync() itself, which sleeps for most of the
+//    predicted transfer time (see dma_wait_stats() in dma.h), instead of polling
+//    dma_busy(). The "transfer" time then includes the sync, and "polls" counts the
+//    status checks dma_sync() made.
+//    -p runs a different benchmark: 1, 2, 4, ... up to "producers" threads share the DMA,
+//    each running "reps" transfers of PRODUCER_BYTES bytes (or, with -M, of max_bytes
+//    rounded down to the stream width), first taking turns with a mutex
+//    around dma_rx()/dma_tx()/dma_sync(), then through the service thread (dma_submit()
+//    and dma_request_wait()). It reports the total transfer rate and the latency of each
+//    transfer (from wanting the DMA to having the data) for both.
+//    -t axi uses the AXI Timer at TIMER_BASE (as in timer/petalinux.c) instead of
+//    CLOCK_MONOTONIC_RAW. Adjust TIMER_BASE and TIMER_FREQ below to match your design.
+//
+// To run it without a board, against the software model of the DMA:
+//    gcc -O2 -DDMA_MODEL -I../memalloc -I../dma_driver dmabench.c ../dma_driver/dma.c ../dma_driver/dma_model.c -lpthread
+// (The AXI Timer is not available then, so the benchmark always uses the clock.)
+// The model's timing can be set from the environment, e.g.
+//    DMA_MODEL_BANDWIDTH=400 DMA_MODEL_SETUP_US=2 DMA_MODEL_JITTER_US=1 ./a.out
+// for 400 MB/s per channel, after 2-3us of setup per transfer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>    // file operations (open, close)
+#include <sys/mman.h> // memory management (mmap, munmap)
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "dma.h"
+
+#define TIMER_BASE 0x42800000
+#define TIMER_FREQ 100         // in MHz
+
+#define DEFAULT_REPS 1000      // transfers per size
+#define PRODUCER_BYTES 256     // size of each transfer in the producer benchmark (-p)
+#define MAX_PRODUCERS 64
+
+// Timing, with either the AXI Timer or CLOCK_MONOTONIC_RAW
+static volatile unsigned int *timer;   // the AXI Timer's registers, if we are using it
+static int timer_fd = -1;
+
+static int timer_open() {
+    timer_fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (timer_fd == -1) {
+        printf("ERROR: Could not open /dev/mem\n");
+        return -1;
+    }
+
+    void *p = mmap(NULL, 64, PROT_READ | PROT_WRITE, MAP_SHARED, timer_fd, TIMER_BASE);
+    if (p == MAP_FAILED) {
+        printf("ERROR: Could not mmap timer\n");
+        close(timer_fd);
+        return -1;
+    }
+    timer = p;
+
+    timer[0] = 0x20;                      // clear the timer
+    timer[0] = 0x80;                      // start the timer
+    return 0;
+}
+
+static void timer_close() {
+    if (timer) {
+        munmap((void*)timer, 64);
+        close(timer_fd);
+    }
+}
+
+// Read the time: timer cycles, or nanoseconds
+static uint64_t now() {
+    if (timer)
+        return timer[2];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Microseconds between two readings of now(). The AXI Timer counter is 32 bits, so
+// it wraps after about 43 seconds; the unsigned subtraction handles one wrap.
+static double elapsed_us(uint64_t start, uint64_t end) {
+    if (timer)
+        return (double)(uint32_t)(end - start) / TIMER_FREQ;
+    return (end - start) / 1000.0;
+}
+
+// CPU time used by this thread, in microseconds
+static double cpu_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1000.0;
+}
+
+
+// Results for one transfer size
+struct result {
+    int size;
+    double mb_per_s;
+    double setup[3], transfer[3], sync[3];   // p50, p99, p99.9, in microseconds
+    double poll_cpu_us;                      // CPU time spent polling, per transfer
+    double polls;                            // dma_busy() calls, per transfer
+    int errors;
+};
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Sort the samples, and take the 50th, 99th and 99.9th percentiles
+static void percentiles(double *samples, int n, double out[3]) {
+    static const double p[3] = { 0.50, 0.99, 0.999 };
+    qsort(samples, n, sizeof(double), compare_doubles);
+    for (int i=0; i<3; i++) {
+        int k = (int)(p[i]*n + 0.999999) - 1;
+        if (k < 0)
+            k = 0;
+        if (k >= n)
+            k = n-1;
+        out[i] = samples[k];
+    }
+}
+
+// Run "reps" transfers of "size" bytes, and fill in the results
+static int bench_size(int size, int reps, int wait_in_sync, double *setup, double *transfer, double *sync,
+                      struct result *r) {
+    unsigned char* txbase = (unsigned char*) getTxBuffer();
+    unsigned char* rxbase = (unsigned char*) getRxBuffer();
+    for (int i=0; i<size; i++)
+        txbase[i] = i*7 + size;
+
+    double total_us = 0, poll_cpu = 0;
+    long long polls = 0;
+    struct dma_wait_stats ws0, ws1;
+    dma_wait_stats(&ws0);
+
+    for (int rep=0; rep<reps; rep++) {
+        uint64_t t0 = now();
+        if (dma_rx(size) || dma_tx(size))
+            return -1;
+        uint64_t t1 = now();
+
+        double c0 = cpu_us();
+        while (!wait_in_sync && dma_busy()) {
+            polls++;
+#ifdef DMA_MODEL
+            sched_yield();     // the model's thread may be sharing this CPU
+#endif
+        }
+        if (wait_in_sync && dma_sync())
+            return -1;
+        double c1 = cpu_us();
+        uint64_t t2 = now();
+
+        if (!wait_in_sync && dma_sync())
+            return -1;
+        uint64_t t3 = now();
+
+        setup[rep] = elapsed_us(t0, t1);
+        transfer[rep] = elapsed_us(t1, t2);
+        sync[rep] = elapsed_us(t2, t3);
+        total_us += elapsed_us(t0, t3);
+        poll_cpu += c1 - c0;
+    }
+
+    if (wait_in_sync) {
+        dma_wait_stats(&ws1);
+        polls = ws1.polls - ws0.polls;
+    }
+
+    r->errors = 0;
+    for (int i=0; i<size; i++)
+        if (rxbase[i] != txbase[i])
+            r->errors++;
+
+    r->size = size;
+    r->mb_per_s = (total_us > 0) ? (double)size*reps / total_us : 0;   // bytes per microsecond == MB/s
+    r->poll_cpu_us = poll_cpu / reps;
+    r->polls = (double)polls / reps;
+    percentiles(setup, reps, r->setup);
+    percentiles(transfer, reps, r->transfer);
+    percentiles(sync, reps, r->sync);
+    return 0;
+}
+
+static void print_json_part(const char *name, const double p[3]) {
+    printf("\"%s\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f}, ", name, p[0], p[1], p[2]);
+}
+
+static void print_json(struct result *r, int n, int reps, const char *timer_name, int wait_in_sync) {
+    printf("{\n");
+    printf("  \"backend\": \"%s\",\n",
+#ifdef DMA_MODEL
+           "model"
+#else
+           "hardware"
+#endif
+           );
+    printf("  \"timer\": \"%s\",\n", timer_name);
+    printf("  \"reps\": %d,\n", reps);
+    printf("  \"wait\": \"%s\",\n", wait_in_sync ? "sync" : "poll");
+    struct dma_init_stats is;
+    dma_init_stats(&is);
+    printf("  \"init\": {\"total_us\": %.1f, \"open_us\": %.1f, \"buffers_us\": %.1f, \"buffers\": %d},\n",
+           is.total_us, is.open_us, is.buffers_us, is.buffers);
+    if (wait_in_sync) {
+        struct dma_wait_stats ws;
+        dma_wait_stats(&ws);
+        printf("  \"wait_fit\": {\"mb_per_s\": %.3f, \"setup_us\": %.3f, \"error_us\": %.3f, \"sleep_us\": %.1f},\n",
+               ws.mb_per_s, ws.setup_us, ws.error_us, ws.sleep_us);
+    }
+    printf("  \"results\": [\n");
+    for (int i=0; i<n; i++) {
+        printf("    {\"size\": %d, \"mb_per_s\": %.3f, ", r[i].size, r[i].mb_per_s);
+        print_json_part("setup_us", r[i].setup);
+        print_json_part("transfer_us", r[i].transfer);
+        print_json_part("sync_us", r[i].sync);
+        printf("\"poll_cpu_us\": %.3f, \"polls\": %.1f, \"errors\": %d}%s\n",
+               r[i].poll_cpu_us, r[i].polls, r[i].errors, (i < n-1) ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+static void print_csv(struct result *r, int n) {
+    printf("size,mb_per_s,setup_p50_us,setup_p99_us,setup_p999_us,"
+           "transfer_p50_us,transfer_p99_us,transfer_p999_us,"
+           "sync_p50_us,sync_p99_us,sync_p999_us,poll_cpu_us,polls,errors\n");
+    for (int i=0; i<n; i++) {
+        printf("%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f,%d\n",
+               r[i].size, r[i].mb_per_s,
+               r[i].setup[0], r[i].setup[1], r[i].setup[2],
+               r[i].transfer[0], r[i].transfer[1], r[i].transfer[2],
+               r[i].sync[0], r[i].sync[1], r[i].sync[2],
+               r[i].poll_cpu_us, r[i].polls, r[i].errors);
+    }
+}
+
+
+// The producer benchmark (-p): several threads sharing the DMA
+static pthread_mutex_t dma_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct producer {
+    int reps, use_service;
+    int bytes;           // size of each transfer
+    double *latency;     // one sample per transfer, in microseconds
+    int errors;
+};
+
+static void *producer_main(void *arg) {
+    struct producer *p = arg;
+    struct dma_request req = { .tx_offset = 0, .rx_offset = 0, .len = p->bytes };
+
+    for (int rep=0; rep<p->reps; rep++) {
+        uint64_t t0 = now();
+        if (p->use_service) {
+            if (dma_submit(&req) || dma_request_wait(&req))
+                p->errors++;
+        } else {
+            pthread_mutex_lock(&dma_mutex);
+            if (dma_rx(p->bytes) || dma_tx(p->bytes) || dma_sync())
+                p->errors++;
+            pthread_mutex_unlock(&dma_mutex);
+        }
+        p->latency[rep] = elapsed_us(t0, now());
+    }
+    return NULL;
+}
+
+// Results for one number of producers and one way of sharing the DMA
+struct producer_result {
+    int producers, use_service;
+    double transfers_per_s;
+    double latency[3];   // p50, p99, p99.9, in microseconds
+    double mean_batch;   // requests the service thread ran per batch
+    int errors;
+};
+
+static int bench_producers(int nthreads, int reps, int bytes, int use_service, double *samples,
+                           struct producer_result *r) {
+    pthread_t threads[MAX_PRODUCERS];
+    struct producer p[MAX_PRODUCERS];
+    struct dma_service_stats st0, st1;
+
+    if (use_service && dma_service_start())
+        return -1;
+    dma_service_stats(&st0);
+
+    uint64_t t0 = now();
+    for (int t=0; t<nthreads; t++) {
+        p[t] = (struct producer){ .reps = reps, .use_service = use_service, .bytes = bytes,
+                                  .latency = samples + t*reps };
+        if (pthread_create(&threads[t], NULL, producer_main, &p[t])) {
+            printf("ERROR: Could not start producer thread\n");
+            nthreads = t;
+            break;
+        }
+    }
+    r->errors = 0;
+    for (int t=0; t<nthreads; t++) {
+        pthread_join(threads[t], NULL);
+        r->errors += p[t].errors;
+    }
+    double total_us = elapsed_us(t0, now());
+
+    dma_service_stats(&st1);
+    if (use_service)
+        dma_service_stop();
+
+    long long batches = st1.batches - st0.batches;
+    r->producers = nthreads;
+    r->use_service = use_service;
+    r->transfers_per_s = (total_us > 0) ? nthreads * reps * 1e6 / total_us : 0;
+    r->mean_batch = batches ? (double)(st1.requests - st0.requests) / batches : 0;
+    percentiles(samples, nthreads * reps, r->latency);
+    return 0;
+}
+
+static void print_producers(struct producer_result *r, int n, int reps, int bytes, const char *timer_name, int csv) {
+    if (csv) {
+        printf("producers,method,transfers_per_s,latency_p50_us,latency_p99_us,latency_p999_us,mean_batch,errors\n");
+        for (int i=0; i<n; i++)
+            printf("%d,%s,%.1f,%.3f,%.3f,%.3f,%.2f,%d\n", r[i].producers, r[i].use_service ? "service" : "mutex",
+                   r[i].transfers_per_s, r[i].latency[0], r[i].latency[1], r[i].latency[2],
+                   r[i].mean_batch, r[i].errors);
+        return;
+    }
+
+    printf("{\n");
+    printf("  \"backend\": \"%s\",\n",
+#ifdef DMA_MODEL
+           "model"
+#else
+           "hardware"
+#endif
+           );
+    printf("  \"timer\": \"%s\",\n", timer_name);
+    printf("  \"reps\": %d,\n", reps);
+    printf("  \"bytes\": %d,\n", bytes);
+    printf("  \"results\": [\n");
+    for (int i=0; i<n; i++) {
+        printf("    {\"producers\": %d, \"method\": \"%s\", \"transfers_per_s\": %.1f, ",
+               r[i].producers, r[i].use_service ? "service" : "mutex", r[i].transfers_per_s);
+        print_json_part("latency_us", r[i].latency);
+        printf("\"mean_batch\": %.2f, \"errors\": %d}%s\n", r[i].mean_batch, r[i].errors, (i < n-1) ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+static void usage() {
+    printf("Usage: dmabench [-n reps] [-M max_bytes] [-f json|csv] [-t clock|axi] [-w poll|sync] [-p producers]\n");
+}
+
+int main(int argc, char **argv) {
+    int reps = DEFAULT_REPS;
+    // Sizes must be multiples of the stream width (note 14 in dma.h)
+    int max_size = ((1<<MAX_DMA_LEN_BITS) - 1) & ~(DMA_DATA_WIDTH-1);   // the largest legal transfer
+    int csv = 0, use_axi_timer = 0, wait_in_sync = 0, producers = 0, max_given = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:M:f:t:w:p:")) != -1) {
+        switch (opt) {
+        case 'n': reps = atoi(optarg); break;
+        case 'M': max_size = atoi(optarg) & ~(DMA_DATA_WIDTH-1); max_given = 1; break;
+        case 'f': csv = (strcmp(optarg, "csv") == 0); break;
+        case 't': use_axi_timer = (strcmp(optarg, "axi") == 0); break;
+        case 'w': wait_in_sync = (strcmp(optarg, "sync") == 0); break;
+        case 'p': producers = atoi(optarg); break;
+        default: usage(); return -1;
+        }
+    }
+    if (reps < 1 || max_size < DMA_DATA_WIDTH || producers < 0 || producers > MAX_PRODUCERS) {
+        usage();
+        return -1;
+    }
+
+#ifdef DMA_MODEL
+    if (use_axi_timer) {
+        fprintf(stderr, "The AXI Timer is not available with the DMA model; using CLOCK_MONOTONIC_RAW\n");
+        use_axi_timer = 0;
+    }
+#endif
+    if (use_axi_timer && timer_open())
+        return -1;
+
+    if (producers) {
+        int bytes = max_given ? max_size : PRODUCER_BYTES;
+        if (dma_init(bytes))
+            return -1;
+        dma_reset();
+
+        double *samples = malloc((size_t)producers * reps * sizeof(double));
+        if (samples == NULL) {
+            printf("ERROR: cannot allocate %d x %d samples\n", producers, reps);
+            dma_cleanup();
+            timer_close();
+            return -1;
+        }
+        struct producer_result pr[16];
+        int n = 0, res = 0;
+        for (int t=1; res == 0; t *= 2) {
+            if (t > producers)
+                t = producers;
+            for (int use_service=0; use_service<2 && res == 0; use_service++)
+                if ((res = bench_producers(t, reps, bytes, use_service, samples, &pr[n])) == 0)
+                    n++;
+            if (t == producers)
+                break;
+        }
+        print_producers(pr, n, reps, bytes, use_axi_timer ? "axi_timer" : "clock_monotonic_raw", csv);
+
+        free(samples);
+        dma_cleanup();
+        timer_close();
+        return res;
+    }
+
+    // One pair of buffers, big enough for the largest transfer
+    if (dma_init(max_size))
+        return -1;
+    dma_reset();
+
+    double *setup = malloc(reps*sizeof(double));
+    double *transfer = malloc(reps*sizeof(double));
+    double *sync = malloc(reps*sizeof(double));
+    if (setup == NULL || transfer == NULL || sync == NULL) {
+        printf("ERROR: cannot allocate %d samples\n", reps);
+        free(setup);
+        free(transfer);
+        free(sync);
+        dma_cleanup();
+        timer_close();
+        return -1;
+    }
+    struct result results[32];
+    int n = 0;
+
+    int res = 0;
+    for (int size=DMA_DATA_WIDTH; res == 0; size *= 2) {
+        if (size > max_size)
+            size = max_size;
+        res = bench_size(size, reps, wait_in_sync, setup, transfer, sync, &results[n]);
+        if (res == 0)
+            n++;
+        if (size == max_size)
+            break;
+    }
+
+    if (csv)
+        print_csv(results, n);
+    else
+        print_json(results, n, reps, use_axi_timer ? "axi_timer" : "clock_monotonic_raw", wait_in_sync);
+
+    free(setup);
+    free(transfer);
+    free(sync);
+    dma_cleanup();
+    timer_close();
+    return res;
+}
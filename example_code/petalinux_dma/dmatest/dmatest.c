@@ -33,32 +33,1159 @@
 //    6. Your dmabuffer module is confiugred to have a buffer of size 2^20. (If this is not true,
 //       then change macro DMABUFFER_LEN in dma.h to match the actual buffer length.)
 
+// Modes ("dmatest <n> <mode>"; with no mode, one simple-mode transfer of n ints):
+//    sg        the same transfer in scatter-gather mode (needs the scatter-gather engine)
+//    ring      streams several blocks of n ints through a ring of buffers
+//    irq       waits for the DMA's interrupts through UIO instead of polling; change
+//              MM2S_UIO and S2MM_UIO below to match your device tree
+//    async     splits the n ints into several asynchronous transfers and waits for them
+//              with dma_xfer_wait_any()
+//    stripe    splits the n ints over the DMAs at STRIPE_BASES below (in scatter-gather
+//              mode); each of them must be in its own loopback
+//    stream    writes n ints to a temporary file and streams it through the DMA into
+//              another one with dma_stream()
+//    zerocopy  sends the n ints from the program's own memory (dma_register()), into a
+//              memfd registered with dma_register_dmabuf() (not a real dma-buf, so bounced)
+//    cached    uses cached Tx and Rx buffers (dma_init_mode())
+//    batch     sends the n ints as a batch of small transfers with dma_batch(), each
+//              landing in reverse order, and compares the cost per transfer with
+//              dma_rx()/dma_tx()/dma_sync()
+//    sgbatch   the same in scatter-gather mode
+//    service   SERVICE_THREADS threads share the DMA through the service thread
+//              (dma_service_start()); half wait on each request, half use callbacks
+//    pool      acquires blocks of assorted sizes from a buffer pool (dma_pool_create()),
+//              checks that they do not overlap, and sends the n ints between two of them
+//    startup   reserves the buffers together with dma_buffers_reserve(), and prints how
+//              long dma_init() and the reservation took
+//    wide      checks that transfers which do not fit a WIDE_WIDTH-byte stream are
+//              refused, then moves the n ints in odd-sized pieces with the DRE on (needs
+//              a DMA configured that way; the model accepts anything)
+//    capture   captures a never-ending stream of counting words into a ring of
+//              CAPTURE_SLOTS slots (dma_capture_start()), checks that the count runs on
+//              except where slots are reported lost or stalled, then stops reading and
+//              checks that the overrun is reported. Against the model the words come from its source; on
+//              a board something must feed the S2MM stream (needs scatter-gather)
+//    mc        the AXI MCDMA at MC_BASE, with MC_CHANNELS channels looped back and TDEST
+//              picking the channel that receives each packet
+//    export    exports a cached RxBuffer as a dma-buf (dma_export_rx_buffer()) and has a
+//              child process map it and check the data without any copy
+
 // This test will:
 //    - initialize the buffers and DMA
 //    - write test data into the Tx buffer
 //    - run the DMA
 //    - check that the Rx buffer matches
+//
+// To run it without a board, against the software model of the DMA:
+//    gcc -DDMA_MODEL -I../memalloc -I../dma_driver dmatest.c ../dma_driver/dma.c ../dma_driver/dma_model.c -lpthread
 
+#include <string.h>
 
 #include <stdio.h>
 #include <fcntl.h>  // file operations
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/dma-buf.h>
 #include "dma.h"
 
+#define MM2S_UIO "/dev/uio0"   // UIO devices for the DMA's interrupts (for "irq" mode)
+#define S2MM_UIO "/dev/uio1"
+
+#define RING_SLOTS  4    // buffer pairs in the ring
+#define RING_BLOCKS 64   // blocks streamed through the ring
+
+// Stream RING_BLOCKS blocks of txsize ints through a ring of buffers, checking each block
+// as it comes back. Also count how often the CPU was filling or draining a buffer while
+// the DMA was moving another one.
+static int ring_test(int txsize) {
+    int res = dma_ring_init(RING_SLOTS, txsize*sizeof(int));
+    if (res != 0)
+        return res;
+
+    dma_reset();
+
+    int filled = 0, drained = 0, errors = 0;
+    int overlapped_fills = 0, overlapped_drains = 0;
+
+    while (drained < RING_BLOCKS) {
+        // Fill and submit as many slots as we can
+        int slot;
+        while (filled < RING_BLOCKS && (slot = dma_ring_produce()) >= 0) {
+            overlapped_fills += dma_ring_in_flight();
+            int* txbase = (int*) dma_ring_tx_buffer(slot);
+            for (int i=0; i<txsize; i++)
+                txbase[i] = (filled << 16) + i;
+            res = dma_ring_submit(txsize*sizeof(int));
+            if (res != 0)
+                return res;
+            filled++;
+        }
+
+        // Drain the oldest slot
+        slot = dma_ring_wait();
+        if (slot < 0)
+            return -1;
+        overlapped_drains += dma_ring_in_flight();
+        int* rxbase = (int*) dma_ring_rx_buffer(slot);
+        for (int i=0; i<txsize; i++) {
+            if (rxbase[i] != (drained << 16) + i) {
+                errors++;
+                printf("Error on block %d word %d: Expected 0x%x, received 0x%x\r\n", drained, i, (drained << 16) + i, rxbase[i]);
+            }
+        }
+        dma_ring_release();
+        drained++;
+    }
+
+    if (errors)
+        printf("%d errors\r\n", errors);
+    else
+        printf("All data (%d blocks of %d ints) received successfully.\r\n", RING_BLOCKS, txsize);
+    printf("%d of %d fills and %d of %d drains overlapped with a DMA transfer.\r\n",
+           overlapped_fills, RING_BLOCKS, overlapped_drains, RING_BLOCKS);
+
+    dma_cleanup();
+    return 0;
+}
+
+#define STRIPE_ENGINES 2 // DMAs used by the "stripe" test, and their base addresses
+static const unsigned int STRIPE_BASES[STRIPE_ENGINES] = { DMA_BASE, DMA_BASE + 0x10000 };
+
+// Send txsize ints with the transfer split over STRIPE_ENGINES DMAs
+static int stripe_test(int txsize) {
+    struct dma_stripe *s = dma_stripe_init(STRIPE_BASES, STRIPE_ENGINES, txsize*sizeof(int), 1);
+    if (s == NULL)
+        return -1;
+
+    int* txbase = (int*) dma_stripe_tx_buffer(s);
+    int* rxbase = (int*) dma_stripe_rx_buffer(s);
+    for (int i=0; i<txsize; i++) {
+        txbase[i] = 0x70000000 + i;
+        rxbase[i] = 0;
+    }
+
+    dma_stripe_reset(s);
+
+    int res = dma_stripe_rx(s, txsize*sizeof(int));
+    if (res == 0)
+        res = dma_stripe_tx(s, txsize*sizeof(int));
+    if (res == 0)
+        res = dma_stripe_sync(s);
+    if (res != 0) {
+        dma_stripe_cleanup(s);
+        return res;
+    }
+
+    int errors=0;
+    for (int i=0; i<txsize; i++) {
+        if (txbase[i] != rxbase[i]) {
+            errors++;
+            printf("Error on word %d: Expected 0x%x, received 0x%x\r\n", i, txbase[i], rxbase[i]);
+        }
+    }
+    if (errors)
+        printf("%d errors\r\n", errors);
+    else
+        printf("All data (%d ints over %d DMAs) received successfully.\r\n", txsize, STRIPE_ENGINES);
+
+    dma_stripe_cleanup(s);
+    return 0;
+}
+
+// Stream txsize ints from one temporary file to another through a buffer ring, and
+// check the output file
+static int stream_test(int txsize) {
+    FILE *in = tmpfile();
+    FILE *out = tmpfile();
+    if (in == NULL || out == NULL) {
+        printf("ERROR: failed to create temporary files\r\n");
+        return -1;
+    }
+
+    for (int i=0; i<txsize; i++) {
+        int word = 0x70000000 + i;
+        fwrite(&word, sizeof(int), 1, in);
+    }
+    fflush(in);
+    rewind(in);
+
+    // Each slot holds the largest legal transfer; dma_stream() picks the chunk size
+    int res = dma_ring_init(RING_SLOTS, DMA_SG_MAX_CHUNK);
+    if (res != 0)
+        return res;
+    dma_reset();
+
+    struct dma_stream_stats stats;
+    res = dma_stream(fileno(in), fileno(out), &stats);
+    dma_cleanup();
+    if (res != 0)
+        return res;
+
+    rewind(out);
+    int errors=0;
+    for (int i=0; i<txsize; i++) {
+        int word;
+        if (fread(&word, sizeof(int), 1, out) != 1 || word != 0x70000000 + i) {
+            errors++;
+            if (errors < 10)
+                printf("Error on word %d\r\n", i);
+        }
+    }
+    if (errors)
+        printf("%d errors\r\n", errors);
+    else
+        printf("All data (%lld bytes in %d chunks) streamed successfully.\r\n", stats.bytes, stats.chunks);
+    printf("%.1f MB/s, settled on %d-byte chunks.\r\n", stats.mb_per_s, stats.chunk_size);
+
+    fclose(in);
+    fclose(out);
+    return 0;
+}
+
+#define BATCH_INTS 16    // ints per transfer in the "batch" tests
+
+#define SERVICE_THREADS 4 // producer threads in the "service" test
+
+#define POOL_REGIONS 2          // memalloc buffers in the "pool" test's pool...
+#define POOL_REGION_SIZE 262144 // ...of this many bytes each
+#define POOL_BLOCKS 256         // blocks of assorted sizes it acquires
+
+// Send txsize ints in BATCH_INTS-int transfers, first one at a time, then as one batch
+// whose transfers land in the RxBuffer in reverse order
+static int batch_test(int txsize, int sg) {
+    int n = (txsize + BATCH_INTS - 1) / BATCH_INTS;
+    txsize = n * BATCH_INTS;
+    int res = sg ? dma_sg_init(txsize*sizeof(int)) : dma_init(txsize*sizeof(int));
+    if (res != 0)
+        return res;
+    dma_reset();
+
+    int* txbase = (int*) getTxBuffer();
+    int* rxbase = (int*) getRxBuffer();
+    for (int i=0; i<txsize; i++) {
+        txbase[i] = 0x70000000 + i;
+        rxbase[i] = 0;
+    }
+
+    struct dma_batch_entry *e = malloc(n * sizeof(struct dma_batch_entry));
+    for (int i=0; i<n; i++) {
+        e[i].tx_offset = i * BATCH_INTS * sizeof(int);
+        e[i].rx_offset = (n-1-i) * BATCH_INTS * sizeof(int);
+        e[i].len = BATCH_INTS * sizeof(int);
+    }
+
+    // The same number of transfers, one call each
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i=0; i<n && res == 0; i++) {
+        if (sg)
+            res = dma_sg_rx(e[i].len) || dma_sg_tx(e[i].len) || dma_sg_sync();
+        else
+            res = dma_rx(e[i].len) || dma_tx(e[i].len) || dma_sync();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double single_us = ((t1.tv_sec - t0.tv_sec)*1e9 + (t1.tv_nsec - t0.tv_nsec)) / 1000.0 / n;
+
+    struct dma_batch_stats stats;
+    if (res == 0)
+        res = dma_batch(e, n, &stats);
+    if (res != 0) {
+        free(e);
+        dma_cleanup();
+        return -1;
+    }
+
+    int errors=0;
+    for (int i=0; i<n; i++) {
+        for (int k=0; k<BATCH_INTS; k++) {
+            int expected = 0x70000000 + i*BATCH_INTS + k;
+            int received = rxbase[(n-1-i)*BATCH_INTS + k];
+            if (received != expected) {
+                errors++;
+                if (errors < 10)
+                    printf("Error in transfer %d, word %d: Expected 0x%x, received 0x%x\r\n", i, k, expected, received);
+            }
+        }
+    }
+    if (errors)
+        printf("%d errors\r\n", errors);
+    else
+        printf("All data (%d transfers of %d ints) received successfully.\r\n", n, BATCH_INTS);
+    printf("%.2f us per transfer one at a time, %.2f us batched (%d register writes).\r\n",
+           single_us, stats.us_per_transfer, stats.reg_writes);
+
+    free(e);
+    dma_cleanup();
+    return 0;
+}
+
+// One producer thread of the "service" test: it sends transfers t, t+SERVICE_THREADS, ...
+struct producer {
+    int t, n;            // thread number, and total number of transfers
+    int use_callback;
+    int left;            // callback requests not yet done
+    int failed;
+};
+
+static void producer_done(struct dma_request *req, int status) {
+    struct producer *p = req->arg;
+    if (status)
+        __atomic_fetch_add(&p->failed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&p->left, 1, __ATOMIC_RELEASE);
+}
+
+static void *producer_main(void *arg) {
+    struct producer *p = arg;
+    int mine = (p->n - p->t + SERVICE_THREADS - 1) / SERVICE_THREADS;
+    struct dma_request *req = calloc(mine, sizeof(struct dma_request));
+
+    p->left = mine;
+    for (int k=0; k<mine; k++) {
+        int i = p->t + k*SERVICE_THREADS;
+        req[k].tx_offset = req[k].rx_offset = i * BATCH_INTS * sizeof(int);
+        req[k].len = BATCH_INTS * sizeof(int);
+        if (p->use_callback) {
+            req[k].done = producer_done;
+            req[k].arg = p;
+            if (dma_submit(&req[k])) {
+                p->failed++;
+                __atomic_fetch_sub(&p->left, 1, __ATOMIC_RELEASE);
+            }
+        } else if (dma_submit(&req[k]) || dma_request_wait(&req[k])) {
+            p->failed++;
+        }
+    }
+    while (__atomic_load_n(&p->left, __ATOMIC_ACQUIRE) > 0 && p->use_callback)
+        sched_yield();
+
+    free(req);
+    return NULL;
+}
+
+// Send txsize ints in BATCH_INTS-int transfers from SERVICE_THREADS threads at once,
+// through the service thread
+static int service_test(int txsize) {
+    int n = (txsize + BATCH_INTS - 1) / BATCH_INTS;
+    txsize = n * BATCH_INTS;
+    if (dma_init(txsize*sizeof(int)))
+        return -1;
+    dma_reset();
+
+    int* txbase = (int*) getTxBuffer();
+    int* rxbase = (int*) getRxBuffer();
+    for (int i=0; i<txsize; i++) {
+        txbase[i] = 0x50000000 + i;
+        rxbase[i] = 0;
+    }
+
+    if (dma_service_start()) {
+        dma_cleanup();
+        return -1;
+    }
+
+    pthread_t threads[SERVICE_THREADS];
+    struct producer p[SERVICE_THREADS];
+    for (int t=0; t<SERVICE_THREADS; t++) {
+        p[t] = (struct producer){ .t = t, .n = n, .use_callback = t & 1 };
+        pthread_create(&threads[t], NULL, producer_main, &p[t]);
+    }
+    int failed = 0;
+    for (int t=0; t<SERVICE_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        failed += p[t].failed;
+    }
+
+    struct dma_service_stats stats;
+    dma_service_stats(&stats);
+    dma_service_stop();
+
+    int errors=0;
+    for (int i=0; i<txsize; i++) {
+        if (rxbase[i] != 0x50000000 + i) {
+            errors++;
+            if (errors < 10)
+                printf("Error in word %d: Expected 0x%x, received 0x%x\r\n", i, 0x50000000 + i, rxbase[i]);
+        }
+    }
+    if (errors || failed)
+        printf("%d errors, %d failed requests\r\n", errors, failed);
+    else
+        printf("All data (%d transfers of %d ints, from %d threads) received successfully.\r\n",
+               n, BATCH_INTS, SERVICE_THREADS);
+    printf("%lld requests in %lld batches (%.1f per batch), %lld wakeups.\r\n",
+           stats.requests, stats.batches, stats.mean_batch, stats.wakeups);
+
+    dma_cleanup();
+    return (errors || failed) ? -1 : 0;
+}
+
+// Acquire and release blocks of assorted sizes from a pool, then send txsize ints from one
+// pool block to another
+static int pool_test(int txsize) {
+    int bytes = txsize * sizeof(int);
+    if (bytes > DMA_POOL_SLAB_SIZE || bytes >= (1<<MAX_DMA_LEN_BITS)) {
+        printf("ERROR: The pool test sends at most %d ints\r\n",
+               ((DMA_POOL_SLAB_SIZE < (1<<MAX_DMA_LEN_BITS)) ? DMA_POOL_SLAB_SIZE : (1<<MAX_DMA_LEN_BITS) - 4) / 4);
+        return -1;
+    }
+    if (dma_init(4096))
+        return -1;
+    dma_reset();
+
+    struct dma_pool *pool = dma_pool_create(POOL_REGIONS, POOL_REGION_SIZE, DMA_BUF_COHERENT);
+    if (pool == NULL) {
+        dma_cleanup();
+        return -1;
+    }
+
+    // Blocks of 1 byte to 1 KB; fill each with its number, so overlaps show up
+    unsigned char *blocks[POOL_BLOCKS];
+    int sizes[POOL_BLOCKS];
+    int errors = 0;
+    unsigned int seed = 1;
+    for (int i=0; i<POOL_BLOCKS; i++) {
+        unsigned int phy = 0;
+        sizes[i] = 1 + rand_r(&seed) % 1024;
+        blocks[i] = dma_pool_acquire(pool, sizes[i], &phy);
+        if (blocks[i] == NULL || ((uintptr_t)blocks[i] % 64) != 0 || (phy % 64) != 0) {
+            printf("Error: block %d (%d bytes) at %p, physical 0x%x\r\n", i, sizes[i], blocks[i], phy);
+            errors++;
+            sizes[i] = 0;
+            continue;
+        }
+        memset(blocks[i], i, sizes[i]);
+    }
+    // Give every other block back, and take new ones in their place
+    for (int i=0; i<POOL_BLOCKS; i+=2) {
+        dma_pool_release(pool, blocks[i]);
+        blocks[i] = dma_pool_acquire(pool, sizes[i] ? sizes[i] : 1, NULL);
+        if (blocks[i])
+            memset(blocks[i], i, sizes[i]);
+    }
+    for (int i=0; i<POOL_BLOCKS; i++)
+        for (int k=0; k<sizes[i]; k++)
+            if (blocks[i][k] != (unsigned char)i) {
+                printf("Error: block %d was overwritten at byte %d\r\n", i, k);
+                errors++;
+                break;
+            }
+
+    struct dma_pool_stats stats;
+    dma_pool_stats(pool, &stats);
+    printf("Pool: %lld bytes in use (high water %lld), %d of %d slabs free\r\n",
+           stats.bytes_in_use, stats.bytes_high_water, stats.free_slabs, stats.total_slabs);
+    for (int c=0; c<DMA_POOL_CLASSES; c++)
+        if (stats.slabs[c])
+            printf("    %6d-byte blocks: %d in use, in %d slabs\r\n",
+                   stats.block_size[c], stats.blocks_in_use[c], stats.slabs[c]);
+
+    // Releasing a block twice must be refused, and leave the pool as it was
+    unsigned char *keep = dma_pool_acquire(pool, 64, NULL);
+    unsigned char *twice = dma_pool_acquire(pool, 64, NULL);
+    dma_pool_release(pool, twice);
+    dma_pool_stats(pool, &stats);
+    long long in_use = stats.bytes_in_use;
+    printf("Releasing a block twice (expect an ERROR):\r\n");
+    dma_pool_release(pool, twice);
+    dma_pool_stats(pool, &stats);
+    if (keep == NULL || twice == NULL || stats.bytes_in_use != in_use) {
+        printf("Error: releasing a block twice changed the pool (%lld bytes in use, not %lld)\r\n",
+               stats.bytes_in_use, in_use);
+        errors++;
+    }
+    dma_pool_release(pool, keep);
+
+    // Time acquiring and releasing one block
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i=0; i<100000; i++)
+        dma_pool_release(pool, dma_pool_acquire(pool, 1024, NULL));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%.1f ns to acquire and release a block\r\n",
+           ((t1.tv_sec - t0.tv_sec)*1e9 + (t1.tv_nsec - t0.tv_nsec)) / 100000);
+
+    for (int i=0; i<POOL_BLOCKS; i++)
+        dma_pool_release(pool, blocks[i]);
+
+    // Move data between two pool blocks
+    unsigned int tx_phy, rx_phy;
+    int *tx = dma_pool_acquire(pool, bytes, &tx_phy);
+    int *rx = dma_pool_acquire(pool, bytes, &rx_phy);
+    int res = -1;
+    if (tx && rx) {
+        for (int i=0; i<txsize; i++) {
+            tx[i] = 0x30000000 + i;
+            rx[i] = 0;
+        }
+        res = dma_rx_phys(rx_phy, bytes) || dma_tx_phys(tx_phy, bytes) || dma_sync();
+    }
+    if (res == 0) {
+        for (int i=0; i<txsize; i++) {
+            if (rx[i] != 0x30000000 + i) {
+                errors++;
+                if (errors < 10)
+                    printf("Error in word %d: Expected 0x%x, received 0x%x\r\n", i, 0x30000000 + i, rx[i]);
+            }
+        }
+    }
+    dma_pool_release(pool, tx);
+    dma_pool_release(pool, rx);
+
+    dma_pool_stats(pool, &stats);
+    if (stats.bytes_in_use != 0) {
+        printf("Error: %lld bytes still in use\r\n", stats.bytes_in_use);
+        errors++;
+    }
+    if (errors || res)
+        printf("%d errors\r\n", errors);
+    else
+        printf("All data (%d ints, between pool blocks) received successfully.\r\n", txsize);
+
+    dma_pool_destroy(pool);
+    dma_cleanup();
+    return (errors || res) ? -1 : 0;
+}
+
+// Reserve a pair of buffers in one call, and send txsize ints from one to the other
+static int startup_test(int txsize) {
+    int bytes = txsize * sizeof(int);
+    if (dma_init(4))   // only for the DMA's registers
+        return -1;
+    dma_reset();
+
+    struct dma_init_stats is;
+    dma_init_stats(&is);
+    printf("dma_init(): %.1f us (%.1f us opening, %.1f us for %d buffers)\r\n",
+           is.total_us, is.open_us, is.buffers_us, is.buffers);
+
+    struct dma_buffer bufs[2] = {
+        { .size = bytes, .mode = DMA_BUF_COHERENT },
+        { .size = bytes, .mode = DMA_BUF_CACHED }
+    };
+    double us;
+    if (dma_buffers_reserve(bufs, 2, &us)) {
+        dma_cleanup();
+        return -1;
+    }
+    printf("dma_buffers_reserve(): %.1f us for 2 buffers of %d bytes\r\n", us, bytes);
+
+    int *tx = bufs[0].addr, *rx = bufs[1].addr;
+    for (int i=0; i<txsize; i++) {
+        tx[i] = 0x20000000 + i;
+        rx[i] = 0;
+    }
+    int res = dma_buffer_sync(&bufs[1], 0, bytes, MEMALLOC_SYNC_FOR_DEVICE) ||
+              dma_rx_phys(bufs[1].phy_addr, bytes) || dma_tx_phys(bufs[0].phy_addr, bytes) || dma_sync() ||
+              dma_buffer_sync(&bufs[1], 0, bytes, MEMALLOC_SYNC_FOR_CPU);
+
+    int errors=0;
+    for (int i=0; i<txsize && res == 0; i++) {
+        if (rx[i] != 0x20000000 + i) {
+            errors++;
+            if (errors < 10)
+                printf("Error in word %d: Expected 0x%x, received 0x%x\r\n", i, 0x20000000 + i, rx[i]);
+        }
+    }
+    if (errors || res)
+        printf("%d errors\r\n", errors);
+    else
+        printf("All data (%d ints) received successfully.\r\n", txsize);
+
+    dma_buffers_release(bufs, 2);
+    dma_cleanup();
+    return (errors || res) ? -1 : 0;
+}
+
+#define WIDE_WIDTH 16            // stream width for the "wide" test, in bytes
+
+// Check the driver against a wide stream, then against an unaligned (DRE) one
+static int wide_test(int txsize) {
+    int bytes = (txsize*sizeof(int) + WIDE_WIDTH-1) & ~(WIDE_WIDTH-1);
+    if (dma_init(bytes))
+        return -1;
+    dma_reset();
+
+    unsigned char *tx = getTxBuffer();
+    unsigned char *rx = getRxBuffer();
+    for (int i=0; i<bytes; i++) {
+        tx[i] = (unsigned char)(i*7 + 1);
+        rx[i] = 0;
+    }
+
+    // A WIDE_WIDTH-byte stream without the DRE: only whole, aligned beats
+    int res = dma_set_stream(WIDE_WIDTH, 0);
+    if (res == 0) {
+        printf("Expect three transfers to be refused for a %d-byte stream:\r\n", WIDE_WIDTH);
+        struct dma_batch_entry odd_size = { 0, 0, WIDE_WIDTH + 4 };
+        struct dma_batch_entry odd_offset = { 4, 4, WIDE_WIDTH };
+        if (dma_rx(WIDE_WIDTH + 4) == 0 || dma_batch(&odd_size, 1, NULL) == 0 ||
+            dma_batch(&odd_offset, 1, NULL) == 0) {
+            printf("ERROR: A transfer that does not fit the stream was accepted\r\n");
+            res = -1;
+        }
+    }
+    if (res == 0)
+        res = dma_rx(bytes) || dma_tx(bytes) || dma_sync();
+
+    int errors=0;
+    for (int i=0; i<bytes && res == 0; i++)
+        if (rx[i] != tx[i])
+            errors++;
+    if (res == 0 && errors == 0)
+        printf("%d bytes received successfully over a %d-byte stream.\r\n", bytes, WIDE_WIDTH);
+
+    // With the DRE: pieces of 1, 2, ... bytes, each from one byte above where it lands
+    struct dma_batch_entry e[64];
+    int n = 0;
+    if (res == 0 && errors == 0 && (res = dma_set_stream(8, 1)) == 0) {
+        memset(rx, 0, bytes);
+        for (int pos = 1; pos < bytes && n < 64; n++) {
+            e[n].tx_offset = pos;
+            e[n].rx_offset = pos - 1;
+            e[n].len = (n + 1 < bytes - pos) ? n + 1 : bytes - pos;
+            pos += e[n].len;
+        }
+        res = dma_batch(e, n, NULL);
+        for (int k=0; k<n && res == 0; k++)
+            for (int i=0; i<e[k].len; i++)
+                if (rx[e[k].rx_offset + i] != tx[e[k].tx_offset + i]) {
+                    errors++;
+                    if (errors < 10)
+                        printf("Error in piece %d, byte %d: Expected 0x%x, received 0x%x\r\n",
+                               k, i, tx[e[k].tx_offset + i], rx[e[k].rx_offset + i]);
+                }
+        if (res == 0 && errors == 0)
+            printf("%d unaligned pieces received successfully with the DRE.\r\n", n);
+    }
+
+    if (errors)
+        printf("%d errors\r\n", errors);
+    dma_cleanup();
+    return (errors || res) ? -1 : 0;
+}
+
+#define CAPTURE_SLOTS  16        // slots in the "capture" test's ring...
+#define CAPTURE_BLOCKS 256       // ...and how many of them it reads
+#define CAPTURE_MBPS   20        // rate of the model's source, for the "capture" test
+#define CAPTURE_POLLS  4         // polls of the capture thread each slot takes to fill, at least
+
+// Capture counting words in slots of (at least) txsize ints, and check that none go
+// missing unnoticed. As note 15 in dma.h asks, the slots are big enough that the capture
+// thread looks several times while each fills.
+static int capture_test(int txsize) {
+#ifdef DMA_MODEL
+    struct dma_model_config cfg = { .source_mbps = CAPTURE_MBPS };
+    dma_model_configure(&cfg);
+#endif
+    int slot_size = txsize*sizeof(int);
+    if (slot_size < CAPTURE_POLLS * DMA_CAPTURE_POLL_US * CAPTURE_MBPS)   // MB/s = bytes/us
+        slot_size = CAPTURE_POLLS * DMA_CAPTURE_POLL_US * CAPTURE_MBPS;
+    if (dma_init(4))   // only for the DMA's registers
+        return -1;
+    dma_reset();
+    if (dma_capture_start(CAPTURE_SLOTS, slot_size, DMA_BUF_COHERENT)) {
+        dma_cleanup();
+        return -1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int res = 0, errors = 0, have_next = 0, stalls = 0;
+    unsigned int next = 0;
+    long long lost = 0, bytes = 0;
+    for (int i=0; i<CAPTURE_BLOCKS && res == 0; i++) {
+        struct dma_capture_block b;
+        if (dma_capture_wait(&b, 1000) != 1) {
+            printf("ERROR: Nothing was captured\r\n");
+            res = -1;
+            break;
+        }
+        if (b.lost) {
+            lost += b.lost;
+            have_next = 0;
+        }
+        if (b.stalled) {   // words the source could not hold back are gone
+            stalls++;
+            have_next = 0;
+        }
+
+        // Like a seqlock: what was read only counts if the slot is still good afterwards
+        unsigned int *w = b.data;
+        unsigned int first = w[0];
+        int bad = -1;
+        for (int k=0; k<b.len/4 && bad < 0; k++)
+            if (w[k] != first + k)
+                bad = k;
+        unsigned int last = w[b.len/4 - 1];
+        if (dma_capture_release(&b)) {
+            lost++;
+            have_next = 0;
+            continue;
+        }
+
+        if (bad >= 0 || (have_next && first != next)) {
+            errors++;
+            if (errors < 10)
+                printf("Error in slot %llu: words do not run on (first 0x%x, expected 0x%x)\r\n",
+                       b.seq, first, have_next ? next : first);
+        }
+        next = last + 1;
+        have_next = 1;
+        bytes += b.len;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double us = (t1.tv_sec - t0.tv_sec)*1e6 + (t1.tv_nsec - t0.tv_nsec)/1e3;
+    if (res == 0)
+        printf("%lld bytes in %d slots at %.1f MB/s, %lld slots lost, %d stalls.\r\n", bytes, CAPTURE_BLOCKS, bytes/us, lost, stalls);
+
+    // Stop reading for long enough to go round the ring a few times
+    if (res == 0) {
+        usleep(4.0 * CAPTURE_SLOTS * slot_size / CAPTURE_MBPS);
+        struct dma_capture_block b;
+        if (dma_capture_wait(&b, 1000) != 1 || b.lost == 0) {
+            printf("ERROR: Overrun not reported\r\n");
+            res = -1;
+        } else {
+            printf("After a pause in reading, %lld slots were reported lost, as expected.\r\n", b.lost);
+            dma_capture_release(&b);
+        }
+    }
+
+    struct dma_capture_stats cs;
+    dma_capture_stats(&cs);
+    printf("%llu slots filled, %lld lost and %lld stalls in all; %llu slots counted.\r\n",
+           cs.slots, cs.lost, cs.stalls, dma_capture_head());
+
+    if (errors) {
+        printf("ERROR: %d slots did not run on from the one before\r\n", errors);
+        res = -1;
+    } else if (res == 0)
+        printf("All data (%d slots of %d bytes) captured successfully.\r\n", CAPTURE_BLOCKS, slot_size);
+    dma_cleanup();
+    return res;
+}
+
+#define MC_BASE     (DMA_BASE + 0x20000)  // the MCDMA used by the "mc" test
+#define MC_CHANNELS 4    // its channels
+#define MC_PARTS    4    // packets each channel sends per round...
+#define MC_ROUNDS   16   // ...and rounds
+
+// Check a finished MCDMA transfer of a "size"-byte packet. Returns 0 if it is all right.
+static int mc_check(struct dma_mc_completion *c, int size) {
+    if (c->status || c->len != size) {
+        printf("ERROR: MCDMA channel %d %s moved %d bytes of %d\r\n", c->channel,
+               c->dir == DMA_MC_TX ? "Tx" : "Rx", c->len, size);
+        return -1;
+    }
+    if (c->dir == DMA_MC_RX && c->tdest != c->channel) {
+        printf("ERROR: MCDMA channel %d received a packet for TDEST %d\r\n", c->channel, c->tdest);
+        return -1;
+    }
+    return 0;
+}
+
+// Send txsize ints from each of MC_CHANNELS channels of an MCDMA to the next channel
+static int mc_test(int txsize) {
+    int part = txsize / MC_PARTS;   // ints per packet
+    if (part < 1) {
+        printf("ERROR: The mc test needs at least %d ints\r\n", MC_PARTS);
+        return -1;
+    }
+    struct dma_mc *mc = dma_mc_init(MC_BASE, MC_CHANNELS, txsize*sizeof(int));
+    if (mc == NULL)
+        return -1;
+
+    int res = 0, errors = 0, lead = 0;
+    struct dma_mc_completion done[2*MC_CHANNELS*MC_PARTS];
+    for (int r=0; r<MC_ROUNDS && res == 0; r++) {
+        for (int ch=0; ch<MC_CHANNELS; ch++) {
+            int *tx = dma_mc_tx_buffer(mc, ch);
+            int *rx = dma_mc_rx_buffer(mc, ch);
+            for (int i=0; i<part*MC_PARTS; i++) {
+                tx[i] = (r << 24) | (ch << 20) | i;
+                rx[i] = 0;
+            }
+        }
+
+        // Queue the packets before the buffers to receive them: the stream waits for a
+        // buffer, so by then every channel has all its packets queued, and the MCDMA
+        // has to share the stream fairly between them
+        for (int ch=0; ch<MC_CHANNELS && res == 0; ch++)
+            for (int p=0; p<MC_PARTS && res == 0; p++)
+                res = dma_mc_tx(mc, ch, p*part*sizeof(int), part*sizeof(int), (ch+1) % MC_CHANNELS);
+        for (int ch=0; ch<MC_CHANNELS && res == 0; ch++)
+            for (int p=0; p<MC_PARTS && res == 0; p++)
+                res = dma_mc_rx(mc, ch, p*part*sizeof(int), part*sizeof(int));
+
+        // The first round waits on each channel in turn; the rest take whatever finishes
+        int sent[MC_CHANNELS] = { 0 };
+        int got = 0;
+        while (res == 0 && got < 2*MC_CHANNELS*MC_PARTS) {
+            int n;
+            if (r == 0) {
+                int q = got / MC_PARTS;
+                n = dma_mc_channel_wait(mc, q / 2, q % 2, &done[0], 1000);
+            } else {
+                n = dma_mc_wait(mc, done, 2*MC_CHANNELS*MC_PARTS, 1000);
+            }
+            if (n <= 0) {
+                printf("ERROR: MCDMA transfers did not finish\r\n");
+                res = -1;
+                break;
+            }
+            for (int i=0; i<n && res == 0; i++) {
+                res = mc_check(&done[i], part*sizeof(int));
+                if (done[i].dir != DMA_MC_TX || r == 0)
+                    continue;
+
+                // How far has this channel got ahead of the others?
+                int ch = done[i].channel;
+                sent[ch]++;
+                for (int other=0; other<MC_CHANNELS; other++)
+                    if (sent[ch] - sent[other] > lead)
+                        lead = sent[ch] - sent[other];
+            }
+            got += n;
+        }
+
+        for (int ch=0; ch<MC_CHANNELS && res == 0; ch++) {
+            int from = (ch + MC_CHANNELS - 1) % MC_CHANNELS;
+            int *tx = dma_mc_tx_buffer(mc, from);
+            int *rx = dma_mc_rx_buffer(mc, ch);
+            for (int i=0; i<part*MC_PARTS; i++) {
+                if (tx[i] != rx[i]) {
+                    errors++;
+                    if (errors < 10)
+                        printf("Error on channel %d, word %d: Expected 0x%x, received 0x%x\r\n", ch, i, tx[i], rx[i]);
+                }
+            }
+        }
+    }
+
+    if (res == 0 && lead > 2) {
+        printf("ERROR: One MCDMA channel got %d packets ahead of another\r\n", lead);
+        res = -1;
+    }
+    if (errors)
+        printf("%d errors\r\n", errors);
+    else if (res == 0)
+        printf("All data (%d rounds of %d packets on %d channels) received successfully; no channel got more than %d packets ahead.\r\n",
+               MC_ROUNDS, MC_PARTS, MC_CHANNELS, lead);
+
+    dma_mc_cleanup(mc);
+    return (errors || res) ? -1 : 0;
+}
+
+// Send txsize ints straight from the program's memory, into a memfd standing in for a
+// dma-buf, without using the driver's Tx and Rx buffers
+static int zerocopy_test(int txsize) {
+    int size = txsize*sizeof(int);
+    int res = dma_init(size);
+    if (res != 0)
+        return res;
+
+    int *txdata = aligned_alloc(4096, (size + 4095) & ~4095);
+    int fd = syscall(SYS_memfd_create, "dmatest", 0);
+    if (txdata == NULL || fd < 0 || ftruncate(fd, size)) {
+        printf("ERROR: failed to allocate test buffers\r\n");
+        return -1;
+    }
+    for (int i=0; i<txsize; i++)
+        txdata[i] = 0x70000000 + i;
+
+    int tx = dma_register(txdata, size);
+    int rx = dma_register_dmabuf(fd, size);
+    if (tx < 0 || rx < 0)
+        return -1;
+    printf("Tx region: %s; Rx region: %s\r\n", dma_region_zero_copy(tx) ? "zero-copy" : "bounced",
+           dma_region_zero_copy(rx) ? "zero-copy" : "bounced");
+
+    dma_reset();
+    res = dma_region_rx(rx, 0, size);
+    if (res == 0)
+        res = dma_region_tx(tx, 0, size);
+    if (res == 0)
+        res = dma_sync();
+    if (res != 0)
+        return res;
+
+    int *rxdata = (int*) dma_region_buffer(rx);
+    int errors=0;
+    for (int i=0; i<txsize; i++) {
+        if (txdata[i] != rxdata[i]) {
+            errors++;
+            printf("Error on word %d: Expected 0x%x, received 0x%x\r\n", i, txdata[i], rxdata[i]);
+        }
+    }
+    if (errors)
+        printf("%d errors\r\n", errors);
+    else
+        printf("All data (%d ints) received successfully.\r\n", txsize);
+
+    dma_cleanup();
+    close(fd);
+    free(txdata);
+    return 0;
+}
+
+// Start or end CPU access to a mapped dma-buf. (The model's stand-in for a dma-buf is a
+// memfd, which does not know this ioctl, and needs nothing.)
+static void dmabuf_cpu_access(int fd, int start) {
+    struct dma_buf_sync sync = { DMA_BUF_SYNC_READ | (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END) };
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+// The consumer in export_test(): receive a dma-buf fd on sock, map it, and check that it
+// holds txsize ints of test data. Returns: the number of errors, or -1 on error
+static int export_consumer(int sock, int txsize) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cmsg;
+    if (recvmsg(sock, &msg, 0) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        printf("ERROR: the consumer did not get a dma-buf\r\n");
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    int size = txsize*sizeof(int);
+    int *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        printf("ERROR: the consumer could not map the dma-buf\r\n");
+        return -1;
+    }
+    dmabuf_cpu_access(fd, 1);
+    int errors=0;
+    for (int i=0; i<txsize; i++) {
+        if (data[i] != 0x70000000 + i) {
+            errors++;
+            printf("Error on word %d: Expected 0x%x, received 0x%x\r\n", i, 0x70000000 + i, data[i]);
+        }
+    }
+    dmabuf_cpu_access(fd, 0);
+    munmap(data, size);
+    close(fd);
+    return errors;
+}
+
+// Receive txsize ints into a cached RxBuffer, then hand it to another process as a
+// dma-buf, and let that process check the data in place
+static int export_test(int txsize) {
+    int size = txsize*sizeof(int);
+    int res = dma_init_mode(size, DMA_BUF_COHERENT, DMA_BUF_CACHED);
+    if (res != 0)
+        return res;
+
+    int* txbase = (int*) getTxBuffer();
+    for (int i=0; i<txsize; i++)
+        txbase[i] = 0x70000000 + i;
+
+    dma_reset();
+    res = dma_rx(size);
+    if (res == 0)
+        res = dma_tx(size);
+    if (res == 0)
+        res = dma_sync();
+    int fd = (res == 0) ? dma_export_rx_buffer() : -1;
+    int sv[2];
+    if (fd < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        printf("ERROR: failed to export the RxBuffer\r\n");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        int errors = export_consumer(sv[1], txsize);
+        _exit(errors == 0 ? 0 : 1);
+    }
+    close(sv[1]);
+
+    // Send the fd, then our copy can go: the child's keeps the buffer alive
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (pid < 0 || sendmsg(sv[0], &msg, 0) != 1)
+        printf("ERROR: failed to send the dma-buf\r\n");
+    close(fd);
+    close(sv[0]);
+
+    int status = -1;
+    if (pid > 0)
+        waitpid(pid, &status, 0);
+    dma_cleanup();
+    if (status != 0) {
+        printf("The consumer process found errors\r\n");
+        return -1;
+    }
+    printf("All data (%d ints) received successfully by another process, through a dma-buf.\r\n", txsize);
+    return 0;
+}
+
+#define ASYNC_PARTS 4    // number of asynchronous transfers the data is split into
+
+// Send txsize ints as ASYNC_PARTS separate asynchronous transfers in each direction,
+// then wait for the Rx transfers in whatever order they finish.
+static int async_test(int txsize) {
+    int res = dma_init(txsize*sizeof(int));
+    if (res != 0)
+        return res;
+
+    int* txbase = (int*) getTxBuffer();
+    int* rxbase = (int*) getRxBuffer();
+    for (int i=0; i<txsize; i++) {
+        txbase[i] = 0x70000000 + i;
+        rxbase[i] = 0;
+    }
+
+    dma_reset();
+
+    // Each part must be a whole number of ints
+    int part = txsize / ASYNC_PARTS;
+    if (part == 0) {
+        printf("ERROR: need at least %d ints for the async test\r\n", ASYNC_PARTS);
+        return -1;
+    }
+
+    struct dma_xfer *rx[ASYNC_PARTS], *tx[ASYNC_PARTS];
+    for (int p=0; p<ASYNC_PARTS; p++) {
+        rx[p] = dma_rx_async(p*part*sizeof(int), part*sizeof(int));
+        tx[p] = dma_tx_async(p*part*sizeof(int), part*sizeof(int));
+        if (rx[p] == NULL || tx[p] == NULL)
+            return -1;
+    }
+
+    // Wait for the Rx transfers one at a time, as they complete
+    int remaining = ASYNC_PARTS;
+    while (remaining > 0) {
+        int i = dma_xfer_wait_any(rx, remaining, DMA_IRQ_TIMEOUT_MS);
+        if (i < 0 || dma_xfer_status(rx[i]) != 1)
+            return -1;
+        dma_xfer_free(rx[i]);
+        rx[i] = rx[--remaining];
+    }
+    res = dma_xfer_wait_all(tx, ASYNC_PARTS, DMA_IRQ_TIMEOUT_MS);
+    for (int p=0; p<ASYNC_PARTS; p++)
+        dma_xfer_free(tx[p]);
+    if (res != 0)
+        return res;
+
+    int errors=0;
+    for (int i=0; i<part*ASYNC_PARTS; i++) {
+        if (txbase[i] != rxbase[i]) {
+            errors++;
+            printf("Error on word %d: Expected 0x%x, received 0x%x\r\n", i, txbase[i], rxbase[i]);
+        }
+    }
+    if (errors)
+        printf("%d errors\r\n", errors);
+    else
+        printf("All data (%d transfers of %d ints) received successfully.\r\n", ASYNC_PARTS, part);
+
+    dma_cleanup();
+    return 0;
+}
+
 int main(int argc, char **argv) {
     int txsize; // number of integers to test
-    if (argc == 2) 
+    if (argc >= 2) 
         txsize = atoi(argv[1]);
     else
         txsize = 16;
 
+    // Use scatter-gather mode if asked to
+    int sg = (argc >= 3) && (strcmp(argv[2], "sg") == 0);
+    int irq = (argc >= 3) && (strcmp(argv[2], "irq") == 0);
+    int cached = (argc >= 3) && (strcmp(argv[2], "cached") == 0);
+
+    if ((argc >= 3) && (strcmp(argv[2], "ring") == 0))
+        return ring_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "async") == 0))
+        return async_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "stripe") == 0))
+        return stripe_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "stream") == 0))
+        return stream_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "zerocopy") == 0))
+        return zerocopy_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "batch") == 0))
+        return batch_test(txsize, 0);
+
+    if ((argc >= 3) && (strcmp(argv[2], "sgbatch") == 0))
+        return batch_test(txsize, 1);
+
+    if ((argc >= 3) && (strcmp(argv[2], "service") == 0))
+        return service_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "pool") == 0))
+        return pool_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "startup") == 0))
+        return startup_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "wide") == 0))
+        return wide_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "capture") == 0))
+        return capture_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "mc") == 0))
+        return mc_test(txsize);
+
+    if ((argc >= 3) && (strcmp(argv[2], "export") == 0))
+        return export_test(txsize);
+
     // Step 1: Initialize the DMA driver. If its return value != 0, there was an error.
-    int res = dma_init(txsize*sizeof(int));
+    int res;
+    if (sg)
+        res = dma_sg_init(txsize*sizeof(int));
+    else if (cached)
+        res = dma_init_mode(txsize*sizeof(int), DMA_BUF_CACHED, DMA_BUF_CACHED);
+    else
+        res = dma_init(txsize*sizeof(int));
     if (res != 0) 
         return res;
 
+    // Optionally, wait for interrupts instead of polling
+    if (irq) {
+        res = dma_irq_init(MM2S_UIO, S2MM_UIO);
+        if (res != 0)
+            return res;
+    }
+
     // Step 2: Get pointers to the tx and rx buffers from DMA driver. Cast them
     // to whatever datatype you need for your application (here int pointers)
     int* txbase = (int*) getTxBuffer();
@@ -84,18 +1211,19 @@ int main(int argc, char **argv) {
 
     // Step 5: Set up the DMA's Rx and Tx configurations by telling the DMA driver the length of 
     // each transfer in bytes. Here we are transferring txsize ints.
-    res = dma_rx(txsize*sizeof(int));
+    // (In scatter-gather mode, the sizes can be larger than 2^MAX_DMA_LEN_BITS.)
+    res = sg ? dma_sg_rx(txsize*sizeof(int)) : dma_rx(txsize*sizeof(int));
     if (res != 0) {
         return res;
     }
 
-    res = dma_tx(txsize*sizeof(int));
+    res = sg ? dma_sg_tx(txsize*sizeof(int)) : dma_tx(txsize*sizeof(int));
     if (res != 0) {
         return res;
     }
     
     // Step 6: Call dma_sync() to wait until all DMA transfers are complete.
-    res = dma_sync();
+    res = sg ? dma_sg_sync() : dma_sync();
     if (res != 0) {
         return res;
     }
@@ -0,0 +1,169 @@
+/*
+* Buddy allocator, for carving a large DMA chunk into many small buffers.
+*
+* It only does the bookkeeping: it hands out offsets into a chunk of 2^max_order bytes,
+* in blocks of 2^min_order bytes and up, each aligned to its size, and never touches the
+* chunk itself. It is plain C with no kernel dependencies, so memalloc.c uses it in the
+* kernel and buddytest.c tests it in user space. Allocating and freeing both take time
+* proportional to max_order - min_order, however full the chunk is. It does no locking;
+* the caller must.
+*
+* The bookkeeping is one entry per smallest block: a tag saying whether a (free or
+* allocated) block starts there, and of what order, and the links of the free list of
+* that order, if the block is free.
+*/
+
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#define BUDDY_MAX_SPAN 15	/* most orders between the smallest block and the chunk */
+#define BUDDY_NONE     0xffff	/* end of a free list */
+#define BUDDY_NO_BLOCK 0xff	/* tag: no block starts here */
+#define BUDDY_FREE     0x80	/* tag: the block that starts here is free */
+
+struct buddy {
+	int min_order;		/* log2 of the smallest block, in bytes */
+	int max_order;		/* log2 of the chunk, in bytes */
+	unsigned long free_bytes;
+	unsigned short free_head[BUDDY_MAX_SPAN + 1];	/* first free block of each order */
+	unsigned short *next;	/* free list links, indexed by smallest block */
+	unsigned short *prev;
+	unsigned char *tag;	/* per smallest block: order | BUDDY_FREE, order, or BUDDY_NO_BLOCK */
+};
+
+/* Bytes of bookkeeping buddy_init() needs for a chunk */
+static inline unsigned long buddy_state_size(int min_order, int max_order)
+{
+	unsigned long nblocks = 1UL << (max_order - min_order);
+
+	return(nblocks * (2 * sizeof(unsigned short) + 1));
+}
+
+static inline void buddy_push(struct buddy *b, unsigned int blk, int k)
+{
+	unsigned short head = b->free_head[k];
+
+	b->next[blk] = head;
+	b->prev[blk] = BUDDY_NONE;
+	if (head != BUDDY_NONE)
+		b->prev[head] = blk;
+	b->free_head[k] = blk;
+	b->tag[blk] = k | BUDDY_FREE;
+}
+
+static inline void buddy_unlink(struct buddy *b, unsigned int blk, int k)
+{
+	if (b->prev[blk] != BUDDY_NONE)
+		b->next[b->prev[blk]] = b->next[blk];
+	else
+		b->free_head[k] = b->next[blk];
+	if (b->next[blk] != BUDDY_NONE)
+		b->prev[b->next[blk]] = b->prev[blk];
+	b->tag[blk] = BUDDY_NO_BLOCK;
+}
+
+/* Set up b to carve a chunk of 2^max_order bytes into blocks of 2^min_order bytes and
+   up, keeping its bookkeeping in state (buddy_state_size() bytes). The whole chunk
+   starts out free. Returns: 0 on success; -1 if the orders are out of range */
+static inline int buddy_init(struct buddy *b, int min_order, int max_order, void *state)
+{
+	unsigned long nblocks, i;
+	int k;
+
+	if (min_order < 0 || max_order < min_order || max_order - min_order > BUDDY_MAX_SPAN ||
+	    max_order >= 8 * (int)sizeof(unsigned long) - 1)
+		return(-1);
+
+	nblocks = 1UL << (max_order - min_order);
+	b->min_order = min_order;
+	b->max_order = max_order;
+	b->next = (unsigned short *)state;
+	b->prev = b->next + nblocks;
+	b->tag = (unsigned char *)(b->prev + nblocks);
+	for (i = 0; i < nblocks; i++)
+		b->tag[i] = BUDDY_NO_BLOCK;
+	for (k = 0; k <= BUDDY_MAX_SPAN; k++)
+		b->free_head[k] = BUDDY_NONE;
+
+	buddy_push(b, 0, max_order - min_order);
+	b->free_bytes = 1UL << max_order;
+	return(0);
+}
+
+/* Allocate a block of at least size bytes (at least one byte), aligned to its size.
+   Returns: its offset in the chunk, or -1 if there is no free block big enough */
+static inline long buddy_alloc(struct buddy *b, unsigned long size)
+{
+	int span = b->max_order - b->min_order;
+	unsigned int blk;
+	int want = 0;	/* order wanted, counted from min_order */
+	int k;
+
+	while (want <= span && (1UL << (b->min_order + want)) < size)
+		want++;
+	if (want > span)
+		return(-1);
+
+	for (k = want; k <= span && b->free_head[k] == BUDDY_NONE; k++)
+		;
+	if (k > span)
+		return(-1);
+
+	blk = b->free_head[k];
+	buddy_unlink(b, blk, k);
+
+	/* Split it down, freeing the upper half each time */
+	while (k > want)
+	{
+		k--;
+		buddy_push(b, blk + (1U << k), k);
+	}
+
+	b->tag[blk] = want;
+	b->free_bytes -= 1UL << (b->min_order + want);
+	return((long)blk << b->min_order);
+}
+
+/* Size of the allocated block at offset. Returns: its size, or 0 if no allocated block
+   starts there */
+static inline unsigned long buddy_block_size(struct buddy *b, unsigned long offset)
+{
+	unsigned long blk = offset >> b->min_order;
+
+	if (offset >= (1UL << b->max_order) || (offset & ((1UL << b->min_order) - 1)) != 0 ||
+	    b->tag[blk] == BUDDY_NO_BLOCK || (b->tag[blk] & BUDDY_FREE) != 0)
+		return(0);
+	return(1UL << (b->min_order + b->tag[blk]));
+}
+
+/* Free the allocated block at offset, merging it with its buddy for as long as that is
+   free too. Returns: 0 on success; -1 if no allocated block starts there */
+static inline int buddy_free(struct buddy *b, unsigned long offset)
+{
+	int span = b->max_order - b->min_order;
+	unsigned int blk, buddy;
+	int k;
+
+	if (buddy_block_size(b, offset) == 0)
+		return(-1);
+
+	blk = offset >> b->min_order;
+	k = b->tag[blk];
+	b->tag[blk] = BUDDY_NO_BLOCK;
+	b->free_bytes += 1UL << (b->min_order + k);
+
+	while (k < span)
+	{
+		buddy = blk ^ (1U << k);
+		if (b->tag[buddy] != (k | BUDDY_FREE))
+			break;
+		buddy_unlink(b, buddy, k);
+		if (buddy < blk)
+			blk = buddy;
+		k++;
+	}
+	buddy_push(b, blk, k);
+	return(0);
+}
+
+#endif /* BUDDY_H */
@@ -0,0 +1,176 @@
+/*
+* Test of memalloc's buddy allocator (buddy.h), in user space.
+*
+* It runs a long random sequence of allocations and frees against one chunk, laid out
+* like memalloc's (MEMALLOC_CHUNK_ORDER bytes, in blocks of MEMALLOC_BLOCK_ORDER and up),
+* and after each one checks the allocator against a plain map of which smallest blocks
+* are in use:
+*    - every block is aligned to its size, the smallest size that fits, and in the chunk
+*    - no two blocks overlap
+*    - the free byte count is right
+*    - an allocation fails only if no free, aligned run of its block size exists (so
+*      freed blocks are always merged back)
+* Then it frees everything and checks that the whole chunk can be allocated again.
+*
+* Build and run:
+*    gcc -Wall buddytest.c -o buddytest
+*    ./buddytest [operations] [seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buddy.h"
+
+#define MEMALLOC_BLOCK_ORDER 8	/* as in memalloc.c */
+#define MEMALLOC_CHUNK_ORDER 20
+#define MAX_LIVE 2048		/* most blocks allocated at once */
+
+#define NBLOCKS (1 << (MEMALLOC_CHUNK_ORDER - MEMALLOC_BLOCK_ORDER))
+
+struct live {
+	long offset;
+	unsigned long size;	/* requested */
+};
+
+static struct live live[MAX_LIVE];
+static int nlive;
+static int owner[NBLOCKS];	/* 1 + index into live of the block covering it, or 0 */
+
+/* Size of the block the allocator should hand out for size bytes */
+static unsigned long block_size(unsigned long size)
+{
+	unsigned long s = 1UL << MEMALLOC_BLOCK_ORDER;
+	while (s < size)
+		s <<= 1;
+	return s;
+}
+
+/* Is there a free, aligned run of "bytes" in the map? */
+static int fits(unsigned long bytes)
+{
+	int n = bytes >> MEMALLOC_BLOCK_ORDER;
+	for (int start = 0; start < NBLOCKS; start += n) {
+		int i;
+		for (i = start; i < start + n && owner[i] == 0; i++)
+			;
+		if (i == start + n)
+			return 1;
+	}
+	return 0;
+}
+
+static void mark(long offset, unsigned long bytes, int who)
+{
+	for (long i = offset >> MEMALLOC_BLOCK_ORDER; i < (long)((offset + bytes) >> MEMALLOC_BLOCK_ORDER); i++)
+		owner[i] = who;
+}
+
+/* Check one allocation. Returns: 0 if it is right; -1 if not */
+static int check_alloc(struct buddy *b, long offset, unsigned long size) {
+	unsigned long bytes = block_size(size);
+	if (offset < 0) {
+		if (bytes <= (1UL << MEMALLOC_CHUNK_ORDER) && fits(bytes)) {
+			printf("ERROR: allocating %lu bytes failed, but a %lu-byte run is free\n", size, bytes);
+			return -1;
+		}
+		return 0;
+	}
+	if (buddy_block_size(b, offset) != bytes || (offset & (bytes - 1)) != 0 ||
+	    offset + bytes > (1UL << MEMALLOC_CHUNK_ORDER)) {
+		printf("ERROR: %lu bytes got a %lu-byte block at %ld\n", size, buddy_block_size(b, offset), offset);
+		return -1;
+	}
+	for (long i = offset >> MEMALLOC_BLOCK_ORDER; i < (long)((offset + bytes) >> MEMALLOC_BLOCK_ORDER); i++) {
+		if (owner[i] != 0) {
+			printf("ERROR: the block at %ld overlaps the one at %ld\n", offset, live[owner[i]-1].offset);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int check_free_bytes(struct buddy *b) {
+	unsigned long used = 0;
+	for (int i = 0; i < nlive; i++)
+		used += block_size(live[i].size);
+	if (b->free_bytes != (1UL << MEMALLOC_CHUNK_ORDER) - used) {
+		printf("ERROR: %lu bytes free; expected %lu\n", b->free_bytes, (1UL << MEMALLOC_CHUNK_ORDER) - used);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int ops = (argc >= 2) ? atoi(argv[1]) : 100000;
+	unsigned int seed = (argc >= 3) ? atoi(argv[2]) : 1;
+	struct buddy b;
+	void *state = malloc(buddy_state_size(MEMALLOC_BLOCK_ORDER, MEMALLOC_CHUNK_ORDER));
+	long fails = 0;
+
+	srand(seed);
+	if (state == NULL || buddy_init(&b, MEMALLOC_BLOCK_ORDER, MEMALLOC_CHUNK_ORDER, state)) {
+		printf("ERROR: buddy_init failed\n");
+		return -1;
+	}
+	if (buddy_init(&b, 4, 4 + BUDDY_MAX_SPAN + 1, state) == 0) {
+		printf("ERROR: buddy_init accepted too many orders\n");
+		return -1;
+	}
+	buddy_init(&b, MEMALLOC_BLOCK_ORDER, MEMALLOC_CHUNK_ORDER, state);
+
+	for (int op = 0; op < ops; op++) {
+		// Mostly small buffers, some up to the whole chunk; free about as often as we allocate
+		if (nlive < MAX_LIVE && (nlive == 0 || rand() % 2)) {
+			unsigned long size;
+			switch (rand() % 8) {
+			case 0:  size = 1 + rand() % (1 << MEMALLOC_CHUNK_ORDER); break;
+			case 1:
+			case 2:  size = 1 + rand() % 65536; break;
+			default: size = 1 + rand() % 2048; break;
+			}
+			long offset = buddy_alloc(&b, size);
+			if (check_alloc(&b, offset, size))
+				return -1;
+			if (offset < 0) {
+				fails++;
+				continue;
+			}
+			live[nlive].offset = offset;
+			live[nlive].size = size;
+			nlive++;
+			mark(offset, block_size(size), nlive);
+		} else {
+			int i = rand() % nlive;
+			if (buddy_free(&b, live[i].offset)) {
+				printf("ERROR: freeing the block at %ld failed\n", live[i].offset);
+				return -1;
+			}
+			if (buddy_free(&b, live[i].offset) == 0) {
+				printf("ERROR: the block at %ld was freed twice\n", live[i].offset);
+				return -1;
+			}
+			mark(live[i].offset, block_size(live[i].size), 0);
+			live[i] = live[--nlive];
+			if (nlive > i)
+				mark(live[i].offset, block_size(live[i].size), i + 1);
+		}
+		if (check_free_bytes(&b))
+			return -1;
+	}
+
+	if (buddy_free(&b, 1) == 0 || buddy_free(&b, 1UL << MEMALLOC_CHUNK_ORDER) == 0) {
+		printf("ERROR: freeing a block that was never allocated worked\n");
+		return -1;
+	}
+	while (nlive > 0)
+		buddy_free(&b, live[--nlive].offset);
+	if (check_free_bytes(&b) || buddy_alloc(&b, 1UL << MEMALLOC_CHUNK_ORDER) != 0) {
+		printf("ERROR: the chunk did not merge back into one block\n");
+		return -1;
+	}
+
+	printf("All %d operations checked successfully (%ld allocations did not fit).\n", ops, fails);
+	free(state);
+	return 0;
+}
@@ -5,10 +5,49 @@
 
 // Modified, 2018-08-04, Peter Milder
 //   - commented out some debug print statements
+//   - added importing of user pages and dma-bufs, and cache sync, for zero-copy DMA
+//   - added cached and write-combining buffers
+//   - each open file has its own buffers, so several processes can use the module at once
+//   - the mmap offset picks the buffer to map, so ACTIVATE is no longer needed
+//   - added exporting of buffers as dma-bufs
+//   - buffer IDs have no limit, and small buffers can be carved out of large chunks
+//   - added statistics in debugfs
+//   - the commands encode the size of ioctl_arg_t (_IOWR), so old programs are refused
 
 /*
 * DMA memory allocation.  This kernel module allocates coherent, non-cached
 * memory and returns the physical and virtual address of the allocated buffer.
+* On request, the memory can instead be cached (the application must then sync it
+* with MEMALLOC_SYNC_CMD before and after each transfer), or write-combining.
+*
+* It can also import memory the application already has (user pages, or a dma-buf
+* from another driver), as long as it is physically contiguous, and return its
+* physical address. Imported memory is cached, so it must be synced with
+* MEMALLOC_SYNC_CMD before and after each transfer.
+*
+* Buffers belong to the open file they were reserved through: buffer IDs are numbered
+* per file, and closing the file frees its buffers and no one else's.
+*
+* mmap maps the buffer whose physical address is the mmap offset (or, with a larger
+* offset, part of it from that page on). Offset 0, when no buffer is there, maps the
+* buffer last made active, as the original module did; a carved buffer that does not
+* start on a page cannot be mapped that way, as the mapping would not start at it.
+*
+* MEMALLOC_EXPORT_DMABUF_CMD exports a buffer as a dma-buf, so another process (which
+* gets the fd over a Unix socket) or another driver can use it without a copy. Its
+* memory then lives until the buffer is released and every dma-buf of it is closed.
+*
+* A file can have any number of buffers. Coherent and write-combining buffers of up to
+* MEMALLOC_SUBALLOC_MAX bytes reserved with MEMALLOC_SUBALLOC do not get an allocation
+* each: they are carved out of large chunks (MEMALLOC_CHUNK_SIZE) of the file's by a
+* buddy allocator (buddy.h), so reserving one is quick and does not fragment CMA. mmap
+* maps a chunk whole, as several of the file's buffers may share a page. Without the
+* flag, as for programs written for the original module, every buffer has memory of its
+* own and starts on a page.
+*
+* Statistics are in debugfs, in memalloc/stats: the buffers and bytes reserved (in all,
+* at most at once, and by each process), reserve and release counts, failures, and a
+* histogram of how long each reserve took.
 */
 
 #include <linux/fs.h>
@@ -19,20 +58,103 @@
 #include <linux/device.h>
 #include <linux/uaccess.h>
 #include <linux/dma-mapping.h>
+#include <linux/dma-buf.h>
+#include <linux/debugfs.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/scatterlist.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
 
 #include "memalloc.h"
+#include "buddy.h"
+
+#define MEMALLOC_CHUNK_ORDER 20	/* chunks of 1 MB... */
+#define MEMALLOC_CHUNK_SIZE  (1 << MEMALLOC_CHUNK_ORDER)
+#define MEMALLOC_BLOCK_ORDER 8	/* ...carved into blocks of 256 bytes and up */
+#define MEMALLOC_LATENCY_BUCKETS 20	/* reserve latency: < 1 us, then one per power of 2 */
+
+/* Where a buffer's memory came from */
+#define BUFFER_COHERENT 0	/* allocated here, with dma_alloc_coherent */
+#define BUFFER_USER     1	/* user pages, pinned by IMPORT_USER */
+#define BUFFER_DMABUF   2	/* a dma-buf, attached by IMPORT_DMABUF */
+#define BUFFER_CACHED   3	/* allocated here, cached, and mapped for streaming DMA */
+#define BUFFER_WC       4	/* allocated here, with dma_alloc_wc */
 
 /* Buffer information */
 struct buffer_info_t {
-	int active;
+	int type;
 	int size;
 	dma_addr_t handle;
 	int *kernel_address;
+	struct page **pages;		/* BUFFER_USER */
+	int npages;
+	struct dma_buf *dmabuf;		/* BUFFER_DMABUF */
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	struct memalloc_export_t *export;	/* set once exported: it owns the memory then */
+	struct memalloc_chunk_t *chunk;		/* the chunk it was carved out of, or NULL */
+};
+
+/* A large coherent or write-combining allocation that small buffers are carved out of */
+struct memalloc_chunk_t {
+	struct list_head list;	/* the file's chunks */
+	int type;		/* BUFFER_COHERENT or BUFFER_WC */
+	int *kernel_address;
+	dma_addr_t handle;
+	int used;		/* buffers carved out of it */
+	struct buddy buddy;
+	void *buddy_state;
+};
+
+/* The memory of a buffer that has been exported as a dma-buf. The buffer and each of
+   its dma-bufs hold a reference, and whichever lets go last frees the memory. */
+struct memalloc_export_t {
+	struct kref ref;
+	int type;
+	int size;
+	int *kernel_address;
+	dma_addr_t handle;
 };
-static struct buffer_info_t buffer_info[MEMALLOC_BUFFER_MAX_NUMBER];
 
-/* Which buffer is currently active - for mmap */
-static int active_buffer_id;
+/* What one open file (one process, usually) has: its buffers, and which is active */
+struct memalloc_file_t {
+	struct mutex lock;	/* guards the buffers and chunks (see memalloc_ioctl) */
+	struct idr buffers;	/* struct buffer_info_t, by buffer ID */
+	struct list_head chunks;
+	int active_buffer_id;	/* which buffer mmap maps at offset 0 */
+
+	struct list_head files;	/* every open file, for the statistics */
+	pid_t pid;		/* the process that opened it */
+	char comm[TASK_COMM_LEN];
+	long reserved_buffers;	/* buffers reserved (not imported), under stats_lock */
+	long long reserved_bytes;
+};
+
+/* Module-wide statistics, shown in debugfs. Counts are of buffers reserved here, not
+   imported ones, unless they say otherwise. */
+struct memalloc_stats_t {
+	long buffers;
+	long long bytes;
+	long long bytes_high_water;
+	long chunks;
+	long long reserves, releases, failures;
+	long imported;		/* imported buffers */
+	long long imports;
+	long long latency[MEMALLOC_LATENCY_BUCKETS];	/* reserves by time taken */
+};
+static struct memalloc_stats_t stats;
+static DEFINE_SPINLOCK(stats_lock);
+
+static LIST_HEAD(files);
+static DEFINE_MUTEX(files_lock);
+static struct dentry *debugfs_dir;
 
 struct memalloc_if_t {
 	struct device *device_p;
@@ -48,21 +170,53 @@ static int memalloc_release (struct inode *, struct file *);
 static int memalloc_open(struct inode *, struct file *);
 
 static struct file_operations fops = {
+	.owner = THIS_MODULE,
 	.unlocked_ioctl = memalloc_ioctl,
 	.mmap = memalloc_mmap,
 	.release = memalloc_release,
 	.open = memalloc_open
 };
 
-static int reserve_buffer(ioctl_arg_t *);
-static int release_buffer(ioctl_arg_t *ioctl_arg);
-static int get_physical_address (ioctl_arg_t *ioctl_arg);
-static void cleanup(void);
+static int reserve_buffer(struct memalloc_file_t *f, ioctl_arg_t *);
+static int release_buffer(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg);
+static int get_physical_address (struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg);
+static int import_user_buffer(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg);
+static int import_dmabuf(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg);
+static int sync_buffer(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg);
+static int export_buffer(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg);
+static int do_mmap(struct memalloc_file_t *f, struct vm_area_struct *vma);
+static struct buffer_info_t *new_buffer(struct memalloc_file_t *f, int *id);
+static struct buffer_info_t *get_buffer(struct memalloc_file_t *f, int id);
+static struct buffer_info_t *find_mapping(struct memalloc_file_t *f, unsigned long pgoff, unsigned long *first);
+static struct memalloc_chunk_t *find_chunk(struct memalloc_file_t *f, unsigned long pgoff);
+static int carve_buffer(struct memalloc_file_t *f, struct buffer_info_t *b, size_t size);
+static void uncarve_buffer(struct memalloc_file_t *f, struct buffer_info_t *b);
+static void free_chunk(struct memalloc_chunk_t *c);
+static int mmap_memory(int type, int size, int *kernel_address, dma_addr_t handle, struct vm_area_struct *vma);
+static void free_memory(int type, int size, int *kernel_address, dma_addr_t handle);
+static void free_buffer(struct memalloc_file_t *f, int id, struct buffer_info_t *b);
+static void cleanup(struct memalloc_file_t *f);
+static void stats_reserve(struct memalloc_file_t *f, size_t size, u64 ns, int status);
+static void stats_release(struct memalloc_file_t *f, struct buffer_info_t *b);
 
+/* mmap takes the file's lock with mmap_lock already held, so the ioctls must not take
+   mmap_lock while holding it: copying to and from user space and pinning user pages,
+   which can fault, are done without it, and the lock is only held around lookups and
+   changes of the buffers and chunks. */
 static long memalloc_ioctl (struct file *fd, unsigned int cmd, unsigned long arg)
 {
+	struct memalloc_file_t *f = fd->private_data;
 	struct ioctl_arg_t ioctl_arg;
 	long status;
+	u64 start;
+
+	/* Refuse commands of another size, such as those of programs built against the
+	   original, smaller ioctl_arg_t, before reading the argument */
+	if (_IOC_TYPE(cmd) != MEMALLOC_IOCTL_BASE || _IOC_SIZE(cmd) != sizeof(ioctl_arg_t))
+	{
+		printk(KERN_ERR "ERROR: Wrong command: %d (rebuild against this memalloc.h).\n", cmd);
+		return(-ENOTTY);
+	}
 
 	status = copy_from_user(&ioctl_arg, (void __user *)arg, sizeof(ioctl_arg_t));	
 	if (status != 0)
@@ -76,7 +230,11 @@ static long memalloc_ioctl (struct file *fd, unsigned int cmd, unsigned long arg
 	{
 		case MEMALLOC_RESERVE_CMD:
 		        //printk(KERN_ERR "DEBUG: Module fops->ioctl: RESERVE (%zu bytes).\n", ioctl_arg.buffer_size);
-			status = reserve_buffer(&ioctl_arg);
+			start = ktime_get_ns();
+			mutex_lock(&f->lock);
+			status = reserve_buffer(f, &ioctl_arg);
+			stats_reserve(f, ioctl_arg.buffer_size, ktime_get_ns() - start, status);
+			mutex_unlock(&f->lock);
 			if (status != 0)
 			{
 				status = -1;
@@ -93,11 +251,15 @@ static long memalloc_ioctl (struct file *fd, unsigned int cmd, unsigned long arg
 			break;
 		case MEMALLOC_RELEASE_CMD:
 		        //printk(KERN_ERR "DEBUG: Module fops->ioctl: RELEASE.\n");
-			status = release_buffer(&ioctl_arg);
+			mutex_lock(&f->lock);
+			status = release_buffer(f, &ioctl_arg);
+			mutex_unlock(&f->lock);
 			break;
 		case MEMALLOC_GET_PHYSICAL_CMD:
 		        // printk(KERN_ERR "DEBUG: Module fops->ioctl: GET_PHYSICAL (id %d).\n", ioctl_arg.buffer_id);
-			status = get_physical_address(&ioctl_arg);
+			mutex_lock(&f->lock);
+			status = get_physical_address(f, &ioctl_arg);
+			mutex_unlock(&f->lock);
 
 			status = copy_to_user((ioctl_arg_t*)arg, &ioctl_arg, sizeof(ioctl_arg_t));
 			if (status != 0)
@@ -109,14 +271,63 @@ static long memalloc_ioctl (struct file *fd, unsigned int cmd, unsigned long arg
 			break;
 		case MEMALLOC_ACTIVATE_BUFFER_CMD:
 		        // printk(KERN_ERR "DEBUG: Module fops->ioctl: ACTIVATE_BUFFER (id %d).\n", ioctl_arg.buffer_id);
-			if (ioctl_arg.buffer_id > MEMALLOC_BUFFER_MAX_NUMBER || buffer_info[ioctl_arg.buffer_id].active == 0)
+			mutex_lock(&f->lock);
+			if (get_buffer(f, ioctl_arg.buffer_id) == NULL)
+				status = -1;
+			else
+			{
+				f->active_buffer_id = ioctl_arg.buffer_id;
+				status = 0;
+			}
+			mutex_unlock(&f->lock);
+			break;
+		case MEMALLOC_IMPORT_USER_CMD:
+		case MEMALLOC_IMPORT_DMABUF_CMD:
+			if (cmd == MEMALLOC_IMPORT_USER_CMD)
+				status = import_user_buffer(f, &ioctl_arg);
+			else
+				status = import_dmabuf(f, &ioctl_arg);
+			if (status != 0)
+			{
+				status = -1;
+				return(status);
+			}
+			spin_lock(&stats_lock);
+			stats.imported++;
+			stats.imports++;
+			spin_unlock(&stats_lock);
+
+			status = copy_to_user((ioctl_arg_t*)arg, &ioctl_arg, sizeof(ioctl_arg_t));
+			if (status != 0)
+			{
+				printk(KERN_ERR "ERROR: copy_to_user failed (%ld bytes).\n", status);
+				status = -1;
+				return(status);
+			}
+			break;
+		case MEMALLOC_SYNC_CMD:
+			mutex_lock(&f->lock);
+			status = sync_buffer(f, &ioctl_arg);
+			mutex_unlock(&f->lock);
+			break;
+		case MEMALLOC_EXPORT_DMABUF_CMD:
+			mutex_lock(&f->lock);
+			status = export_buffer(f, &ioctl_arg);
+			mutex_unlock(&f->lock);
+			if (status != 0)
+			{
+				status = -1;
+				return(status);
+			}
+
+			status = copy_to_user((ioctl_arg_t*)arg, &ioctl_arg, sizeof(ioctl_arg_t));
+			if (status != 0)
 			{
-				printk(KERN_ERR "ERROR: Wrong bufferID %lu.\n", arg);
+				/* The fd is already installed; the process still owns it */
+				printk(KERN_ERR "ERROR: copy_to_user failed (%ld bytes).\n", status);
 				status = -1;
 				return(status);
 			}
-			active_buffer_id = ioctl_arg.buffer_id;
-			status = 0;
 			break;
 		default:
 			printk(KERN_ERR "ERROR: Wrong command: %d.\n", cmd);
@@ -129,32 +340,134 @@ static long memalloc_ioctl (struct file *fd, unsigned int cmd, unsigned long arg
 
 static int memalloc_mmap (struct file *fd, struct vm_area_struct *vma)
 {
+	struct memalloc_file_t *f = fd->private_data;
+	int status;
+
         //printk(KERN_ERR "DEBUG: Module fops->mmap.\n");
-       
-	return dma_mmap_coherent(NULL, vma, buffer_info[active_buffer_id].kernel_address, buffer_info[active_buffer_id].handle, vma->vm_end-vma->vm_start);
+
+	mutex_lock(&f->lock);
+	status = do_mmap(f, vma);
+	mutex_unlock(&f->lock);
+	return(status);
 }
 
+/* Map the buffer the mmap offset picks, with the file's lock held */
+static int do_mmap (struct memalloc_file_t *f, struct vm_area_struct *vma)
+{
+	struct memalloc_chunk_t *c = find_chunk(f, vma->vm_pgoff);
+	unsigned long first;	/* first page of the buffer to map */
+	struct buffer_info_t *b = NULL;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	/* Chunks are mapped whole (from any page on), not buffer by buffer */
+	if (c == NULL)
+	{
+		b = find_mapping(f, vma->vm_pgoff, &first);
+		if (b != NULL && b->chunk != NULL)
+		{
+			/* The active buffer, at offset 0, is in a chunk; the caller expects the
+			   mapping to start at the buffer, so it must start on a page */
+			if (b->handle & ~PAGE_MASK)
+			{
+				printk(KERN_ERR "ERROR: Buffer at 0x%lx does not start on a page; mmap it at its phys_addr.\n", (unsigned long)b->handle);
+				return(-EINVAL);
+			}
+			c = b->chunk;
+			first = (b->handle >> PAGE_SHIFT) - (c->handle >> PAGE_SHIFT);
+		}
+	}
+	else
+		first = vma->vm_pgoff - (c->handle >> PAGE_SHIFT);
+	if (c != NULL)
+	{
+		if ((first << PAGE_SHIFT) + size > MEMALLOC_CHUNK_SIZE)
+			return(-EINVAL);
+		vma->vm_pgoff = first;
+		return mmap_memory(c->type, MEMALLOC_CHUNK_SIZE, c->kernel_address, c->handle, vma);
+	}
+
+	if (b == NULL)
+	{
+		printk(KERN_ERR "ERROR: No buffer at mmap offset 0x%lx.\n", vma->vm_pgoff << PAGE_SHIFT);
+		return(-EINVAL);
+	}
+	if ((first << PAGE_SHIFT) + size > PAGE_ALIGN(b->size))
+		return(-EINVAL);
+
+	if (b->type == BUFFER_USER || b->type == BUFFER_DMABUF)
+	{
+		/* Imported buffers are already mapped by whoever owns them */
+		printk(KERN_ERR "ERROR: Buffer at 0x%lx is imported; it cannot be mmap-ed.\n", (unsigned long)b->handle);
+		return(-EINVAL);
+	}
+
+	vma->vm_pgoff = first;
+	return mmap_memory(b->type, b->size, b->kernel_address, b->handle, vma);
+}
+
+/* Map memory allocated here (not imported), from page vma->vm_pgoff of it on */
+static int mmap_memory(int type, int size, int *kernel_address, dma_addr_t handle, struct vm_area_struct *vma)
+{
+	switch (type)
+	{
+		case BUFFER_COHERENT:
+			return dma_mmap_coherent(NULL, vma, kernel_address, handle, PAGE_ALIGN(size));
+		case BUFFER_WC:
+			return dma_mmap_wc(NULL, vma, kernel_address, handle, PAGE_ALIGN(size));
+		default:
+			/* Ordinary memory, so keep the default (cached) page protection */
+			return remap_pfn_range(vma, vma->vm_start, (virt_to_phys(kernel_address) >> PAGE_SHIFT) + vma->vm_pgoff,
+			                       vma->vm_end - vma->vm_start, vma->vm_page_prot);
+	}
+}
+
+/* The file is closed (and no longer mapped): free its buffers, and only its */
 static int memalloc_release(struct inode *in, struct file *fd)
 {
+	struct memalloc_file_t *f = fd->private_data;
+
         //printk(KERN_ERR "DEBUG: Module fops->release.\n");
 
-	cleanup();
+	mutex_lock(&files_lock);
+	list_del(&f->files);
+	mutex_unlock(&files_lock);
+
+	cleanup(f);
+	idr_destroy(&f->buffers);
+	mutex_destroy(&f->lock);
+	kfree(f);
+	fd->private_data = NULL;
 	return(0);
 }
 
 static int memalloc_open(struct inode *ino, struct file *file)
 {
+	struct memalloc_file_t *f;
+
         //printk(KERN_ERR "DEBUG: Module fops->open.\n");
 
-	file->private_data = container_of(ino->i_cdev, struct memalloc_if_t, cdev);
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (f == NULL)
+		return(-ENOMEM);
+	mutex_init(&f->lock);
+	idr_init(&f->buffers);
+	INIT_LIST_HEAD(&f->chunks);
+	f->pid = task_tgid_nr(current);
+	get_task_comm(f->comm, current);
+	file->private_data = f;
+
+	mutex_lock(&files_lock);
+	list_add_tail(&f->files, &files);
+	mutex_unlock(&files_lock);
 
 	return(0);
 }
 
 
 
-static int reserve_buffer(ioctl_arg_t *ioctl_arg)
+static int reserve_buffer(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg)
 {
+	struct buffer_info_t *b;
 	int id;
 	size_t size;
 	void *vaddr;
@@ -162,17 +475,37 @@ static int reserve_buffer(ioctl_arg_t *ioctl_arg)
 
 	size = ioctl_arg->buffer_size;
 
-	for (id = 0; id < MEMALLOC_BUFFER_MAX_NUMBER; id++)
+	b = new_buffer(f, &id);
+	if (b == NULL)
+		return(-1);
+	//printk(KERN_ERR "DEBUG: Reserving buffer %d.\n", id);
+
+	switch (ioctl_arg->flags & MEMALLOC_MODE_MASK)
 	{
-		if (buffer_info[id].active == 0) /* First available buffer (non active). */
-		{
-		        //printk(KERN_ERR "DEBUG: Reserving buffer %d.\n", id);
-			buffer_info[id].active = 1;
+		case MEMALLOC_CACHED:
+			b->type = BUFFER_CACHED;
+			break;
+		case MEMALLOC_WRITECOMBINE:
+			b->type = BUFFER_WC;
 			break;
+		default:
+			b->type = BUFFER_COHERENT;
+			break;
+	}
+	b->size = (int)size;
+
+	/* Small uncached buffers are carved out of a chunk, if the caller asks for it */
+	if (b->type != BUFFER_CACHED && size <= MEMALLOC_SUBALLOC_MAX && (ioctl_arg->flags & MEMALLOC_SUBALLOC) &&
+	    !(ioctl_arg->flags & MEMALLOC_DEDICATED))
+	{
+		if (carve_buffer(f, b, size) != 0)
+		{
+			free_buffer(f, id, NULL);
+			return(-1);
 		}
+		paddr = b->handle;
 	}
-	
-	if (id < MEMALLOC_BUFFER_MAX_NUMBER)
+	else
 	{
 #if 0
 		long long unsigned dma_mask = dma_get_required_mask(interface.device_p);
@@ -187,79 +520,781 @@ static int reserve_buffer(ioctl_arg_t *ioctl_arg)
 
 		vaddr = dma_alloc_coherent(interface.device_p, size, &paddr, GFP_KERNEL);
 #else
-		vaddr = dma_alloc_coherent(NULL, size, &paddr, GFP_KERNEL);
+		switch (b->type)
+		{
+			case BUFFER_CACHED:
+				/* Physically contiguous pages, mapped for streaming DMA */
+				vaddr = alloc_pages_exact(PAGE_ALIGN(size), GFP_KERNEL | __GFP_ZERO);
+				if (vaddr != NULL)
+				{
+					paddr = dma_map_single(interface.device_p, vaddr, size, DMA_BIDIRECTIONAL);
+					if (dma_mapping_error(interface.device_p, paddr))
+					{
+						free_pages_exact(vaddr, PAGE_ALIGN(size));
+						vaddr = NULL;
+					}
+				}
+				break;
+			case BUFFER_WC:
+				vaddr = dma_alloc_wc(NULL, size, &paddr, GFP_KERNEL);
+				break;
+			default:
+				vaddr = dma_alloc_coherent(NULL, size, &paddr, GFP_KERNEL);
+				break;
+		}
 
 #endif
 		if (vaddr == NULL)
 		{
 			printk(KERN_ERR "ERROR: Allocation failure (vaddr %p).\n", vaddr);
+			free_buffer(f, id, NULL);
 			return(-1);
 		}
 		//printk(KERN_ERR "DEBUG: Allocated buffer %d (paddr = 0x%p, k-vaddr = 0x%x).\n", id, paddr, vaddr);
 
-		buffer_info[id].kernel_address = vaddr;
-		buffer_info[id].handle = paddr;
-		buffer_info[id].size = (int)size;
+		b->kernel_address = vaddr;
+		b->handle = paddr;
+	}
+
+	ioctl_arg->buffer_id = id;
+	ioctl_arg->phys_addr = paddr;
+	if (ioctl_arg->flags & MEMALLOC_ACTIVATE)
+		f->active_buffer_id = id;
+	return(0);
+}
+
+static int release_buffer(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg)
+{
+	struct buffer_info_t *b = get_buffer(f, ioctl_arg->buffer_id);
 
-		ioctl_arg->buffer_id = id;
-		return(0);
+	if (b == NULL)
+		return(-1);
+	//printk(KERN_ERR "DEBUG: Releasing buffer %d.\n", ioctl_arg->buffer_id);
+	free_buffer(f, ioctl_arg->buffer_id, b);
+	return(0);
+}
+
+/* Make a new, empty buffer and give it the lowest free ID. Returns: the buffer, or NULL
+   on error */
+static struct buffer_info_t *new_buffer(struct memalloc_file_t *f, int *id)
+{
+	struct buffer_info_t *b = kzalloc(sizeof(*b), GFP_KERNEL);
+
+	if (b == NULL)
+		return(NULL);
+	*id = idr_alloc(&f->buffers, b, 0, 0, GFP_KERNEL);
+	if (*id < 0)
+	{
+		printk(KERN_ERR "ERROR: No buffer available.\n");
+		kfree(b);
+		return(NULL);
 	}
+	return(b);
+}
+
+/* Look up one of the file's buffers. Returns: the buffer, or NULL if the file has no
+   buffer with that ID */
+static struct buffer_info_t *get_buffer(struct memalloc_file_t *f, int id)
+{
+	struct buffer_info_t *b = (id < 0) ? NULL : idr_find(&f->buffers, id);
+
+	if (b == NULL)
+		printk(KERN_ERR "ERROR: Wrong bufferID %d.\n", id);
+	return(b);
+}
+
+/* Find the buffer an mmap at page offset pgoff maps: the one whose pages include
+   physical page pgoff or, failing that, for pgoff 0, the active buffer. Sets *first to
+   the page of the buffer the mapping starts at. Returns: the buffer, or NULL if none */
+static struct buffer_info_t *find_mapping(struct memalloc_file_t *f, unsigned long pgoff, unsigned long *first)
+{
+	struct buffer_info_t *b;
+	unsigned long start;
+	int id;
+
+	idr_for_each_entry(&f->buffers, b, id)
+	{
+		if (b->chunk != NULL || b->type == BUFFER_USER || b->type == BUFFER_DMABUF)
+			continue;
+		start = b->handle >> PAGE_SHIFT;
+		if (pgoff >= start && pgoff < start + (PAGE_ALIGN(b->size) >> PAGE_SHIFT))
+		{
+			*first = pgoff - start;
+			return(b);
+		}
+	}
+
+	if (pgoff != 0)
+		return(NULL);
+	*first = 0;
+	return(get_buffer(f, f->active_buffer_id));
+}
+
+/* Find the file's chunk that holds physical page pgoff. Returns: the chunk, or NULL */
+static struct memalloc_chunk_t *find_chunk(struct memalloc_file_t *f, unsigned long pgoff)
+{
+	struct memalloc_chunk_t *c;
+	unsigned long start;
+
+	list_for_each_entry(c, &f->chunks, list)
+	{
+		start = c->handle >> PAGE_SHIFT;
+		if (pgoff >= start && pgoff < start + (MEMALLOC_CHUNK_SIZE >> PAGE_SHIFT))
+			return(c);
+	}
+	return(NULL);
+}
+
+/* Allocate a new chunk of memory of the given type. Returns: the chunk, or NULL on error */
+static struct memalloc_chunk_t *new_chunk(int type)
+{
+	struct memalloc_chunk_t *c = kzalloc(sizeof(*c), GFP_KERNEL);
+
+	if (c == NULL)
+		return(NULL);
+	c->type = type;
+	c->buddy_state = kmalloc(buddy_state_size(MEMALLOC_BLOCK_ORDER, MEMALLOC_CHUNK_ORDER), GFP_KERNEL);
+	if (c->buddy_state == NULL)
+		goto err_free;
+	if (type == BUFFER_WC)
+		c->kernel_address = dma_alloc_wc(NULL, MEMALLOC_CHUNK_SIZE, &c->handle, GFP_KERNEL);
 	else
+		c->kernel_address = dma_alloc_coherent(NULL, MEMALLOC_CHUNK_SIZE, &c->handle, GFP_KERNEL);
+	if (c->kernel_address == NULL)
 	{
-		printk(KERN_ERR "ERROR: No buffer available.\n");
+		printk(KERN_ERR "ERROR: Chunk allocation failure.\n");
+		goto err_free;
+	}
+	buddy_init(&c->buddy, MEMALLOC_BLOCK_ORDER, MEMALLOC_CHUNK_ORDER, c->buddy_state);
+
+	spin_lock(&stats_lock);
+	stats.chunks++;
+	spin_unlock(&stats_lock);
+	return(c);
+
+err_free:
+	kfree(c->buddy_state);
+	kfree(c);
+	return(NULL);
+}
+
+static void free_chunk(struct memalloc_chunk_t *c)
+{
+	spin_lock(&stats_lock);
+	stats.chunks--;
+	spin_unlock(&stats_lock);
+
+	free_memory(c->type, MEMALLOC_CHUNK_SIZE, c->kernel_address, c->handle);
+	kfree(c->buddy_state);
+	kfree(c);
+}
+
+/* Carve a buffer out of the first of the file's chunks of its type with room for it,
+   adding a chunk if none has. Older chunks come first, so newer ones can empty out.
+   Returns: 0 on success; -1 on error */
+static int carve_buffer(struct memalloc_file_t *f, struct buffer_info_t *b, size_t size)
+{
+	struct memalloc_chunk_t *c;
+	long offset;
+
+	list_for_each_entry(c, &f->chunks, list)
+	{
+		if (c->type == b->type && (offset = buddy_alloc(&c->buddy, size)) >= 0)
+			goto found;
+	}
+
+	c = new_chunk(b->type);
+	if (c == NULL)
+		return(-1);
+	list_add_tail(&c->list, &f->chunks);
+	offset = buddy_alloc(&c->buddy, size);
+
+found:
+	c->used++;
+	b->chunk = c;
+	b->kernel_address = (int *)((char *)c->kernel_address + offset);
+	b->handle = c->handle + offset;
+	return(0);
+}
+
+/* Give a carved buffer back to its chunk. An empty chunk is freed, unless it is the
+   file's only empty chunk of its type: that one is kept, so that reserving and releasing
+   one buffer over and over does not allocate a chunk each time. */
+static void uncarve_buffer(struct memalloc_file_t *f, struct buffer_info_t *b)
+{
+	struct memalloc_chunk_t *c = b->chunk, *other;
+
+	buddy_free(&c->buddy, (char *)b->kernel_address - (char *)c->kernel_address);
+	b->chunk = NULL;
+	if (--c->used > 0)
+		return;
+
+	list_for_each_entry(other, &f->chunks, list)
+	{
+		if (other != c && other->type == c->type && other->used == 0)
+		{
+			list_del(&c->list);
+			free_chunk(c);
+			return;
+		}
+	}
+}
+
+/* Pin the user pages at user_addr, and, if they are physically contiguous, map them
+   for DMA so the device can use them in place. Called without the file's lock, as
+   pinning can fault. */
+static int import_user_buffer(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg)
+{
+	struct buffer_info_t *b;
+	unsigned long addr = ioctl_arg->user_addr;
+	size_t size = ioctl_arg->buffer_size;
+	int npages, pinned, i, id;
+	struct page **pages;
+	dma_addr_t paddr;
+
+	if (size == 0)
+		return(-1);
+	npages = ((addr + size - 1) >> PAGE_SHIFT) - (addr >> PAGE_SHIFT) + 1;
+
+	pages = kmalloc_array(npages, sizeof(struct page *), GFP_KERNEL);
+	if (pages == NULL)
+		return(-1);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+	pinned = pin_user_pages_fast(addr & PAGE_MASK, npages, FOLL_WRITE | FOLL_LONGTERM, pages);
+#else
+	pinned = get_user_pages_fast(addr & PAGE_MASK, npages, 1, pages);
+#endif
+	if (pinned != npages)
+	{
+		printk(KERN_ERR "ERROR: Could only pin %d of %d pages.\n", pinned, npages);
+		goto err_unpin;
+	}
+
+	/* The DMA needs one physical address for the whole buffer */
+	for (i = 1; i < npages; i++)
+	{
+		if (page_to_pfn(pages[i]) != page_to_pfn(pages[0]) + i)
+		{
+			//printk(KERN_ERR "DEBUG: User buffer is not physically contiguous (page %d).\n", i);
+			goto err_unpin;
+		}
+	}
+
+	paddr = dma_map_page(interface.device_p, pages[0], offset_in_page(addr), size, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(interface.device_p, paddr))
+	{
+		printk(KERN_ERR "ERROR: Failed to map user buffer for DMA.\n");
+		goto err_unpin;
+	}
+
+	mutex_lock(&f->lock);
+	b = new_buffer(f, &id);
+	if (b == NULL)
+	{
+		mutex_unlock(&f->lock);
+		dma_unmap_page(interface.device_p, paddr, size, DMA_BIDIRECTIONAL);
+		goto err_unpin;
+	}
+
+	b->type = BUFFER_USER;
+	b->size = (int)size;
+	b->handle = paddr;
+	b->kernel_address = NULL;
+	b->pages = pages;
+	b->npages = npages;
+	mutex_unlock(&f->lock);
+
+	ioctl_arg->buffer_id = id;
+	ioctl_arg->phys_addr = paddr;
+	return(0);
+
+err_unpin:
+	for (i = 0; i < pinned; i++)
+	{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+		unpin_user_page(pages[i]);
+#else
+		put_page(pages[i]);
+#endif
+	}
+	kfree(pages);
+	return(-1);
+}
+
+/* Attach to a dma-buf exported by another driver, and, if it is contiguous in DMA
+   address space, use it in place. Called without the file's lock. */
+static int import_dmabuf(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg)
+{
+	struct buffer_info_t *b;
+	struct dma_buf *dmabuf;
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	int id;
+
+	dmabuf = dma_buf_get(ioctl_arg->dmabuf_fd);
+	if (IS_ERR(dmabuf))
+	{
+		printk(KERN_ERR "ERROR: fd %d is not a dma-buf.\n", ioctl_arg->dmabuf_fd);
 		return(-1);
 	}
 
+	attach = dma_buf_attach(dmabuf, interface.device_p);
+	if (IS_ERR(attach))
+	{
+		printk(KERN_ERR "ERROR: Failed to attach to dma-buf.\n");
+		goto err_put;
+	}
+
+	sgt = dma_buf_map_attachment(attach, DMA_BIDIRECTIONAL);
+	if (IS_ERR(sgt))
+	{
+		printk(KERN_ERR "ERROR: Failed to map dma-buf.\n");
+		goto err_detach;
+	}
+
+	if (sgt->nents != 1 || sg_dma_len(sgt->sgl) < ioctl_arg->buffer_size)
+	{
+		//printk(KERN_ERR "DEBUG: dma-buf is not contiguous (%d segments).\n", sgt->nents);
+		goto err_unmap;
+	}
+
+	mutex_lock(&f->lock);
+	b = new_buffer(f, &id);
+	if (b == NULL)
+	{
+		mutex_unlock(&f->lock);
+		goto err_unmap;
+	}
+
+	b->type = BUFFER_DMABUF;
+	b->size = (int)ioctl_arg->buffer_size;
+	b->handle = sg_dma_address(sgt->sgl);
+	b->kernel_address = NULL;
+	b->dmabuf = dmabuf;
+	b->attach = attach;
+	b->sgt = sgt;
+	mutex_unlock(&f->lock);
+
+	ioctl_arg->buffer_id = id;
+	ioctl_arg->phys_addr = b->handle;
 	return(0);
+
+err_unmap:
+	dma_buf_unmap_attachment(attach, sgt, DMA_BIDIRECTIONAL);
+err_detach:
+	dma_buf_detach(dmabuf, attach);
+err_put:
+	dma_buf_put(dmabuf);
+	return(-1);
 }
 
-static int release_buffer(ioctl_arg_t *ioctl_arg)
+/* Make a cached buffer's contents visible to the device (before a transfer) or to
+   the CPU (after one): the buffer_size bytes at sync_offset, or the whole buffer if
+   buffer_size is 0. Coherent and write-combining buffers need nothing. */
+static int sync_buffer(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg)
 {
 	int id = ioctl_arg->buffer_id;
+	struct buffer_info_t *b = get_buffer(f, id);
+	unsigned long offset = ioctl_arg->sync_offset;
+	size_t size = ioctl_arg->buffer_size;
+
+	if (b == NULL)
+		return(-1);
 
-	if (id > MEMALLOC_BUFFER_MAX_NUMBER)
+	if (size == 0)
 	{
-		printk(KERN_ERR "ERROR: Wrong bufferID %d.\n", id);
+		offset = 0;
+		size = b->size;
+	}
+	if (offset > b->size || size > b->size - offset)
+	{
+		printk(KERN_ERR "ERROR: Sync of %zu bytes at %lu is outside buffer %d.\n", size, offset, id);
 		return(-1);
 	}
-	//printk(KERN_ERR "DEBUG: Releasing buffer %d.\n", id);
-	buffer_info[id].active = 0;
-	dma_free_coherent(NULL, buffer_info[id].size, buffer_info[id].kernel_address, buffer_info[id].handle);
+
+	switch (b->type)
+	{
+		case BUFFER_USER:
+		case BUFFER_CACHED:
+			if (ioctl_arg->sync_dir == MEMALLOC_SYNC_FOR_DEVICE)
+				dma_sync_single_for_device(interface.device_p, b->handle + offset, size, DMA_BIDIRECTIONAL);
+			else
+				dma_sync_single_for_cpu(interface.device_p, b->handle + offset, size, DMA_BIDIRECTIONAL);
+			break;
+		case BUFFER_DMABUF:
+			if (ioctl_arg->sync_dir == MEMALLOC_SYNC_FOR_DEVICE)
+				dma_sync_sg_for_device(interface.device_p, b->sgt->sgl, b->sgt->orig_nents, DMA_BIDIRECTIONAL);
+			else
+				dma_sync_sg_for_cpu(interface.device_p, b->sgt->sgl, b->sgt->orig_nents, DMA_BIDIRECTIONAL);
+			break;
+		default:
+			break;
+	}
 	return(0);
 }
 
-static int get_physical_address (ioctl_arg_t *ioctl_arg)
+/* Exported buffers: each dma-buf of one is a reference to its memalloc_export_t */
+
+/* The last reference is gone: free the memory */
+static void release_export(struct kref *ref)
 {
-	int id = ioctl_arg->buffer_id;
+	struct memalloc_export_t *e = container_of(ref, struct memalloc_export_t, ref);
+
+	free_memory(e->type, e->size, e->kernel_address, e->handle);
+	kfree(e);
+}
+
+/* The first page of an exported buffer. memalloc's DMA addresses are physical
+   addresses (there is no IOMMU), as the user-space driver already assumes. */
+static struct page *export_page(struct memalloc_export_t *e)
+{
+	if (e->type == BUFFER_CACHED)
+		return(virt_to_page(e->kernel_address));
+	return(pfn_to_page(PHYS_PFN(e->handle)));
+}
+
+/* Map an exported buffer for a device that imported it: it is one contiguous piece */
+static struct sg_table *memalloc_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir)
+{
+	struct memalloc_export_t *e = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int nents;
 
-	if (id > MEMALLOC_BUFFER_MAX_NUMBER || buffer_info[id].active == 0)
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (sgt == NULL)
+		return(ERR_PTR(-ENOMEM));
+	if (sg_alloc_table(sgt, 1, GFP_KERNEL) != 0)
 	{
-		printk(KERN_ERR "ERROR: Wrong bufferID %d.\n", id);
+		kfree(sgt);
+		return(ERR_PTR(-ENOMEM));
+	}
+	sg_set_page(sgt->sgl, export_page(e), PAGE_ALIGN(e->size), 0);
+
+	nents = dma_map_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+	if (nents == 0)
+	{
+		sg_free_table(sgt);
+		kfree(sgt);
+		return(ERR_PTR(-ENOMEM));
+	}
+	sgt->nents = nents;
+	return(sgt);
+}
+
+static void memalloc_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt, enum dma_data_direction dir)
+{
+	dma_unmap_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+/* The last fd (and importer) of a dma-buf is gone */
+static void memalloc_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct memalloc_export_t *e = dmabuf->priv;
+
+	kref_put(&e->ref, release_export);
+}
+
+/* mmap of the dma-buf fd; the dma-buf core has already checked the range */
+static int memalloc_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct memalloc_export_t *e = dmabuf->priv;
+
+	return(mmap_memory(e->type, e->size, e->kernel_address, e->handle, vma));
+}
+
+/* DMA_BUF_IOCTL_SYNC, around CPU access by an importer: a cached buffer needs the same
+   cache maintenance as MEMALLOC_SYNC_CMD; coherent and write-combining ones need none */
+static int memalloc_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct memalloc_export_t *e = dmabuf->priv;
+
+	if (e->type == BUFFER_CACHED)
+		dma_sync_single_for_cpu(interface.device_p, e->handle, e->size, DMA_BIDIRECTIONAL);
+	return(0);
+}
+
+static int memalloc_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct memalloc_export_t *e = dmabuf->priv;
+
+	if (e->type == BUFFER_CACHED)
+		dma_sync_single_for_device(interface.device_p, e->handle, e->size, DMA_BIDIRECTIONAL);
+	return(0);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+/* Older kernels insist on a kernel mapping op; the memory is already mapped */
+static void *memalloc_dmabuf_kmap(struct dma_buf *dmabuf, unsigned long page_num)
+{
+	struct memalloc_export_t *e = dmabuf->priv;
+
+	return((char *)e->kernel_address + (page_num << PAGE_SHIFT));
+}
+#endif
+
+static const struct dma_buf_ops memalloc_dmabuf_ops = {
+	.map_dma_buf = memalloc_dmabuf_map,
+	.unmap_dma_buf = memalloc_dmabuf_unmap,
+	.release = memalloc_dmabuf_release,
+	.mmap = memalloc_dmabuf_mmap,
+	.begin_cpu_access = memalloc_dmabuf_begin_cpu_access,
+	.end_cpu_access = memalloc_dmabuf_end_cpu_access,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+	.map = memalloc_dmabuf_kmap,
+#endif
+};
+
+/* Export a buffer allocated here as a new dma-buf, and return its fd in dmabuf_fd. Each
+   export makes a new dma-buf of the same memory. */
+static int export_buffer(struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg)
+{
+	struct buffer_info_t *b = get_buffer(f, ioctl_arg->buffer_id);
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct memalloc_export_t *e;
+	struct dma_buf *dmabuf;
+	int fd;
+
+	if (b == NULL)
+		return(-1);
+	if (b->type == BUFFER_USER || b->type == BUFFER_DMABUF)
+	{
+		printk(KERN_ERR "ERROR: Buffer %d is imported; it cannot be exported.\n", ioctl_arg->buffer_id);
+		return(-1);
+	}
+	if (b->chunk != NULL)
+	{
+		printk(KERN_ERR "ERROR: Buffer %d shares a chunk; reserve it without MEMALLOC_SUBALLOC to export it.\n", ioctl_arg->buffer_id);
 		return(-1);
 	}
 
-	ioctl_arg->phys_addr = buffer_info[id].handle;
+	/* The first export hands the memory over to a counted owner */
+	if (b->export == NULL)
+	{
+		e = kzalloc(sizeof(*e), GFP_KERNEL);
+		if (e == NULL)
+			return(-1);
+		kref_init(&e->ref);
+		e->type = b->type;
+		e->size = b->size;
+		e->kernel_address = b->kernel_address;
+		e->handle = b->handle;
+		b->export = e;
+	}
+	e = b->export;
 
+	exp_info.ops = &memalloc_dmabuf_ops;
+	exp_info.size = PAGE_ALIGN(b->size);
+	exp_info.flags = O_RDWR;
+	exp_info.priv = e;
+	kref_get(&e->ref);
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf))
+	{
+		printk(KERN_ERR "ERROR: Failed to export buffer %d.\n", ioctl_arg->buffer_id);
+		kref_put(&e->ref, release_export);
+		return(-1);
+	}
+
+	fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+	if (fd < 0)
+	{
+		dma_buf_put(dmabuf);	/* its release drops the reference */
+		return(-1);
+	}
+	ioctl_arg->dmabuf_fd = fd;
 	return(0);
 }
 
-static void cleanup(void)
+/* Free memory allocated here, however it was allocated */
+static void free_memory(int type, int size, int *kernel_address, dma_addr_t handle)
+{
+	switch (type)
+	{
+		case BUFFER_CACHED:
+			dma_unmap_single(interface.device_p, handle, size, DMA_BIDIRECTIONAL);
+			free_pages_exact(kernel_address, PAGE_ALIGN(size));
+			break;
+		case BUFFER_WC:
+			dma_free_wc(NULL, size, kernel_address, handle);
+			break;
+		default:
+			dma_free_coherent(NULL, size, kernel_address, handle);
+			break;
+	}
+}
+
+/* Free buffer id, however it was made (b: the buffer, or NULL if it was never filled in) */
+static void free_buffer(struct memalloc_file_t *f, int id, struct buffer_info_t *b)
 {
 	int i;
-	for (i = 0; i < MEMALLOC_BUFFER_MAX_NUMBER; i++)
+
+	if (b == NULL)
 	{
-		if (buffer_info[i].active != 0)
-		{
-			dma_free_coherent(NULL, buffer_info[i].size, buffer_info[i].kernel_address, buffer_info[i].handle);
-			buffer_info[i].active = 0;
-		}
+		kfree(idr_remove(&f->buffers, id));
+		return;
+	}
+	stats_release(f, b);
+
+	switch (b->type)
+	{
+		case BUFFER_USER:
+			dma_unmap_page(interface.device_p, b->handle, b->size, DMA_BIDIRECTIONAL);
+			for (i = 0; i < b->npages; i++)
+			{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+				unpin_user_page(b->pages[i]);
+#else
+				set_page_dirty_lock(b->pages[i]);
+				put_page(b->pages[i]);
+#endif
+			}
+			kfree(b->pages);
+			b->pages = NULL;
+			break;
+		case BUFFER_DMABUF:
+			dma_buf_unmap_attachment(b->attach, b->sgt, DMA_BIDIRECTIONAL);
+			dma_buf_detach(b->dmabuf, b->attach);
+			dma_buf_put(b->dmabuf);
+			b->dmabuf = NULL;
+			break;
+		default:
+			if (b->chunk != NULL)
+				uncarve_buffer(f, b);
+			else if (b->export != NULL)	/* its memory lives on while its dma-bufs do */
+				kref_put(&b->export->ref, release_export);
+			else
+				free_memory(b->type, b->size, b->kernel_address, b->handle);
+			break;
+	}
+	idr_remove(&f->buffers, id);
+	kfree(b);
+}
+
+static int get_physical_address (struct memalloc_file_t *f, ioctl_arg_t *ioctl_arg)
+{
+	struct buffer_info_t *b = get_buffer(f, ioctl_arg->buffer_id);
+
+	if (b == NULL)
+		return(-1);
+
+	ioctl_arg->phys_addr = b->handle;
+
+	return(0);
+}
+
+/* Count a reserve (successful or not, status 0 or -1) that took ns nanoseconds */
+static void stats_reserve(struct memalloc_file_t *f, size_t size, u64 ns, int status)
+{
+	u64 us = ns / 1000;
+	int bucket = 0;
+
+	while (us > 0 && bucket < MEMALLOC_LATENCY_BUCKETS - 1)
+	{
+		us >>= 1;
+		bucket++;
+	}
+
+	spin_lock(&stats_lock);
+	stats.latency[bucket]++;
+	if (status != 0)
+		stats.failures++;
+	else
+	{
+		stats.reserves++;
+		stats.buffers++;
+		stats.bytes += size;
+		if (stats.bytes > stats.bytes_high_water)
+			stats.bytes_high_water = stats.bytes;
+		f->reserved_buffers++;
+		f->reserved_bytes += size;
+	}
+	spin_unlock(&stats_lock);
+}
+
+/* Count a buffer being freed */
+static void stats_release(struct memalloc_file_t *f, struct buffer_info_t *b)
+{
+	spin_lock(&stats_lock);
+	if (b->type == BUFFER_USER || b->type == BUFFER_DMABUF)
+		stats.imported--;
+	else
+	{
+		stats.releases++;
+		stats.buffers--;
+		stats.bytes -= b->size;
+		f->reserved_buffers--;
+		f->reserved_bytes -= b->size;
+	}
+	spin_unlock(&stats_lock);
+}
+
+/* debugfs memalloc/stats */
+static int memalloc_stats_show(struct seq_file *m, void *unused)
+{
+	struct memalloc_stats_t s;
+	struct memalloc_file_t *f;
+	int i;
+
+	spin_lock(&stats_lock);
+	s = stats;
+	spin_unlock(&stats_lock);
+
+	seq_printf(m, "buffers:          %ld\n", s.buffers);
+	seq_printf(m, "bytes:            %lld\n", s.bytes);
+	seq_printf(m, "bytes high water: %lld\n", s.bytes_high_water);
+	seq_printf(m, "chunks:           %ld (%ld bytes)\n", s.chunks, s.chunks * MEMALLOC_CHUNK_SIZE);
+	seq_printf(m, "reserves:         %lld\n", s.reserves);
+	seq_printf(m, "releases:         %lld\n", s.releases);
+	seq_printf(m, "failures:         %lld\n", s.failures);
+	seq_printf(m, "imported buffers: %ld (%lld imports)\n", s.imported, s.imports);
+
+	seq_puts(m, "\nreserve latency:\n");
+	for (i = 0; i < MEMALLOC_LATENCY_BUCKETS; i++)
+	{
+		if (i == 0)
+			seq_printf(m, "  %7s us: %lld\n", "< 1", s.latency[i]);
+		else if (i == MEMALLOC_LATENCY_BUCKETS - 1)
+			seq_printf(m, "  >= %6lu us: %lld\n", 1UL << (i - 1), s.latency[i]);
+		else
+			seq_printf(m, "  %6lu+ us: %lld\n", 1UL << (i - 1), s.latency[i]);
+	}
+
+	seq_puts(m, "\nby process:\n");
+	mutex_lock(&files_lock);
+	list_for_each_entry(f, &files, files)
+	{
+		spin_lock(&stats_lock);
+		seq_printf(m, "  %d %s: %ld buffers, %lld bytes\n", f->pid, f->comm,
+			   f->reserved_buffers, f->reserved_bytes);
+		spin_unlock(&stats_lock);
+	}
+	mutex_unlock(&files_lock);
+	return(0);
+}
+DEFINE_SHOW_ATTRIBUTE(memalloc_stats);
+
+/* Free every buffer and chunk of one file */
+static void cleanup(struct memalloc_file_t *f)
+{
+	struct memalloc_chunk_t *c, *next;
+	struct buffer_info_t *b;
+	int id;
+
+	idr_for_each_entry(&f->buffers, b, id)
+		free_buffer(f, id, b);
+	list_for_each_entry_safe(c, next, &f->chunks, list)
+	{
+		list_del(&c->list);
+		free_chunk(c);
 	}
 }
 
 static int __init memalloc_init(void)
 {
 	int rc;
-	int i;
 	static struct class *local_class_p = NULL;
 	
 	//printk(KERN_ERR "DEBUG: Module init.\n");
@@ -300,13 +1335,13 @@ static int __init memalloc_init(void)
 	}
 	//printk(KERN_ERR "DEBUG: Create the device node /dev/%s: DONE\n", DEVICE_NAME);
 
-	for (i = 0; i < MEMALLOC_BUFFER_MAX_NUMBER; i++)
-	{
-		buffer_info[active_buffer_id].active = 0;
-	}
+	/* The streaming DMA calls (cached and imported buffers) need a DMA mask */
+	interface.device_p->dma_mask = &interface.device_p->coherent_dma_mask;
+	dma_set_mask_and_coherent(interface.device_p, DMA_BIT_MASK(32));
 
-	/* */
-	/* dma_set_mask(interface.device_p, DMA_BIT_MASK(32)); */
+	/* Statistics are nice to have, so carry on without them if debugfs is missing */
+	debugfs_dir = debugfs_create_dir(DEVICE_NAME, NULL);
+	debugfs_create_file("stats", 0444, debugfs_dir, NULL, &memalloc_stats_fops);
 	
 	return(0);
 }
@@ -315,7 +1350,10 @@ static void __exit memalloc_exit(void)
 {
 	printk(KERN_ERR "DEBUG: Module exit.\n");
 
-	cleanup();
+	/* Every file has been closed (fops.owner holds the module until then), so every
+	   buffer is already free */
+
+	debugfs_remove_recursive(debugfs_dir);
 
 	cdev_del(&interface.cdev);
 
@@ -332,3 +1370,6 @@ module_exit(memalloc_exit);
 MODULE_AUTHOR("Giuseppe Di Guglielmo");
 MODULE_DESCRIPTION("Create a buffer and return physical and virtual address, for DMA userspace driver. Thanks to Massimiliano Giacometti.");
 MODULE_LICENSE("GPL");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
@@ -12,21 +12,66 @@ extern "C" {
 
 #define MEMALLOC_ERR -1
 
-#define MEMALLOC_BUFFER_MAX_NUMBER 16
+/* With MEMALLOC_SUBALLOC, RESERVE carves coherent and write-combining buffers of up to
+ * this many bytes out of a few large chunks. Such a buffer may start part-way into a
+ * page: mmap the page it starts in and add the rest of phys_addr. It cannot be mapped
+ * at offset 0 (as the active buffer) unless it starts on a page. */
+#define MEMALLOC_SUBALLOC_MAX  (64 * 1024)
 
-#define MEMALLOC_IOCTL_BASE 1
-#define MEMALLOC_RESERVE_CMD         _IO(MEMALLOC_IOCTL_BASE, 0) 
-#define MEMALLOC_RELEASE_CMD         _IO(MEMALLOC_IOCTL_BASE, 1)
-#define MEMALLOC_GET_PHYSICAL_CMD    _IO(MEMALLOC_IOCTL_BASE, 2)
-#define MEMALLOC_ACTIVATE_BUFFER_CMD _IO(MEMALLOC_IOCTL_BASE, 3)
+/* flags values for MEMALLOC_RESERVE_CMD: one kind of memory... */
+#define MEMALLOC_COHERENT      0   /* uncached (the default) */
+#define MEMALLOC_CACHED        1   /* cached; sync before and after each transfer */
+#define MEMALLOC_WRITECOMBINE  2   /* uncached, but writes are combined; good for Tx-only buffers */
+#define MEMALLOC_MODE_MASK     0xff
+/* ...plus, optionally: */
+#define MEMALLOC_ACTIVATE      0x100 /* make the new buffer the one mmap maps at offset 0, as ACTIVATE does */
+#define MEMALLOC_DEDICATED     0x200 /* give the buffer memory of its own; the default, and
+                                        wins over MEMALLOC_SUBALLOC */
+#define MEMALLOC_SUBALLOC      0x400 /* carve a small buffer out of a shared chunk (see
+                                        MEMALLOC_SUBALLOC_MAX); it cannot be exported */
+
+/* RESERVE also returns the new buffer's phys_addr, which is page aligned unless the
+ * buffer was carved (MEMALLOC_SUBALLOC). mmap with phys_addr as the offset maps
+ * that buffer (and a page-aligned offset past it maps the rest of the buffer from there),
+ * so a buffer is ready after one ioctl and an mmap, and threads can map different
+ * buffers at once. Offset 0 still maps the active buffer (ACTIVATE), unless a buffer
+ * really starts at physical address 0. */
+
+/* EXPORT_DMABUF returns a dma-buf fd (O_CLOEXEC) for buffer_id, which must have been
+ * reserved, not imported. Importers of a cached buffer bracket CPU access with
+ * DMA_BUF_IOCTL_SYNC. The memory is freed once the buffer is released and every
+ * dma-buf of it is closed. */
+
+/* sync_dir values for MEMALLOC_SYNC_CMD */
+#define MEMALLOC_SYNC_FOR_DEVICE 0
+#define MEMALLOC_SYNC_FOR_CPU    1
 
 typedef struct ioctl_arg_t
 {
 	size_t buffer_size;      /* in */
 	int buffer_id;           /* in, out */
 	unsigned long phys_addr; /* out */
+	unsigned long user_addr; /* in: IMPORT_USER */
+	int dmabuf_fd;           /* in: IMPORT_DMABUF; out: EXPORT_DMABUF */
+	int sync_dir;            /* in: SYNC */
+	int flags;               /* in: RESERVE */
+	unsigned long sync_offset; /* in: SYNC (syncs buffer_size bytes from here; 0 bytes: all) */
 } ioctl_arg_t;
 
+/* The commands carry the size of ioctl_arg_t, which has grown since the original module
+ * (it had only buffer_size, buffer_id and phys_addr): a program built against the old
+ * header uses the old command numbers, and now gets an error instead of having the
+ * module read past its argument. Rebuild such programs against this header. */
+#define MEMALLOC_IOCTL_BASE 1
+#define MEMALLOC_RESERVE_CMD         _IOWR(MEMALLOC_IOCTL_BASE, 0, ioctl_arg_t)
+#define MEMALLOC_RELEASE_CMD         _IOWR(MEMALLOC_IOCTL_BASE, 1, ioctl_arg_t)
+#define MEMALLOC_GET_PHYSICAL_CMD    _IOWR(MEMALLOC_IOCTL_BASE, 2, ioctl_arg_t)
+#define MEMALLOC_ACTIVATE_BUFFER_CMD _IOWR(MEMALLOC_IOCTL_BASE, 3, ioctl_arg_t)
+#define MEMALLOC_IMPORT_USER_CMD     _IOWR(MEMALLOC_IOCTL_BASE, 4, ioctl_arg_t)
+#define MEMALLOC_IMPORT_DMABUF_CMD   _IOWR(MEMALLOC_IOCTL_BASE, 5, ioctl_arg_t)
+#define MEMALLOC_SYNC_CMD            _IOWR(MEMALLOC_IOCTL_BASE, 6, ioctl_arg_t)
+#define MEMALLOC_EXPORT_DMABUF_CMD   _IOWR(MEMALLOC_IOCTL_BASE, 7, ioctl_arg_t)
+
 #ifdef __cplusplus
 }
 #endif